@@ -41,6 +41,14 @@ public:
 
 };
 
+// 8 rays for Trace8Rays. They are kept as two 4-wide halves, so that they can be set up with
+// the same FourVectors math as FourRays, and so that the sse fallback can trace the halves.
+class EightRays
+{
+public:
+	FourRays Rays[2];										// rays 0-3 and rays 4-7
+};
+
 /// The format a triangle is stored in for intersections. size of this structure is important.
 /// This structure can be in one of two forms. Before the ray tracing environment is set up, the
 /// ProjectedEdgeEquations hold the coordinates of the 3 vertices, for facilitating bounding box
@@ -192,6 +200,30 @@ protected:
 
 };
 
+// tuning parameters for the kd-tree builders and traversal. see the comment above
+// CalculateCostsOfSplit.
+#define COST_OF_TRAVERSAL 75								// approximate #operations
+#define COST_OF_INTERSECTION 167							// approximate #operations
+#define MAX_TREE_DEPTH 21
+
+
+#define WIDEBVH_EMPTY_SLOT -1								// WideBVHNode::NumTris[] of an unused slot
+#define WIDEBVH_MAX_DEPTH 80								// the bvh builder makes a leaf of anything this
+															// deep, so the traversal stack can't overflow
+
+struct ALIGN16 WideBVHNode
+{
+	// node of the optional 4-wide bounding volume hierarchy. The bounds of the 4 children are
+	// stored one child per lane so that they can be pulled straight into sse registers.
+	fltx4 ChildMins[3];
+	fltx4 ChildMaxs[3];
+	int32 Children[4];										// inner child: index of the node.
+	                                                        // leaf child: first entry in
+	                                                        // WideBVHTriangleIndexList
+	int32 NumTris[4];										// 0=inner node, >0=leaf,
+	                                                        // WIDEBVH_EMPTY_SLOT=unused
+} ALIGN16_POST;
+
 
 struct RayTracingSingleResult
 {
@@ -220,6 +252,14 @@ public:
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
+#define RTE_FLAGS_EXACT_TREE_GENERATION 8					// use the old single threaded kd-tree
+															// builder instead of the binned one
+#define RTE_FLAGS_WIDE_BVH 16								// also build a 4-wide bvh and trace
+															// rays through it instead of the kd-tree
+#define RTE_FLAGS_NO_AVX2 32								// never use the avx2 tracer, even if
+															// the cpu has it
+
+#define RTE_CACHE_KEY_SIZE 16								// bytes in the key passed to SaveCache/LoadCache
 
 enum RayTraceLightingMode_t {
 	DIRECT_LIGHTING,										// just dot product lighting
@@ -267,12 +307,17 @@ public:
 	CUtlVector<LightDesc_t> LightList;						//< the list of lights
 	CUtlVector<Vector> TriangleColors;						//< color of tries
 	CUtlVector<int32> TriangleMaterials;					//< material index of tries
+	CUtlVector<WideBVHNode, CUtlMemoryAligned<WideBVHNode,16> > WideBVHTree; //< RTE_FLAGS_WIDE_BVH only. root is 0
+	CUtlVector<int32> WideBVHTriangleIndexList;				//< triangle indices of the bvh leaves
+	int NumBuildThreads;									//< threads used to build the tree. 0=one
+															//< per logical processor
 
 public:
 	RayTracingEnvironment() : OptimizedTriangleList( 1024 )
 	{
 		BackgroundColor.DuplicateVector(Vector(1,0,0));		// red
 		Flags=0;
+		NumBuildThreads=0;
 	}
 
 
@@ -297,6 +342,13 @@ public:
 	// SetupAccelerationStructure to prepare for tracing
 	void SetupAccelerationStructure(void);
 
+	// save the triangles and acceleration structures built by SetupAccelerationStructure, or
+	// load them back instead of adding the triangles and calling SetupAccelerationStructure.
+	// The key identifies the scene. LoadCache fails (and leaves the environment alone) if the
+	// file's key or tree building flags don't match.
+	bool SaveCache(const char *pFileName, const uint8 *pKey) const;
+	bool LoadCache(const char *pFileName, const uint8 *pKey);
+
 
 	// lowest level intersection routine - fire 4 rays through the scene. all 4 rays must pass the
 	// Check() function, and t extents must be initialized. skipid can be set to exclude a
@@ -310,6 +362,23 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// trace 8 rays at once. When the cpu has avx2, and all 8 rays have the same direction signs,
+	// they are traced through the kd-tree as one 8-wide packet. Otherwise, or when there's a
+	// callback, the two halves are traced with Trace4Rays. pTMin, pTMax and rslt_out point at
+	// 2 entries, one for each half.
+	void Trace8Rays(const EightRays &rays, fltx4 const *pTMin, fltx4 const *pTMax,
+					RayTracingResult *rslt_out,
+					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
+
+	// true if Trace8Rays can use the 8-wide tracer
+	bool SupportsTrace8Rays(void) const;
+
+	// same thing through the 4-wide bvh. The rays don't have to share direction signs. Trace4Rays
+	// calls this when RTE_FLAGS_WIDE_BVH is set.
+	void Trace4RaysWideBVH(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+						   RayTracingResult *rslt_out,
+						   int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -356,6 +425,11 @@ public:
 	void CalculateTriangleListBounds(int32 const *tris,int ntris,
 									 Vector &minout, Vector &maxout);
 
+	// binned surface area heuristic builders (buildtree.cpp). The kd-tree one splits the lower
+	// levels of the tree across NumBuildThreads threads.
+	void BuildKDTree(void);
+	void BuildWideBVH(void);
+
 	void AddInfinitePointLight(Vector position,				// light center
 							   Vector intensity);			// rgb amount
 
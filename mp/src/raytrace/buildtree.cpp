@@ -0,0 +1,746 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Binned surface area heuristic builders for the kd-tree and the
+//			optional 4-wide bvh.
+//
+//=============================================================================//
+
+#include "raytrace.h"
+#include "tier0/threadtools.h"
+
+
+// The exact builder in raytrace.cpp re-classifies every triangle for every candidate split,
+// which makes it O(n^2) per node. Here each axis is cut into a fixed number of bins and the
+// triangles are counted into them once, so every bin boundary can be evaluated with a prefix
+// sum. The cost formula, termination criteria and the "grow empty nodes" trick are the same as
+// the exact builder's.
+//
+// The top of the tree is built on the calling thread. Subtrees below a size threshold are
+// deferred, built by worker threads into their own node and triangle index arrays, and spliced
+// onto the end of the tree afterwards. Because a split pair of children is always added
+// together, the "right child follows the left child" invariant survives the splice.
+
+#define KD_NUM_BINS 32
+
+// Deferred subtrees are never smaller than this - below it threading isn't worth the overhead.
+#define KD_MIN_TASK_TRIS 1024
+
+// The tree is cut into roughly this many subtrees per build thread, for load balancing.
+#define KD_TASKS_PER_THREAD 8
+
+#define BVH_NUM_BINS 16
+#define BVH_MAX_LEAF_TRIS 4
+#define BVH_FORCE_LEAF_TRIS 16								// never make leaves bigger than this, unless
+															// they are WIDEBVH_MAX_DEPTH deep
+#define BVH_MAX_DEPTH 48									// past this, split lists in half
+
+
+static float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
+{
+	Vector boxdim=boxmax-boxmin;
+	return 2.0*((boxdim[0]*boxdim[2])+(boxdim[0]*boxdim[1])+(boxdim[1]*boxdim[2]));
+}
+
+static void CalculateTriangleBounds( RayTracingEnvironment &env, CUtlVector<Vector> &mins,
+									 CUtlVector<Vector> &maxs )
+{
+	int ntris=env.OptimizedTriangleList.Count();
+	mins.SetCount( ntris );
+	maxs.SetCount( ntris );
+	for(int t=0;t<ntris;t++)
+	{
+		CacheOptimizedTriangle const &tri=env.OptimizedTriangleList[t];
+		Vector tmin=tri.Vertex(0);
+		Vector tmax=tmin;
+		for(int v=1;v<3;v++)
+		{
+			VectorMin( tri.Vertex(v), tmin, tmin );
+			VectorMax( tri.Vertex(v), tmax, tmax );
+		}
+		mins[t]=tmin;
+		maxs[t]=tmax;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// kd-tree
+//-----------------------------------------------------------------------------
+
+struct KDBuildTask_t
+{
+	int m_nNode;											// placeholder node in OptimizedKDTree
+	int32 *m_pTris;
+	int m_nTris;
+	Vector m_MinBound;
+	Vector m_MaxBound;
+	int m_nDepth;
+
+	// output. local root is node 0, leaf indices are relative to m_TriangleIndexList
+	CUtlVector<CacheOptimizedKDNode> m_Nodes;
+	CUtlVector<int32> m_TriangleIndexList;
+};
+
+class CKDTreeBuilder
+{
+public:
+	CKDTreeBuilder( RayTracingEnvironment &env ) : m_Env( env ) {}
+	~CKDTreeBuilder();
+
+	void Build( int nThreads );
+
+private:
+	void BuildNode( CUtlVector<CacheOptimizedKDNode> &nodes, CUtlVector<int32> &tris,
+					int node_number, int32 const *tri_list, int ntris,
+					Vector MinBound, Vector MaxBound, int depth, bool bDefer );
+
+	void MakeLeaf( CUtlVector<CacheOptimizedKDNode> &nodes, CUtlVector<int32> &tris,
+				   int node_number, int32 const *tri_list, int ntris,
+				   Vector const &MinBound, Vector const &MaxBound );
+
+	float FindBestSplit( int32 const *tri_list, int ntris, Vector const &MinBound,
+						 Vector const &MaxBound, int &split_plane, float &split_value ) const;
+
+	int Classify( int tri, int split_plane, float split_value ) const;
+
+	void RunTasks();
+	void SpliceTask( KDBuildTask_t *pTask );
+
+	static unsigned TaskThreadFn( void *pParam );
+
+	RayTracingEnvironment &m_Env;
+	CUtlVector<Vector> m_TriMins;
+	CUtlVector<Vector> m_TriMaxs;
+
+	int m_nThreads;
+	int m_nMaxTaskTris;
+	CUtlVector<KDBuildTask_t *> m_Tasks;
+	volatile long m_nNextTask;
+};
+
+
+CKDTreeBuilder::~CKDTreeBuilder()
+{
+	m_Tasks.PurgeAndDeleteElements();
+}
+
+
+int CKDTreeBuilder::Classify( int tri, int split_plane, float split_value ) const
+{
+	// same as CacheOptimizedTriangle::ClassifyAgainstAxisSplit, using the cached bounds
+	if (m_TriMins[tri][split_plane]>=split_value)
+		return PLANECHECK_POSITIVE;
+	if (m_TriMaxs[tri][split_plane]<=split_value)
+		return PLANECHECK_NEGATIVE;
+	return PLANECHECK_STRADDLING;
+}
+
+
+float CKDTreeBuilder::FindBestSplit( int32 const *tri_list, int ntris, Vector const &MinBound,
+									 Vector const &MaxBound, int &split_plane,
+									 float &split_value ) const
+{
+	float best_cost=1.0e23;
+	float SA=BoxSurfaceArea(MinBound,MaxBound);
+	if (SA<=0)
+		return best_cost;
+	float ISA=1.0/SA;
+
+	for(int axis=0;axis<3;axis++)
+	{
+		float extent=MaxBound[axis]-MinBound[axis];
+		if (extent<=0)
+			continue;
+
+		// count where each triangle starts and ends
+		int nstart[KD_NUM_BINS];
+		int nend[KD_NUM_BINS];
+		memset(nstart,0,sizeof(nstart));
+		memset(nend,0,sizeof(nend));
+		float bin_scale=KD_NUM_BINS/extent;
+		float min_coord=1.0e23,max_coord=-1.0e23;
+		for(int t=0;t<ntris;t++)
+		{
+			float lo=m_TriMins[tri_list[t]][axis];
+			float hi=m_TriMaxs[tri_list[t]][axis];
+			min_coord=min(min_coord,lo);
+			max_coord=max(max_coord,hi);
+			nstart[clamp((int) ((lo-MinBound[axis])*bin_scale),0,KD_NUM_BINS-1)]++;
+			nend[clamp((int) ((hi-MinBound[axis])*bin_scale),0,KD_NUM_BINS-1)]++;
+		}
+
+		Vector LeftMaxes=MaxBound;
+		Vector RightMins=MinBound;
+
+		// try each bin boundary. triangles which end in a bin below the boundary are entirely
+		// on the left, those that start in a bin at or above it are entirely on the right.
+		int nstarted=0,nended=0;
+		for(int b=1;b<KD_NUM_BINS;b++)
+		{
+			nstarted+=nstart[b-1];
+			nended+=nend[b-1];
+			float trial_splitvalue=MinBound[axis]+b*(extent/KD_NUM_BINS);
+			LeftMaxes[axis]=trial_splitvalue;
+			RightMins[axis]=trial_splitvalue;
+			int nleft=nended;
+			int nright=ntris-nstarted;
+			int nboth=ntris-nleft-nright;
+			float trial_cost=COST_OF_TRAVERSAL+COST_OF_INTERSECTION*(nboth+
+				(BoxSurfaceArea(MinBound,LeftMaxes)*ISA*nleft)+
+				(BoxSurfaceArea(RightMins,MaxBound)*ISA*nright));
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=trial_splitvalue;
+			}
+		}
+
+		// also try cutting off the empty space around the triangles
+		for(int side=0;side<2;side++)
+		{
+			float trial_splitvalue=(side==0) ? min_coord : max_coord;
+			if ((trial_splitvalue<=MinBound[axis]) || (trial_splitvalue>=MaxBound[axis]))
+				continue;
+			LeftMaxes[axis]=trial_splitvalue;
+			RightMins[axis]=trial_splitvalue;
+			float trial_cost;
+			if (side==0)
+				trial_cost=COST_OF_TRAVERSAL+COST_OF_INTERSECTION*
+					BoxSurfaceArea(RightMins,MaxBound)*ISA*ntris;
+			else
+				trial_cost=COST_OF_TRAVERSAL+COST_OF_INTERSECTION*
+					BoxSurfaceArea(MinBound,LeftMaxes)*ISA*ntris;
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=trial_splitvalue;
+			}
+		}
+	}
+	return best_cost;
+}
+
+
+void CKDTreeBuilder::MakeLeaf( CUtlVector<CacheOptimizedKDNode> &nodes, CUtlVector<int32> &tris,
+							   int node_number, int32 const *tri_list, int ntris,
+							   Vector const &MinBound, Vector const &MaxBound )
+{
+	nodes[node_number].Children=KDNODE_STATE_LEAF+(tris.Count()<<2);
+	nodes[node_number].SetNumberOfTrianglesInLeafNode(ntris);
+#ifdef DEBUG_RAYTRACE
+	nodes[node_number].vecMins = MinBound;
+	nodes[node_number].vecMaxs = MaxBound;
+#endif
+	tris.AddMultipleToTail( ntris, tri_list );
+}
+
+
+void CKDTreeBuilder::BuildNode( CUtlVector<CacheOptimizedKDNode> &nodes, CUtlVector<int32> &tris,
+								int node_number, int32 const *tri_list, int ntris,
+								Vector MinBound, Vector MaxBound, int depth, bool bDefer )
+{
+	if (ntris<3)											// never split empty lists
+	{
+		MakeLeaf(nodes,tris,node_number,tri_list,ntris,MinBound,MaxBound);
+		return;
+	}
+
+	if ( bDefer && ( ntris<=m_nMaxTaskTris ) )
+	{
+		// leave the node as a placeholder and let a worker thread build it
+		KDBuildTask_t *pTask=new KDBuildTask_t;
+		pTask->m_nNode=node_number;
+		pTask->m_pTris=new int32[ntris];
+		memcpy(pTask->m_pTris,tri_list,ntris*sizeof(int32));
+		pTask->m_nTris=ntris;
+		pTask->m_MinBound=MinBound;
+		pTask->m_MaxBound=MaxBound;
+		pTask->m_nDepth=depth;
+		m_Tasks.AddToTail(pTask);
+		return;
+	}
+
+	int split_plane=0;
+	float split_value=0;
+	float best_cost=FindBestSplit(tri_list,ntris,MinBound,MaxBound,split_plane,split_value);
+	float cost_of_no_split=COST_OF_INTERSECTION*ntris;
+	if ( (cost_of_no_split<=best_cost) || (depth>MAX_TREE_DEPTH))
+	{
+		MakeLeaf(nodes,tris,node_number,tri_list,ntris,MinBound,MaxBound);
+		return;
+	}
+
+	// the bins only estimate the counts. classify exactly now.
+	int nleft=0,nright=0,nboth=0;
+	for(int t=0;t<ntris;t++)
+	{
+		switch(Classify(tri_list[t],split_plane,split_value))
+		{
+			case PLANECHECK_NEGATIVE:
+				nleft++;
+				break;
+			case PLANECHECK_POSITIVE:
+				nright++;
+				break;
+			case PLANECHECK_STRADDLING:
+				nboth++;
+				break;
+		}
+	}
+
+	int32 *new_triangle_list=new int32[ntris];
+	int n_left_output=0;
+	int n_both_output=0;
+	int n_right_output=0;
+	for(int t=0;t<ntris;t++)
+	{
+		switch(Classify(tri_list[t],split_plane,split_value))
+		{
+			case PLANECHECK_NEGATIVE:
+				new_triangle_list[n_left_output++]=tri_list[t];
+				break;
+			case PLANECHECK_POSITIVE:
+				n_right_output++;
+				new_triangle_list[ntris-n_right_output]=tri_list[t];
+				break;
+			case PLANECHECK_STRADDLING:
+				new_triangle_list[nleft+n_both_output]=tri_list[t];
+				n_both_output++;
+				break;
+		}
+	}
+
+	Vector LeftMaxes=MaxBound;
+	Vector RightMins=MinBound;
+	LeftMaxes[split_plane]=split_value;
+	RightMins[split_plane]=split_value;
+
+	int left_child=nodes.Count();
+	int right_child=left_child+1;
+	nodes[node_number].Children=split_plane+(left_child<<2);
+	nodes[node_number].SplittingPlaneValue=split_value;
+#ifdef DEBUG_RAYTRACE
+	nodes[node_number].vecMins = MinBound;
+	nodes[node_number].vecMaxs = MaxBound;
+#endif
+	CacheOptimizedKDNode newnode;
+	nodes.AddToTail(newnode);
+	nodes.AddToTail(newnode);
+
+	if ( (ntris<20) && ((nleft==0) || (nright==0)) )
+		depth+=100;
+	BuildNode(nodes,tris,left_child,new_triangle_list,nleft+nboth,MinBound,LeftMaxes,
+			  depth+1,bDefer);
+	BuildNode(nodes,tris,right_child,new_triangle_list+nleft,nright+nboth,RightMins,MaxBound,
+			  depth+1,bDefer);
+	delete[] new_triangle_list;
+}
+
+
+unsigned CKDTreeBuilder::TaskThreadFn( void *pParam )
+{
+	CKDTreeBuilder *pBuilder=(CKDTreeBuilder *) pParam;
+	for(;;)
+	{
+		int i=ThreadInterlockedIncrement(&pBuilder->m_nNextTask)-1;
+		if (i>=pBuilder->m_Tasks.Count())
+			break;
+		KDBuildTask_t *pTask=pBuilder->m_Tasks[i];
+		CacheOptimizedKDNode root;
+		pTask->m_Nodes.AddToTail(root);
+		pBuilder->BuildNode(pTask->m_Nodes,pTask->m_TriangleIndexList,0,pTask->m_pTris,
+							pTask->m_nTris,pTask->m_MinBound,pTask->m_MaxBound,
+							pTask->m_nDepth,false);
+		delete[] pTask->m_pTris;
+		pTask->m_pTris=NULL;
+	}
+	return 0;
+}
+
+
+static int __cdecl CompareTaskSizes( KDBuildTask_t * const *pA, KDBuildTask_t * const *pB )
+{
+	// biggest first, so that the small ones fill in the gaps at the end
+	return (*pB)->m_nTris-(*pA)->m_nTris;
+}
+
+void CKDTreeBuilder::RunTasks()
+{
+	m_Tasks.Sort(CompareTaskSizes);
+	m_nNextTask=0;
+
+	int nWorkers=min(m_nThreads,m_Tasks.Count())-1;
+	ThreadHandle_t *pHandles=new ThreadHandle_t[max(nWorkers,1)];
+	for(int i=0;i<nWorkers;i++)
+		pHandles[i]=CreateSimpleThread(TaskThreadFn,this);
+
+	// this thread works too
+	TaskThreadFn(this);
+
+	for(int i=0;i<nWorkers;i++)
+	{
+		ThreadJoin(pHandles[i]);
+		ReleaseThreadHandle(pHandles[i]);
+	}
+	delete[] pHandles;
+}
+
+
+void CKDTreeBuilder::SpliceTask( KDBuildTask_t *pTask )
+{
+	// local node 0 replaces the placeholder, the rest go on the end. local node i ends up at
+	// nNodeBase+i.
+	int nNodeBase=m_Env.OptimizedKDTree.Count()-1;
+	int nTriBase=m_Env.TriangleIndexList.Count();
+
+	for(int i=0;i<pTask->m_Nodes.Count();i++)
+	{
+		CacheOptimizedKDNode node=pTask->m_Nodes[i];
+		if (node.NodeType()==KDNODE_STATE_LEAF)
+			node.Children=KDNODE_STATE_LEAF+((node.TriangleIndexStart()+nTriBase)<<2);
+		else
+			node.Children=node.NodeType()+((node.LeftChild()+nNodeBase)<<2);
+
+		if (i==0)
+			m_Env.OptimizedKDTree[pTask->m_nNode]=node;
+		else
+			m_Env.OptimizedKDTree.AddToTail(node);
+	}
+	m_Env.TriangleIndexList.AddVectorToTail(pTask->m_TriangleIndexList);
+}
+
+
+void CKDTreeBuilder::Build( int nThreads )
+{
+	int ntris=m_Env.OptimizedTriangleList.Count();
+	CalculateTriangleBounds(m_Env,m_TriMins,m_TriMaxs);
+
+	m_nThreads=max(nThreads,1);
+	m_nMaxTaskTris=max(KD_MIN_TASK_TRIS,ntris/(m_nThreads*KD_TASKS_PER_THREAD));
+
+	int32 *root_triangle_list=new int32[ntris];
+	for(int t=0;t<ntris;t++)
+		root_triangle_list[t]=t;
+	m_Env.CalculateTriangleListBounds(root_triangle_list,ntris,m_Env.m_MinBound,
+									  m_Env.m_MaxBound);
+
+	CacheOptimizedKDNode root;
+	m_Env.OptimizedKDTree.AddToTail(root);
+	BuildNode(m_Env.OptimizedKDTree,m_Env.TriangleIndexList,0,root_triangle_list,ntris,
+			  m_Env.m_MinBound,m_Env.m_MaxBound,0,(m_nThreads>1));
+	delete[] root_triangle_list;
+
+	if (m_Tasks.Count())
+	{
+		RunTasks();
+		for(int i=0;i<m_Tasks.Count();i++)
+			SpliceTask(m_Tasks[i]);
+	}
+}
+
+
+void RayTracingEnvironment::BuildKDTree(void)
+{
+	int nThreads=NumBuildThreads;
+	if (nThreads<=0)
+		nThreads=GetCPUInformation()->m_nLogicalProcessors;
+
+	CKDTreeBuilder builder(*this);
+	builder.Build(nThreads);
+}
+
+
+//-----------------------------------------------------------------------------
+// 4-wide bvh. A binary bvh is built with binned SAH over the triangle
+// centroids, then collapsed by pulling the children of the largest inner
+// children up into their parent until each node has 4.
+//-----------------------------------------------------------------------------
+
+struct BVHBuildNode_t
+{
+	Vector m_Mins;
+	Vector m_Maxs;
+	int m_nLeft;											// right child is m_nLeft+1. -1 for leaves
+	int m_nFirstTri;
+	int m_nNumTris;
+};
+
+class CWideBVHBuilder
+{
+public:
+	CWideBVHBuilder( RayTracingEnvironment &env ) : m_Env( env ) {}
+
+	void Build();
+
+private:
+	void BuildNode( int node_number, int first, int ntris, int depth );
+	int CollapseNode( int node_number );
+	int MakeSingleLeafNode( int node_number );
+
+	RayTracingEnvironment &m_Env;
+	CUtlVector<Vector> m_TriMins;
+	CUtlVector<Vector> m_TriMaxs;
+	CUtlVector<BVHBuildNode_t> m_Nodes;
+};
+
+
+void CWideBVHBuilder::BuildNode( int node_number, int first, int ntris, int depth )
+{
+	CUtlVector<int32> &tris=m_Env.WideBVHTriangleIndexList;
+
+	Vector mins( 1.0e23, 1.0e23, 1.0e23 ), maxs( -1.0e23, -1.0e23, -1.0e23 );
+	Vector cmins=mins, cmaxs=maxs;							// centroid bounds
+	for(int t=first;t<first+ntris;t++)
+	{
+		VectorMin( m_TriMins[tris[t]], mins, mins );
+		VectorMax( m_TriMaxs[tris[t]], maxs, maxs );
+		Vector centroid=0.5*(m_TriMins[tris[t]]+m_TriMaxs[tris[t]]);
+		VectorMin( centroid, cmins, cmins );
+		VectorMax( centroid, cmaxs, cmaxs );
+	}
+	m_Nodes[node_number].m_Mins=mins;
+	m_Nodes[node_number].m_Maxs=maxs;
+	m_Nodes[node_number].m_nLeft=-1;
+	m_Nodes[node_number].m_nFirstTri=first;
+	m_Nodes[node_number].m_nNumTris=ntris;
+
+	if (ntris<=BVH_MAX_LEAF_TRIS)
+		return;
+
+	// Trace4RaysWideBVH's stack is sized for this depth. a big leaf is slow, a deeper tree
+	// would overflow it.
+	if (depth>=WIDEBVH_MAX_DEPTH)
+		return;
+
+	float ISA=BoxSurfaceArea(mins,maxs);
+	ISA=(ISA>0) ? 1.0/ISA : 0;
+	float best_cost=1.0e23;
+	int best_axis=-1,best_bin=0;
+	if (depth<BVH_MAX_DEPTH)
+	{
+		for(int axis=0;axis<3;axis++)
+		{
+			float extent=cmaxs[axis]-cmins[axis];
+			if (extent<=0)
+				continue;
+			float bin_scale=BVH_NUM_BINS*0.999/extent;
+
+			int ncount[BVH_NUM_BINS];
+			Vector bmins[BVH_NUM_BINS],bmaxs[BVH_NUM_BINS];
+			for(int b=0;b<BVH_NUM_BINS;b++)
+			{
+				ncount[b]=0;
+				bmins[b]=Vector( 1.0e23, 1.0e23, 1.0e23 );
+				bmaxs[b]=Vector( -1.0e23, -1.0e23, -1.0e23 );
+			}
+			for(int t=first;t<first+ntris;t++)
+			{
+				float centroid=0.5*(m_TriMins[tris[t]][axis]+m_TriMaxs[tris[t]][axis]);
+				int b=(int) ((centroid-cmins[axis])*bin_scale);
+				ncount[b]++;
+				VectorMin( m_TriMins[tris[t]], bmins[b], bmins[b] );
+				VectorMax( m_TriMaxs[tris[t]], bmaxs[b], bmaxs[b] );
+			}
+
+			// sweep from the right to get the cost of everything right of each boundary
+			float right_cost[BVH_NUM_BINS];
+			Vector rmins=bmins[BVH_NUM_BINS-1],rmaxs=bmaxs[BVH_NUM_BINS-1];
+			int nright=ncount[BVH_NUM_BINS-1];
+			for(int b=BVH_NUM_BINS-1;b>0;b--)
+			{
+				right_cost[b]=nright ? BoxSurfaceArea(rmins,rmaxs)*nright : 0;
+				VectorMin( bmins[b-1], rmins, rmins );
+				VectorMax( bmaxs[b-1], rmaxs, rmaxs );
+				nright+=ncount[b-1];
+			}
+
+			Vector lmins=bmins[0],lmaxs=bmaxs[0];
+			int nleft=ncount[0];
+			for(int b=1;b<BVH_NUM_BINS;b++)
+			{
+				if (nleft && (nleft<ntris))
+				{
+					float trial_cost=COST_OF_TRAVERSAL+COST_OF_INTERSECTION*ISA*
+						(BoxSurfaceArea(lmins,lmaxs)*nleft+right_cost[b]);
+					if (trial_cost<best_cost)
+					{
+						best_cost=trial_cost;
+						best_axis=axis;
+						best_bin=b;
+					}
+				}
+				VectorMin( bmins[b], lmins, lmins );
+				VectorMax( bmaxs[b], lmaxs, lmaxs );
+				nleft+=ncount[b];
+			}
+		}
+	}
+
+	float cost_of_no_split=COST_OF_INTERSECTION*ntris;
+	if ((best_axis!=-1) && (cost_of_no_split<=best_cost) && (ntris<=BVH_FORCE_LEAF_TRIS))
+		return;
+
+	int nleft;
+	if (best_axis==-1)
+	{
+		// all the centroids are in the same place, or the tree got too deep. just split the
+		// list in half.
+		nleft=ntris/2;
+	}
+	else
+	{
+		float bin_scale=BVH_NUM_BINS*0.999/(cmaxs[best_axis]-cmins[best_axis]);
+		int lo=first,hi=first+ntris-1;
+		while(lo<=hi)
+		{
+			float centroid=0.5*(m_TriMins[tris[lo]][best_axis]+m_TriMaxs[tris[lo]][best_axis]);
+			if ((int) ((centroid-cmins[best_axis])*bin_scale)<best_bin)
+				lo++;
+			else
+			{
+				int32 tmp=tris[lo];
+				tris[lo]=tris[hi];
+				tris[hi]=tmp;
+				hi--;
+			}
+		}
+		nleft=lo-first;
+		if ((nleft==0) || (nleft==ntris))
+			nleft=ntris/2;
+	}
+
+	int left_child=m_Nodes.AddMultipleToTail(2);
+	m_Nodes[node_number].m_nLeft=left_child;
+	BuildNode(left_child,first,nleft,depth+1);
+	BuildNode(left_child+1,first+nleft,ntris-nleft,depth+1);
+}
+
+
+static void InitWideBVHNode( WideBVHNode &node )
+{
+	// empty slots get inside out bounds so that they can never be hit
+	for(int c=0;c<3;c++)
+	{
+		node.ChildMins[c]=ReplicateX4(1.0e23);
+		node.ChildMaxs[c]=ReplicateX4(-1.0e23);
+	}
+	for(int i=0;i<4;i++)
+	{
+		node.Children[i]=0;
+		node.NumTris[i]=WIDEBVH_EMPTY_SLOT;
+	}
+}
+
+
+int CWideBVHBuilder::MakeSingleLeafNode( int node_number )
+{
+	// only used when the whole tree is a single leaf
+	int wide_node=m_Env.WideBVHTree.AddToTail();
+	WideBVHNode &node=m_Env.WideBVHTree[wide_node];
+	InitWideBVHNode(node);
+	BVHBuildNode_t const &leaf=m_Nodes[node_number];
+	for(int c=0;c<3;c++)
+	{
+		SubFloat(node.ChildMins[c],0)=leaf.m_Mins[c];
+		SubFloat(node.ChildMaxs[c],0)=leaf.m_Maxs[c];
+	}
+	node.Children[0]=leaf.m_nFirstTri;
+	node.NumTris[0]=leaf.m_nNumTris;
+	return wide_node;
+}
+
+
+int CWideBVHBuilder::CollapseNode( int node_number )
+{
+	int children[4];
+	int nchildren=2;
+	children[0]=m_Nodes[node_number].m_nLeft;
+	children[1]=children[0]+1;
+
+	// open up the inner child with the biggest surface area until there are 4
+	while(nchildren<4)
+	{
+		int best=-1;
+		float best_area=-1;
+		for(int i=0;i<nchildren;i++)
+		{
+			BVHBuildNode_t const &child=m_Nodes[children[i]];
+			if (child.m_nLeft==-1)
+				continue;
+			float area=BoxSurfaceArea(child.m_Mins,child.m_Maxs);
+			if (area>best_area)
+			{
+				best_area=area;
+				best=i;
+			}
+		}
+		if (best==-1)
+			break;
+		int opened=children[best];
+		children[best]=m_Nodes[opened].m_nLeft;
+		children[nchildren++]=m_Nodes[opened].m_nLeft+1;
+	}
+
+	int wide_node=m_Env.WideBVHTree.AddToTail();
+	InitWideBVHNode(m_Env.WideBVHTree[wide_node]);
+	for(int i=0;i<nchildren;i++)
+	{
+		BVHBuildNode_t const &child=m_Nodes[children[i]];
+		int32 child_idx;
+		int32 child_tris;
+		if (child.m_nLeft==-1)
+		{
+			child_idx=child.m_nFirstTri;
+			child_tris=child.m_nNumTris;
+		}
+		else
+		{
+			child_idx=CollapseNode(children[i]);
+			child_tris=0;
+		}
+
+		// CollapseNode can grow the array, so don't hold onto a reference across it
+		WideBVHNode &node=m_Env.WideBVHTree[wide_node];
+		for(int c=0;c<3;c++)
+		{
+			SubFloat(node.ChildMins[c],i)=child.m_Mins[c];
+			SubFloat(node.ChildMaxs[c],i)=child.m_Maxs[c];
+		}
+		node.Children[i]=child_idx;
+		node.NumTris[i]=child_tris;
+	}
+	return wide_node;
+}
+
+
+void CWideBVHBuilder::Build()
+{
+	int ntris=m_Env.OptimizedTriangleList.Count();
+	m_Env.WideBVHTree.Purge();
+	m_Env.WideBVHTriangleIndexList.SetCount(ntris);
+	if (ntris==0)
+		return;
+
+	CalculateTriangleBounds(m_Env,m_TriMins,m_TriMaxs);
+	for(int t=0;t<ntris;t++)
+		m_Env.WideBVHTriangleIndexList[t]=t;
+
+	m_Nodes.EnsureCapacity(2*ntris/BVH_MAX_LEAF_TRIS);
+	m_Nodes.AddToTail();
+	BuildNode(0,0,ntris,0);
+
+	m_Env.WideBVHTree.EnsureCapacity(m_Nodes.Count()/3+1);
+	if (m_Nodes[0].m_nLeft==-1)
+		MakeSingleLeafNode(0);
+	else
+		CollapseNode(0);
+}
+
+
+void RayTracingEnvironment::BuildWideBVH(void)
+{
+	CWideBVHBuilder builder(*this);
+	builder.Build();
+}
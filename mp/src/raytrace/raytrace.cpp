@@ -256,7 +256,6 @@ int CacheOptimizedTriangle::ClassifyAgainstAxisSplit(int split_plane, float spli
 }
 
 #define MAILBOX_HASH_SIZE 256
-#define MAX_TREE_DEPTH 21
 #define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
 
 struct NodeToVisit {
@@ -266,9 +265,10 @@ struct NodeToVisit {
 };
 
 
-static fltx4 FourEpsilons={1.0e-10,1.0e-10,1.0e-10,1.0e-10};
-static fltx4 FourZeros={1.0e-10,1.0e-10,1.0e-10,1.0e-10};
-static fltx4 FourNegativeEpsilons={-1.0e-10,-1.0e-10,-1.0e-10,-1.0e-10};
+// trace8.cpp uses these too, so the 8 ray triangle test stays the same as IntersectTriangle4
+fltx4 FourEpsilons={1.0e-10,1.0e-10,1.0e-10,1.0e-10};
+fltx4 FourZeros={1.0e-10,1.0e-10,1.0e-10,1.0e-10};
+fltx4 FourNegativeEpsilons={-1.0e-10,-1.0e-10,-1.0e-10,-1.0e-10};
 
 static float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
 {
@@ -276,10 +276,118 @@ static float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
 	return 2.0*((boxdim[0]*boxdim[2])+(boxdim[0]*boxdim[1])+(boxdim[1]*boxdim[2]));
 }
 
+// test 4 rays against one triangle, and update rslt_out for any rays which hit it closer than
+// their current hit.
+static FORCEINLINE void IntersectTriangle4( const FourRays &rays, int32 tnum, TriIntersectData_t const *tri,
+											RayTracingResult *rslt_out, ITransparentTriangleCallback *pCallback )
+{
+	n_intersection_calculations++;
+	// compute plane intersection
+
+
+	FourVectors N;
+	N.x = ReplicateX4( tri->m_flNx );
+	N.y = ReplicateX4( tri->m_flNy );
+	N.z = ReplicateX4( tri->m_flNz );
+
+	fltx4 DDotN = rays.direction * N;
+	// mask off zero or near zero (ray parallel to surface)
+	fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
+							CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
+
+	fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
+
+	fltx4 isect_t=DivSIMD( numerator,DDotN );
+	// now, we have the distance to the plane. lets update our mask
+	did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
+	//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
+	did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// now, check 3 edges
+	fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
+						MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
+	fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
+						   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
+	
+	// do barycentric coordinate check
+	fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+
+	B0 = AddSIMD(
+		B0,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+	B0 = AddSIMD(
+		B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
+
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
+
+	fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+	B1 = AddSIMD(
+		B1,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
+
+	B1 = AddSIMD(
+		B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
+	
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
+
+	fltx4 B2 = AddSIMD( B1, B0 );
+	did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// if the triangle is transparent
+	if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
+	{
+		if ( pCallback )
+		{
+			// assuming a triangle indexed as v0, v1, v2
+			// the projected edge equations are set up such that the vert opposite the first
+			// equation is v2, and the vert opposite the second equation is v0
+			// Therefore we pass them back in 1, 2, 0 order
+			// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
+			// barycentric coordinate.  Compute that now and pass it to the callback
+			fltx4 b2 = SubSIMD( Four_Ones, B2 );
+			if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
+			{
+				did_hit = Four_Zeros;
+			}
+		}
+	}
+	// now, set the hit_id and closest_hit fields for any enabled rays
+	fltx4 replicated_n = ReplicateIX4(tnum);
+	StoreAlignedSIMD((float *) rslt_out->HitIds,
+				 OrSIMD(AndSIMD(replicated_n,did_hit),
+						   AndNotSIMD(did_hit,LoadAlignedSIMD(
+											 (float *) rslt_out->HitIds))));
+	rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
+					 AndNotSIMD(did_hit,rslt_out->HitDistance));
+
+	rslt_out->surface_normal.x=OrSIMD(
+		AndSIMD(N.x,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.x));
+	rslt_out->surface_normal.y=OrSIMD(
+		AndSIMD(N.y,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.y));
+	rslt_out->surface_normal.z=OrSIMD(
+		AndSIMD(N.z,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.z));
+}
+
 void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
 									   RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
 {
+	if ( Flags & RTE_FLAGS_WIDE_BVH )
+	{
+		// the bvh doesn't care about direction signs
+		Trace4RaysWideBVH( rays, TMin, TMax, rslt_out, skip_id, pCallback );
+		return;
+	}
+
 	int msk=rays.CalculateDirectionSignMask();
 	if (msk!=-1)
 		Trace4Rays(rays,TMin,TMax,msk,rslt_out,skip_id, pCallback);
@@ -348,6 +456,12 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 									   int DirectionSignMask, RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
 {
+	if ( Flags & RTE_FLAGS_WIDE_BVH )
+	{
+		Trace4RaysWideBVH( rays, TMin, TMax, rslt_out, skip_id, pCallback );
+		return;
+	}
+
 	rays.Check();
 
 	memset(rslt_out->HitIds,0xff,sizeof(rslt_out->HitIds));
@@ -476,102 +590,8 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 				TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
 				if ( ( mailboxids[mbox_slot] != tnum ) && ( tri->m_nTriangleID != skip_id ) )
 				{
-					n_intersection_calculations++;
 					mailboxids[mbox_slot] = tnum;
-					// compute plane intersection
-
-
-					FourVectors N;
-					N.x = ReplicateX4( tri->m_flNx );
-					N.y = ReplicateX4( tri->m_flNy );
-					N.z = ReplicateX4( tri->m_flNz );
-
-					fltx4 DDotN = rays.direction * N;
-					// mask off zero or near zero (ray parallel to surface)
-					fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
-											CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
-
-					fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
-
-					fltx4 isect_t=DivSIMD( numerator,DDotN );
-					// now, we have the distance to the plane. lets update our mask
-					did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
-					//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
-					did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// now, check 3 edges
-					fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
-										MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
-					fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
-										   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
-					
-					// do barycentric coordinate check
-					fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
-
-					B0 = AddSIMD(
-						B0,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
-					B0 = AddSIMD(
-						B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
-
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
-
-					fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
-					B1 = AddSIMD(
-						B1,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
-
-					B1 = AddSIMD(
-						B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
-					
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
-
-					fltx4 B2 = AddSIMD( B1, B0 );
-					did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// if the triangle is transparent
-					if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
-					{
-						if ( pCallback )
-						{
-							// assuming a triangle indexed as v0, v1, v2
-							// the projected edge equations are set up such that the vert opposite the first
-							// equation is v2, and the vert opposite the second equation is v0
-							// Therefore we pass them back in 1, 2, 0 order
-							// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
-							// barycentric coordinate.  Compute that now and pass it to the callback
-							fltx4 b2 = SubSIMD( Four_Ones, B2 );
-							if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
-							{
-								did_hit = Four_Zeros;
-							}
-						}
-					}
-					// now, set the hit_id and closest_hit fields for any enabled rays
-					fltx4 replicated_n = ReplicateIX4(tnum);
-					StoreAlignedSIMD((float *) rslt_out->HitIds,
-								 OrSIMD(AndSIMD(replicated_n,did_hit),
-										   AndNotSIMD(did_hit,LoadAlignedSIMD(
-															 (float *) rslt_out->HitIds))));
-					rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
-									 AndNotSIMD(did_hit,rslt_out->HitDistance));
-
-					rslt_out->surface_normal.x=OrSIMD(
-						AndSIMD(N.x,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.x));
-					rslt_out->surface_normal.y=OrSIMD(
-						AndSIMD(N.y,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.y));
-					rslt_out->surface_normal.z=OrSIMD(
-						AndSIMD(N.z,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.z));
-					
+					IntersectTriangle4( rays, tnum, tri, rslt_out, pCallback );
 				}
 			} while (--ntris);
 			// now, check if all rays have terminated
@@ -595,6 +615,114 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 }
 
 
+// each inner node leaves at most 3 of its children on the stack while the nearest one is
+// visited, and every level of the wide tree is at least one level of the binary tree it was
+// collapsed from, which the builder stops at WIDEBVH_MAX_DEPTH.
+#define WIDEBVH_STACK_SIZE (3*WIDEBVH_MAX_DEPTH+1)
+
+struct WideBVHNodeToVisit
+{
+	fltx4 TMin;												// entry distance of each ray. FLT_MAX
+															// for rays which miss the box
+	int32 Child;
+	int32 NumTris;
+};
+
+void RayTracingEnvironment::Trace4RaysWideBVH(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+											  RayTracingResult *rslt_out,
+											  int32 skip_id, ITransparentTriangleCallback *pCallback)
+{
+	memset(rslt_out->HitIds,0xff,sizeof(rslt_out->HitIds));
+
+	rslt_out->HitDistance=ReplicateX4(1.0e23);
+
+	rslt_out->surface_normal.DuplicateVector(Vector(0.,0.,0.));
+
+	if ( WideBVHTree.Count() == 0 )
+		return;
+
+	FourVectors OneOverRayDir=rays.direction;
+	OneOverRayDir.MakeReciprocalSaturate();
+
+	WideBVHNodeToVisit NodeStack[WIDEBVH_STACK_SIZE];
+	WideBVHNodeToVisit *stack_ptr=NodeStack;
+	stack_ptr->TMin=TMin;
+	stack_ptr->Child=0;
+	stack_ptr->NumTris=0;
+	stack_ptr++;
+
+	while( stack_ptr != NodeStack )
+	{
+		--stack_ptr;
+		// skip nodes that are further away than what all of the rays have hit since pushing them
+		fltx4 TFar=MinSIMD(TMax,rslt_out->HitDistance);
+		if (! IsAnyNegative(CmpLeSIMD(stack_ptr->TMin,TFar)))
+			continue;
+
+		int32 child=stack_ptr->Child;
+		int ntris=stack_ptr->NumTris;
+		if (ntris)
+		{
+			// leaf. triangles are not duplicated between leaves, so no mailbox is needed
+			int32 const *tlist=&(WideBVHTriangleIndexList[child]);
+			do
+			{
+				int tnum=*(tlist++);
+				TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+				if ( tri->m_nTriangleID != skip_id )
+					IntersectTriangle4( rays, tnum, tri, rslt_out, pCallback );
+			} while (--ntris);
+			continue;
+		}
+
+		// inner node. clip the rays against all 4 child boxes, then push the children that got
+		// hit so that the nearest one gets popped first.
+		WideBVHNode const &node=WideBVHTree[child];
+		WideBVHNodeToVisit hits[4];
+		float hit_dists[4];
+		int nhits=0;
+		for(int i=0;i<4;i++)
+		{
+			if (node.NumTris[i]==WIDEBVH_EMPTY_SLOT)
+				continue;
+			fltx4 box_tmin=TMin;
+			fltx4 box_tmax=TFar;
+			for(int c=0;c<3;c++)
+			{
+				fltx4 isect_min_t=
+					MulSIMD(SubSIMD(ReplicateX4(SubFloat(node.ChildMins[c],i)),rays.origin[c]),OneOverRayDir[c]);
+				fltx4 isect_max_t=
+					MulSIMD(SubSIMD(ReplicateX4(SubFloat(node.ChildMaxs[c],i)),rays.origin[c]),OneOverRayDir[c]);
+				box_tmin=MaxSIMD(box_tmin,MinSIMD(isect_min_t,isect_max_t));
+				box_tmax=MinSIMD(box_tmax,MaxSIMD(isect_min_t,isect_max_t));
+			}
+			fltx4 hit=CmpLeSIMD(box_tmin,box_tmax);
+			if (! IsAnyNegative(hit))
+				continue;
+			box_tmin=OrSIMD(AndSIMD(hit,box_tmin),AndNotSIMD(hit,Four_FLT_MAX));
+			float dist=min(min(SubFloat(box_tmin,0),SubFloat(box_tmin,1)),
+						   min(SubFloat(box_tmin,2),SubFloat(box_tmin,3)));
+
+			// insertion sort, furthest first
+			int slot=nhits++;
+			while( (slot>0) && (hit_dists[slot-1]<dist) )
+			{
+				hits[slot]=hits[slot-1];
+				hit_dists[slot]=hit_dists[slot-1];
+				slot--;
+			}
+			hits[slot].TMin=box_tmin;
+			hits[slot].Child=node.Children[i];
+			hits[slot].NumTris=node.NumTris[i];
+			hit_dists[slot]=dist;
+		}
+		Assert( stack_ptr+nhits <= &NodeStack[WIDEBVH_STACK_SIZE] );
+		for(int i=0;i<nhits;i++)
+			*(stack_ptr++)=hits[i];
+	}
+}
+
+
 int RayTracingEnvironment::MakeLeafNode(int first_tri, int last_tri)
 {
 	CacheOptimizedKDNode ret;
@@ -647,9 +775,6 @@ void RayTracingEnvironment::CalculateTriangleListBounds(int32 const *tris,int nt
 // one side being devoid of triangles, the empty side is "grown" as much as possible.
 //
 
-#define COST_OF_TRAVERSAL 75								// approximate #operations
-#define COST_OF_INTERSECTION 167							// approximate #operations
-
 
 float RayTracingEnvironment::CalculateCostsOfSplit(
 	int split_plane,int32 const *tri_list,int ntris,
@@ -874,15 +999,26 @@ void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int
 
 void RayTracingEnvironment::SetupAccelerationStructure(void)
 {
-	CacheOptimizedKDNode root;
-	OptimizedKDTree.AddToTail(root);
-	int32 *root_triangle_list=new int32[OptimizedTriangleList.Count()];
-	for(int t=0;t<OptimizedTriangleList.Count();t++)
-		root_triangle_list[t]=t;
-	CalculateTriangleListBounds(root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,
-								m_MaxBound);
-	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
-	delete[] root_triangle_list;
+	if ( Flags & RTE_FLAGS_EXACT_TREE_GENERATION )
+	{
+		CacheOptimizedKDNode root;
+		OptimizedKDTree.AddToTail(root);
+		int32 *root_triangle_list=new int32[OptimizedTriangleList.Count()];
+		for(int t=0;t<OptimizedTriangleList.Count();t++)
+			root_triangle_list[t]=t;
+		CalculateTriangleListBounds(root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,
+									m_MaxBound);
+		RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
+		delete[] root_triangle_list;
+	}
+	else
+	{
+		BuildKDTree();
+	}
+
+	// the bvh builder needs the triangle vertices too, so it has to run before the conversion
+	if ( Flags & RTE_FLAGS_WIDE_BVH )
+		BuildWideBVH();
 
 	// now, convert all triangles to "intersection format"
 	for(int i=0;i<OptimizedTriangleList.Count();i++)
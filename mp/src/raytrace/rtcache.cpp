@@ -0,0 +1,314 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: On-disk cache of a built RayTracingEnvironment.
+//
+//=============================================================================//
+
+#include "raytrace.h"
+#include <stdio.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+// The file is a header followed by one lump per array, bsp style. Every lump starts on a 16
+// byte boundary so the sse data (the bvh nodes) stays aligned in the mapped view. The arrays
+// are raw memory images, so a cache is only good for the build that wrote it - the structure
+// sizes in the header catch the common mismatches (32 vs 64 bit, DEBUG_RAYTRACE).
+
+#define RTCACHE_ID				(('C'<<24)+('T'<<16)+('R'<<8)+'V')	// little-endian "VRTC"
+#define RTCACHE_VERSION			2
+#define RTCACHE_LUMP_ALIGN		16
+
+// The flags that change what gets built. A cache saved with different ones is stale.
+#define RTCACHE_FLAGS_MASK		( RTE_FLAGS_FAST_TREE_GENERATION | RTE_FLAGS_EXACT_TREE_GENERATION | \
+								  RTE_FLAGS_WIDE_BVH | RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS |		\
+								  RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS )
+
+enum
+{
+	RTCACHE_LUMP_TRIANGLES = 0,
+	RTCACHE_LUMP_KDNODES,
+	RTCACHE_LUMP_TRIANGLE_INDICES,
+	RTCACHE_LUMP_TRIANGLE_COLORS,
+	RTCACHE_LUMP_TRIANGLE_MATERIALS,
+	RTCACHE_LUMP_BVHNODES,
+	RTCACHE_LUMP_BVH_TRIANGLE_INDICES,
+
+	RTCACHE_NUM_LUMPS
+};
+
+static const int s_nLumpElementSizes[RTCACHE_NUM_LUMPS] =
+{
+	sizeof( CacheOptimizedTriangle ),
+	sizeof( CacheOptimizedKDNode ),
+	sizeof( int32 ),
+	sizeof( Vector ),
+	sizeof( int32 ),
+	sizeof( WideBVHNode ),
+	sizeof( int32 ),
+};
+
+struct RayTraceCacheLump_t
+{
+	int32 m_nOffset;
+	int32 m_nCount;											// elements, not bytes
+	int32 m_nElementSize;
+};
+
+struct RayTraceCacheHeader_t
+{
+	int32 m_nId;
+	int32 m_nVersion;
+	uint8 m_Key[RTE_CACHE_KEY_SIZE];
+	uint32 m_nFlags;										// RTE_FLAGS_xxx & RTCACHE_FLAGS_MASK
+	float m_MinBound[3];
+	float m_MaxBound[3];
+	RayTraceCacheLump_t m_Lumps[RTCACHE_NUM_LUMPS];
+};
+
+
+static int AlignLumpOffset( int nOffset )
+{
+	return ( nOffset + RTCACHE_LUMP_ALIGN - 1 ) & ~( RTCACHE_LUMP_ALIGN - 1 );
+}
+
+
+static bool PadToLump( FILE *fp, const RayTraceCacheLump_t &lump )
+{
+	static const uint8 s_Padding[RTCACHE_LUMP_ALIGN] = { 0 };
+
+	long nPos = ftell( fp );
+	if ( nPos > lump.m_nOffset )
+		return false;
+	return ( nPos == lump.m_nOffset ) || ( fwrite( s_Padding, lump.m_nOffset - nPos, 1, fp ) == 1 );
+}
+
+
+static bool WriteLump( FILE *fp, const RayTraceCacheLump_t &lump, const void *pData )
+{
+	if ( !PadToLump( fp, lump ) )
+		return false;
+
+	size_t nBytes = (size_t)lump.m_nCount * lump.m_nElementSize;
+	return ( nBytes == 0 ) || ( fwrite( pData, nBytes, 1, fp ) == 1 );
+}
+
+
+bool RayTracingEnvironment::SaveCache( const char *pFileName, const uint8 *pKey ) const
+{
+	RayTraceCacheHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.m_nId = RTCACHE_ID;
+	header.m_nVersion = RTCACHE_VERSION;
+	memcpy( header.m_Key, pKey, RTE_CACHE_KEY_SIZE );
+	header.m_nFlags = Flags & RTCACHE_FLAGS_MASK;
+	for ( int i = 0; i < 3; i++ )
+	{
+		header.m_MinBound[i] = m_MinBound[i];
+		header.m_MaxBound[i] = m_MaxBound[i];
+	}
+
+	const int nCounts[RTCACHE_NUM_LUMPS] =
+	{
+		OptimizedTriangleList.Count(),
+		OptimizedKDTree.Count(),
+		TriangleIndexList.Count(),
+		TriangleColors.Count(),
+		TriangleMaterials.Count(),
+		WideBVHTree.Count(),
+		WideBVHTriangleIndexList.Count(),
+	};
+
+	int64 nOffset = sizeof( header );
+	for ( int i = 0; i < RTCACHE_NUM_LUMPS; i++ )
+	{
+		nOffset = AlignLumpOffset( (int)nOffset );
+		header.m_Lumps[i].m_nOffset = (int)nOffset;
+		header.m_Lumps[i].m_nCount = nCounts[i];
+		header.m_Lumps[i].m_nElementSize = s_nLumpElementSizes[i];
+
+		nOffset += (int64)nCounts[i] * s_nLumpElementSizes[i];
+		if ( nOffset > 0x7fff0000 )
+			return false;									// too big for the lump offsets
+	}
+
+	FILE *fp = fopen( pFileName, "wb" );
+	if ( !fp )
+		return false;
+
+	bool bOk = ( fwrite( &header, sizeof( header ), 1, fp ) == 1 );
+
+	// the triangles live in a block vector, so they have to go out one block at a time
+	const RayTraceCacheLump_t &triLump = header.m_Lumps[RTCACHE_LUMP_TRIANGLES];
+	bOk = bOk && PadToLump( fp, triLump );
+	for ( int i = 0; bOk && i < OptimizedTriangleList.Count(); )
+	{
+		const CacheOptimizedTriangle *pFirst = &OptimizedTriangleList[i];
+		int nRun = 1;
+		while ( i + nRun < OptimizedTriangleList.Count() && &OptimizedTriangleList[i + nRun] == pFirst + nRun )
+			nRun++;
+		bOk = ( fwrite( pFirst, sizeof( CacheOptimizedTriangle ), nRun, fp ) == (size_t)nRun );
+		i += nRun;
+	}
+
+	bOk = bOk && WriteLump( fp, header.m_Lumps[RTCACHE_LUMP_KDNODES], OptimizedKDTree.Base() );
+	bOk = bOk && WriteLump( fp, header.m_Lumps[RTCACHE_LUMP_TRIANGLE_INDICES], TriangleIndexList.Base() );
+	bOk = bOk && WriteLump( fp, header.m_Lumps[RTCACHE_LUMP_TRIANGLE_COLORS], TriangleColors.Base() );
+	bOk = bOk && WriteLump( fp, header.m_Lumps[RTCACHE_LUMP_TRIANGLE_MATERIALS], TriangleMaterials.Base() );
+	bOk = bOk && WriteLump( fp, header.m_Lumps[RTCACHE_LUMP_BVHNODES], WideBVHTree.Base() );
+	bOk = bOk && WriteLump( fp, header.m_Lumps[RTCACHE_LUMP_BVH_TRIANGLE_INDICES], WideBVHTriangleIndexList.Base() );
+
+	bOk = ( fclose( fp ) == 0 ) && bOk;
+	if ( !bOk )
+		remove( pFileName );								// don't leave a truncated cache around
+	return bOk;
+}
+
+
+//-----------------------------------------------------------------------------
+// Read only view of a whole file
+//-----------------------------------------------------------------------------
+class CMappedCacheFile
+{
+public:
+	CMappedCacheFile() : m_pData( NULL ), m_nSize( 0 )
+	{
+#ifdef _WIN32
+		m_hFile = INVALID_HANDLE_VALUE;
+		m_hMapping = NULL;
+#else
+		m_nFD = -1;
+#endif
+	}
+
+	~CMappedCacheFile()
+	{
+#ifdef _WIN32
+		if ( m_pData )
+			UnmapViewOfFile( m_pData );
+		if ( m_hMapping )
+			CloseHandle( m_hMapping );
+		if ( m_hFile != INVALID_HANDLE_VALUE )
+			CloseHandle( m_hFile );
+#else
+		if ( m_pData )
+			munmap( (void *)m_pData, m_nSize );
+		if ( m_nFD >= 0 )
+			close( m_nFD );
+#endif
+	}
+
+	bool Map( const char *pFileName )
+	{
+#ifdef _WIN32
+		m_hFile = CreateFile( pFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+		if ( m_hFile == INVALID_HANDLE_VALUE )
+			return false;
+		LARGE_INTEGER size;
+		if ( !GetFileSizeEx( m_hFile, &size ) || size.QuadPart == 0 || size.HighPart != 0 )
+			return false;
+		m_nSize = size.LowPart;
+		m_hMapping = CreateFileMapping( m_hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+		if ( !m_hMapping )
+			return false;
+		m_pData = (const uint8 *)MapViewOfFile( m_hMapping, FILE_MAP_READ, 0, 0, 0 );
+#else
+		m_nFD = open( pFileName, O_RDONLY );
+		if ( m_nFD < 0 )
+			return false;
+		struct stat st;
+		if ( fstat( m_nFD, &st ) != 0 || st.st_size == 0 || st.st_size > 0x7fffffff )
+			return false;
+		m_nSize = st.st_size;
+		void *pView = mmap( NULL, m_nSize, PROT_READ, MAP_PRIVATE, m_nFD, 0 );
+		m_pData = ( pView != MAP_FAILED ) ? (const uint8 *)pView : NULL;
+#endif
+		return m_pData != NULL;
+	}
+
+	const uint8 *Base() const								{ return m_pData; }
+	size_t Size() const										{ return m_nSize; }
+
+private:
+	const uint8 *m_pData;
+	size_t m_nSize;
+#ifdef _WIN32
+	HANDLE m_hFile;
+	HANDLE m_hMapping;
+#else
+	int m_nFD;
+#endif
+};
+
+
+template< class T, class A >
+static void CopyLump( CUtlVector< T, A > &dest, const uint8 *pBase, const RayTraceCacheLump_t &lump )
+{
+	// assign rather than memcpy, some of the element types (Vector) have their own operator=
+	dest.SetCount( lump.m_nCount );
+	const T *pSrc = (const T *)( pBase + lump.m_nOffset );
+	for ( int i = 0; i < lump.m_nCount; i++ )
+		dest[i] = pSrc[i];
+}
+
+
+bool RayTracingEnvironment::LoadCache( const char *pFileName, const uint8 *pKey )
+{
+	CMappedCacheFile file;
+	if ( !file.Map( pFileName ) || file.Size() < sizeof( RayTraceCacheHeader_t ) )
+		return false;
+
+	const RayTraceCacheHeader_t &header = *(const RayTraceCacheHeader_t *)file.Base();
+	if ( header.m_nId != RTCACHE_ID || header.m_nVersion != RTCACHE_VERSION ||
+		memcmp( header.m_Key, pKey, RTE_CACHE_KEY_SIZE ) ||
+		header.m_nFlags != ( Flags & RTCACHE_FLAGS_MASK ) )
+	{
+		return false;
+	}
+
+	for ( int i = 0; i < RTCACHE_NUM_LUMPS; i++ )
+	{
+		const RayTraceCacheLump_t &lump = header.m_Lumps[i];
+		if ( lump.m_nElementSize != s_nLumpElementSizes[i] || lump.m_nCount < 0 || lump.m_nOffset < (int)sizeof( header ) ||
+			( lump.m_nOffset & ( RTCACHE_LUMP_ALIGN - 1 ) ) ||
+			(uint64)lump.m_nOffset + (uint64)lump.m_nCount * lump.m_nElementSize > file.Size() )
+		{
+			return false;
+		}
+	}
+
+	int nTris = header.m_Lumps[RTCACHE_LUMP_TRIANGLES].m_nCount;
+	if ( !header.m_Lumps[RTCACHE_LUMP_KDNODES].m_nCount ||
+		( header.m_Lumps[RTCACHE_LUMP_TRIANGLE_COLORS].m_nCount != 0 &&
+		  header.m_Lumps[RTCACHE_LUMP_TRIANGLE_COLORS].m_nCount != nTris ) ||
+		( header.m_Lumps[RTCACHE_LUMP_TRIANGLE_MATERIALS].m_nCount != 0 &&
+		  header.m_Lumps[RTCACHE_LUMP_TRIANGLE_MATERIALS].m_nCount != nTris ) )
+	{
+		return false;
+	}
+
+	// The cache replaces whatever is in here
+	const uint8 *pBase = file.Base();
+	const CacheOptimizedTriangle *pTris = (const CacheOptimizedTriangle *)( pBase + header.m_Lumps[RTCACHE_LUMP_TRIANGLES].m_nOffset );
+	OptimizedTriangleList.SetCount( nTris );
+	for ( int i = 0; i < nTris; i++ )
+		OptimizedTriangleList[i] = pTris[i];
+
+	CopyLump( OptimizedKDTree, pBase, header.m_Lumps[RTCACHE_LUMP_KDNODES] );
+	CopyLump( TriangleIndexList, pBase, header.m_Lumps[RTCACHE_LUMP_TRIANGLE_INDICES] );
+	CopyLump( TriangleColors, pBase, header.m_Lumps[RTCACHE_LUMP_TRIANGLE_COLORS] );
+	CopyLump( TriangleMaterials, pBase, header.m_Lumps[RTCACHE_LUMP_TRIANGLE_MATERIALS] );
+	CopyLump( WideBVHTree, pBase, header.m_Lumps[RTCACHE_LUMP_BVHNODES] );
+	CopyLump( WideBVHTriangleIndexList, pBase, header.m_Lumps[RTCACHE_LUMP_BVH_TRIANGLE_INDICES] );
+
+	m_MinBound.Init( header.m_MinBound[0], header.m_MinBound[1], header.m_MinBound[2] );
+	m_MaxBound.Init( header.m_MaxBound[0], header.m_MaxBound[1], header.m_MaxBound[2] );
+	return true;
+}
@@ -0,0 +1,285 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: 8 ray packet tracing. The kd-tree traversal from raytrace.cpp,
+//			8 rays wide with avx2 and fma, and the sse fallback.
+//
+//=============================================================================//
+
+#include "raytrace.h"
+#include "tier1/processor_detect.h"
+
+// The avx2 code is compiled with the instruction set enabled on just the functions that need it,
+// rather than on the whole file. That way inline functions from the headers which get emitted
+// here can't end up using avx instructions in code that runs on older cpus.
+#if defined( _MSC_VER ) && ( _MSC_VER >= 1700 ) && !defined( _X360 )
+#define RAYTRACE_AVX2 1
+#define AVX2_FUNCTION
+#elif defined( __GNUC__ ) && ( ( __GNUC__ > 4 ) || ( ( __GNUC__ == 4 ) && ( __GNUC_MINOR__ >= 9 ) ) )
+#define RAYTRACE_AVX2 1
+#define AVX2_FUNCTION __attribute__(( target( "avx2,fma" ) ))
+#endif
+
+#ifdef RAYTRACE_AVX2
+#include <immintrin.h>
+#endif
+
+
+bool RayTracingEnvironment::SupportsTrace8Rays(void) const
+{
+#ifdef RAYTRACE_AVX2
+	static int s_nHasAVX2 = -1;
+	if ( s_nHasAVX2 == -1 )
+		s_nHasAVX2 = CheckAVX2Technology() ? 1 : 0;
+	return ( s_nHasAVX2 == 1 ) && !( Flags & RTE_FLAGS_NO_AVX2 );
+#else
+	return false;
+#endif
+}
+
+
+#ifdef RAYTRACE_AVX2
+
+#define MAILBOX_HASH_SIZE 256
+#define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
+
+struct NodeToVisit8
+{
+	__m256 TMin;
+	__m256 TMax;
+	CacheOptimizedKDNode const *node;
+};
+
+// puts two fltx4s into the low and high halves of an 8-wide register
+#define COMBINE_FLTX4( lo, hi ) _mm256_insertf128_ps( _mm256_castps128_ps256( lo ), ( hi ), 1 )
+
+// the triangle test constants from raytrace.cpp
+extern fltx4 FourEpsilons;
+extern fltx4 FourZeros;
+extern fltx4 FourNegativeEpsilons;
+
+AVX2_FUNCTION static void StoreResults8( RayTracingResult *rslt_out, __m256 const &hit_ids,
+										 __m256 const &hit_dist, __m256 const *hit_normal )
+{
+	_mm_store_ps( (float *) rslt_out[0].HitIds, _mm256_castps256_ps128( hit_ids ) );
+	_mm_store_ps( (float *) rslt_out[1].HitIds, _mm256_extractf128_ps( hit_ids, 1 ) );
+	rslt_out[0].HitDistance = _mm256_castps256_ps128( hit_dist );
+	rslt_out[1].HitDistance = _mm256_extractf128_ps( hit_dist, 1 );
+	for(int c=0;c<3;c++)
+	{
+		rslt_out[0].surface_normal[c] = _mm256_castps256_ps128( hit_normal[c] );
+		rslt_out[1].surface_normal[c] = _mm256_extractf128_ps( hit_normal[c], 1 );
+	}
+}
+
+// Same algorithm as RayTracingEnvironment::Trace4Rays, including the epsilons, so the results
+// match it except for the odd ray grazing a triangle edge, where fma rounds differently. No
+// transparent triangle callback - Trace8Rays doesn't come here with one.
+AVX2_FUNCTION static void Trace8RaysKDTree( RayTracingEnvironment &env, const EightRays &rays,
+											fltx4 const *pTMin, fltx4 const *pTMax,
+											int DirectionSignMask, RayTracingResult *rslt_out,
+											int32 skip_id )
+{
+	rays.Rays[0].Check();
+	rays.Rays[1].Check();
+
+	__m256 origin[3], direction[3], OneOverRayDir[3];
+	FourVectors OneOverRayDir0=rays.Rays[0].direction;
+	FourVectors OneOverRayDir1=rays.Rays[1].direction;
+	OneOverRayDir0.MakeReciprocalSaturate();
+	OneOverRayDir1.MakeReciprocalSaturate();
+	for(int c=0;c<3;c++)
+	{
+		origin[c]=COMBINE_FLTX4( rays.Rays[0].origin[c], rays.Rays[1].origin[c] );
+		direction[c]=COMBINE_FLTX4( rays.Rays[0].direction[c], rays.Rays[1].direction[c] );
+		OneOverRayDir[c]=COMBINE_FLTX4( OneOverRayDir0[c], OneOverRayDir1[c] );
+	}
+
+	__m256 hit_ids=_mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+	__m256 hit_dist=_mm256_set1_ps( 1.0e23 );
+	__m256 hit_normal[3];
+	hit_normal[0]=hit_normal[1]=hit_normal[2]=_mm256_setzero_ps();
+
+	__m256 TMin=COMBINE_FLTX4( pTMin[0], pTMin[1] );
+	__m256 TMax=COMBINE_FLTX4( pTMax[0], pTMax[1] );
+
+	// now, clip rays against bounding box
+	for(int c=0;c<3;c++)
+	{
+		__m256 isect_min_t=_mm256_mul_ps(
+			_mm256_sub_ps( _mm256_set1_ps( env.m_MinBound[c] ), origin[c] ), OneOverRayDir[c] );
+		__m256 isect_max_t=_mm256_mul_ps(
+			_mm256_sub_ps( _mm256_set1_ps( env.m_MaxBound[c] ), origin[c] ), OneOverRayDir[c] );
+		TMin=_mm256_max_ps( TMin, _mm256_min_ps( isect_min_t, isect_max_t ) );
+		TMax=_mm256_min_ps( TMax, _mm256_max_ps( isect_min_t, isect_max_t ) );
+	}
+	if (! _mm256_movemask_ps( _mm256_cmp_ps( TMin, TMax, _CMP_LE_OQ ) ) )
+	{
+		StoreResults8( rslt_out, hit_ids, hit_dist, hit_normal );	// missed bounding box
+		return;
+	}
+
+	int32 mailboxids[MAILBOX_HASH_SIZE];					// used to avoid redundant triangle tests
+	memset(mailboxids,0xff,sizeof(mailboxids));
+
+	int front_idx[3],back_idx[3];							// based on ray direction, whether to
+															// visit left or right node first
+	for(int c=0;c<3;c++)
+	{
+		back_idx[c]=( DirectionSignMask & ( 1 << c ) ) ? 0 : 1;
+		front_idx[c]=1-back_idx[c];
+	}
+
+	__m256 const epsilon=COMBINE_FLTX4( FourEpsilons, FourEpsilons );
+	__m256 const zeros=COMBINE_FLTX4( FourZeros, FourZeros );
+	__m256 const negative_epsilon=COMBINE_FLTX4( FourNegativeEpsilons, FourNegativeEpsilons );
+	__m256 const ones=COMBINE_FLTX4( Four_Ones, Four_Ones );
+
+	NodeToVisit8 NodeQueue[MAX_NODE_STACK_LEN];
+	CacheOptimizedKDNode const *CurNode=&(env.OptimizedKDTree[0]);
+	NodeToVisit8 *stack_ptr=&NodeQueue[MAX_NODE_STACK_LEN];
+	for(;;)
+	{
+		while (CurNode->NodeType() != KDNODE_STATE_LEAF)		// traverse until next leaf
+		{
+			int split_plane_number=CurNode->NodeType();
+			CacheOptimizedKDNode const *FrontChild=&(env.OptimizedKDTree[CurNode->LeftChild()]);
+
+			__m256 dist_to_sep_plane=						// dist=(split-org)/dir
+				_mm256_mul_ps(
+					_mm256_sub_ps( _mm256_set1_ps( CurNode->SplittingPlaneValue ),
+								   origin[split_plane_number] ), OneOverRayDir[split_plane_number] );
+			__m256 active=_mm256_cmp_ps( TMin, TMax, _CMP_LE_OQ );
+
+			__m256 hits_front=_mm256_and_ps( active, _mm256_cmp_ps( dist_to_sep_plane, TMin, _CMP_GE_OQ ) );
+			if (! _mm256_movemask_ps( hits_front ) )
+			{
+				// missed the front. only traverse back
+				CurNode=FrontChild+back_idx[split_plane_number];
+				TMin=_mm256_max_ps( TMin, dist_to_sep_plane );
+			}
+			else
+			{
+				__m256 hits_back=_mm256_and_ps( active, _mm256_cmp_ps( dist_to_sep_plane, TMax, _CMP_LE_OQ ) );
+				if (! _mm256_movemask_ps( hits_back ) )
+				{
+					// missed the back - only need to traverse front node
+					CurNode=FrontChild+front_idx[split_plane_number];
+					TMax=_mm256_min_ps( TMax, dist_to_sep_plane );
+				}
+				else
+				{
+					// at least some rays hit both nodes.
+					// must push far, traverse near
+					assert(stack_ptr>NodeQueue);
+					--stack_ptr;
+					stack_ptr->node=FrontChild+back_idx[split_plane_number];
+					stack_ptr->TMin=_mm256_max_ps( TMin, dist_to_sep_plane );
+					stack_ptr->TMax=TMax;
+					CurNode=FrontChild+front_idx[split_plane_number];
+					TMax=_mm256_min_ps( TMax, dist_to_sep_plane );
+				}
+			}
+		}
+		// hit a leaf! must do intersection check
+		int ntris=CurNode->NumberOfTrianglesInLeaf();
+		if (ntris)
+		{
+			int32 const *tlist=&(env.TriangleIndexList[CurNode->TriangleIndexStart()]);
+			do
+			{
+				int tnum=*(tlist++);
+				// check mailbox
+				int mbox_slot=tnum & (MAILBOX_HASH_SIZE-1);
+				TriIntersectData_t const *tri = &( env.OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+				if ( ( mailboxids[mbox_slot] == tnum ) || ( tri->m_nTriangleID == skip_id ) )
+					continue;
+				mailboxids[mbox_slot] = tnum;
+
+				// compute plane intersection
+				__m256 Nx=_mm256_set1_ps( tri->m_flNx );
+				__m256 Ny=_mm256_set1_ps( tri->m_flNy );
+				__m256 Nz=_mm256_set1_ps( tri->m_flNz );
+
+				__m256 DDotN=_mm256_fmadd_ps( direction[0], Nx,
+											  _mm256_fmadd_ps( direction[1], Ny, _mm256_mul_ps( direction[2], Nz ) ) );
+				// mask off zero or near zero (ray parallel to surface)
+				__m256 did_hit=_mm256_or_ps( _mm256_cmp_ps( DDotN, epsilon, _CMP_GT_OQ ),
+											 _mm256_cmp_ps( DDotN, negative_epsilon, _CMP_LT_OQ ) );
+
+				__m256 ODotN=_mm256_fmadd_ps( origin[0], Nx,
+											  _mm256_fmadd_ps( origin[1], Ny, _mm256_mul_ps( origin[2], Nz ) ) );
+				__m256 isect_t=_mm256_div_ps( _mm256_sub_ps( _mm256_set1_ps( tri->m_flD ), ODotN ), DDotN );
+
+				// now, we have the distance to the plane. lets update our mask
+				did_hit=_mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, zeros, _CMP_GT_OQ ) );
+				did_hit=_mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, hit_dist, _CMP_LT_OQ ) );
+				if (! _mm256_movemask_ps( did_hit ) )
+					continue;
+
+				// now, check 3 edges
+				__m256 hitc1=_mm256_fmadd_ps( isect_t, direction[tri->m_nCoordSelect0], origin[tri->m_nCoordSelect0] );
+				__m256 hitc2=_mm256_fmadd_ps( isect_t, direction[tri->m_nCoordSelect1], origin[tri->m_nCoordSelect1] );
+
+				// do barycentric coordinate check
+				__m256 B0=_mm256_fmadd_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[0] ), hitc1,
+					_mm256_fmadd_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[1] ), hitc2,
+									 _mm256_set1_ps( tri->m_ProjectedEdgeEquations[2] ) ) );
+				did_hit=_mm256_and_ps( did_hit, _mm256_cmp_ps( B0, zeros, _CMP_GE_OQ ) );
+
+				__m256 B1=_mm256_fmadd_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[3] ), hitc1,
+					_mm256_fmadd_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[4] ), hitc2,
+									 _mm256_set1_ps( tri->m_ProjectedEdgeEquations[5] ) ) );
+				did_hit=_mm256_and_ps( did_hit, _mm256_cmp_ps( B1, zeros, _CMP_GE_OQ ) );
+
+				did_hit=_mm256_and_ps( did_hit, _mm256_cmp_ps( _mm256_add_ps( B0, B1 ), ones, _CMP_LE_OQ ) );
+				if (! _mm256_movemask_ps( did_hit ) )
+					continue;
+
+				// now, set the hit_id and closest_hit fields for any enabled rays
+				hit_ids=_mm256_blendv_ps( hit_ids, _mm256_castsi256_ps( _mm256_set1_epi32( tnum ) ), did_hit );
+				hit_dist=_mm256_blendv_ps( hit_dist, isect_t, did_hit );
+				hit_normal[0]=_mm256_blendv_ps( hit_normal[0], Nx, did_hit );
+				hit_normal[1]=_mm256_blendv_ps( hit_normal[1], Ny, did_hit );
+				hit_normal[2]=_mm256_blendv_ps( hit_normal[2], Nz, did_hit );
+			} while (--ntris);
+
+			// now, check if all rays have terminated
+			if (! _mm256_movemask_ps( _mm256_cmp_ps( TMax, hit_dist, _CMP_LE_OQ ) ) )
+				break;
+		}
+
+		if (stack_ptr==&NodeQueue[MAX_NODE_STACK_LEN])
+			break;
+
+		// pop stack!
+		CurNode=stack_ptr->node;
+		TMin=stack_ptr->TMin;
+		TMax=stack_ptr->TMax;
+		stack_ptr++;
+	}
+
+	StoreResults8( rslt_out, hit_ids, hit_dist, hit_normal );
+}
+
+#endif // RAYTRACE_AVX2
+
+
+void RayTracingEnvironment::Trace8Rays(const EightRays &rays, fltx4 const *pTMin, fltx4 const *pTMax,
+									   RayTracingResult *rslt_out,
+									   int32 skip_id, ITransparentTriangleCallback *pCallback)
+{
+#ifdef RAYTRACE_AVX2
+	if ( ( pCallback == NULL ) && !( Flags & RTE_FLAGS_WIDE_BVH ) && SupportsTrace8Rays() )
+	{
+		int msk=rays.Rays[0].CalculateDirectionSignMask();
+		if ( ( msk != -1 ) && ( msk == rays.Rays[1].CalculateDirectionSignMask() ) )
+		{
+			Trace8RaysKDTree( *this, rays, pTMin, pTMax, msk, rslt_out, skip_id );
+			return;
+		}
+	}
+#endif
+
+	Trace4Rays( rays.Rays[0], pTMin[0], pTMax[0], &rslt_out[0], skip_id, pCallback );
+	Trace4Rays( rays.Rays[1], pTMin[1], pTMax[1], &rslt_out[1], skip_id, pCallback );
+}
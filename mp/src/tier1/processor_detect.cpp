@@ -272,3 +272,39 @@ bool Check3DNowTechnology(void)
 #pragma optimize( "", on )
 
 #endif // _WIN32
+
+#if defined( _WIN32 ) && !defined( _X360 )
+
+#include <intrin.h>
+
+bool CheckAVX2Technology(void)
+{
+#if defined( _MSC_VER ) && ( _MSC_VER >= 1700 )
+	int regs[4];		// eax, ebx, ecx, edx
+
+	__cpuid( regs, 0 );
+	if ( regs[0] < 7 )
+		return false;
+
+	__cpuid( regs, 1 );
+	if ( !( regs[2] & ( 1 << 27 ) ) ||	// bit 27 is set if the OS uses xsave
+		 !( regs[2] & ( 1 << 28 ) ) ||	// bit 28 is set for AVX
+		 !( regs[2] & ( 1 << 12 ) ) )	// bit 12 is set for FMA3
+		return false;
+
+	// The OS has to save the xmm and ymm state on context switches
+	if ( ( _xgetbv( 0 ) & 6 ) != 6 )
+		return false;
+
+	__cpuidex( regs, 7, 0 );
+	return ( regs[1] & ( 1 << 5 ) ) != 0;	// bit 5 of ebx is set for AVX2
+#else
+	return false;
+#endif
+}
+
+#elif defined( _X360 )
+
+bool CheckAVX2Technology(void) { return false; }
+
+#endif
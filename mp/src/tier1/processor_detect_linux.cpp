@@ -9,6 +9,10 @@
 #define cpuid(in,a,b,c,d)												\
 	asm("pushl %%ebx\n\t" "cpuid\n\t" "movl %%ebx,%%esi\n\t" "pop %%ebx": "=a" (a), "=S" (b), "=c" (c), "=d" (d) : "a" (in));
 
+// same thing for the leaves that take a sub-leaf in ecx
+#define cpuid_count(in,sub,a,b,c,d)										\
+	asm("pushl %%ebx\n\t" "cpuid\n\t" "movl %%ebx,%%esi\n\t" "pop %%ebx": "=a" (a), "=S" (b), "=c" (c), "=d" (d) : "a" (in), "c" (sub));
+
 bool CheckMMXTechnology(void)
 {
     unsigned long eax,ebx,edx,unused;
@@ -45,3 +49,26 @@ bool Check3DNowTechnology(void)
     }
     return false;
 }
+
+bool CheckAVX2Technology(void)
+{
+    unsigned long eax,ebx,ecx,edx;
+    cpuid(0,eax,ebx,ecx,edx);
+    if ( eax < 7 )
+        return false;
+
+    cpuid(1,eax,ebx,ecx,edx);
+    if ( !( ecx & ( 1 << 27 ) ) ||		// OS uses xsave
+         !( ecx & ( 1 << 28 ) ) ||		// AVX
+         !( ecx & ( 1 << 12 ) ) )		// FMA3
+        return false;
+
+    // make sure the OS saves the xmm and ymm registers. xgetbv isn't known to older assemblers.
+    unsigned long xcr0_lo, xcr0_hi;
+    asm(".byte 0x0f, 0x01, 0xd0" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ( ( xcr0_lo & 6 ) != 6 )
+        return false;
+
+    cpuid_count(7,0,eax,ebx,ecx,edx);
+    return ( ebx & ( 1 << 5 ) ) != 0;	// AVX2
+}
@@ -9,6 +9,7 @@
 #include "cmdlib.h"
 #include "mathlib/mathlib.h"
 #include "bsplib.h"
+#include "visbits.h"
 #include "zip_utils.h"
 #include "scriplib.h"
 #include "utllinkedlist.h"
@@ -1451,14 +1452,9 @@ int CompressVis (byte *vis, byte *dest)
 		if (vis[j])
 			continue;
 
-		rep = 1;
-		for ( j++; j<visrow ; j++)
-			if (vis[j] || rep == 255)
-				break;
-			else
-				rep++;
+		rep = VisBits_CountZeroBytes (vis + j, min (visrow - j, 255));
 		*dest_p++ = rep;
-		j--;
+		j += rep - 1;
 	}
 	
 	return dest_p - dest;
@@ -1497,11 +1493,8 @@ void DecompressVis (byte *in, byte *decompressed)
 			c = row - (out - decompressed);
 			Warning( "warning: Vis decompression overrun\n" );
 		}
-		while (c)
-		{
-			*out++ = 0;
-			c--;
-		}
+		memset (out, 0, c);
+		out += c;
 	} while (out - decompressed < row);
 }
 
@@ -2733,6 +2726,39 @@ void WriteBSPFile( const char *filename, char *pUnused )
 	g_pFileSystem->Close( g_hBSPFile );
 }
 
+//-----------------------------------------------------------------------------
+// Overwrites one lump of a bsp file WriteBSPFile wrote, leaving the rest of the
+// file alone. The lump has to be the same size it was; if it isn't (or the file
+// isn't what we expect) nothing is written and this returns false.
+//-----------------------------------------------------------------------------
+bool RewriteBSPFileLump( const char *filename, int lumpnum, const void *pData, int nLength )
+{
+	if ( g_bSwapOnWrite )
+		return false;
+
+	FileHandle_t hFile = g_pFileSystem->Open( filename, "r+b" );
+	if ( !hFile )
+		return false;
+
+	dheader_t header;
+	bool bOk = ( g_pFileSystem->Read( &header, sizeof( header ), hFile ) == sizeof( header ) ) &&
+		header.ident == IDBSPHEADER && header.version == BSPVERSION;
+
+	const lump_t *pLump = &header.lumps[lumpnum];
+	if ( bOk && pLump->filelen == nLength && pLump->uncompressedSize == 0 )
+	{
+		g_pFileSystem->Seek( hFile, pLump->fileofs, FILESYSTEM_SEEK_HEAD );
+		bOk = ( g_pFileSystem->Write( pData, nLength, hFile ) == nLength );
+	}
+	else
+	{
+		bOk = false;
+	}
+
+	g_pFileSystem->Close( hFile );
+	return bOk;
+}
+
 // Generate the next clear lump filename for the bsp file
 bool GenerateNextLumpFileName( const char *bspfilename, char *lumpfilename, int buffsize )
 {
@@ -293,6 +293,7 @@ void	LoadBSPFile( const char *filename );
 void	LoadBSPFile_FileSystemOnly( const char *filename );
 void	LoadBSPFileTexinfo( const char *filename );
 void	WriteBSPFile( const char *filename, char *pUnused = NULL );
+bool	RewriteBSPFileLump( const char *filename, int lumpnum, const void *pData, int nLength );
 void	PrintBSPFileSizes(void);
 void	PrintBSPPackDirectory(void);
 void	ReleasePakFileLumps(void);
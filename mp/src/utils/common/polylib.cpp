@@ -31,7 +31,10 @@ void pw(winding_t *w)
 		printf ("(%5.1f, %5.1f, %5.1f)\n",w->p[i][0], w->p[i][1],w->p[i][2]);
 }
 
-winding_t *winding_pool[MAX_POINTS_ON_WINDING+4];
+// Freed windings, by size. Each thread has its own free lists, so allocating
+// and freeing windings never takes ThreadLock. A winding freed on a different
+// thread than it was allocated on just moves to that thread's list.
+static winding_t *winding_pool[MAX_TOOL_THREADS+1][MAX_POINTS_ON_WINDING+4];
 
 /*
 =============
@@ -50,18 +53,17 @@ winding_t *AllocWinding (int points)
 		if (c_active_windings > c_peak_windings)
 			c_peak_windings = c_active_windings;
 	}
-	ThreadLock();
-	if (winding_pool[points])
+	winding_t **pPool = winding_pool[ GetCurrentThreadIndex() ];
+	if (pPool[points])
 	{
-		w = winding_pool[points];
-		winding_pool[points] = w->next;
+		w = pPool[points];
+		pPool[points] = w->next;
 	}
 	else
 	{
 		w = (winding_t *)malloc(sizeof(*w));
 		w->p = (Vector *)calloc( points, sizeof(Vector) );
 	}
-	ThreadUnlock();
 	w->numpoints = 0; // None are occupied yet even though allocated.
 	w->maxpoints = points;
 	w->next = NULL;
@@ -73,11 +75,10 @@ void FreeWinding (winding_t *w)
 	if (w->numpoints == 0xdeaddead)
 		Error ("FreeWinding: freed a freed winding");
 	
-	ThreadLock();
+	winding_t **pPool = winding_pool[ GetCurrentThreadIndex() ];
 	w->numpoints = 0xdeaddead; // flag as freed
-	w->next = winding_pool[w->maxpoints];
-	winding_pool[w->maxpoints] = w;
-	ThreadUnlock();
+	w->next = pPool[w->maxpoints];
+	pPool[w->maxpoints] = w;
 }
 
 /*
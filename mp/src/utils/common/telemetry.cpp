@@ -0,0 +1,274 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Per-phase timing, throughput and memory statistics for the map
+//			compile tools, written out as a JSON report for build machines.
+//
+//=============================================================================//
+
+#include "tier0/platform.h"
+#ifdef IS_WINDOWS_PC
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+#include "cmdlib.h"
+#include "threads.h"
+#include "telemetry.h"
+#include "utlvector.h"
+
+
+#define MAX_TELEMETRY_PHASE_NAME	64
+#define MAX_TELEMETRY_PHASE_DEPTH	16
+
+struct TelemetryPhase_t
+{
+	char m_szName[MAX_TELEMETRY_PHASE_NAME];
+	int m_nDepth;							// how deeply nested the first run was
+	int m_nRuns;
+	double m_flWallTime;					// seconds
+	double m_flCPUTime;						// seconds, all threads
+	int64 m_nWorkItems;
+	int64 m_nPeakRSS;						// bytes, highest seen at the end of a run
+
+	// Only for phases that ran threads (RunThreadsOn)
+	int m_nThreads;
+	double m_flThreadedWallTime;			// wall time of the runs that reported thread times
+	double m_flThreadBusyTime[MAX_TOOL_THREADS];
+	double m_flThreadIdleTime[MAX_TOOL_THREADS];
+};
+
+struct OpenTelemetryPhase_t
+{
+	int m_iPhase;
+	double m_flStartWallTime;
+	double m_flStartCPUTime;
+	int m_nThreads;							// from Telemetry_AddThreadTimes, 0 if it wasn't called
+	double m_flThreadBusyTime[MAX_TOOL_THREADS];
+};
+
+static CUtlVector<TelemetryPhase_t*> g_TelemetryPhases;
+static OpenTelemetryPhase_t g_OpenTelemetryPhases[MAX_TELEMETRY_PHASE_DEPTH];
+static int g_nOpenTelemetryPhases;
+static int g_nTelemetryPhasesTooDeep;		// Begins past MAX_TELEMETRY_PHASE_DEPTH, they're ignored
+
+
+static double GetProcessCPUTime()
+{
+#ifdef IS_WINDOWS_PC
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	if ( !GetProcessTimes( GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime ) )
+		return 0;
+
+	// FILETIMEs are in 100ns units
+	uint64 nKernel = ( (uint64)kernelTime.dwHighDateTime << 32 ) | kernelTime.dwLowDateTime;
+	uint64 nUser = ( (uint64)userTime.dwHighDateTime << 32 ) | userTime.dwLowDateTime;
+	return (double)( nKernel + nUser ) * 1e-7;
+#else
+	struct rusage usage;
+	if ( getrusage( RUSAGE_SELF, &usage ) != 0 )
+		return 0;
+
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+		usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+#endif
+}
+
+
+static int64 GetProcessPeakRSS()
+{
+#ifdef IS_WINDOWS_PC
+	PROCESS_MEMORY_COUNTERS counters;
+	if ( !GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) )
+		return 0;
+
+	return counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if ( getrusage( RUSAGE_SELF, &usage ) != 0 )
+		return 0;
+
+#ifdef OSX
+	return usage.ru_maxrss;					// bytes on OSX
+#else
+	return (int64)usage.ru_maxrss * 1024;	// kilobytes on Linux
+#endif
+#endif
+}
+
+
+static TelemetryPhase_t *FindOrAddPhase( const char *pName )
+{
+	// Names like "Build Patch/Sample Hash Table(s)....." come straight from the
+	// console output, so lose the trailing dots
+	char szName[MAX_TELEMETRY_PHASE_NAME];
+	Q_strncpy( szName, pName, sizeof( szName ) );
+	int nLen = Q_strlen( szName );
+	while ( nLen > 0 && ( szName[nLen-1] == '.' || szName[nLen-1] == ' ' || szName[nLen-1] == ':' ) )
+	{
+		szName[--nLen] = 0;
+	}
+
+	for ( int i = 0; i < g_TelemetryPhases.Count(); i++ )
+	{
+		if ( !Q_strcmp( g_TelemetryPhases[i]->m_szName, szName ) )
+			return g_TelemetryPhases[i];
+	}
+
+	TelemetryPhase_t *pPhase = new TelemetryPhase_t;
+	memset( pPhase, 0, sizeof( *pPhase ) );
+	Q_strncpy( pPhase->m_szName, szName, sizeof( pPhase->m_szName ) );
+	pPhase->m_nDepth = g_nOpenTelemetryPhases;
+	g_TelemetryPhases.AddToTail( pPhase );
+	return pPhase;
+}
+
+
+void Telemetry_BeginPhase( const char *pName )
+{
+	if ( g_nOpenTelemetryPhases >= MAX_TELEMETRY_PHASE_DEPTH )
+	{
+		g_nTelemetryPhasesTooDeep++;
+		return;
+	}
+
+	TelemetryPhase_t *pPhase = FindOrAddPhase( pName );
+
+	OpenTelemetryPhase_t *pOpen = &g_OpenTelemetryPhases[g_nOpenTelemetryPhases++];
+	pOpen->m_iPhase = g_TelemetryPhases.Find( pPhase );
+	pOpen->m_nThreads = 0;
+	pOpen->m_flStartCPUTime = GetProcessCPUTime();
+	pOpen->m_flStartWallTime = Plat_FloatTime();
+}
+
+
+void Telemetry_AddThreadTimes( int nThreads, const double *pBusyTimes )
+{
+	if ( g_nTelemetryPhasesTooDeep || !g_nOpenTelemetryPhases )
+		return;
+
+	OpenTelemetryPhase_t *pOpen = &g_OpenTelemetryPhases[g_nOpenTelemetryPhases-1];
+	pOpen->m_nThreads = min( nThreads, MAX_TOOL_THREADS );
+	for ( int i = 0; i < pOpen->m_nThreads; i++ )
+	{
+		pOpen->m_flThreadBusyTime[i] = pBusyTimes[i];
+	}
+}
+
+
+void Telemetry_EndPhase( int nWorkItems )
+{
+	if ( g_nTelemetryPhasesTooDeep )
+	{
+		g_nTelemetryPhasesTooDeep--;
+		return;
+	}
+
+	if ( !g_nOpenTelemetryPhases )
+	{
+		Assert( !"Telemetry_EndPhase without Telemetry_BeginPhase" );
+		return;
+	}
+
+	double flWallTime = Plat_FloatTime();
+	double flCPUTime = GetProcessCPUTime();
+
+	OpenTelemetryPhase_t *pOpen = &g_OpenTelemetryPhases[--g_nOpenTelemetryPhases];
+	TelemetryPhase_t *pPhase = g_TelemetryPhases[pOpen->m_iPhase];
+
+	double flPhaseWallTime = flWallTime - pOpen->m_flStartWallTime;
+	pPhase->m_nRuns++;
+	pPhase->m_flWallTime += flPhaseWallTime;
+	pPhase->m_flCPUTime += flCPUTime - pOpen->m_flStartCPUTime;
+	pPhase->m_nWorkItems += nWorkItems;
+	pPhase->m_nPeakRSS = max( pPhase->m_nPeakRSS, GetProcessPeakRSS() );
+
+	if ( pOpen->m_nThreads )
+	{
+		pPhase->m_nThreads = max( pPhase->m_nThreads, pOpen->m_nThreads );
+		pPhase->m_flThreadedWallTime += flPhaseWallTime;
+		for ( int i = 0; i < pOpen->m_nThreads; i++ )
+		{
+			double flBusy = min( pOpen->m_flThreadBusyTime[i], flPhaseWallTime );
+			pPhase->m_flThreadBusyTime[i] += flBusy;
+			pPhase->m_flThreadIdleTime[i] += flPhaseWallTime - flBusy;
+		}
+	}
+}
+
+
+// The phase names are all plain identifiers and console strings, but be safe
+static void WriteJSONString( FileHandle_t fp, const char *pString )
+{
+	CmdLib_FPrintf( fp, "\"" );
+	for ( const char *p = pString; *p; p++ )
+	{
+		if ( *p == '"' || *p == '\\' )
+			CmdLib_FPrintf( fp, "\\%c", *p );
+		else if ( (unsigned char)*p < ' ' )
+			CmdLib_FPrintf( fp, "\\u%04x", (unsigned char)*p );
+		else
+			CmdLib_FPrintf( fp, "%c", *p );
+	}
+	CmdLib_FPrintf( fp, "\"" );
+}
+
+
+bool Telemetry_WriteReport( const char *pFileName, const char *pToolName )
+{
+	FileHandle_t fp = g_pFileSystem->Open( pFileName, "w" );
+	if ( !fp )
+	{
+		Warning( "Couldn't write telemetry report %s\n", pFileName );
+		return false;
+	}
+
+	CmdLib_FPrintf( fp, "{\n" );
+	CmdLib_FPrintf( fp, "\t\"tool\": " );
+	WriteJSONString( fp, pToolName );
+	CmdLib_FPrintf( fp, ",\n" );
+	CmdLib_FPrintf( fp, "\t\"threads\": %d,\n", numthreads );
+	CmdLib_FPrintf( fp, "\t\"peak_rss_bytes\": %lld,\n", (long long)GetProcessPeakRSS() );
+	CmdLib_FPrintf( fp, "\t\"phases\": [\n" );
+
+	for ( int i = 0; i < g_TelemetryPhases.Count(); i++ )
+	{
+		const TelemetryPhase_t *pPhase = g_TelemetryPhases[i];
+
+		CmdLib_FPrintf( fp, "\t\t{\n" );
+		CmdLib_FPrintf( fp, "\t\t\t\"name\": " );
+		WriteJSONString( fp, pPhase->m_szName );
+		CmdLib_FPrintf( fp, ",\n" );
+		CmdLib_FPrintf( fp, "\t\t\t\"depth\": %d,\n", pPhase->m_nDepth );
+		CmdLib_FPrintf( fp, "\t\t\t\"runs\": %d,\n", pPhase->m_nRuns );
+		CmdLib_FPrintf( fp, "\t\t\t\"wall_seconds\": %.4f,\n", pPhase->m_flWallTime );
+		CmdLib_FPrintf( fp, "\t\t\t\"cpu_seconds\": %.4f,\n", pPhase->m_flCPUTime );
+		CmdLib_FPrintf( fp, "\t\t\t\"work_items\": %lld,\n", (long long)pPhase->m_nWorkItems );
+		CmdLib_FPrintf( fp, "\t\t\t\"work_items_per_second\": %.2f,\n",
+			pPhase->m_flWallTime > 0 ? pPhase->m_nWorkItems / pPhase->m_flWallTime : 0.0 );
+		CmdLib_FPrintf( fp, "\t\t\t\"peak_rss_bytes\": %lld", (long long)pPhase->m_nPeakRSS );
+
+		if ( pPhase->m_nThreads )
+		{
+			CmdLib_FPrintf( fp, ",\n\t\t\t\"threaded_wall_seconds\": %.4f,\n", pPhase->m_flThreadedWallTime );
+			CmdLib_FPrintf( fp, "\t\t\t\"threads\": [\n" );
+			for ( int iThread = 0; iThread < pPhase->m_nThreads; iThread++ )
+			{
+				CmdLib_FPrintf( fp, "\t\t\t\t{ \"busy_seconds\": %.4f, \"idle_seconds\": %.4f }%s\n",
+					pPhase->m_flThreadBusyTime[iThread], pPhase->m_flThreadIdleTime[iThread],
+					( iThread + 1 < pPhase->m_nThreads ) ? "," : "" );
+			}
+			CmdLib_FPrintf( fp, "\t\t\t]" );
+		}
+
+		CmdLib_FPrintf( fp, "\n\t\t}%s\n", ( i + 1 < g_TelemetryPhases.Count() ) ? "," : "" );
+	}
+
+	CmdLib_FPrintf( fp, "\t]\n" );
+	CmdLib_FPrintf( fp, "}\n" );
+	g_pFileSystem->Close( fp );
+
+	Msg( "Wrote telemetry report %s\n", pFileName );
+	return true;
+}
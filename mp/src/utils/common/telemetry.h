@@ -0,0 +1,40 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Per-phase timing, throughput and memory statistics for the map
+//			compile tools, written out as a JSON report for build machines.
+//
+//=============================================================================//
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+
+// Phases are named stretches of the compile. They can nest, and all the runs of
+// a phase with the same name are added together, so a phase that runs once per
+// bounce shows up once in the report. RunThreadsOn makes a phase for every call,
+// named after the thread function.
+//
+// Only call these from the main thread.
+void Telemetry_BeginPhase( const char *pName );
+void Telemetry_EndPhase( int nWorkItems = 0 );
+
+// RunThreadsOn reports how long each thread spent in its thread function before it
+// ends its phase. The rest of the phase's wall time counts as that thread's idle time.
+void Telemetry_AddThreadTimes( int nThreads, const double *pBusyTimes );
+
+// Writes everything recorded so far. pToolName is "vbsp", "vvis" or "vrad".
+bool Telemetry_WriteReport( const char *pFileName, const char *pToolName );
+
+// Begins a phase and ends it when it goes out of scope.
+class CTelemetryPhase
+{
+public:
+	CTelemetryPhase( const char *pName )	{ Telemetry_BeginPhase( pName ); }
+	~CTelemetryPhase()						{ Telemetry_EndPhase(); }
+};
+
+
+#endif // TELEMETRY_H
@@ -13,13 +13,18 @@
 
 #define	USED
 
+#include "tier0/platform.h"
+#ifdef IS_WINDOWS_PC
 #include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
 #include "cmdlib.h"
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
-
-#define	MAX_THREADS	16
+#include "telemetry.h"
+#include "tier0/threadtools.h"
 
 
 class CRunThreadsData
@@ -28,20 +33,183 @@ public:
 	int m_iThread;
 	void *m_pUserData;
 	RunThreadsFn m_Fn;
+	ERunThreadsPriority m_ePriority;
+	double m_flBusyTime;			// how long m_Fn ran for, for the telemetry
 };
 
-CRunThreadsData g_RunThreadsData[MAX_THREADS];
+CRunThreadsData g_RunThreadsData[MAX_TOOL_THREADS];
 
 
-int		dispatch;
 int		workcount;
 qboolean		pacifier;
 
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
 
-HANDLE g_ThreadHandles[MAX_THREADS];
+ThreadHandle_t g_ThreadHandles[MAX_TOOL_THREADS];
+
+
+/*
+===================================================================
+
+WORK DISTRIBUTION
+
+The work items [0,workcount) are cut into chunks. Chunks get smaller
+towards the end of the list (guided scheduling) so the last, usually
+most expensive, items are handed out one at a time. The chunks are
+dealt round-robin onto one deque per thread, so every thread walks
+the list in roughly ascending order - vvis depends on the cheap
+portals finishing before the expensive ones that can reuse them.
+
+A thread pops chunks off the front of its own deque and only takes
+the per-deque spin lock to do so. When its deque runs dry it steals
+chunks from the back of the other threads' deques.
+
+===================================================================
+*/
+
+// Never hand out more than this many items per grab, no matter how big the job.
+#define MAX_WORK_CHUNK_SIZE		64
+
+// Chunk size is the remaining item count divided by this many chunks per thread.
+#define WORK_CHUNKS_PER_THREAD	4
+
+struct ALIGN128 CWorkDeque
+{
+	CThreadFastMutex m_Lock;
+
+	// Slot s of deque d holds chunk ( s * g_nWorkDeques + d ).
+	// The owner pops at m_iHead, thieves take from m_iTail-1.
+	volatile int m_iHead;
+	volatile int m_iTail;
+
+	// The chunk the owning thread is currently working through.
+	// Only ever touched by the owning thread.
+	int m_iCurItem;
+	int m_iEndItem;
+} ALIGN128_POST;
+
+static CWorkDeque g_WorkDeques[MAX_TOOL_THREADS];
+static int g_nWorkDeques;
+
+// Chunk i covers items [ g_pWorkChunkStarts[i], g_pWorkChunkStarts[i+1] ).
+static int *g_pWorkChunkStarts;
+static int g_nWorkChunks;
+
+// Number of items handed out so far, for the pacifier.
+static volatile long g_nWorkDispatched;
+static CThreadFastMutex g_PacifierLock;
+
+// Index + 1 of the RunThreadsOn thread we're on, 0 if not in a worker.
+static CTHREADLOCALINT g_iCurrentWorkThread;
+
+
+static int GetCurrentWorkDeque()
+{
+	int iThread = GETLOCAL( g_iCurrentWorkThread ) - 1;
+	if ( iThread < 0 || iThread >= g_nWorkDeques )
+		return 0;
+
+	return iThread;
+}
+
+
+int GetCurrentThreadIndex()
+{
+	int iThread = GETLOCAL( g_iCurrentWorkThread ) - 1;
+	if ( iThread < 0 )
+		return THREADINDEX_MAIN;
+
+	return iThread;
+}
+
+
+static void SetupThreadWork( int workcnt, int nThreads )
+{
+	workcount = workcnt;
+	g_nWorkDispatched = 0;
+
+	if ( nThreads < 1 )
+		nThreads = 1;
+
+	// Figure out the chunk boundaries.
+	delete [] g_pWorkChunkStarts;
+	g_pWorkChunkStarts = new int[ workcnt + 1 ];
+	g_nWorkChunks = 0;
+
+	int iItem = 0;
+	while ( iItem < workcnt )
+	{
+		int nChunkSize = ( workcnt - iItem ) / ( nThreads * WORK_CHUNKS_PER_THREAD );
+		nChunkSize = clamp( nChunkSize, 1, MAX_WORK_CHUNK_SIZE );
+
+		g_pWorkChunkStarts[g_nWorkChunks++] = iItem;
+		iItem += nChunkSize;
+	}
+	g_pWorkChunkStarts[g_nWorkChunks] = workcnt;
+
+	// Deal them out onto the deques.
+	g_nWorkDeques = nThreads;
+	for ( int i=0; i < nThreads; i++ )
+	{
+		CWorkDeque *pDeque = &g_WorkDeques[i];
+		pDeque->m_iHead = 0;
+		pDeque->m_iTail = ( g_nWorkChunks - i + nThreads - 1 ) / nThreads;
+		pDeque->m_iCurItem = pDeque->m_iEndItem = 0;
+	}
+}
+
+
+static void ShutdownThreadWork()
+{
+	delete [] g_pWorkChunkStarts;
+	g_pWorkChunkStarts = NULL;
+	g_nWorkChunks = 0;
+	g_nWorkDeques = 0;
+}
+
 
+// Takes one chunk from the front of our own deque, or from the back of someone else's.
+// Returns false when there's nothing left anywhere.
+static bool GrabWorkChunk( int iDeque, int &iStart, int &iEnd )
+{
+	int iChunk = -1;
+
+	CWorkDeque *pDeque = &g_WorkDeques[iDeque];
+	pDeque->m_Lock.Lock();
+	if ( pDeque->m_iHead < pDeque->m_iTail )
+	{
+		iChunk = pDeque->m_iHead * g_nWorkDeques + iDeque;
+		pDeque->m_iHead++;
+	}
+	pDeque->m_Lock.Unlock();
+
+	// Our deque is empty. Go steal.
+	for ( int i=1; iChunk == -1 && i < g_nWorkDeques; i++ )
+	{
+		int iVictim = ( iDeque + i ) % g_nWorkDeques;
+		CWorkDeque *pVictim = &g_WorkDeques[iVictim];
+
+		// Don't bother taking the lock if it looks empty.
+		if ( pVictim->m_iHead >= pVictim->m_iTail )
+			continue;
+
+		pVictim->m_Lock.Lock();
+		if ( pVictim->m_iHead < pVictim->m_iTail )
+		{
+			pVictim->m_iTail--;
+			iChunk = pVictim->m_iTail * g_nWorkDeques + iVictim;
+		}
+		pVictim->m_Lock.Unlock();
+	}
+
+	if ( iChunk == -1 )
+		return false;
+
+	iStart = g_pWorkChunkStarts[iChunk];
+	iEnd = g_pWorkChunkStarts[iChunk+1];
+	return true;
+}
 
 
 /*
@@ -52,23 +220,28 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
-
-	ThreadLock ();
+	CWorkDeque *pDeque = &g_WorkDeques[ GetCurrentWorkDeque() ];
 
-	if (dispatch == workcount)
+	if ( pDeque->m_iCurItem >= pDeque->m_iEndItem )
 	{
-		ThreadUnlock ();
-		return -1;
-	}
+		int iStart, iEnd;
+		if ( !GrabWorkChunk( GetCurrentWorkDeque(), iStart, iEnd ) )
+			return -1;
+
+		pDeque->m_iCurItem = iStart;
+		pDeque->m_iEndItem = iEnd;
 
-	UpdatePacifier( (float)dispatch / workcount );
+		ThreadInterlockedExchangeAdd( &g_nWorkDispatched, iEnd - iStart );
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+		// Whoever gets here first updates the pacifier. Nobody waits for it.
+		if ( g_PacifierLock.TryLock() )
+		{
+			UpdatePacifier( (float)g_nWorkDispatched / workcount );
+			g_PacifierLock.Unlock();
+		}
+	}
 
-	return r;
+	return pDeque->m_iCurItem++;
 }
 
 
@@ -83,7 +256,7 @@ void ThreadWorkerFunction( int iThread, void *pUserData )
 		work = GetThreadWork ();
 		if (work == -1)
 			break;
-		 
+
 		workfunction( iThread, work );
 	}
 }
@@ -92,7 +265,7 @@ void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, ThreadWorkerFn
 {
 	if (numthreads == -1)
 		ThreadSetDefault ();
-	
+
 	workfunction = func;
 	RunThreadsOn (workcnt, showpacifier, ThreadWorkerFunction);
 }
@@ -101,57 +274,106 @@ void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, ThreadWorkerFn
 /*
 ===================================================================
 
-WIN32
+THREADS
 
 ===================================================================
 */
 
 int		numthreads = -1;
-CRITICAL_SECTION		crit;
+CThreadMutex	crit;
 static int enter;
 
+// ThreadLock wait statistics, per call site. Only touched while holding crit.
+#define MAX_THREADLOCK_SITES	64
 
-class CCritInit
+struct ThreadLockSite_t
 {
-public:
-	CCritInit()
-	{
-		InitializeCriticalSection (&crit);
-	}
-} g_CritInit;
+	const char *m_pFile;
+	int m_nLine;
+	int m_nLocks;
+	int m_nWaits;							// times the lock was already taken
+	double m_flWaitTime;					// seconds spent waiting for it
+};
 
+static ThreadLockSite_t g_ThreadLockSites[MAX_THREADLOCK_SITES];
+static int g_nThreadLockSites;
 
 
 void SetLowPriority()
 {
+#ifdef _WIN32
 	SetPriorityClass( GetCurrentProcess(), IDLE_PRIORITY_CLASS );
+#else
+	setpriority( PRIO_PROCESS, 0, 19 );
+#endif
 }
 
 
 void ThreadSetDefault (void)
 {
-	SYSTEM_INFO info;
-
 	if (numthreads == -1)	// not set manually
 	{
-		GetSystemInfo (&info);
-		numthreads = info.dwNumberOfProcessors;
-		if (numthreads < 1 || numthreads > 32)
+		numthreads = GetCPUInformation()->m_nLogicalProcessors;
+		if (numthreads < 1)
 			numthreads = 1;
 	}
 
+	if ( numthreads > MAX_TOOL_THREADS )
+	{
+		Warning( "Clamping %i threads to %i\n", numthreads, MAX_TOOL_THREADS );
+		numthreads = MAX_TOOL_THREADS;
+	}
+
 	Msg ("%i threads\n", numthreads);
 }
 
 
-void ThreadLock (void)
+void ThreadLockAt( const char *pFile, int nLine )
 {
 	if (!threaded)
 		return;
-	EnterCriticalSection (&crit);
+
+	// Only time the lock when somebody else has it, so the uncontended case stays cheap
+	double flWaitTime = 0;
+	bool bWaited = !crit.TryLock();
+	if ( bWaited )
+	{
+		double flStart = Plat_FloatTime();
+		crit.Lock();
+		flWaitTime = Plat_FloatTime() - flStart;
+	}
+
 	if (enter)
 		Error ("Recursive ThreadLock\n");
 	enter = 1;
+
+	ThreadLockSite_t *pSite = NULL;
+	for ( int i=0; i < g_nThreadLockSites; i++ )
+	{
+		if ( g_ThreadLockSites[i].m_nLine == nLine &&
+			( g_ThreadLockSites[i].m_pFile == pFile || !Q_stricmp( g_ThreadLockSites[i].m_pFile, pFile ) ) )
+		{
+			pSite = &g_ThreadLockSites[i];
+			break;
+		}
+	}
+
+	if ( !pSite && g_nThreadLockSites < MAX_THREADLOCK_SITES )
+	{
+		pSite = &g_ThreadLockSites[g_nThreadLockSites++];
+		pSite->m_pFile = pFile;
+		pSite->m_nLine = nLine;
+	}
+
+	if ( pSite )
+	{
+		pSite->m_nLocks++;
+		if ( bWaited )
+		{
+			pSite->m_nWaits++;
+			pSite->m_flWaitTime += flWaitTime;
+		}
+	}
 }
 
 void ThreadUnlock (void)
@@ -161,15 +383,47 @@ void ThreadUnlock (void)
 	if (!enter)
 		Error ("ThreadUnlock without lock\n");
 	enter = 0;
-	LeaveCriticalSection (&crit);
+	crit.Unlock();
+}
+
+
+void PrintThreadLockContention()
+{
+	if ( !g_nThreadLockSites )
+	{
+		Msg( "ThreadLock: never taken by worker threads\n" );
+		return;
+	}
+
+	Msg( "ThreadLock contention:\n" );
+	for ( int i=0; i < g_nThreadLockSites; i++ )
+	{
+		const ThreadLockSite_t &site = g_ThreadLockSites[i];
+		Msg( "  %s(%d): %d locks, waited %d times for %.3f seconds\n",
+			Q_UnqualifiedFileName( site.m_pFile ), site.m_nLine, site.m_nLocks, site.m_nWaits, site.m_flWaitTime );
+	}
 }
 
 
 // This runs in the thread and dispatches a RunThreadsFn call.
-DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
+static unsigned InternalRunThreadsFn( void *pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+
+#ifndef _WIN32
+	// Linux applies setpriority( PRIO_PROCESS, 0 ) to the calling thread only.
+	if ( pData->m_ePriority == k_eRunThreadsPriority_Idle ||
+		( pData->m_ePriority == k_eRunThreadsPriority_UseGlobalState && g_bLowPriorityThreads ) )
+	{
+		setpriority( PRIO_PROCESS, 0, 19 );
+	}
+#endif
+
+	double flStart = Plat_FloatTime();
+	g_iCurrentWorkThread = pData->m_iThread + 1;
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
+	g_iCurrentWorkThread = 0;
+	pData->m_flBusyTime = Plat_FloatTime() - flStart;
 	return 0;
 }
 
@@ -187,38 +441,48 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 		g_RunThreadsData[i].m_iThread = i;
 		g_RunThreadsData[i].m_pUserData = pUserData;
 		g_RunThreadsData[i].m_Fn = fn;
+		g_RunThreadsData[i].m_ePriority = ePriority;
+		g_RunThreadsData[i].m_flBusyTime = 0;
 
-		DWORD dwDummy;
-		g_ThreadHandles[i] = CreateThread(
-		   NULL,	// LPSECURITY_ATTRIBUTES lpsa,
-		   0,		// DWORD cbStack,
-		   InternalRunThreadsFn,	// LPTHREAD_START_ROUTINE lpStartAddr,
-		   &g_RunThreadsData[i],	// LPVOID lpvThreadParm,
-		   0,			// DWORD fdwCreate,
-		   &dwDummy );
+		g_ThreadHandles[i] = CreateSimpleThread( InternalRunThreadsFn, &g_RunThreadsData[i] );
+		if ( !g_ThreadHandles[i] )
+			Error( "RunThreads_Start: couldn't create thread %i\n", i );
 
+#ifdef _WIN32
 		if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
 		{
 			if( g_bLowPriorityThreads )
-				SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_LOWEST );
+				ThreadSetPriority( g_ThreadHandles[i], THREAD_PRIORITY_LOWEST );
 		}
 		else if ( ePriority == k_eRunThreadsPriority_Idle )
 		{
-			SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
+			ThreadSetPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
 		}
+#endif
 	}
 }
 
 
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
 	for ( int i=0; i < numthreads; i++ )
-		CloseHandle( g_ThreadHandles[i] );
+	{
+		ThreadJoin( g_ThreadHandles[i] );
+		ReleaseThreadHandle( g_ThreadHandles[i] );
+		g_ThreadHandles[i] = NULL;
+	}
 
 	threaded = false;
 }
-	
+
+
+static const char *g_pRunThreadsName = NULL;
+
+void SetRunThreadsName( const char *pName )
+{
+	g_pRunThreadsName = pName;
+}
+
 
 /*
 =============
@@ -229,9 +493,14 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 {
 	int		start, end;
 
+	if (numthreads == -1)
+		ThreadSetDefault ();
+
+	Telemetry_BeginPhase( g_pRunThreadsName ? g_pRunThreadsName : "RunThreadsOn" );
+	g_pRunThreadsName = NULL;
+
 	start = Plat_FloatTime();
-	dispatch = 0;
-	workcount = workcnt;
+	SetupThreadWork( workcnt, numthreads );
 	StartPacifier("");
 	pacifier = showpacifier;
 
@@ -241,10 +510,19 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	return;
 #endif
 
-	
+
 	RunThreads_Start( fn, pUserData );
 	RunThreads_End();
 
+	ShutdownThreadWork();
+
+	double flBusyTimes[MAX_TOOL_THREADS];
+	for ( int i=0; i < numthreads; i++ )
+	{
+		flBusyTimes[i] = g_RunThreadsData[i].m_flBusyTime;
+	}
+	Telemetry_AddThreadTimes( numthreads, flBusyTimes );
+	Telemetry_EndPhase( workcnt );
 
 	end = Plat_FloatTime();
 	if (pacifier)
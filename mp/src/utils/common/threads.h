@@ -18,7 +18,7 @@
 
 // Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
 // large so THREADINDEX_MAIN can be used from the main thread.
-#define MAX_TOOL_THREADS	16
+#define MAX_TOOL_THREADS	128
 #define THREADINDEX_MAIN	(MAX_TOOL_THREADS)
 
 
@@ -43,6 +43,9 @@ enum ERunThreadsPriority
 void SetLowPriority();
 
 void ThreadSetDefault (void);
+
+// Returns the next work item for the calling RunThreadsOn thread, or -1 when there's none left.
+// Items are grabbed in chunks from a per-thread queue, so they don't come back in strict order.
 int	GetThreadWork (void);
 
 void RunThreadsOnIndividual ( int workcnt, qboolean showpacifier, ThreadWorkerFn fn );
@@ -53,13 +56,77 @@ void RunThreadsOn ( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *p
 void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePriority=k_eRunThreadsPriority_UseGlobalState );
 void RunThreads_End();
 
-void ThreadLock (void);
+// Returns the iThread of the RunThreadsOn / RunThreads_Start thread we're on,
+// or THREADINDEX_MAIN from any other thread.
+int GetCurrentThreadIndex();
+
+// The big global lock. Each ThreadLock call site keeps count of how often it
+// had to wait for the lock and for how long - see PrintThreadLockContention.
+void ThreadLockAt( const char *pFile, int nLine );
 void ThreadUnlock (void);
+#define ThreadLock() ThreadLockAt( __FILE__, __LINE__ )
+
+// Prints the ThreadLock wait times per call site (for -verbose).
+void PrintThreadLockContention();
+
+// Names the telemetry phase of the next RunThreadsOn call. The RunThreadsOn macros
+// below pass the thread function's name.
+void SetRunThreadsName( const char *pName );
+
+
+//-----------------------------------------------------------------------------
+// One T per thread, each on its own cache line, for counters and such that
+// the threads update without locking. Index it with the iThread the thread
+// function gets (or GetCurrentThreadIndex) and merge the shards once the
+// RunThreadsOn call has returned.
+//-----------------------------------------------------------------------------
+template< class T >
+class CThreadShards
+{
+public:
+	CThreadShards()						{ Reset( T() ); }
+
+	void Reset( const T &value )
+	{
+		for ( int i=0; i < MAX_TOOL_THREADS+1; i++ )
+			m_Shards[i].m_Value = value;
+	}
+
+	T &operator[]( int iThread )		{ return m_Shards[iThread].m_Value; }
+	const T &operator[]( int iThread ) const	{ return m_Shards[iThread].m_Value; }
+
+	T Sum() const
+	{
+		T sum = m_Shards[0].m_Value;
+		for ( int i=1; i < MAX_TOOL_THREADS+1; i++ )
+			sum += m_Shards[i].m_Value;
+		return sum;
+	}
+
+	T Max() const
+	{
+		T maxValue = m_Shards[0].m_Value;
+		for ( int i=1; i < MAX_TOOL_THREADS+1; i++ )
+		{
+			if ( maxValue < m_Shards[i].m_Value )
+				maxValue = m_Shards[i].m_Value;
+		}
+		return maxValue;
+	}
+
+private:
+	struct ALIGN128 Shard_t
+	{
+		T m_Value;
+	} ALIGN128_POST;
+
+	Shard_t m_Shards[MAX_TOOL_THREADS+1];
+};
 
 
 #ifndef NO_THREAD_NAMES
-#define RunThreadsOn(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOn(n,p,f); }
-#define RunThreadsOnIndividual(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOnIndividual(n,p,f); }
+#define RunThreadsOn(n,p,f) { if (p) printf("%-20s ", #f ":"); SetRunThreadsName( #f ); RunThreadsOn(n,p,f); }
+#define RunThreadsOnIndividual(n,p,f) { if (p) printf("%-20s ", #f ":"); SetRunThreadsName( #f ); RunThreadsOnIndividual(n,p,f); }
 #endif
 
 #endif // THREADS_H
@@ -0,0 +1,421 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Bit vector kernels for the PVS/PAS rows and vvis' portal sets.
+//
+//=============================================================================//
+
+#include "visbits.h"
+#include "bitvec.h"
+#include "tier1/processor_detect.h"
+
+#if defined( _M_IX86 ) || defined( _M_X64 ) || defined( __SSE2__ )
+#define VISBITS_SSE2
+#include <emmintrin.h>
+#endif
+
+// Like raytrace's trace8.cpp, the avx2 paths are compiled with the instruction
+// set enabled on just their functions and only run when CheckAVX2Technology
+// says so. Every cpu with avx2 also has popcnt.
+#if defined( _MSC_VER ) && ( _MSC_VER >= 1700 ) && !defined( _X360 )
+#define VISBITS_AVX2
+#define AVX2_FUNCTION
+#include <intrin.h>
+#elif defined( __GNUC__ ) && ( ( __GNUC__ > 4 ) || ( ( __GNUC__ == 4 ) && ( __GNUC_MINOR__ >= 9 ) ) ) && ( defined( __i386__ ) || defined( __x86_64__ ) )
+#define VISBITS_AVX2
+#define AVX2_FUNCTION __attribute__(( target( "avx2,popcnt" ) ))
+#endif
+
+#ifdef VISBITS_AVX2
+#include <immintrin.h>
+#endif
+
+
+//-----------------------------------------------------------------------------
+// Single word helpers
+//-----------------------------------------------------------------------------
+static inline uint64 LoadWord( const byte *p )
+{
+	uint64 w;
+	memcpy( &w, p, sizeof( w ) );
+	return w;
+}
+
+static inline void StoreWord( byte *p, uint64 w )
+{
+	memcpy( p, &w, sizeof( w ) );
+}
+
+static inline int PopCount64( uint64 w )
+{
+#ifdef __GNUC__
+	return __builtin_popcountll( w );
+#else
+	w = w - ( ( w >> 1 ) & 0x5555555555555555ull );
+	w = ( w & 0x3333333333333333ull ) + ( ( w >> 2 ) & 0x3333333333333333ull );
+	w = ( w + ( w >> 4 ) ) & 0x0f0f0f0f0f0f0f0full;
+	return (int)( ( w * 0x0101010101010101ull ) >> 56 );
+#endif
+}
+
+static inline int FirstBit64( uint64 w )
+{
+#ifdef __GNUC__
+	return __builtin_ctzll( w );
+#else
+	uint32 lo = (uint32)w;
+	return lo ? FirstBitInWord( lo, 0 ) : FirstBitInWord( (uint32)( w >> 32 ), 32 );
+#endif
+}
+
+
+#ifdef VISBITS_SSE2
+// Bits set in each byte, then summed into the two 64 bit halves by psadbw
+static inline __m128i PopCount128( __m128i v )
+{
+	const __m128i m1 = _mm_set1_epi8( 0x55 );
+	const __m128i m2 = _mm_set1_epi8( 0x33 );
+	const __m128i m4 = _mm_set1_epi8( 0x0f );
+
+	v = _mm_sub_epi8( v, _mm_and_si128( _mm_srli_epi64( v, 1 ), m1 ) );
+	v = _mm_add_epi8( _mm_and_si128( v, m2 ), _mm_and_si128( _mm_srli_epi64( v, 2 ), m2 ) );
+	v = _mm_and_si128( _mm_add_epi8( v, _mm_srli_epi64( v, 4 ) ), m4 );
+	return _mm_sad_epu8( v, _mm_setzero_si128() );
+}
+#endif
+
+
+#ifdef VISBITS_AVX2
+static bool UseAVX2()
+{
+	static int s_nHasAVX2 = -1;
+	if ( s_nHasAVX2 == -1 )
+		s_nHasAVX2 = CheckAVX2Technology() ? 1 : 0;
+	return s_nHasAVX2 == 1;
+}
+
+AVX2_FUNCTION static inline int PopCount64_AVX2( uint64 w )
+{
+#if defined( _MSC_VER ) && defined( _M_X64 )
+	return (int)__popcnt64( w );
+#elif defined( _MSC_VER )
+	return (int)( __popcnt( (uint32)w ) + __popcnt( (uint32)( w >> 32 ) ) );
+#else
+	return __builtin_popcountll( w );
+#endif
+}
+
+// These do the whole 32 byte blocks and return where they got to, the callers
+// finish the rest with the sse2 and word loops below
+
+AVX2_FUNCTION static int Count_AVX2( const byte *pBits, int nWords, int *pCount )
+{
+	int nCount = 0;
+	int i = 0;
+	for ( ; i + 4 <= nWords; i += 4 )
+	{
+		nCount += PopCount64_AVX2( LoadWord( pBits + i * 8 ) ) + PopCount64_AVX2( LoadWord( pBits + i * 8 + 8 ) ) +
+			PopCount64_AVX2( LoadWord( pBits + i * 8 + 16 ) ) + PopCount64_AVX2( LoadWord( pBits + i * 8 + 24 ) );
+	}
+	*pCount += nCount;
+	return i;
+}
+
+AVX2_FUNCTION static int Or_AVX2( byte *pDest, const byte *pSrc, int nBytes )
+{
+	int i = 0;
+	for ( ; i + 32 <= nBytes; i += 32 )
+	{
+		__m256i d = _mm256_loadu_si256( (const __m256i*)( pDest + i ) );
+		__m256i s = _mm256_loadu_si256( (const __m256i*)( pSrc + i ) );
+		_mm256_storeu_si256( (__m256i*)( pDest + i ), _mm256_or_si256( d, s ) );
+	}
+	_mm256_zeroupper();
+	return i;
+}
+
+AVX2_FUNCTION static int AndHasNew_AVX2( byte *pDest, const byte *pA, const byte *pB, const byte *pSeen, int nBytes, uint64 *pMore )
+{
+	int i = 0;
+	__m256i moreV = _mm256_setzero_si256();
+	for ( ; i + 32 <= nBytes; i += 32 )
+	{
+		__m256i d = _mm256_and_si256( _mm256_loadu_si256( (const __m256i*)( pA + i ) ), _mm256_loadu_si256( (const __m256i*)( pB + i ) ) );
+		_mm256_storeu_si256( (__m256i*)( pDest + i ), d );
+		moreV = _mm256_or_si256( moreV, _mm256_andnot_si256( _mm256_loadu_si256( (const __m256i*)( pSeen + i ) ), d ) );
+	}
+	*pMore |= !_mm256_testz_si256( moreV, moreV );
+	_mm256_zeroupper();
+	return i;
+}
+
+AVX2_FUNCTION static int AndHasNewRange_AVX2( uint64 *pDest, const uint64 *pA, const uint64 *pB, const uint64 *pSeen,
+	int i, int iLastWord, int *pFirst, int *pLast, uint64 *pMore )
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i moreV = zero;
+	for ( ; i + 4 <= iLastWord; i += 4 )
+	{
+		__m256i d = _mm256_and_si256( _mm256_loadu_si256( (const __m256i*)( pA + i ) ), _mm256_loadu_si256( (const __m256i*)( pB + i ) ) );
+		_mm256_storeu_si256( (__m256i*)( pDest + i ), d );
+
+		// A bit for each word that's non-zero
+		int nonZero = ~_mm256_movemask_pd( _mm256_castsi256_pd( _mm256_cmpeq_epi64( d, zero ) ) ) & 0xf;
+		if ( !nonZero )
+			continue;
+
+		moreV = _mm256_or_si256( moreV, _mm256_andnot_si256( _mm256_loadu_si256( (const __m256i*)( pSeen + i ) ), d ) );
+		if ( *pFirst < 0 )
+		{
+			*pFirst = i + FirstBitInWord( nonZero, 0 );
+		}
+		*pLast = i + ( ( nonZero & 8 ) ? 4 : ( nonZero & 4 ) ? 3 : ( nonZero & 2 ) ? 2 : 1 );
+	}
+	*pMore |= !_mm256_testz_si256( moreV, moreV );
+	_mm256_zeroupper();
+	return i;
+}
+
+AVX2_FUNCTION static int CountZeroBytes_AVX2( const byte *pBytes, int nBytes, bool *pFound )
+{
+	const __m256i zero = _mm256_setzero_si256();
+	int i = 0;
+	for ( ; i + 32 <= nBytes; i += 32 )
+	{
+		uint32 zeroBytes = (uint32)_mm256_movemask_epi8( _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i*)( pBytes + i ) ), zero ) );
+		if ( zeroBytes != 0xffffffff )
+		{
+			_mm256_zeroupper();
+			*pFound = true;
+			return i + FirstBitInWord( ~zeroBytes, 0 );
+		}
+	}
+	_mm256_zeroupper();
+	*pFound = false;
+	return i;
+}
+#endif
+
+
+int VisBits_Count( const byte *pBits, int nBits )
+{
+	int nWords = nBits >> 6;
+	int nCount = 0;
+	int i = 0;
+
+#ifdef VISBITS_AVX2
+	if ( UseAVX2() )
+	{
+		i = Count_AVX2( pBits, nWords, &nCount );
+	}
+#endif
+
+#ifdef VISBITS_SSE2
+	__m128i sum = _mm_setzero_si128();
+	for ( ; i + 2 <= nWords; i += 2 )
+	{
+		sum = _mm_add_epi64( sum, PopCount128( _mm_loadu_si128( (const __m128i*)( pBits + i * 8 ) ) ) );
+	}
+	nCount += _mm_cvtsi128_si32( sum ) + _mm_cvtsi128_si32( _mm_unpackhi_epi64( sum, sum ) );
+#endif
+
+	for ( ; i < nWords; i++ )
+	{
+		nCount += PopCount64( LoadWord( pBits + i * 8 ) );
+	}
+
+	// Whatever's left of the last word, without reading past ( nBits + 7 ) >> 3 bytes
+	for ( int iBit = nWords << 6; iBit < nBits; iBit++ )
+	{
+		if ( pBits[iBit >> 3] & ( 1 << ( iBit & 7 ) ) )
+			nCount++;
+	}
+
+	return nCount;
+}
+
+
+void VisBits_Or( byte *pDest, const byte *pSrc, int nBytes )
+{
+	int i = 0;
+
+#ifdef VISBITS_AVX2
+	if ( UseAVX2() )
+	{
+		i = Or_AVX2( pDest, pSrc, nBytes );
+	}
+#endif
+
+#ifdef VISBITS_SSE2
+	for ( ; i + 16 <= nBytes; i += 16 )
+	{
+		__m128i d = _mm_loadu_si128( (const __m128i*)( pDest + i ) );
+		__m128i s = _mm_loadu_si128( (const __m128i*)( pSrc + i ) );
+		_mm_storeu_si128( (__m128i*)( pDest + i ), _mm_or_si128( d, s ) );
+	}
+#endif
+
+	for ( ; i < nBytes; i += 8 )
+	{
+		StoreWord( pDest + i, LoadWord( pDest + i ) | LoadWord( pSrc + i ) );
+	}
+}
+
+
+bool VisBits_AndHasNew( byte *pDest, const byte *pA, const byte *pB, const byte *pSeen, int nBytes )
+{
+	int i = 0;
+	uint64 more = 0;
+
+#ifdef VISBITS_AVX2
+	if ( UseAVX2() )
+	{
+		i = AndHasNew_AVX2( pDest, pA, pB, pSeen, nBytes, &more );
+	}
+#endif
+
+#ifdef VISBITS_SSE2
+	__m128i moreV = _mm_setzero_si128();
+	for ( ; i + 16 <= nBytes; i += 16 )
+	{
+		__m128i d = _mm_and_si128( _mm_loadu_si128( (const __m128i*)( pA + i ) ), _mm_loadu_si128( (const __m128i*)( pB + i ) ) );
+		_mm_storeu_si128( (__m128i*)( pDest + i ), d );
+		moreV = _mm_or_si128( moreV, _mm_andnot_si128( _mm_loadu_si128( (const __m128i*)( pSeen + i ) ), d ) );
+	}
+	more |= ( _mm_movemask_epi8( _mm_cmpeq_epi8( moreV, _mm_setzero_si128() ) ) != 0xffff );
+#endif
+
+	for ( ; i < nBytes; i += 8 )
+	{
+		uint64 d = LoadWord( pA + i ) & LoadWord( pB + i );
+		StoreWord( pDest + i, d );
+		more |= d & ~LoadWord( pSeen + i );
+	}
+
+	return more != 0;
+}
+
+
+bool VisBits_AndHasNewRange( uint64 *pDest, const uint64 *pA, const uint64 *pB, const uint64 *pSeen,
+	int iFirstWord, int iLastWord, int *pFirstWord, int *pLastWord )
+{
+	int iFirst = -1;
+	int iLast = 0;
+	uint64 more = 0;
+	int i = iFirstWord;
+
+#ifdef VISBITS_AVX2
+	if ( UseAVX2() )
+	{
+		i = AndHasNewRange_AVX2( pDest, pA, pB, pSeen, i, iLastWord, &iFirst, &iLast, &more );
+	}
+#endif
+
+#ifdef VISBITS_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	__m128i moreV = zero;
+	for ( ; i + 2 <= iLastWord; i += 2 )
+	{
+		__m128i d = _mm_and_si128( _mm_loadu_si128( (const __m128i*)( pA + i ) ), _mm_loadu_si128( (const __m128i*)( pB + i ) ) );
+		_mm_storeu_si128( (__m128i*)( pDest + i ), d );
+
+		// A byte mask of which bytes are zero, 8 bits per word
+		int zeroBytes = _mm_movemask_epi8( _mm_cmpeq_epi8( d, zero ) );
+		if ( zeroBytes == 0xffff )
+			continue;
+
+		moreV = _mm_or_si128( moreV, _mm_andnot_si128( _mm_loadu_si128( (const __m128i*)( pSeen + i ) ), d ) );
+		if ( iFirst < 0 )
+		{
+			iFirst = ( ( zeroBytes & 0xff ) != 0xff ) ? i : i + 1;
+		}
+		iLast = ( ( zeroBytes >> 8 ) != 0xff ) ? i + 2 : i + 1;
+	}
+	more |= ( _mm_movemask_epi8( _mm_cmpeq_epi8( moreV, zero ) ) != 0xffff );
+#endif
+
+	for ( ; i < iLastWord; i++ )
+	{
+		uint64 d = pA[i] & pB[i];
+		pDest[i] = d;
+		if ( !d )
+			continue;
+
+		if ( iFirst < 0 )
+			iFirst = i;
+		iLast = i + 1;
+		more |= d & ~pSeen[i];
+	}
+
+	*pFirstWord = iFirst < 0 ? 0 : iFirst;
+	*pLastWord = iLast;
+	return more != 0;
+}
+
+
+int VisBits_NextSet( const byte *pBits, int nBytes, int iBit )
+{
+	int nWords = nBytes >> 3;
+	int iWord = iBit >> 6;
+	if ( iWord >= nWords )
+		return -1;
+
+	// Drop the bits before iBit in the first word
+	uint64 w = LoadWord( pBits + iWord * 8 ) & ( ~0ull << ( iBit & 63 ) );
+	while ( !w )
+	{
+		if ( ++iWord >= nWords )
+			return -1;
+		w = LoadWord( pBits + iWord * 8 );
+	}
+
+	return ( iWord << 6 ) + FirstBit64( w );
+}
+
+
+int VisBits_CountZeroBytes( const byte *pBytes, int nBytes )
+{
+	int i = 0;
+
+#ifdef VISBITS_AVX2
+	if ( UseAVX2() )
+	{
+		bool bFound;
+		i = CountZeroBytes_AVX2( pBytes, nBytes, &bFound );
+		if ( bFound )
+			return i;
+	}
+#endif
+
+#ifdef VISBITS_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	for ( ; i + 16 <= nBytes; i += 16 )
+	{
+		int zeroBytes = _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i*)( pBytes + i ) ), zero ) );
+		if ( zeroBytes != 0xffff )
+			return i + FirstBit64( ~zeroBytes & 0xffff );
+	}
+#endif
+
+	while ( i < nBytes && !pBytes[i] )
+	{
+		i++;
+	}
+	return i;
+}
+
+
+void VisBits_Transpose64( uint64 *pTile )
+{
+	// Swap the off-diagonal 32x32 blocks, then the 16x16 blocks inside each of
+	// those, and so on down to single bits
+	uint64 mask = 0x00000000ffffffffull;
+	for ( int j = 32; j; j >>= 1, mask ^= mask << j )
+	{
+		for ( int k = 0; k < 64; k = ( ( k | j ) + 1 ) & ~j )
+		{
+			uint64 t = ( ( pTile[k] >> j ) ^ pTile[k | j] ) & mask;
+			pTile[k] ^= t << j;
+			pTile[k | j] ^= t;
+		}
+	}
+}
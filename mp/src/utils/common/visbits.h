@@ -0,0 +1,47 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Bit vector kernels for the PVS/PAS rows and vvis' portal sets.
+//
+//=============================================================================//
+
+#ifndef VISBITS_H
+#define VISBITS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/platform.h"
+
+
+// The vectors are byte arrays laid out like CheckBit/SetBit use them, so bit n
+// is bit ( n & 63 ) of 64 bit word ( n >> 6 ) on the little-endian machines the
+// tools run on. Functions taking a size in bytes want it to be a multiple of 8,
+// which vvis' portal and leaf rows are ( ( ( n + 63 ) & ~63 ) >> 3 bytes ).
+// Nothing needs to be aligned.
+
+// Number of set bits among the first nBits.
+int VisBits_Count( const byte *pBits, int nBits );
+
+// pDest |= pSrc
+void VisBits_Or( byte *pDest, const byte *pSrc, int nBytes );
+
+// pDest = pA & pB. Returns true if pDest has any bits that aren't in pSeen.
+bool VisBits_AndHasNew( byte *pDest, const byte *pA, const byte *pB, const byte *pSeen, int nBytes );
+
+// Same for the 64 bit words from iFirstWord up to iLastWord. The range of words
+// that came out non-zero goes in *pFirstWord and *pLastWord (one past the end),
+// or 0, 0 when they all came out zero.
+bool VisBits_AndHasNewRange( uint64 *pDest, const uint64 *pA, const uint64 *pB, const uint64 *pSeen,
+	int iFirstWord, int iLastWord, int *pFirstWord, int *pLastWord );
+
+// The first set bit at or after iBit, or -1.
+int VisBits_NextSet( const byte *pBits, int nBytes, int iBit );
+
+// How many of the first nBytes are zero before the first non-zero one.
+int VisBits_CountZeroBytes( const byte *pBytes, int nBytes );
+
+// Transposes a 64x64 bit tile in place: bit c of pTile[r] ends up as bit r of pTile[c].
+void VisBits_Transpose64( uint64 *pTile );
+
+
+#endif // VISBITS_H
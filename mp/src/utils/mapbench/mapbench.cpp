@@ -0,0 +1,1151 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Benchmark for the map compile tools. Generates a .vmf of a given
+//			size (rooms, brushes, displacements, lights, static props) and
+//			times vbsp, vvis and vrad on it.
+//
+//			Everything the map needs is generated too (gameinfo.txt, the
+//			one material it uses and a box model for the props), so it runs
+//			without any game content.
+//
+//			mapbench itself builds for Windows and POSIX, but vbsp, vvis and
+//			vrad need vmpi and only build for Windows. Elsewhere only -genonly
+//			is useful unless the tools can be run some other way.
+//
+//=============================================================================//
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+#include "tier0/platform.h"
+#include "tier1/strtools.h"
+#include "tier1/utlbuffer.h"
+#include "mathlib/mathlib.h"
+#include "vstdlib/random.h"
+#include "bspflags.h"
+#include "studio.h"
+#include "optimize.h"
+
+
+#define MAPBENCH_MATERIAL		"mapbench/wall"
+#define MAPBENCH_WALL			16			// wall, floor and ceiling thickness
+#define MAPBENCH_DOOR_WIDTH		128
+#define MAPBENCH_DOOR_HEIGHT	128
+#define MAPBENCH_TILE			128			// displacement tile size
+#define MAPBENCH_DISP_POWER		3
+#define MAPBENCH_MAX_RUNS		64
+
+#define MAPBENCH_PROP_MODEL		"models/mapbench/box.mdl"
+#define MAPBENCH_PROP_SIZE		32			// the box model's width and height
+#define MAPBENCH_PROP_CHECKSUM	0x4243424d	// any value will do, it only has to match across the model files
+
+enum
+{
+	STAGE_VBSP = 0,
+	STAGE_VVIS,
+	STAGE_VRAD,
+	NUM_STAGES
+};
+
+static const char *g_pStageNames[NUM_STAGES] = { "vbsp", "vvis", "vrad" };
+
+
+struct MapBenchParams_t
+{
+	int m_nRooms;
+	int m_nBrushes;
+	int m_nDisplacements;
+	int m_nLights;
+	int m_nProps;
+	int m_nRoomSize;
+	int m_nRoomHeight;
+	int m_nSeed;
+	char m_szPropModel[MAX_PATH];
+};
+
+struct StageResult_t
+{
+	bool m_bRan;
+	int m_nRuns;
+	int m_nExitCode;
+	double m_flSeconds[MAPBENCH_MAX_RUNS];
+};
+
+
+//-----------------------------------------------------------------------------
+// VMF writer
+//-----------------------------------------------------------------------------
+class CVMFWriter
+{
+public:
+	CVMFWriter( CUtlBuffer &buf ) : m_Buf( buf ), m_nNextID( 1 ), m_nBrushes( 0 ), m_nDisplacements( 0 ) {}
+
+	void BeginWorld();
+	void EndWorld()								{ m_Buf.Printf( "}\n" ); }
+
+	// Axis aligned box brush. If bDispTop is set the top face becomes a
+	// displacement with a bump of flBumpHeight in the middle.
+	void Box( const Vector &mins, const Vector &maxs, bool bDispTop = false, float flBumpHeight = 0.0f );
+
+	void BeginEntity( const char *pClassName );
+	void KeyValue( const char *pKey, const char *pValue )	{ m_Buf.Printf( "\t\"%s\" \"%s\"\n", pKey, pValue ); }
+	void KeyValueVector( const char *pKey, const Vector &v )	{ m_Buf.Printf( "\t\"%s\" \"%g %g %g\"\n", pKey, v.x, v.y, v.z ); }
+	void EndEntity()							{ m_Buf.Printf( "}\n" ); }
+
+	int BrushCount() const						{ return m_nBrushes; }
+	int DisplacementCount() const				{ return m_nDisplacements; }
+
+private:
+	void Side( const Vector &p0, const Vector &p1, const Vector &p2, const char *pUAxis, const char *pVAxis );
+	void DispInfo( const Vector &start, float flBumpHeight );
+
+	CUtlBuffer &m_Buf;
+	int m_nNextID;
+	int m_nBrushes;
+	int m_nDisplacements;
+};
+
+
+void CVMFWriter::BeginWorld()
+{
+	m_Buf.Printf( "versioninfo\n{\n\t\"editorversion\" \"400\"\n\t\"mapversion\" \"1\"\n\t\"formatversion\" \"100\"\n}\n" );
+	m_Buf.Printf( "world\n{\n" );
+	m_Buf.Printf( "\t\"id\" \"%d\"\n", m_nNextID++ );
+	m_Buf.Printf( "\t\"mapversion\" \"1\"\n" );
+	m_Buf.Printf( "\t\"classname\" \"worldspawn\"\n" );
+	m_Buf.Printf( "\t\"skyname\" \"sky_day01_01\"\n" );
+}
+
+
+void CVMFWriter::Side( const Vector &p0, const Vector &p1, const Vector &p2, const char *pUAxis, const char *pVAxis )
+{
+	m_Buf.Printf( "\t\tside\n\t\t{\n" );
+	m_Buf.Printf( "\t\t\t\"id\" \"%d\"\n", m_nNextID++ );
+	m_Buf.Printf( "\t\t\t\"plane\" \"(%g %g %g) (%g %g %g) (%g %g %g)\"\n",
+		p0.x, p0.y, p0.z, p1.x, p1.y, p1.z, p2.x, p2.y, p2.z );
+	m_Buf.Printf( "\t\t\t\"material\" \"%s\"\n", MAPBENCH_MATERIAL );
+	m_Buf.Printf( "\t\t\t\"uaxis\" \"%s 0.25\"\n", pUAxis );
+	m_Buf.Printf( "\t\t\t\"vaxis\" \"%s 0.25\"\n", pVAxis );
+	m_Buf.Printf( "\t\t\t\"rotation\" \"0\"\n" );
+	m_Buf.Printf( "\t\t\t\"lightmapscale\" \"16\"\n" );
+	m_Buf.Printf( "\t\t\t\"smoothing_groups\" \"0\"\n" );
+}
+
+
+void CVMFWriter::DispInfo( const Vector &start, float flBumpHeight )
+{
+	int nVerts = ( 1 << MAPBENCH_DISP_POWER ) + 1;
+	int nTris = 2 * ( 1 << MAPBENCH_DISP_POWER );
+
+	m_Buf.Printf( "\t\t\tdispinfo\n\t\t\t{\n" );
+	m_Buf.Printf( "\t\t\t\t\"power\" \"%d\"\n", MAPBENCH_DISP_POWER );
+	m_Buf.Printf( "\t\t\t\t\"startposition\" \"[%g %g %g]\"\n", start.x, start.y, start.z );
+	m_Buf.Printf( "\t\t\t\t\"elevation\" \"0\"\n" );
+	m_Buf.Printf( "\t\t\t\t\"subdiv\" \"0\"\n" );
+
+	m_Buf.Printf( "\t\t\t\tnormals\n\t\t\t\t{\n" );
+	for ( int y = 0; y < nVerts; y++ )
+	{
+		m_Buf.Printf( "\t\t\t\t\t\"row%d\" \"", y );
+		for ( int x = 0; x < nVerts; x++ )
+			m_Buf.Printf( x ? " 0 0 1" : "0 0 1" );
+		m_Buf.Printf( "\"\n" );
+	}
+	m_Buf.Printf( "\t\t\t\t}\n" );
+
+	// A smooth bump in the middle of the tile, zero along the edges so the
+	// neighbouring tiles always line up
+	m_Buf.Printf( "\t\t\t\tdistances\n\t\t\t\t{\n" );
+	for ( int y = 0; y < nVerts; y++ )
+	{
+		m_Buf.Printf( "\t\t\t\t\t\"row%d\" \"", y );
+		for ( int x = 0; x < nVerts; x++ )
+		{
+			float flX = sin( M_PI * x / ( nVerts - 1 ) );
+			float flY = sin( M_PI * y / ( nVerts - 1 ) );
+			m_Buf.Printf( x ? " %.2f" : "%.2f", flBumpHeight * flX * flY );
+		}
+		m_Buf.Printf( "\"\n" );
+	}
+	m_Buf.Printf( "\t\t\t\t}\n" );
+
+	static const char *s_pZeroBlocks[] = { "offsets", "offset_normals", "alphas" };
+	for ( int i = 0; i < (int)ARRAYSIZE( s_pZeroBlocks ); i++ )
+	{
+		m_Buf.Printf( "\t\t\t\t%s\n\t\t\t\t{\n", s_pZeroBlocks[i] );
+		for ( int y = 0; y < nVerts; y++ )
+		{
+			m_Buf.Printf( "\t\t\t\t\t\"row%d\" \"", y );
+			for ( int x = 0; x < nVerts; x++ )
+			{
+				if ( i == 0 )
+					m_Buf.Printf( x ? " 0 0 0" : "0 0 0" );
+				else if ( i == 1 )
+					m_Buf.Printf( x ? " 0 0 1" : "0 0 1" );
+				else
+					m_Buf.Printf( x ? " 0" : "0" );
+			}
+			m_Buf.Printf( "\"\n" );
+		}
+		m_Buf.Printf( "\t\t\t\t}\n" );
+	}
+
+	m_Buf.Printf( "\t\t\t\ttriangle_tags\n\t\t\t\t{\n" );
+	for ( int y = 0; y < nVerts - 1; y++ )
+	{
+		m_Buf.Printf( "\t\t\t\t\t\"row%d\" \"", y );
+		for ( int x = 0; x < nTris; x++ )
+			m_Buf.Printf( x ? " 9" : "9" );
+		m_Buf.Printf( "\"\n" );
+	}
+	m_Buf.Printf( "\t\t\t\t}\n" );
+
+	m_Buf.Printf( "\t\t\t\tallowed_verts\n\t\t\t\t{\n\t\t\t\t\t\"10\" \"-1 -1 -1 -1 -1 -1 -1 -1 -1 -1\"\n\t\t\t\t}\n" );
+	m_Buf.Printf( "\t\t\t}\n" );
+
+	++m_nDisplacements;
+}
+
+
+void CVMFWriter::Box( const Vector &mins, const Vector &maxs, bool bDispTop, float flBumpHeight )
+{
+	float x0 = mins.x, y0 = mins.y, z0 = mins.z;
+	float x1 = maxs.x, y1 = maxs.y, z1 = maxs.z;
+
+	m_Buf.Printf( "\tsolid\n\t{\n" );
+	m_Buf.Printf( "\t\t\"id\" \"%d\"\n", m_nNextID++ );
+
+	// Same winding as Hammer writes for a box, all the normals point out
+
+	// +z
+	Side( Vector( x0, y1, z1 ), Vector( x1, y1, z1 ), Vector( x1, y0, z1 ), "[1 0 0 0]", "[0 -1 0 0]" );
+	if ( bDispTop )
+		DispInfo( Vector( x0, y0, z1 ), flBumpHeight );
+	m_Buf.Printf( "\t\t}\n" );
+
+	// -z
+	Side( Vector( x0, y0, z0 ), Vector( x1, y0, z0 ), Vector( x1, y1, z0 ), "[1 0 0 0]", "[0 -1 0 0]" );
+	m_Buf.Printf( "\t\t}\n" );
+
+	// -x
+	Side( Vector( x0, y1, z1 ), Vector( x0, y0, z1 ), Vector( x0, y0, z0 ), "[0 1 0 0]", "[0 0 -1 0]" );
+	m_Buf.Printf( "\t\t}\n" );
+
+	// +x
+	Side( Vector( x1, y1, z0 ), Vector( x1, y0, z0 ), Vector( x1, y0, z1 ), "[0 1 0 0]", "[0 0 -1 0]" );
+	m_Buf.Printf( "\t\t}\n" );
+
+	// +y
+	Side( Vector( x1, y1, z1 ), Vector( x0, y1, z1 ), Vector( x0, y1, z0 ), "[1 0 0 0]", "[0 0 -1 0]" );
+	m_Buf.Printf( "\t\t}\n" );
+
+	// -y
+	Side( Vector( x1, y0, z0 ), Vector( x0, y0, z0 ), Vector( x0, y0, z1 ), "[1 0 0 0]", "[0 0 -1 0]" );
+	m_Buf.Printf( "\t\t}\n" );
+
+	m_Buf.Printf( "\t}\n" );
+
+	++m_nBrushes;
+}
+
+
+void CVMFWriter::BeginEntity( const char *pClassName )
+{
+	m_Buf.Printf( "entity\n{\n" );
+	m_Buf.Printf( "\t\"id\" \"%d\"\n", m_nNextID++ );
+	m_Buf.Printf( "\t\"classname\" \"%s\"\n", pClassName );
+}
+
+
+//-----------------------------------------------------------------------------
+// Map generation
+//
+// The map is a square grid of rooms inside a sealed shell. Every wall between
+// two rooms has a doorway at a random spot along it, so vvis has portals to
+// flow through and each room only sees part of the map. The extra brushes are
+// pillars inside the rooms, the displacements are bumpy floor tiles.
+//-----------------------------------------------------------------------------
+static int GridSize( int nRooms )
+{
+	int nGrid = 1;
+	while ( nGrid * nGrid < nRooms )
+		++nGrid;
+	return nGrid;
+}
+
+
+// A wall along x (bAlongX) or y, from flStart to flEnd, at flPos on the other axis, with a doorway.
+static void WriteWallWithDoor( CVMFWriter &vmf, CUniformRandomStream &random, const MapBenchParams_t &params,
+	bool bAlongX, float flPos, float flStart, float flEnd )
+{
+	float flHalf = MAPBENCH_WALL * 0.5f;
+	float flDoorStart = random.RandomInt( (int)flStart + MAPBENCH_WALL, (int)flEnd - MAPBENCH_WALL - MAPBENCH_DOOR_WIDTH );
+	float flDoorEnd = flDoorStart + MAPBENCH_DOOR_WIDTH;
+
+	float flSpans[3][3] =
+	{
+		{ flStart, flDoorStart, 0 },
+		{ flDoorEnd, flEnd, 0 },
+		{ flDoorStart, flDoorEnd, MAPBENCH_DOOR_HEIGHT },	// above the door
+	};
+
+	for ( int i = 0; i < 3; i++ )
+	{
+		Vector mins, maxs;
+		if ( bAlongX )
+		{
+			mins.Init( flSpans[i][0], flPos - flHalf, flSpans[i][2] );
+			maxs.Init( flSpans[i][1], flPos + flHalf, params.m_nRoomHeight );
+		}
+		else
+		{
+			mins.Init( flPos - flHalf, flSpans[i][0], flSpans[i][2] );
+			maxs.Init( flPos + flHalf, flSpans[i][1], params.m_nRoomHeight );
+		}
+		vmf.Box( mins, maxs );
+	}
+}
+
+
+// Random point in a random room, at least flMargin from the room's walls.
+static Vector RandomPointInRoom( CUniformRandomStream &random, const MapBenchParams_t &params, int nGrid, float flMargin, float flZ )
+{
+	int nRoomX = random.RandomInt( 0, nGrid - 1 );
+	int nRoomY = random.RandomInt( 0, nGrid - 1 );
+	float flX = nRoomX * params.m_nRoomSize + random.RandomFloat( flMargin, params.m_nRoomSize - flMargin );
+	float flY = nRoomY * params.m_nRoomSize + random.RandomFloat( flMargin, params.m_nRoomSize - flMargin );
+	return Vector( (int)flX, (int)flY, flZ );
+}
+
+
+static void GenerateMap( CUtlBuffer &buf, const MapBenchParams_t &params, int *pBrushes, int *pDisplacements )
+{
+	CUniformRandomStream random;
+	random.SetSeed( params.m_nSeed );
+
+	int nGrid = GridSize( params.m_nRooms );
+	float flSize = nGrid * params.m_nRoomSize;
+	float flHeight = params.m_nRoomHeight;
+	float t = MAPBENCH_WALL;
+
+	CVMFWriter vmf( buf );
+	vmf.BeginWorld();
+
+	// Shell
+	vmf.Box( Vector( -t, -t, -t ), Vector( flSize + t, flSize + t, 0 ) );
+	vmf.Box( Vector( -t, -t, flHeight ), Vector( flSize + t, flSize + t, flHeight + t ) );
+	vmf.Box( Vector( -t, -t, 0 ), Vector( 0, flSize + t, flHeight ) );
+	vmf.Box( Vector( flSize, -t, 0 ), Vector( flSize + t, flSize + t, flHeight ) );
+	vmf.Box( Vector( 0, -t, 0 ), Vector( flSize, 0, flHeight ) );
+	vmf.Box( Vector( 0, flSize, 0 ), Vector( flSize, flSize + t, flHeight ) );
+
+	// Walls between the rooms
+	for ( int iLine = 1; iLine < nGrid; iLine++ )
+	{
+		float flPos = iLine * params.m_nRoomSize;
+		for ( int iRoom = 0; iRoom < nGrid; iRoom++ )
+		{
+			float flStart = iRoom * params.m_nRoomSize;
+			float flEnd = ( iRoom + 1 ) * params.m_nRoomSize;
+			WriteWallWithDoor( vmf, random, params, false, flPos, flStart, flEnd );
+			WriteWallWithDoor( vmf, random, params, true, flPos, flStart, flEnd );
+		}
+	}
+
+	// Pillars
+	for ( int i = 0; i < params.m_nBrushes; i++ )
+	{
+		Vector center = RandomPointInRoom( random, params, nGrid, 64, 0 );
+		float flHalfWidth = random.RandomInt( 8, 32 );
+		float flTop = random.RandomInt( 0, 1 ) ? flHeight : random.RandomInt( 32, (int)flHeight - 32 );
+		vmf.Box( center - Vector( flHalfWidth, flHalfWidth, 0 ), center + Vector( flHalfWidth, flHalfWidth, flTop ) );
+	}
+
+	// Displacement tiles, filling the rooms' floors in order
+	int nTilesPerRow = params.m_nRoomSize / MAPBENCH_TILE - 1;
+	int nTilesPerRoom = nTilesPerRow * nTilesPerRow;
+	int nMaxTiles = nTilesPerRoom * nGrid * nGrid;
+	if ( params.m_nDisplacements > nMaxTiles )
+	{
+		printf( "Only room for %d displacements in %d rooms of size %d\n", nMaxTiles, nGrid * nGrid, params.m_nRoomSize );
+	}
+	for ( int i = 0; i < min( params.m_nDisplacements, nMaxTiles ); i++ )
+	{
+		int iRoom = i / nTilesPerRoom;
+		int iTile = i % nTilesPerRoom;
+		float flX = ( iRoom % nGrid ) * params.m_nRoomSize + MAPBENCH_TILE / 2 + ( iTile % nTilesPerRow ) * MAPBENCH_TILE;
+		float flY = ( iRoom / nGrid ) * params.m_nRoomSize + MAPBENCH_TILE / 2 + ( iTile / nTilesPerRow ) * MAPBENCH_TILE;
+		vmf.Box( Vector( flX, flY, 0 ), Vector( flX + MAPBENCH_TILE, flY + MAPBENCH_TILE, 8 ), true, random.RandomFloat( 8, 48 ) );
+	}
+
+	vmf.EndWorld();
+
+	vmf.BeginEntity( "info_player_start" );
+	vmf.KeyValueVector( "origin", Vector( params.m_nRoomSize / 2, params.m_nRoomSize / 2, 64 ) );
+	vmf.KeyValue( "angles", "0 0 0" );
+	vmf.EndEntity();
+
+	// Always at least one light so vrad has something to do
+	for ( int i = 0; i < max( params.m_nLights, 1 ); i++ )
+	{
+		vmf.BeginEntity( "light" );
+		vmf.KeyValueVector( "origin", RandomPointInRoom( random, params, nGrid, 48, flHeight - 48 ) );
+		vmf.KeyValue( "_light", "255 240 220 200" );
+		vmf.KeyValue( "_lightHDR", "-1 -1 -1 1" );
+		vmf.KeyValue( "_quadratic_attn", "1" );
+		vmf.EndEntity();
+	}
+
+	for ( int i = 0; i < params.m_nProps; i++ )
+	{
+		char angles[32];
+		Q_snprintf( angles, sizeof( angles ), "0 %d 0", random.RandomInt( 0, 359 ) );
+
+		vmf.BeginEntity( "prop_static" );
+		vmf.KeyValueVector( "origin", RandomPointInRoom( random, params, nGrid, 48, 0 ) );
+		vmf.KeyValue( "angles", angles );
+		vmf.KeyValue( "model", params.m_szPropModel );
+		vmf.KeyValue( "solid", "6" );
+		vmf.KeyValue( "skin", "0" );
+		vmf.EndEntity();
+	}
+
+	*pBrushes = vmf.BrushCount();
+	*pDisplacements = vmf.DisplacementCount();
+}
+
+
+//-----------------------------------------------------------------------------
+// Files
+//-----------------------------------------------------------------------------
+static void MakeDir( const char *pPath )
+{
+#ifdef _WIN32
+	_mkdir( pPath );
+#else
+	mkdir( pPath, 0777 );
+#endif
+}
+
+
+// Makes every directory in the path of pFileName.
+static void MakeDirsForFile( const char *pFileName )
+{
+	char path[MAX_PATH];
+	Q_strncpy( path, pFileName, sizeof( path ) );
+	for ( char *p = path + 1; *p; p++ )
+	{
+		if ( *p == '/' || *p == '\\' )
+		{
+			char c = *p;
+			*p = 0;
+			MakeDir( path );
+			*p = c;
+		}
+	}
+}
+
+
+static bool WriteFile( const char *pFileName, const CUtlBuffer &buf )
+{
+	MakeDirsForFile( pFileName );
+
+	FILE *fp = fopen( pFileName, "wb" );
+	if ( !fp )
+	{
+		fprintf( stderr, "Can't write %s\n", pFileName );
+		return false;
+	}
+	fwrite( buf.Base(), 1, buf.TellPut(), fp );
+	fclose( fp );
+	return true;
+}
+
+
+// The tools need a game directory. This one has only the material the map uses,
+// with its reflectivity set so nothing needs to load a texture, and the prop model
+// (see WritePropModel).
+static bool WriteGameDir( const char *pGameDir )
+{
+	char fileName[MAX_PATH];
+	CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+
+	buf.Printf( "\"GameInfo\"\n{\n" );
+	buf.Printf( "\tgame\t\"mapbench\"\n" );
+	buf.Printf( "\ttype\tsingleplayer_only\n" );
+	buf.Printf( "\tFileSystem\n\t{\n" );
+	buf.Printf( "\t\tSteamAppId\t\t243750\n" );
+	buf.Printf( "\t\tSearchPaths\n\t\t{\n" );
+	buf.Printf( "\t\t\tgame\t\t|gameinfo_path|.\n" );
+	buf.Printf( "\t\t}\n\t}\n}\n" );
+	Q_snprintf( fileName, sizeof( fileName ), "%s/gameinfo.txt", pGameDir );
+	if ( !WriteFile( fileName, buf ) )
+		return false;
+
+	buf.Purge();
+	buf.Printf( "\"LightmappedGeneric\"\n{\n" );
+	buf.Printf( "\t\"$basetexture\" \"%s\"\n", MAPBENCH_MATERIAL );
+	buf.Printf( "\t\"$reflectivity\" \"[0.5 0.5 0.5]\"\n" );
+	buf.Printf( "}\n" );
+	Q_snprintf( fileName, sizeof( fileName ), "%s/materials/%s.vmt", pGameDir, MAPBENCH_MATERIAL );
+	return WriteFile( fileName, buf );
+}
+
+
+//-----------------------------------------------------------------------------
+// Prop model
+//
+// A box, written out as the .mdl, .vvd and .dx80.vtx studiomdl would make for
+// a $staticprop with one bone and one mesh. Only what vbsp and vrad read is
+// filled in; it has no sequences, so the game itself can't draw it. The structures
+// are written as they are laid out in this build, like studiomdl does.
+//-----------------------------------------------------------------------------
+#define BOX_VERTS		24			// 4 per side, each side has its own normal
+#define BOX_INDICES		36
+
+// Appends nBytes of zeros to the buffer, returns where they start.
+static int AllocZeroed( CUtlBuffer &buf, int nBytes )
+{
+	int nOffset = buf.TellPut();
+	for ( int i = 0; i < nBytes; i++ )
+		buf.PutChar( 0 );
+	return nOffset;
+}
+
+
+static int AllocString( CUtlBuffer &buf, const char *pString )
+{
+	int nOffset = buf.TellPut();
+	buf.Put( pString, Q_strlen( pString ) + 1 );
+	return nOffset;
+}
+
+
+// Side i of the box faces along axis i / 2, positive for odd i. The sides are laid out
+// 3 by 2 in texture space, so each texel of a prop lightmap belongs to one side only.
+static void BuildBox( mstudiovertex_t *pVerts, Vector4D *pTangents, unsigned short *pIndices )
+{
+	float flHalf = MAPBENCH_PROP_SIZE * 0.5f;
+	Vector center( 0, 0, flHalf );
+
+	for ( int iSide = 0; iSide < 6; iSide++ )
+	{
+		int nAxis = iSide / 2;
+		float flSign = ( iSide & 1 ) ? 1.0f : -1.0f;
+		Vector normal( 0, 0, 0 ), u( 0, 0, 0 ), v( 0, 0, 0 );
+		normal[nAxis] = flSign;
+		u[( nAxis + 1 ) % 3] = 1.0f;
+		v[( nAxis + 2 ) % 3] = 1.0f;
+
+		for ( int iCorner = 0; iCorner < 4; iCorner++ )
+		{
+			float flU = ( iCorner == 1 || iCorner == 2 ) ? 1.0f : 0.0f;
+			float flV = ( iCorner >= 2 ) ? 1.0f : 0.0f;
+
+			mstudiovertex_t &vert = pVerts[iSide * 4 + iCorner];
+			vert.m_BoneWeights.weight[0] = 1.0f;
+			vert.m_BoneWeights.bone[0] = 0;
+			vert.m_BoneWeights.numbones = 1;
+			vert.m_vecPosition = center + flHalf * ( normal + ( 2.0f * flU - 1.0f ) * u + ( 2.0f * flV - 1.0f ) * v );
+			vert.m_vecNormal = normal;
+			vert.m_vecTexCoord.Init( ( iSide % 3 + flU ) / 3.0f, ( iSide / 3 + flV ) / 2.0f );
+			pTangents[iSide * 4 + iCorner].Init( u.x, u.y, u.z, 1.0f );
+		}
+
+		// Corners 0-3 go counterclockwise around u x v, which is +normal. Front faces
+		// are clockwise seen from outside.
+		static const int s_nOutward[6] = { 0, 2, 1, 0, 3, 2 };
+		static const int s_nInward[6] = { 0, 1, 2, 0, 2, 3 };
+		const int *pOrder = ( flSign > 0 ) ? s_nOutward : s_nInward;
+		for ( int i = 0; i < 6; i++ )
+			pIndices[iSide * 6 + i] = iSide * 4 + pOrder[i];
+	}
+}
+
+
+static bool WritePropModel( const char *pGameDir )
+{
+	float flHalf = MAPBENCH_PROP_SIZE * 0.5f;
+	Vector mins( -flHalf, -flHalf, 0 ), maxs( flHalf, flHalf, MAPBENCH_PROP_SIZE );
+	char fileName[MAX_PATH];
+	char baseName[MAX_PATH];
+	Q_snprintf( fileName, sizeof( fileName ), "%s/%s", pGameDir, MAPBENCH_PROP_MODEL );
+	Q_StripExtension( fileName, baseName, sizeof( baseName ) );
+
+	// .vvd, the vertexes. vrad always copies the tangents, so they have to be there too.
+	CUtlBuffer vvd;
+	int nVvdHdr = AllocZeroed( vvd, sizeof( vertexFileHeader_t ) );
+	int nVvdVerts = AllocZeroed( vvd, BOX_VERTS * sizeof( mstudiovertex_t ) );
+	int nVvdTangents = AllocZeroed( vvd, BOX_VERTS * sizeof( Vector4D ) );
+
+	vertexFileHeader_t *pVvdHdr = (vertexFileHeader_t *)( (byte *)vvd.Base() + nVvdHdr );
+	pVvdHdr->id = MODEL_VERTEX_FILE_ID;
+	pVvdHdr->version = MODEL_VERTEX_FILE_VERSION;
+	pVvdHdr->checksum = MAPBENCH_PROP_CHECKSUM;
+	pVvdHdr->numLODs = 1;
+	pVvdHdr->numLODVertexes[0] = BOX_VERTS;
+	pVvdHdr->vertexDataStart = nVvdVerts - nVvdHdr;
+	pVvdHdr->tangentDataStart = nVvdTangents - nVvdHdr;
+
+	unsigned short indices[BOX_INDICES];
+	BuildBox( (mstudiovertex_t *)( (byte *)vvd.Base() + nVvdVerts ), (Vector4D *)( (byte *)vvd.Base() + nVvdTangents ), indices );
+
+	// .dx80.vtx, one strip group holding a triangle list
+	CUtlBuffer vtx;
+	int nVtxHdr = AllocZeroed( vtx, sizeof( OptimizedModel::FileHeader_t ) );
+	int nVtxMatList = AllocZeroed( vtx, sizeof( OptimizedModel::MaterialReplacementListHeader_t ) );
+	int nVtxBodyPart = AllocZeroed( vtx, sizeof( OptimizedModel::BodyPartHeader_t ) );
+	int nVtxModel = AllocZeroed( vtx, sizeof( OptimizedModel::ModelHeader_t ) );
+	int nVtxLOD = AllocZeroed( vtx, sizeof( OptimizedModel::ModelLODHeader_t ) );
+	int nVtxMesh = AllocZeroed( vtx, sizeof( OptimizedModel::MeshHeader_t ) );
+	int nVtxStripGroup = AllocZeroed( vtx, sizeof( OptimizedModel::StripGroupHeader_t ) );
+	int nVtxStrip = AllocZeroed( vtx, sizeof( OptimizedModel::StripHeader_t ) );
+	int nVtxVerts = AllocZeroed( vtx, BOX_VERTS * sizeof( OptimizedModel::Vertex_t ) );
+	int nVtxIndices = AllocZeroed( vtx, BOX_INDICES * sizeof( unsigned short ) );
+
+	byte *pVtx = (byte *)vtx.Base();
+	OptimizedModel::FileHeader_t *pVtxHdr = (OptimizedModel::FileHeader_t *)( pVtx + nVtxHdr );
+	pVtxHdr->version = OPTIMIZED_MODEL_FILE_VERSION;
+	pVtxHdr->vertCacheSize = BOX_VERTS;
+	pVtxHdr->maxBonesPerStrip = 1;
+	pVtxHdr->maxBonesPerTri = 1;
+	pVtxHdr->maxBonesPerVert = 1;
+	pVtxHdr->checkSum = MAPBENCH_PROP_CHECKSUM;
+	pVtxHdr->numLODs = 1;
+	pVtxHdr->materialReplacementListOffset = nVtxMatList - nVtxHdr;
+	pVtxHdr->numBodyParts = 1;
+	pVtxHdr->bodyPartOffset = nVtxBodyPart - nVtxHdr;
+
+	OptimizedModel::BodyPartHeader_t *pVtxBodyPart = (OptimizedModel::BodyPartHeader_t *)( pVtx + nVtxBodyPart );
+	pVtxBodyPart->numModels = 1;
+	pVtxBodyPart->modelOffset = nVtxModel - nVtxBodyPart;
+
+	OptimizedModel::ModelHeader_t *pVtxModel = (OptimizedModel::ModelHeader_t *)( pVtx + nVtxModel );
+	pVtxModel->numLODs = 1;
+	pVtxModel->lodOffset = nVtxLOD - nVtxModel;
+
+	OptimizedModel::ModelLODHeader_t *pVtxLOD = (OptimizedModel::ModelLODHeader_t *)( pVtx + nVtxLOD );
+	pVtxLOD->numMeshes = 1;
+	pVtxLOD->meshOffset = nVtxMesh - nVtxLOD;
+
+	OptimizedModel::MeshHeader_t *pVtxMesh = (OptimizedModel::MeshHeader_t *)( pVtx + nVtxMesh );
+	pVtxMesh->numStripGroups = 1;
+	pVtxMesh->stripGroupHeaderOffset = nVtxStripGroup - nVtxMesh;
+
+	OptimizedModel::StripGroupHeader_t *pVtxStripGroup = (OptimizedModel::StripGroupHeader_t *)( pVtx + nVtxStripGroup );
+	pVtxStripGroup->numVerts = BOX_VERTS;
+	pVtxStripGroup->vertOffset = nVtxVerts - nVtxStripGroup;
+	pVtxStripGroup->numIndices = BOX_INDICES;
+	pVtxStripGroup->indexOffset = nVtxIndices - nVtxStripGroup;
+	pVtxStripGroup->numStrips = 1;
+	pVtxStripGroup->stripOffset = nVtxStrip - nVtxStripGroup;
+
+	OptimizedModel::StripHeader_t *pVtxStrip = (OptimizedModel::StripHeader_t *)( pVtx + nVtxStrip );
+	pVtxStrip->numIndices = BOX_INDICES;
+	pVtxStrip->numVerts = BOX_VERTS;
+	pVtxStrip->numBones = 1;
+	pVtxStrip->flags = OptimizedModel::STRIP_IS_TRILIST;
+
+	for ( int i = 0; i < BOX_VERTS; i++ )
+	{
+		OptimizedModel::Vertex_t *pVert = pVtxStripGroup->pVertex( i );
+		pVert->boneWeightIndex[0] = 0;
+		pVert->numBones = 1;
+		pVert->origMeshVertID = i;
+	}
+	for ( int i = 0; i < BOX_INDICES; i++ )
+		*pVtxStripGroup->pIndex( i ) = indices[i];
+
+	// .mdl
+	CUtlBuffer mdl;
+	int nHdr = AllocZeroed( mdl, sizeof( studiohdr_t ) );
+	int nBone = AllocZeroed( mdl, sizeof( mstudiobone_t ) );
+	int nBodyPart = AllocZeroed( mdl, sizeof( mstudiobodyparts_t ) );
+	int nModel = AllocZeroed( mdl, sizeof( mstudiomodel_t ) );
+	int nMesh = AllocZeroed( mdl, sizeof( mstudiomesh_t ) );
+	int nTexture = AllocZeroed( mdl, sizeof( mstudiotexture_t ) );
+	int nCdTexture = AllocZeroed( mdl, sizeof( int ) );
+	int nSkin = AllocZeroed( mdl, sizeof( int ) );			// one short, padded
+	int nBoneName = AllocString( mdl, "static_prop" );
+	int nSurfaceProp = AllocString( mdl, "default" );
+	int nBodyPartName = AllocString( mdl, "box" );
+	int nTextureName = AllocString( mdl, Q_UnqualifiedFileName( MAPBENCH_MATERIAL ) );
+	char cdTexture[MAX_PATH];
+	Q_ExtractFilePath( MAPBENCH_MATERIAL, cdTexture, sizeof( cdTexture ) );
+	int nCdTextureName = AllocString( mdl, cdTexture );
+
+	byte *pMdl = (byte *)mdl.Base();
+	studiohdr_t *pHdr = (studiohdr_t *)( pMdl + nHdr );
+	pHdr->id = ( 'T' << 24 ) + ( 'S' << 16 ) + ( 'D' << 8 ) + 'I';	// "IDST"
+	pHdr->version = STUDIO_VERSION;
+	pHdr->checksum = MAPBENCH_PROP_CHECKSUM;
+	Q_strncpy( pHdr->name, MAPBENCH_PROP_MODEL + Q_strlen( "models/" ), sizeof( pHdr->name ) );
+	pHdr->length = mdl.TellPut();
+	pHdr->illumposition.Init( 0, 0, flHalf );
+	pHdr->hull_min = mins;
+	pHdr->hull_max = maxs;
+	pHdr->view_bbmin = mins;
+	pHdr->view_bbmax = maxs;
+	pHdr->flags = STUDIOHDR_FLAGS_STATIC_PROP;
+	pHdr->numbones = 1;
+	pHdr->boneindex = nBone - nHdr;
+	pHdr->numtextures = 1;
+	pHdr->textureindex = nTexture - nHdr;
+	pHdr->numcdtextures = 1;
+	pHdr->cdtextureindex = nCdTexture - nHdr;
+	pHdr->numskinref = 1;
+	pHdr->numskinfamilies = 1;
+	pHdr->skinindex = nSkin - nHdr;
+	pHdr->numbodyparts = 1;
+	pHdr->bodypartindex = nBodyPart - nHdr;
+	pHdr->surfacepropindex = nSurfaceProp - nHdr;
+	pHdr->mass = 1.0f;
+	pHdr->contents = CONTENTS_SOLID;
+
+	mstudiobone_t *pBone = (mstudiobone_t *)( pMdl + nBone );
+	pBone->sznameindex = nBoneName - nBone;
+	pBone->parent = -1;
+	for ( int i = 0; i < 6; i++ )
+		pBone->bonecontroller[i] = -1;
+	pBone->quat.Init( 0, 0, 0, 1 );
+	SetIdentityMatrix( pBone->poseToBone );
+	pBone->qAlignment.Init( 0, 0, 0, 1 );
+	pBone->flags = BONE_USED_BY_VERTEX_LOD0;
+	pBone->surfacepropidx = nSurfaceProp - nBone;
+	pBone->contents = CONTENTS_SOLID;
+
+	mstudiobodyparts_t *pBodyPart = (mstudiobodyparts_t *)( pMdl + nBodyPart );
+	pBodyPart->sznameindex = nBodyPartName - nBodyPart;
+	pBodyPart->nummodels = 1;
+	pBodyPart->base = 1;
+	pBodyPart->modelindex = nModel - nBodyPart;
+
+	mstudiomodel_t *pModel = (mstudiomodel_t *)( pMdl + nModel );
+	Q_strncpy( pModel->name, "box", sizeof( pModel->name ) );
+	pModel->boundingradius = ( maxs - mins ).Length() * 0.5f;
+	pModel->nummeshes = 1;
+	pModel->meshindex = nMesh - nModel;
+	pModel->numvertices = BOX_VERTS;
+
+	mstudiomesh_t *pMesh = (mstudiomesh_t *)( pMdl + nMesh );
+	pMesh->modelindex = nModel - nMesh;
+	pMesh->numvertices = BOX_VERTS;
+	pMesh->center.Init( 0, 0, flHalf );
+	pMesh->vertexdata.numLODVertexes[0] = BOX_VERTS;
+
+	mstudiotexture_t *pTexture = (mstudiotexture_t *)( pMdl + nTexture );
+	pTexture->sznameindex = nTextureName - nTexture;
+
+	*(int *)( pMdl + nCdTexture ) = nCdTextureName - nHdr;
+
+	Q_snprintf( fileName, sizeof( fileName ), "%s.vvd", baseName );
+	if ( !WriteFile( fileName, vvd ) )
+		return false;
+	Q_snprintf( fileName, sizeof( fileName ), "%s.dx80.vtx", baseName );
+	if ( !WriteFile( fileName, vtx ) )
+		return false;
+	Q_snprintf( fileName, sizeof( fileName ), "%s.mdl", baseName );
+	return WriteFile( fileName, mdl );
+}
+
+
+//-----------------------------------------------------------------------------
+// Running the tools
+//-----------------------------------------------------------------------------
+static int RunCommand( const char *pCommand )
+{
+	fflush( stdout );
+#ifdef _WIN32
+	// cmd.exe takes the first and last quote off a line that starts with one,
+	// which would leave the exe path unquoted. Give it another pair to take off.
+	char command[4096 + 2];
+	Q_snprintf( command, sizeof( command ), "\"%s\"", pCommand );
+	int nResult = system( command );
+#else
+	int nResult = system( pCommand );
+#endif
+#ifndef _WIN32
+	if ( nResult != -1 && WIFEXITED( nResult ) )
+		nResult = WEXITSTATUS( nResult );
+#endif
+	return nResult;
+}
+
+
+static void Usage()
+{
+	printf(
+		"Usage: mapbench [options] <output directory>\n"
+		"\n"
+		"Writes <output directory>/maps/<name>.vmf and times the compile tools on it.\n"
+		"The timings go to <name>.bench.json and are added to mapbench.csv in the\n"
+		"output directory. Each tool is also run with -telemetry.\n"
+		"\n"
+		"mapbench itself builds on Linux, but vbsp, vvis and vrad need vmpi and only\n"
+		"build for Windows. On Linux use -genonly, or point -bindir at Windows builds of\n"
+		"the tools run some other way (wine, say).\n"
+		"\n"
+		"Map size:\n"
+		"  -rooms <n>       : Number of rooms (rounded up to a square grid). Each wall\n"
+		"                     between rooms has a doorway, this drives the portal count.\n"
+		"                     Default 16.\n"
+		"  -brushes <n>     : Pillar brushes in the rooms. Default 64.\n"
+		"  -disps <n>       : Displacement floor tiles. Default 0.\n"
+		"  -lights <n>      : Light entities. Default 8.\n"
+		"  -props <n>       : prop_static entities. Default 0.\n"
+		"  -propmodel <mdl> : Model for the props. By default a box model is written to\n"
+		"                     the game directory (" MAPBENCH_PROP_MODEL "). With -game,\n"
+		"                     name a model that game has.\n"
+		"  -roomsize <n>    : Width of a room in units. Default 512.\n"
+		"  -roomheight <n>  : Height of the rooms in units. Default 256.\n"
+		"  -seed <n>        : Random seed. The same seed always makes the same map.\n"
+		"  -name <name>     : Map name. Defaults to one made from the sizes.\n"
+		"\n"
+		"Running:\n"
+		"  -bindir <dir>    : Where vbsp, vvis and vrad are. By default they come from the PATH.\n"
+		"  -game <dir>      : Game directory for the tools. By default a minimal one is\n"
+		"                     written to the output directory.\n"
+		"  -stages <list>   : Which of vbsp,vvis,vrad to run. Default all of them.\n"
+		"  -runs <n>        : Run each stage n times before going on to the next one.\n"
+		"                     Default 1.\n"
+		"  -threads <n>     : Passed to vvis and vrad.\n"
+		"  -vbspargs <args> : Extra arguments for vbsp (quote them).\n"
+		"  -vvisargs <args> : Extra arguments for vvis.\n"
+		"  -vradargs <args> : Extra arguments for vrad.\n"
+		"  -label <text>    : Label for the run in mapbench.csv, like a changelist or a\n"
+		"                     commit.\n"
+		"  -genonly         : Only write the map, don't run anything.\n" );
+	exit( -1 );
+}
+
+
+// The label is whatever the user passed, quote it for the csv and the json
+static void PrintCsvField( FILE *fp, const char *pText )
+{
+	fputc( '"', fp );
+	for ( const char *p = pText; *p; p++ )
+	{
+		if ( *p == '"' )
+			fputc( '"', fp );
+		fputc( *p, fp );
+	}
+	fputc( '"', fp );
+}
+
+
+static void PrintJsonString( CUtlBuffer &buf, const char *pText )
+{
+	buf.PutChar( '"' );
+	for ( const char *p = pText; *p; p++ )
+	{
+		if ( *p == '"' || *p == '\\' )
+			buf.PutChar( '\\' );
+		if ( (unsigned char)*p < ' ' )
+			buf.Printf( "\\u%04x", (unsigned char)*p );
+		else
+			buf.PutChar( *p );
+	}
+	buf.PutChar( '"' );
+}
+
+
+static void WriteResults( const char *pOutDir, const char *pMapName, const char *pLabel, const MapBenchParams_t &params,
+	int nBrushes, int nDisplacements, const StageResult_t *pResults )
+{
+	char fileName[MAX_PATH];
+
+	// JSON summary of this run
+	CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	buf.Printf( "{\n" );
+	buf.Printf( "\t\"map\": " );
+	PrintJsonString( buf, pMapName );
+	buf.Printf( ",\n\t\"label\": " );
+	PrintJsonString( buf, pLabel );
+	buf.Printf( ",\n" );
+	buf.Printf( "\t\"seed\": %d,\n", params.m_nSeed );
+	buf.Printf( "\t\"rooms\": %d,\n", GridSize( params.m_nRooms ) * GridSize( params.m_nRooms ) );
+	buf.Printf( "\t\"brushes\": %d,\n", nBrushes );
+	buf.Printf( "\t\"displacements\": %d,\n", nDisplacements );
+	buf.Printf( "\t\"lights\": %d,\n", max( params.m_nLights, 1 ) );
+	buf.Printf( "\t\"props\": %d,\n", params.m_nProps );
+	buf.Printf( "\t\"stages\": [\n" );
+
+	bool bFirst = true;
+	for ( int iStage = 0; iStage < NUM_STAGES; iStage++ )
+	{
+		const StageResult_t &result = pResults[iStage];
+		if ( !result.m_bRan )
+			continue;
+
+		double flMin = result.m_flSeconds[0], flTotal = 0;
+		for ( int iRun = 0; iRun < result.m_nRuns; iRun++ )
+		{
+			flMin = min( flMin, result.m_flSeconds[iRun] );
+			flTotal += result.m_flSeconds[iRun];
+		}
+
+		buf.Printf( "%s\t\t{\n", bFirst ? "" : ",\n" );
+		buf.Printf( "\t\t\t\"tool\": \"%s\",\n", g_pStageNames[iStage] );
+		buf.Printf( "\t\t\t\"exit_code\": %d,\n", result.m_nExitCode );
+		buf.Printf( "\t\t\t\"runs\": %d,\n", result.m_nRuns );
+		buf.Printf( "\t\t\t\"min_seconds\": %.3f,\n", flMin );
+		buf.Printf( "\t\t\t\"mean_seconds\": %.3f,\n", result.m_nRuns ? flTotal / result.m_nRuns : 0.0 );
+		buf.Printf( "\t\t\t\"telemetry\": \"%s.%s.json\"\n", pMapName, g_pStageNames[iStage] );
+		buf.Printf( "\t\t}" );
+		bFirst = false;
+	}
+	buf.Printf( "\n\t]\n}\n" );
+
+	Q_snprintf( fileName, sizeof( fileName ), "%s/maps/%s.bench.json", pOutDir, pMapName );
+	WriteFile( fileName, buf );
+
+	// One line per run in the csv, so runs across changes can be graphed
+	Q_snprintf( fileName, sizeof( fileName ), "%s/mapbench.csv", pOutDir );
+	FILE *fp = fopen( fileName, "r" );
+	bool bNewFile = ( fp == NULL );
+	if ( fp )
+		fclose( fp );
+
+	fp = fopen( fileName, "a" );
+	if ( !fp )
+	{
+		fprintf( stderr, "Can't write %s\n", fileName );
+		return;
+	}
+
+	if ( bNewFile )
+		fprintf( fp, "label,map,seed,rooms,brushes,displacements,lights,props,tool,run,exit_code,seconds\n" );
+
+	for ( int iStage = 0; iStage < NUM_STAGES; iStage++ )
+	{
+		const StageResult_t &result = pResults[iStage];
+		for ( int iRun = 0; iRun < result.m_nRuns; iRun++ )
+		{
+			PrintCsvField( fp, pLabel );
+			fputc( ',', fp );
+			PrintCsvField( fp, pMapName );
+			fprintf( fp, ",%d,%d,%d,%d,%d,%d,", params.m_nSeed,
+				GridSize( params.m_nRooms ) * GridSize( params.m_nRooms ), nBrushes, nDisplacements,
+				max( params.m_nLights, 1 ), params.m_nProps );
+			PrintCsvField( fp, g_pStageNames[iStage] );
+			fprintf( fp, ",%d,%d,%.3f\n", iRun, result.m_nExitCode, result.m_flSeconds[iRun] );
+		}
+	}
+	fclose( fp );
+}
+
+
+int main( int argc, char **argv )
+{
+	MapBenchParams_t params;
+	params.m_nRooms = 16;
+	params.m_nBrushes = 64;
+	params.m_nDisplacements = 0;
+	params.m_nLights = 8;
+	params.m_nProps = 0;
+	params.m_nRoomSize = 512;
+	params.m_nRoomHeight = 256;
+	params.m_nSeed = 1;
+	Q_strncpy( params.m_szPropModel, MAPBENCH_PROP_MODEL, sizeof( params.m_szPropModel ) );
+
+	const char *pMapName = NULL;
+	const char *pBinDir = NULL;
+	const char *pGameDir = NULL;
+	const char *pStages = "vbsp,vvis,vrad";
+	const char *pLabel = "";
+	const char *pExtraArgs[NUM_STAGES] = { "", "", "" };
+	int nRuns = 1;
+	int nThreads = 0;
+	bool bGenOnly = false;
+
+	int i;
+	for ( i = 1; i < argc - 1; i++ )
+	{
+		if ( argv[i][0] != '-' )
+			break;
+
+		if ( !Q_stricmp( argv[i], "-genonly" ) )
+		{
+			bGenOnly = true;
+			continue;
+		}
+
+		// Everything else takes a value
+		if ( i + 1 >= argc - 1 )
+			Usage();
+		const char *pValue = argv[++i];
+
+		if ( !Q_stricmp( argv[i-1], "-rooms" ) )
+			params.m_nRooms = max( atoi( pValue ), 1 );
+		else if ( !Q_stricmp( argv[i-1], "-brushes" ) )
+			params.m_nBrushes = max( atoi( pValue ), 0 );
+		else if ( !Q_stricmp( argv[i-1], "-disps" ) )
+			params.m_nDisplacements = max( atoi( pValue ), 0 );
+		else if ( !Q_stricmp( argv[i-1], "-lights" ) )
+			params.m_nLights = max( atoi( pValue ), 0 );
+		else if ( !Q_stricmp( argv[i-1], "-props" ) )
+			params.m_nProps = max( atoi( pValue ), 0 );
+		else if ( !Q_stricmp( argv[i-1], "-propmodel" ) )
+			Q_strncpy( params.m_szPropModel, pValue, sizeof( params.m_szPropModel ) );
+		else if ( !Q_stricmp( argv[i-1], "-roomsize" ) )
+			params.m_nRoomSize = max( atoi( pValue ), 2 * MAPBENCH_TILE );
+		else if ( !Q_stricmp( argv[i-1], "-roomheight" ) )
+			params.m_nRoomHeight = max( atoi( pValue ), MAPBENCH_DOOR_HEIGHT + 64 );
+		else if ( !Q_stricmp( argv[i-1], "-seed" ) )
+			params.m_nSeed = atoi( pValue );
+		else if ( !Q_stricmp( argv[i-1], "-name" ) )
+			pMapName = pValue;
+		else if ( !Q_stricmp( argv[i-1], "-bindir" ) )
+			pBinDir = pValue;
+		else if ( !Q_stricmp( argv[i-1], "-game" ) )
+			pGameDir = pValue;
+		else if ( !Q_stricmp( argv[i-1], "-stages" ) )
+			pStages = pValue;
+		else if ( !Q_stricmp( argv[i-1], "-runs" ) )
+			nRuns = clamp( atoi( pValue ), 1, MAPBENCH_MAX_RUNS );
+		else if ( !Q_stricmp( argv[i-1], "-threads" ) )
+			nThreads = atoi( pValue );
+		else if ( !Q_stricmp( argv[i-1], "-vbspargs" ) )
+			pExtraArgs[STAGE_VBSP] = pValue;
+		else if ( !Q_stricmp( argv[i-1], "-vvisargs" ) )
+			pExtraArgs[STAGE_VVIS] = pValue;
+		else if ( !Q_stricmp( argv[i-1], "-vradargs" ) )
+			pExtraArgs[STAGE_VRAD] = pValue;
+		else if ( !Q_stricmp( argv[i-1], "-label" ) )
+			pLabel = pValue;
+		else
+		{
+			fprintf( stderr, "Unknown option %s\n\n", argv[i-1] );
+			Usage();
+		}
+	}
+
+	if ( i != argc - 1 )
+		Usage();
+
+	char outDir[MAX_PATH];
+	Q_MakeAbsolutePath( outDir, sizeof( outDir ), argv[i] );
+	Q_StripTrailingSlash( outDir );
+
+	char defaultName[MAX_PATH];
+	if ( !pMapName )
+	{
+		Q_snprintf( defaultName, sizeof( defaultName ), "bench_r%d_b%d_d%d_l%d_p%d_s%d",
+			params.m_nRooms, params.m_nBrushes, params.m_nDisplacements, params.m_nLights, params.m_nProps, params.m_nSeed );
+		pMapName = defaultName;
+	}
+
+	// Game directory
+	char gameDir[MAX_PATH];
+	if ( pGameDir )
+	{
+		Q_MakeAbsolutePath( gameDir, sizeof( gameDir ), pGameDir );
+	}
+	else
+	{
+		Q_snprintf( gameDir, sizeof( gameDir ), "%s/game", outDir );
+		if ( !WriteGameDir( gameDir ) || !WritePropModel( gameDir ) )
+			return -1;
+	}
+
+	// Map
+	CUtlBuffer vmfBuf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	int nBrushes, nDisplacements;
+	GenerateMap( vmfBuf, params, &nBrushes, &nDisplacements );
+
+	char mapBase[MAX_PATH], fileName[MAX_PATH];
+	Q_snprintf( mapBase, sizeof( mapBase ), "%s/maps/%s", outDir, pMapName );
+	Q_snprintf( fileName, sizeof( fileName ), "%s.vmf", mapBase );
+	if ( !WriteFile( fileName, vmfBuf ) )
+		return -1;
+
+	int nGrid = GridSize( params.m_nRooms );
+	printf( "Wrote %s: %d rooms, %d brushes, %d displacements, %d lights, %d props\n",
+		fileName, nGrid * nGrid, nBrushes, nDisplacements, max( params.m_nLights, 1 ), params.m_nProps );
+
+	if ( bGenOnly )
+		return 0;
+
+	// Run the stages
+	StageResult_t results[NUM_STAGES];
+	memset( results, 0, sizeof( results ) );
+
+	for ( int iStage = 0; iStage < NUM_STAGES; iStage++ )
+	{
+		if ( !Q_stristr( pStages, g_pStageNames[iStage] ) )
+			continue;
+
+		char exe[MAX_PATH];
+#ifdef _WIN32
+		Q_snprintf( exe, sizeof( exe ), "%s.exe", g_pStageNames[iStage] );
+#else
+		Q_strncpy( exe, g_pStageNames[iStage], sizeof( exe ) );
+#endif
+		if ( pBinDir )
+		{
+			char temp[MAX_PATH];
+			Q_ComposeFileName( pBinDir, exe, temp, sizeof( temp ) );
+			Q_strncpy( exe, temp, sizeof( exe ) );
+		}
+
+		char threads[32] = "";
+		if ( nThreads > 0 && iStage != STAGE_VBSP )
+			Q_snprintf( threads, sizeof( threads ), "-threads %d ", nThreads );
+
+		char command[4096];
+		Q_snprintf( command, sizeof( command ), "\"%s\" -game \"%s\" -telemetry %s%s%s\"%s\"",
+			exe, gameDir, threads, pExtraArgs[iStage], pExtraArgs[iStage][0] ? " " : "", mapBase );
+
+		StageResult_t &result = results[iStage];
+		result.m_bRan = true;
+		for ( int iRun = 0; iRun < nRuns; iRun++ )
+		{
+			printf( "mapbench: %s (run %d of %d)\n", command, iRun + 1, nRuns );
+
+			double flStart = Plat_FloatTime();
+			result.m_nExitCode = RunCommand( command );
+			result.m_flSeconds[result.m_nRuns++] = Plat_FloatTime() - flStart;
+
+			if ( result.m_nExitCode != 0 )
+				break;
+		}
+
+		if ( result.m_nExitCode != 0 )
+		{
+			fprintf( stderr, "mapbench: %s failed with exit code %d\n", g_pStageNames[iStage], result.m_nExitCode );
+#ifndef _WIN32
+			// 127 is the shell's "command not found"
+			if ( result.m_nExitCode == 127 )
+				fprintf( stderr, "mapbench: vbsp, vvis and vrad only build for Windows, use -genonly or -bindir\n" );
+#endif
+			break;
+		}
+	}
+
+	WriteResults( outDir, pMapName, pLabel, params, nBrushes, nDisplacements, results );
+
+	for ( int iStage = 0; iStage < NUM_STAGES; iStage++ )
+	{
+		const StageResult_t &result = results[iStage];
+		if ( !result.m_bRan )
+			continue;
+
+		double flMin = result.m_flSeconds[0];
+		for ( int iRun = 1; iRun < result.m_nRuns; iRun++ )
+			flMin = min( flMin, result.m_flSeconds[iRun] );
+		printf( "%-6s %8.2f seconds%s\n", g_pStageNames[iStage], flMin, result.m_nExitCode ? " (failed)" : "" );
+	}
+
+	for ( int iStage = 0; iStage < NUM_STAGES; iStage++ )
+	{
+		if ( results[iStage].m_nExitCode )
+			return results[iStage].m_nExitCode;
+	}
+	return 0;
+}
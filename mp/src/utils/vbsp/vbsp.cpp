@@ -19,6 +19,7 @@
 #include "loadcmdline.h"
 #include "byteswap.h"
 #include "worldvertextransitionfixup.h"
+#include "telemetry.h"
 
 extern float		g_maxLightmapDimension;
 
@@ -56,6 +57,7 @@ bool		g_NodrawTriggers = false;
 bool		g_DisableWaterLighting = false;
 bool		g_bAllowDetailCracks = false;
 bool		g_bNoVirtualMesh = false;
+bool		g_bTelemetry = false;
 
 float		g_defaultLuxelSize = DEFAULT_LUXEL_SIZE;
 float		g_luxelScale = 1.0f;
@@ -843,10 +845,12 @@ void ProcessModels (void)
 
 		if (entity_num == 0)
 		{
+			CTelemetryPhase phase( "ProcessWorldModel" );
 			ProcessWorldModel();
 		}
 		else
 		{
+			CTelemetryPhase phase( "ProcessSubModel" );
 			ProcessSubModel( );
 		}
 
@@ -860,7 +864,10 @@ void ProcessModels (void)
 
 	// Turn the skybox into a cubemap in case we don't build env_cubemap textures.
 	Cubemap_CreateDefaultCubemaps();
+
+	Telemetry_BeginPhase( "EndBSPFile" );
 	EndBSPFile ();
+	Telemetry_EndPhase();
 }
 
 
@@ -1092,6 +1099,10 @@ int RunVBSP( int argc, char **argv )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-telemetry" ) )
+		{
+			g_bTelemetry = true;
+		}
 		else if( !Q_stricmp( argv[i], "-lightifmissing" ) )
 		{
 			g_bLightIfMissing = true;
@@ -1183,6 +1194,8 @@ int RunVBSP( int argc, char **argv )
 			"                what affects visibility.\n"
 			"  -nowater    : Get rid of water brushes.\n"
 			"  -low        : Run as an idle-priority process.\n"
+			"  -telemetry  : Write the time, cpu time, throughput and memory use of each\n"
+			"                phase of the compile to <mapname>.vbsp.json.\n"
 			"  -embed <directory>  : Use <directory> as an additional search path for assets\n"
 			"                        and embed all assets in this directory into the compiled\n"
 			"                        map\n"
@@ -1256,6 +1269,7 @@ int RunVBSP( int argc, char **argv )
 	}
 
 	start = Plat_FloatTime();
+	Telemetry_BeginPhase( "vbsp" );
 
 	// Run in the background?
 	if( g_bLowPriority )
@@ -1334,7 +1348,9 @@ int RunVBSP( int argc, char **argv )
 		// Mark as stale since the lighting could be screwed with new ents.
 		AddBufferToPak( GetPakFile(), "stale.txt", "stale", strlen( "stale" ) + 1, false );
 
+		Telemetry_BeginPhase( "LoadMapFile" );
 		LoadMapFile (name);
+		Telemetry_EndPhase( num_entities );
 		SetModelNumbers ();
 		SetLightStyles ();
 
@@ -1365,7 +1381,9 @@ int RunVBSP( int argc, char **argv )
 		// In the only props case, deal with static + detail props only
 		LoadBSPFile (mapFile);
 
+		Telemetry_BeginPhase( "LoadMapFile" );
 		LoadMapFile(name);
+		Telemetry_EndPhase( num_entities );
 		SetModelNumbers();
 		SetLightStyles();
 
@@ -1392,7 +1410,9 @@ int RunVBSP( int argc, char **argv )
 			AddBufferToPak( GetPakFile(), "stale.txt", "stale", strlen( "stale" ) + 1, false );
 		}
 
+		Telemetry_BeginPhase( "LoadMapFile" );
 		LoadMapFile (name);
+		Telemetry_EndPhase( num_entities );
 		WorldVertexTransitionFixup();
 		if( ( g_nDXLevel == 0 ) || ( g_nDXLevel >= 70 ) )
 		{
@@ -1403,7 +1423,10 @@ int RunVBSP( int argc, char **argv )
 		SetModelNumbers ();
 		SetLightStyles ();
 		LoadEmitDetailObjectDictionary( gamedir );
+
+		Telemetry_BeginPhase( "ProcessModels" );
 		ProcessModels ();
+		Telemetry_EndPhase( nummodels );
 
 		// Add embed dir if provided
 		if ( *g_szEmbedDir )
@@ -1419,6 +1442,13 @@ int RunVBSP( int argc, char **argv )
 	GetHourMinuteSecondsString( (int)( end - start ), str, sizeof( str ) );
 	Msg( "%s elapsed\n", str );
 
+	Telemetry_EndPhase();
+	if ( g_bTelemetry )
+	{
+		sprintf( path, "%s.vbsp.json", source );
+		Telemetry_WriteReport( path, "vbsp" );
+	}
+
 	DeleteCmdLine( argc, argv );
 	ReleasePakFileLumps();
 	DeleteMaterialReplacementKeys();
@@ -0,0 +1,330 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: -probes: the light the detail props and the per-leaf ambient
+//			samples get from all around them, interpolated from a sparse grid
+//			of probes instead of shooting rays from every one of them.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "irradiance_probes.h"
+#include "leaf_ambient_lighting.h"
+#include "vraddetailprops.h"
+#include "threads.h"
+#include "utlmap.h"
+#include "worldsize.h"
+
+
+/*
+	Every detail prop and every per-leaf ambient sample shoots NUMVERTEXNORMALS
+	rays to see what's around it. There are tens of thousands of them on an
+	outdoor map and the light they see hardly changes from one to the next.
+
+	The probes sit on the corners of a grid PROBE_SPACING units apart, which
+	each of the PROBE_LEVELS - 1 finer levels halves. A probe shoots the same
+	rays a sample would and keeps the ambient cube and the average over the
+	sphere. Nothing makes them up front: a sample makes the probes it asks for,
+	so they only exist where there are props and leaves, and the threads
+	asking for them make them in parallel.
+
+	A sample starts at the coarsest cell around it. The corners that are in
+	solid or that it can't see (a ray to each) don't count, and the rest are
+	blended by their trilinear weights. When too little of the cell is left,
+	or the corners left differ by more than -probeerror in gamma space, the
+	next level down tries again with the cell around the sample there. When
+	even the finest one fails the caller shoots its own rays.
+
+	The probes only keep light style 0. The detail props that see light in
+	other styles shoot their own rays, and the leaf ambient only ever wanted
+	style 0. The emit_surface lights the leaf ambient adds fall off too fast
+	to interpolate, so it adds those at the sample itself.
+*/
+
+
+bool	g_bIrradianceProbes = false;
+float	g_flIrradianceProbeError = 3.0f;
+
+// The coarsest probes are this far apart, each finer level halves it
+#define PROBE_SPACING			128.0f
+#define PROBE_LEVELS			4
+#define PROBE_FINEST_SPACING	( PROBE_SPACING / ( 1 << ( PROBE_LEVELS - 1 ) ) )
+
+// How much of its cell a sample near a wall or the ground has to have on its
+// side of it before a level other than the finest answers
+#define PROBE_MIN_WEIGHT		0.5f
+
+struct IrradianceProbe_t
+{
+	Vector	m_vecPos;
+	Vector	m_Cube[6];
+	Vector	m_vecAverage;
+	bool	m_bValid;			// not in solid
+	bool	m_bLightStyles;
+};
+
+// By position on the finest grid. They're never moved or freed until
+// IrradianceProbes_Clear, so the pointers can be used outside the lock.
+static CThreadFastMutex s_ProbeLock;
+static CUtlMap<uint64, IrradianceProbe_t*, int> s_Probes( DefLessFunc( uint64 ) );
+
+static CThreadShards<int> s_ProbeRayShards;		// rays the probes shot
+static CThreadShards<int> s_VisRayShards;		// rays from samples to the probes around them
+static CThreadShards<int> s_SampleShards;
+static CThreadShards<int> s_AnsweredShards;
+
+
+static void ComputeProbe( int iThread, const Vector &vecPos, IrradianceProbe_t &probe )
+{
+	probe.m_vecPos = vecPos;
+	probe.m_vecAverage.Init();
+	probe.m_bLightStyles = false;
+	for ( int i = 0; i < 6; i++ )
+	{
+		probe.m_Cube[i].Init();
+	}
+
+	// Rays from inside a brush see its back faces
+	probe.m_bValid = !( dleafs[PointLeafnum( vecPos )].contents & CONTENTS_SOLID );
+	if ( !probe.m_bValid )
+		return;
+
+	// The same rays as ComputeAmbientFromSphericalSamples
+	Vector radcolor[NUMVERTEXNORMALS];
+	float tanTheta = tan( VERTEXNORMAL_CONE_INNER_ANGLE );
+
+	for ( int i = 0; i < NUMVERTEXNORMALS; i++ )
+	{
+		Vector vEnd = vecPos + g_anorms[i] * (COORD_EXTENT * 1.74);
+
+		Vector lightStyleColors[MAX_LIGHTSTYLES];
+		for ( int j = 0; j < MAX_LIGHTSTYLES; j++ )
+		{
+			lightStyleColors[j].Init();
+		}
+		CalcRayAmbientLighting( iThread, vecPos, vEnd, tanTheta, lightStyleColors );
+
+		radcolor[i] = lightStyleColors[0];
+		probe.m_vecAverage += radcolor[i];
+
+		for ( int j = 1; j < MAX_LIGHTSTYLES; j++ )
+		{
+			if ( lightStyleColors[j] != vec3_origin )
+			{
+				probe.m_bLightStyles = true;
+				break;
+			}
+		}
+	}
+
+	probe.m_vecAverage *= 1.0f / NUMVERTEXNORMALS;
+	AmbientCubeFromSphericalSamples( radcolor, probe.m_Cube );
+
+	s_ProbeRayShards[iThread] += NUMVERTEXNORMALS;
+}
+
+
+static IrradianceProbe_t *GetProbe( int iThread, int x, int y, int z )
+{
+	uint64 nKey = ( (uint64)x << 42 ) | ( (uint64)y << 21 ) | (uint64)z;
+
+	s_ProbeLock.Lock();
+	int i = s_Probes.Find( nKey );
+	IrradianceProbe_t *pProbe = s_Probes.IsValidIndex( i ) ? s_Probes[i] : NULL;
+	s_ProbeLock.Unlock();
+
+	if ( pProbe )
+		return pProbe;
+
+	// Make it outside the lock. When two threads make the same probe the
+	// first one in keeps it.
+	pProbe = new IrradianceProbe_t;
+	Vector vecPos( x, y, z );
+	vecPos *= PROBE_FINEST_SPACING;
+	vecPos += Vector( MIN_COORD_INTEGER, MIN_COORD_INTEGER, MIN_COORD_INTEGER );
+	ComputeProbe( iThread, vecPos, *pProbe );
+
+	s_ProbeLock.Lock();
+	i = s_Probes.Find( nKey );
+	if ( s_Probes.IsValidIndex( i ) )
+	{
+		delete pProbe;
+		pProbe = s_Probes[i];
+	}
+	else
+	{
+		s_Probes.Insert( nKey, pProbe );
+	}
+	s_ProbeLock.Unlock();
+
+	return pProbe;
+}
+
+
+bool IrradianceProbes_Sample( int iThread, const Vector &vecPos, IrradianceSample_t &sample )
+{
+	++s_SampleShards[iThread];
+
+	// Where it is on the finest grid
+	Vector vecGrid = vecPos - Vector( MIN_COORD_INTEGER, MIN_COORD_INTEGER, MIN_COORD_INTEGER );
+	vecGrid *= 1.0f / PROBE_FINEST_SPACING;
+	float flGridMax = COORD_EXTENT / PROBE_FINEST_SPACING - 1;
+	if ( vecGrid.x < 0 || vecGrid.y < 0 || vecGrid.z < 0 ||
+		 vecGrid.x >= flGridMax || vecGrid.y >= flGridMax || vecGrid.z >= flGridMax )
+		return false;
+
+	for ( int nLevel = 0; nLevel < PROBE_LEVELS; nLevel++ )
+	{
+		int nStep = 1 << ( PROBE_LEVELS - 1 - nLevel );
+		Vector vecCell = vecGrid * ( 1.0f / nStep );
+
+		int nCell[3];
+		float flFrac[3];
+		for ( int j = 0; j < 3; j++ )
+		{
+			nCell[j] = (int)floor( vecCell[j] );
+			flFrac[j] = vecCell[j] - nCell[j];
+		}
+
+		IrradianceProbe_t *pCorners[8];
+		float flWeights[8];
+		bool bTrace[8];
+		FourVectors start[2], stop[2];
+		int nRays = 0;
+		for ( int k = 0; k < 8; k++ )
+		{
+			int dx = k & 1, dy = ( k >> 1 ) & 1, dz = ( k >> 2 ) & 1;
+			pCorners[k] = GetProbe( iThread, ( nCell[0] + dx ) * nStep, ( nCell[1] + dy ) * nStep, ( nCell[2] + dz ) * nStep );
+			flWeights[k] = ( dx ? flFrac[0] : 1.0f - flFrac[0] ) *
+						   ( dy ? flFrac[1] : 1.0f - flFrac[1] ) *
+						   ( dz ? flFrac[2] : 1.0f - flFrac[2] );
+			if ( !pCorners[k]->m_bValid )
+			{
+				flWeights[k] = 0.0f;
+			}
+
+			// A probe right on top of the sample can't be hidden from it.
+			// The lanes that don't need a ray trace a short one nobody looks at.
+			Vector vecStop = pCorners[k]->m_vecPos;
+			bTrace[k] = flWeights[k] > 0.0f && vecStop.DistToSqr( vecPos ) > 1.0f;
+			if ( bTrace[k] )
+			{
+				++nRays;
+			}
+			else
+			{
+				vecStop = vecPos + Vector( 0, 0, 1 );
+			}
+			start[k >> 2].X( k & 3 ) = vecPos.x;
+			start[k >> 2].Y( k & 3 ) = vecPos.y;
+			start[k >> 2].Z( k & 3 ) = vecPos.z;
+			stop[k >> 2].X( k & 3 ) = vecStop.x;
+			stop[k >> 2].Y( k & 3 ) = vecStop.y;
+			stop[k >> 2].Z( k & 3 ) = vecStop.z;
+		}
+
+		if ( nRays )
+		{
+			fltx4 fractionVisible[2];
+			TestLine8( start, stop, fractionVisible );
+			s_VisRayShards[iThread] += nRays;
+
+			for ( int k = 0; k < 8; k++ )
+			{
+				if ( bTrace[k] && SubFloat( fractionVisible[k >> 2], k & 3 ) < 1.0f )
+				{
+					flWeights[k] = 0.0f;
+				}
+			}
+		}
+
+		float flTotal = 0.0f;
+		for ( int k = 0; k < 8; k++ )
+		{
+			flTotal += flWeights[k];
+		}
+
+		float flMinWeight = ( nLevel == PROBE_LEVELS - 1 ) ? 0.0f : PROBE_MIN_WEIGHT;
+		if ( flTotal <= flMinWeight )
+			continue;
+
+		// Too much going on between the corners to blend them
+		bool bSmooth = true;
+		int iFirst = -1;
+		for ( int k = 0; k < 8 && bSmooth; k++ )
+		{
+			if ( flWeights[k] == 0.0f )
+				continue;
+
+			if ( iFirst == -1 )
+			{
+				iFirst = k;
+			}
+			else if ( CubeDeltaGammaSpace( pCorners[iFirst]->m_Cube, pCorners[k]->m_Cube ) > g_flIrradianceProbeError )
+			{
+				bSmooth = false;
+			}
+		}
+		if ( !bSmooth )
+			continue;
+
+		for ( int i = 0; i < 6; i++ )
+		{
+			sample.m_Cube[i].Init();
+		}
+		sample.m_vecAverage.Init();
+		sample.m_bLightStyles = false;
+
+		for ( int k = 0; k < 8; k++ )
+		{
+			if ( flWeights[k] == 0.0f )
+				continue;
+
+			float flWeight = flWeights[k] / flTotal;
+			for ( int i = 0; i < 6; i++ )
+			{
+				VectorMA( sample.m_Cube[i], flWeight, pCorners[k]->m_Cube[i], sample.m_Cube[i] );
+			}
+			VectorMA( sample.m_vecAverage, flWeight, pCorners[k]->m_vecAverage, sample.m_vecAverage );
+			sample.m_bLightStyles |= pCorners[k]->m_bLightStyles;
+		}
+
+		++s_AnsweredShards[iThread];
+		return true;
+	}
+
+	return false;
+}
+
+
+void IrradianceProbes_Clear()
+{
+	for ( int i = s_Probes.FirstInorder(); s_Probes.IsValidIndex( i ); i = s_Probes.NextInorder( i ) )
+	{
+		delete s_Probes[i];
+	}
+	s_Probes.RemoveAll();
+
+	s_ProbeRayShards.Reset( 0 );
+	s_VisRayShards.Reset( 0 );
+	s_SampleShards.Reset( 0 );
+	s_AnsweredShards.Reset( 0 );
+}
+
+
+void IrradianceProbes_PrintStats()
+{
+	int nSamples = s_SampleShards.Sum();
+	if ( !nSamples )
+		return;
+
+	int nAnswered = s_AnsweredShards.Sum();
+
+	// What the samples would have shot without the probes, and what they and
+	// the probes shot instead
+	double flRaysBefore = (double)nSamples * NUMVERTEXNORMALS;
+	double flRaysAfter = (double)( nSamples - nAnswered ) * NUMVERTEXNORMALS + s_ProbeRayShards.Sum() + s_VisRayShards.Sum();
+
+	Msg( "Irradiance probes: %d probes answered %d of %d ambient samples, %.0f rays instead of %.0f (%d%% saved)\n",
+		s_Probes.Count(), nAnswered, nSamples, flRaysAfter, flRaysBefore,
+		(int)( 100.0 * ( flRaysBefore - flRaysAfter ) / flRaysBefore ) );
+}
@@ -0,0 +1,42 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: -probes: the light the detail props and the per-leaf ambient
+//			samples get from all around them, interpolated from a sparse grid
+//			of probes instead of shooting rays from every one of them.
+//
+//=============================================================================//
+
+#ifndef IRRADIANCE_PROBES_H
+#define IRRADIANCE_PROBES_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "mathlib/vector.h"
+
+
+extern bool		g_bIrradianceProbes;
+extern float	g_flIrradianceProbeError;
+
+// What the rays ComputeAmbientFromSphericalSamples shoots would have seen
+// at a point, light style 0 only
+struct IrradianceSample_t
+{
+	Vector	m_Cube[6];			// before the emit_surface lights go in
+	Vector	m_vecAverage;		// over the whole sphere, what the detail props use
+	bool	m_bLightStyles;		// some of the rays hit light in other styles too
+};
+
+// Interpolates the probes around a point, making any that don't exist yet.
+// Returns false when the probes around it can't see it or differ by more than
+// -probeerror even at the finest level, and the caller has to shoot its own rays.
+bool IrradianceProbes_Sample( int iThread, const Vector &vecPos, IrradianceSample_t &sample );
+
+// Throws away the probes, the lighting they were made from changed
+void IrradianceProbes_Clear();
+
+// How many samples the probes answered and how many rays that saved
+void IrradianceProbes_PrintStats();
+
+
+#endif // IRRADIANCE_PROBES_H
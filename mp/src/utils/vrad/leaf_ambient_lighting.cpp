@@ -6,6 +6,7 @@
 
 #include "vrad.h"
 #include "leaf_ambient_lighting.h"
+#include "irradiance_probes.h"
 #include "bsplib.h"
 #include "vraddetailprops.h"
 #include "mathlib/anorms.h"
@@ -154,6 +155,16 @@ void ComputeAmbientFromSphericalSamples( int iThread, const Vector &vStart, Vect
 		radcolor[i] = lightStyleColors[0];
 	}
 
+	AmbientCubeFromSphericalSamples( radcolor, lightBoxColor );
+
+	// Now add direct light from the emit_surface lights. These go in the ambient cube because
+	// there are a ton of them and they are often so dim that they get filtered out by r_worldlightmin.
+	AddEmitSurfaceLights( vStart, lightBoxColor );
+}
+
+
+void AmbientCubeFromSphericalSamples( const Vector radcolor[NUMVERTEXNORMALS], Vector lightBoxColor[6] )
+{
 	// accumulate samples into radiant box
 	for ( int j = 6; --j >= 0; )
 	{
@@ -173,10 +184,6 @@ void ComputeAmbientFromSphericalSamples( int iThread, const Vector &vStart, Vect
 		
 		lightBoxColor[j] *= 1/t;
 	}
-
-	// Now add direct light from the emit_surface lights. These go in the ambient cube because
-	// there are a ton of them and they are often so dim that they get filtered out by r_worldlightmin.
-	AddEmitSurfaceLights( vStart, lightBoxColor );
 }
 
 
@@ -556,7 +563,20 @@ void ComputeAmbientForLeaf( int iThread, int leafID, CUtlVector<ambientsample_t>
 		// compute each candidate sample and add to the list
 		Vector samplePosition;
 		sampler.GenerateLeafSamplePosition( leafID, leafPlanes, samplePosition );
-		ComputeAmbientFromSphericalSamples( iThread, samplePosition, cube );
+		IrradianceSample_t probeSample;
+		if ( g_bIrradianceProbes && IrradianceProbes_Sample( iThread, samplePosition, probeSample ) )
+		{
+			// the emit_surface lights fall off too quickly to interpolate, add them here
+			for ( int j = 0; j < 6; j++ )
+			{
+				cube[j] = probeSample.m_Cube[j];
+			}
+			AddEmitSurfaceLights( samplePosition, cube );
+		}
+		else
+		{
+			ComputeAmbientFromSphericalSamples( iThread, samplePosition, cube );
+		}
 		// note this will remove the least valuable sample once the limit is reached
 		AddSampleToList( list, samplePosition, cube );
 	}
@@ -10,8 +10,17 @@
 #pragma once
 #endif
 
+#include "mathlib/vector.h"
+#include "mathlib/anorms.h"
+
 
 void ComputePerLeafAmbientLighting();
 
+// Weights the rays shot out along g_anorms into the six sides of an ambient cube
+void AmbientCubeFromSphericalSamples( const Vector radcolor[NUMVERTEXNORMALS], Vector lightBoxColor[6] );
+
+// The largest difference between two ambient cubes, in gamma space units
+int CubeDeltaGammaSpace( Vector *pCube0, Vector *pCube1 );
+
 
 #endif // LEAF_AMBIENT_LIGHTING_H
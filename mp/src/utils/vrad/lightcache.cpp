@@ -0,0 +1,1164 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: -incremental: keeps the direct lighting and bounced light of the
+//			last compile of a map so the next one only relights the faces an
+//			edit could have changed.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmap.h"
+#include "lightcache.h"
+#include "vrad_dispcoll.h"
+#include "collisionutils.h"
+#include "bsptreedata.h"
+#include "mathlib/vplane.h"
+#include "utlbuffer.h"
+#include "utlmap.h"
+
+
+/*
+
+Face, light and occluder numbers all change whenever anything in the map does,
+so everything in the cache is matched up through hashes:
+
+  face key		- the face's winding, plane, texture and lightmap mapping,
+				  vertex normals and displacement (plus the displacements
+				  next to it, which smooth into it)
+  light hash	- everything about a light that GatherSampleLight uses
+  occluder hash	- a brush, sky face, displacement or static prop, as it gets
+				  turned into g_RtEnv triangles
+
+While BuildFacelights runs, every light that adds something to a face is noted
+down for it. A face with the same key as last time keeps its direct lighting
+unless:
+
+  - a light it got something from changed or went away
+  - a light that's new (or changed) is in the PVS of the face
+  - an occluder that's new, changed or gone is inside the hull of the face and
+	a light that lit it last time or can see it now. The hull is a cone from
+	a point light around the face's bounding sphere, a cylinder toward the sun
+	(widened by the sun's angular extent) for light_environment, and all of
+	the front of the face for the sky ambient.
+
+That's a test of volumes instead of the exact shadow ray triangles, so it only
+ever relights too much. The static props keep their own cache of their final
+lighting (see vradstaticprops.cpp), but the same changes decide which of them
+have different direct light: the lights that could reach a prop's bounds last
+time and now, and the changed occluders in between (LightCache_BoxLightingChanged).
+
+The bounced light of every patch is kept too. BounceLight starts from it, so
+when little changed the first bounce already gets close to the answer and the
+rest only have a small difference left to spread around. That's only right
+when bouncing ran until it converged: stopped at -bounce, the bounced light is
+a partial sum, and starting from it would add more bounces on every rerun. So
+it's kept only when BounceLight converged, and -bounce is one of the settings.
+
+*/
+
+#define LIGHTCACHE_ID			(('C'<<24)+('L'<<16)+('R'<<8)+'V')	// little-endian "VRLC"
+#define LIGHTCACHE_VERSION		1
+
+// Changed occluders in the same cell of this size are tested as one box
+#define LIGHTCACHE_MERGE_CELL	256.0f
+
+
+bool g_bLightCache = false;
+
+
+struct LightCacheHeader_t
+{
+	int		id;
+	int		version;
+	uint64	settings;
+	int		numlights;		// numdlights of the run that wrote it
+	int		numoccluders;
+	int		numfaces;
+	int		unused;
+};
+
+// A face in the cache file. The offsets are into s_pCacheData.
+struct CachedFace_t
+{
+	uint64	key;
+	byte	styles[MAXLIGHTMAPS];
+	int		numsamples;
+	int		normalcount;
+	int		numlights;
+	int		lightofs;
+	int		dataofs;
+	int		numpatches;
+	int		patchofs;
+};
+
+// What this run has for a face, to be saved
+struct FaceRecord_t
+{
+	byte	styles[MAXLIGHTMAPS];
+	int		numsamples;
+	int		normalcount;
+	CUtlVector<int> lights;				// directlight_t::index
+	CUtlVector<LightingValue_t> data;	// [style][normal][sample]
+};
+
+
+static CUtlVector<uint64>			s_FaceLocalHash;
+static CUtlVector<uint64>			s_FaceKey;
+static CUtlVector<Vector>			s_FaceMins;
+static CUtlVector<Vector>			s_FaceMaxs;
+static CUtlVector<VPlane>			s_FacePlane;
+static CUtlVector<bool>				s_FaceFlat;
+
+static CUtlVector<uint64>			s_LightHash;		// by directlight_t::index
+static CUtlVector<LightCacheOccluder_t> s_Occluders;
+static uint64						s_nSettingsHash = 0;
+
+static byte							*s_pCacheData = NULL;
+static CUtlVector<CachedFace_t>		s_CachedFaces;
+static CUtlVector<int>				s_FaceReuse;		// cached face whose direct lighting still holds, or -1
+static CUtlVector<Vector>			s_WarmStart;
+
+static CUtlVector<FaceRecord_t>		s_FaceRecords;
+static CUtlVector<byte>				s_ThreadLightBits[MAX_TOOL_THREADS+1];
+
+
+uint64 FinalizeLightCacheHash( MD5Context_t *pContext )
+{
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	MD5Final( digest, pContext );
+
+	uint64 hash;
+	memcpy( &hash, digest, sizeof( hash ) );
+	return hash;
+}
+
+template< class T >
+static inline void HashValue( MD5Context_t *pContext, const T &value )
+{
+	MD5Update( pContext, (const unsigned char *)&value, sizeof( value ) );
+}
+
+static void GetLightCacheFileName( char *pFileName, int nMaxLen )
+{
+	Q_StripExtension( source, pFileName, nMaxLen );
+	Q_strncat( pFileName, g_bHDR ? ".hdr.lightcache" : ".lightcache", nMaxLen, COPY_ALL_CHARACTERS );
+}
+
+
+//-----------------------------------------------------------------------------
+// Keys
+//-----------------------------------------------------------------------------
+
+// The command line options that change direct lighting without changing any
+// face or light, and the bounce count the kept bounced light depends on
+static uint64 LightingSettingsHash()
+{
+	MD5Context_t ctx;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+	HashValue( &ctx, g_bHDR );
+	HashValue( &ctx, do_extra );
+	HashValue( &ctx, extrapasses );
+	HashValue( &ctx, do_fast );
+	HashValue( &ctx, do_centersamples );
+	HashValue( &ctx, g_flSkySampleScale );
+	HashValue( &ctx, g_bLargeDispSampleRadius );
+	HashValue( &ctx, g_flMaxDispSampleSize );
+	HashValue( &ctx, g_bTextureShadows );
+	HashValue( &ctx, g_bStaticPropPolys );
+	HashValue( &ctx, g_bNoSkyRecurse );
+	HashValue( &ctx, g_bFastAmbient );
+	HashValue( &ctx, g_SunAngularExtent );
+	HashValue( &ctx, smoothing_threshold );
+	HashValue( &ctx, numbounce );
+	for ( int i = 0; i < g_NonShadowCastingMaterialStrings.Count(); i++ )
+	{
+		const char *pString = g_NonShadowCastingMaterialStrings[i];
+		MD5Update( &ctx, (const unsigned char *)pString, Q_strlen( pString ) + 1 );
+	}
+	return FinalizeLightCacheHash( &ctx );
+}
+
+static uint64 LightHash( const directlight_t *dl )
+{
+	// Not the cluster, which moves whenever vvis does
+	const dworldlight_t &light = dl->light;
+	MD5Context_t ctx;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+	HashValue( &ctx, light.type );
+	HashValue( &ctx, light.origin );
+	HashValue( &ctx, light.intensity );
+	HashValue( &ctx, light.normal );
+	HashValue( &ctx, light.style );
+	HashValue( &ctx, light.stopdot );
+	HashValue( &ctx, light.stopdot2 );
+	HashValue( &ctx, light.exponent );
+	HashValue( &ctx, light.radius );
+	HashValue( &ctx, light.constant_attn );
+	HashValue( &ctx, light.linear_attn );
+	HashValue( &ctx, light.quadratic_attn );
+	HashValue( &ctx, light.flags );
+	HashValue( &ctx, dl->m_flStartFadeDistance );
+	HashValue( &ctx, dl->m_flEndFadeDistance );
+	HashValue( &ctx, dl->m_flCapDist );
+	return FinalizeLightCacheHash( &ctx );
+}
+
+static uint64 FaceLocalHash( int iFace )
+{
+	dface_t *f = &g_pFaces[iFace];
+	texinfo_t *tx = &texinfo[f->texinfo];
+	dtexdata_t *td = &dtexdata[tx->texdata];
+	const char *pTexName = TexDataStringTable_GetString( td->nameStringTableID );
+
+	MD5Context_t ctx;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+	HashValue( &ctx, dplanes[f->planenum].normal );
+	HashValue( &ctx, dplanes[f->planenum].dist );
+	HashValue( &ctx, f->side );
+	HashValue( &ctx, f->numedges );
+	for ( int j = 0; j < f->numedges; j++ )
+	{
+		HashValue( &ctx, dvertexes[EdgeVertex( f, j )].point );
+	}
+	HashValue( &ctx, tx->textureVecsTexelsPerWorldUnits );
+	HashValue( &ctx, tx->lightmapVecsLuxelsPerWorldUnits );
+	HashValue( &ctx, tx->flags );
+	HashValue( &ctx, td->reflectivity );
+	MD5Update( &ctx, (const unsigned char *)pTexName, Q_strlen( pTexName ) + 1 );
+	HashValue( &ctx, f->m_LightmapTextureMinsInLuxels );
+	HashValue( &ctx, f->m_LightmapTextureSizeInLuxels );
+	HashValue( &ctx, f->smoothingGroups );
+	HashValue( &ctx, face_offset[iFace] );
+
+	// The vertex normals carry the smoothing with the faces around it
+	faceneighbor_t *fn = &faceneighbor[iFace];
+	if ( fn->normal )
+	{
+		MD5Update( &ctx, (const unsigned char *)fn->normal, f->numedges * sizeof( Vector ) );
+	}
+
+	if ( f->dispinfo != -1 )
+	{
+		const ddispinfo_t &disp = g_dispinfo[f->dispinfo];
+		HashValue( &ctx, disp.startPosition );
+		HashValue( &ctx, disp.power );
+		HashValue( &ctx, disp.minTess );
+		HashValue( &ctx, disp.smoothingAngle );
+		HashValue( &ctx, disp.contents );
+		MD5Update( &ctx, (const unsigned char *)&g_DispVerts[disp.m_iDispVertStart], disp.NumVerts() * sizeof( CDispVert ) );
+	}
+
+	return FinalizeLightCacheHash( &ctx );
+}
+
+static uint64 CombineHash( uint64 a, uint64 b )
+{
+	MD5Context_t ctx;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+	HashValue( &ctx, a );
+	HashValue( &ctx, b );
+	return FinalizeLightCacheHash( &ctx );
+}
+
+// Displacement normals are smoothed across the displacements along their edges and corners
+static uint64 DispNeighborHash( const ddispinfo_t &disp )
+{
+	uint64 hash = 0;
+	for ( int i = 0; i < 4; i++ )
+	{
+		for ( int j = 0; j < 2; j++ )
+		{
+			const CDispSubNeighbor &sub = disp.m_EdgeNeighbors[i].m_SubNeighbors[j];
+			if ( sub.IsValid() )
+				hash += s_FaceLocalHash[g_dispinfo[sub.GetNeighborIndex()].m_iMapFace];
+		}
+
+		const CDispCornerNeighbors &corner = disp.m_CornerNeighbors[i];
+		for ( int j = 0; j < corner.m_nNeighbors; j++ )
+		{
+			hash += s_FaceLocalHash[g_dispinfo[corner.m_Neighbors[j]].m_iMapFace];
+		}
+	}
+	return hash;
+}
+
+static void ComputeFaceKeys()
+{
+	s_FaceLocalHash.SetSize( numfaces );
+	s_FaceKey.SetSize( numfaces );
+	s_FaceMins.SetSize( numfaces );
+	s_FaceMaxs.SetSize( numfaces );
+	s_FacePlane.SetSize( numfaces );
+	s_FaceFlat.SetSize( numfaces );
+
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		s_FaceLocalHash[i] = FaceLocalHash( i );
+	}
+
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		dface_t *f = &g_pFaces[i];
+		faceneighbor_t *fn = &faceneighbor[i];
+
+		s_FaceKey[i] = s_FaceLocalHash[i];
+		if ( f->dispinfo != -1 )
+		{
+			s_FaceKey[i] = CombineHash( s_FaceLocalHash[i], DispNeighborHash( g_dispinfo[f->dispinfo] ) );
+		}
+
+		Vector mins( FLT_MAX, FLT_MAX, FLT_MAX );
+		Vector maxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+		for ( int j = 0; j < f->numedges; j++ )
+		{
+			Vector v = dvertexes[EdgeVertex( f, j )].point + face_offset[i];
+			VectorMin( mins, v, mins );
+			VectorMax( maxs, v, maxs );
+		}
+
+		bool bFlat = ( f->dispinfo == -1 );
+		if ( f->dispinfo != -1 )
+		{
+			CVRADDispColl *pDispTree;
+			StaticDispMgr()->GetDispSurf( i, &pDispTree );
+			if ( pDispTree )
+			{
+				Vector dispMins, dispMaxs;
+				pDispTree->GetBounds( dispMins, dispMaxs );
+				VectorMin( mins, dispMins, mins );
+				VectorMax( maxs, dispMaxs, maxs );
+			}
+		}
+		else if ( fn->normal )
+		{
+			for ( int j = 0; j < f->numedges && bFlat; j++ )
+			{
+				bFlat = DotProduct( fn->normal[j], fn->facenormal ) > 0.9999f;
+			}
+		}
+
+		s_FaceMins[i] = mins;
+		s_FaceMaxs[i] = maxs;
+		s_FacePlane[i].Init( fn->facenormal, f->numedges ? DotProduct( fn->facenormal, dvertexes[EdgeVertex( f, 0 )].point + face_offset[i] ) : 0 );
+		s_FaceFlat[i] = bFlat && f->numedges;
+	}
+}
+
+static void GetOccluders( CUtlVector<LightCacheOccluder_t> &occluders )
+{
+	GetBrushOccludersForLightCache( occluders );
+	StaticPropMgr()->GetOccludersForLightCache( occluders );
+
+	// Sky faces (of the world) and displacements go into g_RtEnv themselves
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		bool bSky = ( texinfo[g_pFaces[i].texinfo].flags & SURF_SKY ) &&
+			i >= dmodels[0].firstface && i < dmodels[0].firstface + dmodels[0].numfaces;
+		if ( g_pFaces[i].dispinfo == -1 && !bSky )
+			continue;
+
+		LightCacheOccluder_t &occluder = occluders[occluders.AddToTail()];
+		occluder.m_nHash = s_FaceLocalHash[i];
+		occluder.m_vecMins = s_FaceMins[i];
+		occluder.m_vecMaxs = s_FaceMaxs[i];
+	}
+}
+
+
+// The settings the final lighting of the world comes out of, besides the faces,
+// lights and occluders. The static props pick up the bounced light from the
+// lightmaps, so none of theirs holds when these change.
+static uint64 SceneSettingsHash()
+{
+	MD5Context_t ctx;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+	HashValue( &ctx, LightingSettingsHash() );
+	HashValue( &ctx, ambient );
+	HashValue( &ctx, maxlight );
+	HashValue( &ctx, lightscale );
+	HashValue( &ctx, coring );
+	HashValue( &ctx, dlight_threshold );
+	HashValue( &ctx, indirect_sun );
+	HashValue( &ctx, reflectivityScale );
+	HashValue( &ctx, maxchop );
+	HashValue( &ctx, minchop );
+	HashValue( &ctx, dispchop );
+	HashValue( &ctx, g_bHierarchical );
+	HashValue( &ctx, g_flHierarchicalError );
+	return FinalizeLightCacheHash( &ctx );
+}
+
+
+//-----------------------------------------------------------------------------
+// Invalidation
+//-----------------------------------------------------------------------------
+
+// Hashes that don't show up the same number of times in both runs
+class CHashBalance
+{
+public:
+	CHashBalance() : m_Count( DefLessFunc( uint64 ) ) {}
+
+	void Add( uint64 hash, int n )
+	{
+		int i = m_Count.Find( hash );
+		if ( i == m_Count.InvalidIndex() )
+			i = m_Count.Insert( hash, 0 );
+		m_Count[i] += n;
+	}
+
+	bool IsChanged( uint64 hash ) const
+	{
+		int i = m_Count.Find( hash );
+		return i != m_Count.InvalidIndex() && m_Count[i] != 0;
+	}
+
+	void Purge()
+	{
+		m_Count.Purge();
+	}
+
+private:
+	CUtlMap<uint64, int> m_Count;
+};
+
+// What changed since last run, kept after LoadLightCache for the static props
+static bool								s_bChangesKnown = false;	// false when there was no cache to compare with
+static CHashBalance						s_LightBalance;
+static CUtlMap<uint64, int>				s_LightByHash( DefLessFunc( uint64 ) );	// to directlight_t::index
+static CUtlVector<LightCacheOccluder_t>	s_ChangedBoxes;
+
+static void AddToMergedBoxes( const Vector &mins, const Vector &maxs, CUtlMap<uint64, int> &cells, CUtlVector<LightCacheOccluder_t> &boxes )
+{
+	Vector center = ( mins + maxs ) * 0.5f;
+	uint64 cell = 0;
+	for ( int i = 0; i < 3; i++ )
+	{
+		int c = (int)floor( center[i] / LIGHTCACHE_MERGE_CELL ) & 0xfffff;
+		cell = ( cell << 20 ) | (uint64)c;
+	}
+
+	int iCell = cells.Find( cell );
+	if ( iCell == cells.InvalidIndex() )
+	{
+		int iBox = boxes.AddToTail();
+		boxes[iBox].m_nHash = cell;
+		boxes[iBox].m_vecMins = mins;
+		boxes[iBox].m_vecMaxs = maxs;
+		cells.Insert( cell, iBox );
+		return;
+	}
+
+	LightCacheOccluder_t &box = boxes[cells[iCell]];
+	VectorMin( box.m_vecMins, mins, box.m_vecMins );
+	VectorMax( box.m_vecMaxs, maxs, box.m_vecMaxs );
+}
+
+// Can something in this box be between the light and anything in the target box?
+static bool BoxCanShadowBox( const directlight_t *dl, const Vector &faceMins, const Vector &faceMaxs, const Vector &mins, const Vector &maxs )
+{
+	Vector faceCenter = ( faceMins + faceMaxs ) * 0.5f;
+	float faceRadius = ( faceMaxs - faceMins ).Length() * 0.5f + 1.0f;
+	Vector boxCenter = ( mins + maxs ) * 0.5f;
+	float boxRadius = ( maxs - mins ).Length() * 0.5f;
+
+	switch ( dl->light.type )
+	{
+	case emit_skyambient:
+		return true;
+
+	case emit_skylight:
+		{
+			Vector v = boxCenter - faceCenter;
+			float t = -DotProduct( v, dl->light.normal );
+			if ( t < -( faceRadius + boxRadius ) )
+				return false;
+
+			// The sun rays get jittered by up to about g_SunAngularExtent of their length
+			float r = faceRadius + boxRadius + max( t, 0.0f ) * 2.0f * g_SunAngularExtent;
+			return v.LengthSqr() - t * t <= r * r;
+		}
+
+	default:
+		{
+			Vector hullMins, hullMaxs;
+			VectorMin( faceMins, dl->light.origin, hullMins );
+			VectorMax( faceMaxs, dl->light.origin, hullMaxs );
+			if ( !IsBoxIntersectingBox( hullMins, hullMaxs, mins, maxs ) )
+				return false;
+
+			Vector axis = faceCenter - dl->light.origin;
+			float dist = VectorNormalize( axis );
+			if ( dist <= faceRadius )
+				return true;
+
+			// Distance from the box's center to the side of the cone from the light around the face
+			float sinAngle = faceRadius / dist;
+			float cosAngle = sqrt( 1.0f - sinAngle * sinAngle );
+			Vector v = boxCenter - dl->light.origin;
+			float t = DotProduct( v, axis );
+			float perp = sqrt( max( v.LengthSqr() - t * t, 0.0f ) );
+			return perp * cosAngle - t * sinAngle <= boxRadius;
+		}
+	}
+}
+
+// Can something in this box be between the face and the light?
+static bool BoxCanShadowFace( const directlight_t *dl, int iFace, const Vector &mins, const Vector &maxs )
+{
+	// Shadow rays only leave a flat face on its front side
+	if ( s_FaceFlat[iFace] )
+	{
+		const VPlane &plane = s_FacePlane[iFace];
+		Vector farthest;
+		for ( int i = 0; i < 3; i++ )
+		{
+			farthest[i] = ( plane.m_Normal[i] > 0 ) ? maxs[i] : mins[i];
+		}
+		if ( plane.DistTo( farthest ) < -1.0f )
+			return false;
+	}
+
+	return BoxCanShadowBox( dl, s_FaceMins[iFace], s_FaceMaxs[iFace], mins, maxs );
+}
+
+// The faces in the light's PVS, like BuildFacesVisibleToLights. Displacements
+// aren't in the leaf face lists, so they're always in.
+static void GetFacesVisibleToLight( const directlight_t *dl, CUtlVector<int> &faceMark, int nMark, CUtlVector<int> &faces )
+{
+	faces.RemoveAll();
+	if ( !dvis->numclusters )
+	{
+		for ( int i = 0; i < numfaces; i++ )
+		{
+			faceMark[i] = nMark;
+			faces.AddToTail( i );
+		}
+		return;
+	}
+
+	for ( int iCluster = 0; iCluster < dvis->numclusters; iCluster++ )
+	{
+		if ( !PVSCheck( dl->pvs, iCluster ) )
+			continue;
+
+		for ( int i = 0; i < g_ClusterLeaves[iCluster].leafCount; i++ )
+		{
+			dleaf_t *pLeaf = &dleafs[g_ClusterLeaves[iCluster].leafs[i]];
+			for ( int j = 0; j < pLeaf->numleaffaces; j++ )
+			{
+				int iFace = dleaffaces[pLeaf->firstleafface + j];
+				if ( faceMark[iFace] != nMark )
+				{
+					faceMark[iFace] = nMark;
+					faces.AddToTail( iFace );
+				}
+			}
+		}
+	}
+
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		if ( g_pFaces[i].dispinfo != -1 && faceMark[i] != nMark )
+		{
+			faceMark[i] = nMark;
+			faces.AddToTail( i );
+		}
+	}
+}
+
+static void InvalidateFace( int iFace )
+{
+	s_FaceReuse[iFace] = -1;
+	s_FaceRecords[iFace].lights.RemoveAll();
+}
+
+
+//-----------------------------------------------------------------------------
+// Loading and saving
+//-----------------------------------------------------------------------------
+static void FreeCacheData()
+{
+	free( s_pCacheData );
+	s_pCacheData = NULL;
+	s_CachedFaces.Purge();
+}
+
+static void ResetLightCache()
+{
+	FreeCacheData();
+	s_FaceReuse.Purge();
+	s_WarmStart.Purge();
+	s_FaceRecords.Purge();
+	for ( int i = 0; i < MAX_TOOL_THREADS+1; i++ )
+	{
+		s_ThreadLightBits[i].Purge();
+	}
+}
+
+void LoadLightCache()
+{
+	double flStart = Plat_FloatTime();
+	ResetLightCache();
+	s_bChangesKnown = false;
+	s_LightBalance.Purge();
+	s_LightByHash.Purge();
+	s_ChangedBoxes.Purge();
+
+	ComputeFaceKeys();
+
+	s_LightHash.SetSize( numdlights );
+	memset( s_LightHash.Base(), 0, numdlights * sizeof( uint64 ) );
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		s_LightHash[dl->index] = LightHash( dl );
+	}
+
+	s_Occluders.RemoveAll();
+	GetOccluders( s_Occluders );
+
+	s_nSettingsHash = SceneSettingsHash();
+
+	s_FaceRecords.SetSize( numfaces );
+	s_FaceReuse.SetSize( numfaces );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		memset( s_FaceRecords[i].styles, 255, sizeof( s_FaceRecords[i].styles ) );
+		s_FaceRecords[i].numsamples = 0;
+		s_FaceRecords[i].normalcount = 0;
+		s_FaceReuse[i] = -1;
+	}
+
+	for ( int i = 0; i < MAX_TOOL_THREADS+1; i++ )
+	{
+		s_ThreadLightBits[i].SetSize( ( numdlights + 7 ) >> 3 );
+		memset( s_ThreadLightBits[i].Base(), 0, s_ThreadLightBits[i].Count() );
+	}
+
+	char szFileName[MAX_PATH];
+	GetLightCacheFileName( szFileName, sizeof( szFileName ) );
+	if ( !FileExists( szFileName ) )
+		return;
+
+	int nFileSize = LoadFile( szFileName, (void**)&s_pCacheData );
+	CUtlBuffer buf( s_pCacheData, nFileSize, CUtlBuffer::READ_ONLY );
+
+	LightCacheHeader_t header;
+	buf.Get( &header, sizeof( header ) );
+	if ( !buf.IsValid() || header.id != LIGHTCACHE_ID || header.version != LIGHTCACHE_VERSION ||
+		header.settings != LightingSettingsHash() || header.numlights < 0 || header.numoccluders < 0 ||
+		header.numfaces < 0 || header.numfaces > MAX_MAP_FACES )
+	{
+		Msg( "Ignoring out of date light cache %s\n", szFileName );
+		FreeCacheData();
+		return;
+	}
+
+	CUtlVector<uint64> oldLightHash;
+	oldLightHash.SetSize( header.numlights );
+	for ( int i = 0; i < header.numlights; i++ )
+	{
+		oldLightHash[i] = buf.GetInt64();
+	}
+
+	// Lights and occluders that aren't the same in both runs
+	CHashBalance &lightBalance = s_LightBalance;
+	for ( int i = 0; i < header.numlights; i++ )
+	{
+		if ( oldLightHash[i] )
+			lightBalance.Add( oldLightHash[i], -1 );
+	}
+	CUtlMap<uint64, int> &newLightByHash = s_LightByHash;
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		lightBalance.Add( s_LightHash[dl->index], 1 );
+		newLightByHash.InsertOrReplace( s_LightHash[dl->index], dl->index );
+	}
+
+	CUtlVector<LightCacheOccluder_t> oldOccluders;
+	oldOccluders.SetSize( header.numoccluders );
+	buf.Get( oldOccluders.Base(), header.numoccluders * sizeof( LightCacheOccluder_t ) );
+
+	CHashBalance occluderBalance;
+	for ( int i = 0; i < oldOccluders.Count(); i++ )
+	{
+		occluderBalance.Add( oldOccluders[i].m_nHash, -1 );
+	}
+	for ( int i = 0; i < s_Occluders.Count(); i++ )
+	{
+		occluderBalance.Add( s_Occluders[i].m_nHash, 1 );
+	}
+
+	CUtlMap<uint64, int> cells( DefLessFunc( uint64 ) );
+	CUtlVector<LightCacheOccluder_t> &changedBoxes = s_ChangedBoxes;
+	int nChangedOccluders = 0;
+	for ( int i = 0; i < oldOccluders.Count(); i++ )
+	{
+		if ( occluderBalance.IsChanged( oldOccluders[i].m_nHash ) )
+		{
+			AddToMergedBoxes( oldOccluders[i].m_vecMins, oldOccluders[i].m_vecMaxs, cells, changedBoxes );
+			nChangedOccluders++;
+		}
+	}
+	for ( int i = 0; i < s_Occluders.Count(); i++ )
+	{
+		if ( occluderBalance.IsChanged( s_Occluders[i].m_nHash ) )
+		{
+			AddToMergedBoxes( s_Occluders[i].m_vecMins, s_Occluders[i].m_vecMaxs, cells, changedBoxes );
+			nChangedOccluders++;
+		}
+	}
+
+	// The faces, matched up by key. A key that shows up twice can't be matched.
+	CUtlMap<uint64, int> newFaceByKey( DefLessFunc( uint64 ) );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		int iMap = newFaceByKey.Find( s_FaceKey[i] );
+		if ( iMap == newFaceByKey.InvalidIndex() )
+			newFaceByKey.Insert( s_FaceKey[i], i );
+		else
+			newFaceByKey[iMap] = -1;
+	}
+
+	s_CachedFaces.SetSize( header.numfaces );
+	for ( int i = 0; i < header.numfaces; i++ )
+	{
+		CachedFace_t &face = s_CachedFaces[i];
+		face.key = buf.GetInt64();
+		buf.Get( face.styles, sizeof( face.styles ) );
+		face.numsamples = buf.GetInt();
+		face.normalcount = buf.GetInt();
+		face.numlights = buf.GetInt();
+		if ( !buf.IsValid() || face.numsamples < 0 || face.normalcount < 0 || face.normalcount > NUM_BUMP_VECTS+1 || face.numlights < 0 )
+			break;
+
+		int nStyles = 0;
+		while ( nStyles < MAXLIGHTMAPS && face.styles[nStyles] != 255 )
+		{
+			nStyles++;
+		}
+
+		face.lightofs = buf.TellGet();
+		buf.SeekGet( CUtlBuffer::SEEK_CURRENT, face.numlights * sizeof( int ) );
+		face.dataofs = buf.TellGet();
+		buf.SeekGet( CUtlBuffer::SEEK_CURRENT, nStyles * face.normalcount * face.numsamples * sizeof( LightingValue_t ) );
+		face.numpatches = buf.GetInt();
+		face.patchofs = buf.TellGet();
+		if ( !buf.IsValid() || face.numpatches < 0 )
+			break;
+		buf.SeekGet( CUtlBuffer::SEEK_CURRENT, face.numpatches * sizeof( Vector ) );
+	}
+
+	if ( !buf.IsValid() || buf.TellGet() > nFileSize )
+	{
+		Warning( "Light cache %s is truncated\n", szFileName );
+		FreeCacheData();
+		return;
+	}
+
+	if ( numbounce > 0 )
+	{
+		s_WarmStart.SetSize( g_Patches.Count() );
+		for ( int i = 0; i < s_WarmStart.Count(); i++ )
+		{
+			s_WarmStart[i].Init();
+		}
+	}
+
+	int nMatched = 0;
+	int nWarmFaces = 0;
+	for ( int i = 0; i < header.numfaces; i++ )
+	{
+		const CachedFace_t &face = s_CachedFaces[i];
+		int iMap = newFaceByKey.Find( face.key );
+		if ( iMap == newFaceByKey.InvalidIndex() || newFaceByKey[iMap] < 0 )
+			continue;
+
+		int iFace = newFaceByKey[iMap];
+		nMatched++;
+
+		// Last run's bounced light, if the patches came out the same
+		if ( s_WarmStart.Count() && g_FacePatches[iFace] != g_FacePatches.InvalidIndex() )
+		{
+			int nPatches = 0;
+			for ( int iPatch = g_FacePatches[iFace]; iPatch != g_Patches.InvalidIndex(); iPatch = g_Patches[iPatch].ndxNext )
+			{
+				nPatches++;
+			}
+
+			if ( nPatches == face.numpatches )
+			{
+				const byte *pPatchData = s_pCacheData + face.patchofs;
+				for ( int iPatch = g_FacePatches[iFace]; iPatch != g_Patches.InvalidIndex(); iPatch = g_Patches[iPatch].ndxNext )
+				{
+					s_WarmStart[iPatch] = *(const Vector *)pPatchData;
+					pPatchData += sizeof( Vector );
+				}
+				nWarmFaces++;
+			}
+		}
+
+		// Every light that lit it has to still be there, exactly the same
+		FaceRecord_t &record = s_FaceRecords[iFace];
+		const byte *pLightData = s_pCacheData + face.lightofs;
+		bool bValid = true;
+		for ( int j = 0; j < face.numlights && bValid; j++ )
+		{
+			int iOldLight;
+			memcpy( &iOldLight, pLightData + j * sizeof( int ), sizeof( int ) );
+			if ( iOldLight < 0 || iOldLight >= header.numlights || lightBalance.IsChanged( oldLightHash[iOldLight] ) )
+			{
+				bValid = false;
+				break;
+			}
+			record.lights.AddToTail( newLightByHash[newLightByHash.Find( oldLightHash[iOldLight] )] );
+		}
+
+		if ( bValid )
+			s_FaceReuse[iFace] = i;
+		else
+			record.lights.RemoveAll();
+	}
+
+	// Last run didn't converge (or changed every patch), bounce from the direct light alone
+	if ( nWarmFaces == 0 )
+	{
+		s_WarmStart.Purge();
+	}
+
+	// Lights that are new (or changed) can reach faces that they couldn't before
+	CUtlVector<int> faceMark;
+	faceMark.SetSize( numfaces );
+	memset( faceMark.Base(), 0, numfaces * sizeof( int ) );
+	int nMark = 0;
+
+	CUtlVector<int> faces;
+	int nChangedLights = 0;
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		if ( !lightBalance.IsChanged( s_LightHash[dl->index] ) )
+			continue;
+
+		nChangedLights++;
+		GetFacesVisibleToLight( dl, faceMark, ++nMark, faces );
+		for ( int i = 0; i < faces.Count(); i++ )
+		{
+			InvalidateFace( faces[i] );
+		}
+	}
+
+	// Changed occluders, against every light that lit a face last time or can see it now
+	if ( changedBoxes.Count() )
+	{
+		CUtlVector< CUtlVector<int> > facesLitBy;
+		facesLitBy.SetSize( numdlights );
+		for ( int i = 0; i < numfaces; i++ )
+		{
+			if ( s_FaceReuse[i] < 0 )
+				continue;
+
+			const CUtlVector<int> &lights = s_FaceRecords[i].lights;
+			for ( int j = 0; j < lights.Count(); j++ )
+			{
+				facesLitBy[lights[j]].AddToTail( i );
+			}
+		}
+
+		for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+		{
+			GetFacesVisibleToLight( dl, faceMark, ++nMark, faces );
+			const CUtlVector<int> &litFaces = facesLitBy[dl->index];
+			for ( int i = 0; i < litFaces.Count(); i++ )
+			{
+				if ( faceMark[litFaces[i]] != nMark )
+					faces.AddToTail( litFaces[i] );
+			}
+
+			for ( int i = 0; i < faces.Count(); i++ )
+			{
+				int iFace = faces[i];
+				if ( s_FaceReuse[iFace] < 0 )
+					continue;
+
+				for ( int j = 0; j < changedBoxes.Count(); j++ )
+				{
+					if ( BoxCanShadowFace( dl, iFace, changedBoxes[j].m_vecMins, changedBoxes[j].m_vecMaxs ) )
+					{
+						InvalidateFace( iFace );
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	int nReused = 0;
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		if ( s_FaceReuse[i] >= 0 )
+			nReused++;
+	}
+
+	s_bChangesKnown = true;
+
+	Msg( "Light cache %s: %d of %d faces unchanged, %d changed lights, %d changed occluders\n",
+		szFileName, nMatched, numfaces, nChangedLights, nChangedOccluders );
+	Msg( "Reusing direct lighting for %d faces (%.2f seconds)\n", nReused, Plat_FloatTime() - flStart );
+}
+
+
+bool LightCache_RestoreFace( int facenum, int normalCount )
+{
+	int iCached = s_FaceReuse[facenum];
+	if ( iCached < 0 )
+		return false;
+
+	const CachedFace_t &face = s_CachedFaces[iCached];
+	facelight_t *fl = &facelight[facenum];
+	if ( face.numsamples != fl->numsamples || face.normalcount != normalCount )
+	{
+		InvalidateFace( facenum );
+		return false;
+	}
+
+	dface_t *f = &g_pFaces[facenum];
+	const byte *pData = s_pCacheData + face.dataofs;
+	for ( int k = 0; k < MAXLIGHTMAPS && face.styles[k] != 255; k++ )
+	{
+		f->styles[k] = face.styles[k];
+		for ( int n = 0; n < normalCount; n++ )
+		{
+			fl->light[k][n] = (LightingValue_t *)calloc( fl->numsamples, sizeof( LightingValue_t ) );
+			const LightingValue_t *pSrc = (const LightingValue_t *)pData;
+			for ( int s = 0; s < fl->numsamples; s++ )
+			{
+				fl->light[k][n][s] = pSrc[s];
+			}
+			pData += fl->numsamples * sizeof( LightingValue_t );
+		}
+	}
+	return true;
+}
+
+
+void LightCache_AddFaceLight( int iThread, int facenum, const directlight_t *dl )
+{
+	byte &bits = s_ThreadLightBits[iThread][dl->index >> 3];
+	byte mask = 1 << ( dl->index & 7 );
+	if ( bits & mask )
+		return;
+
+	bits |= mask;
+	s_FaceRecords[facenum].lights.AddToTail( dl->index );
+}
+
+
+void LightCache_RecordFace( int iThread, int facenum, int normalCount )
+{
+	FaceRecord_t &record = s_FaceRecords[facenum];
+	for ( int i = 0; i < record.lights.Count(); i++ )
+	{
+		s_ThreadLightBits[iThread][record.lights[i] >> 3] = 0;
+	}
+
+	dface_t *f = &g_pFaces[facenum];
+	facelight_t *fl = &facelight[facenum];
+	memcpy( record.styles, f->styles, sizeof( record.styles ) );
+	record.numsamples = fl->numsamples;
+	record.normalcount = normalCount;
+
+	int nStyles = 0;
+	while ( nStyles < MAXLIGHTMAPS && f->styles[nStyles] != 255 )
+	{
+		nStyles++;
+	}
+
+	record.data.SetSize( nStyles * normalCount * fl->numsamples );
+	LightingValue_t *pData = record.data.Base();
+	for ( int k = 0; k < nStyles; k++ )
+	{
+		for ( int n = 0; n < normalCount; n++ )
+		{
+			for ( int s = 0; s < fl->numsamples; s++ )
+			{
+				pData[s] = fl->light[k][n][s];
+			}
+			pData += fl->numsamples;
+		}
+	}
+}
+
+
+const Vector *LightCache_GetWarmStart()
+{
+	return s_WarmStart.Count() ? s_WarmStart.Base() : NULL;
+}
+
+
+uint64 LightCache_GetSettingsHash()
+{
+	return s_nSettingsHash;
+}
+
+
+//-----------------------------------------------------------------------------
+// Static props
+//-----------------------------------------------------------------------------
+class CClusterList : public ISpatialLeafEnumerator
+{
+public:
+	virtual bool EnumerateLeaf( int leaf, int context )
+	{
+		int cluster = dleafs[leaf].cluster;
+		if ( cluster >= 0 && m_Clusters.Find( cluster ) == m_Clusters.InvalidIndex() )
+			m_Clusters.AddToTail( cluster );
+		return true;
+	}
+
+	CUtlVector<int> m_Clusters;
+};
+
+// Can the light reach anything in the box? Like the faces, by the PVS of the light.
+static bool LightCanReachBox( const directlight_t *dl, const CUtlVector<int> &clusters )
+{
+	// Without vis (or in solid) every light can
+	if ( !dvis->numclusters || !clusters.Count() )
+		return true;
+
+	for ( int i = 0; i < clusters.Count(); i++ )
+	{
+		if ( PVSCheck( dl->pvs, clusters[i] ) )
+			return true;
+	}
+	return false;
+}
+
+void LightCache_GetLightsReachingBox( const Vector &mins, const Vector &maxs, CUtlVector<uint64> &lights )
+{
+	CClusterList clusterList;
+	ToolBSPTree()->EnumerateLeavesInBox( mins, maxs, &clusterList, 0 );
+
+	lights.RemoveAll();
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		if ( LightCanReachBox( dl, clusterList.m_Clusters ) )
+			lights.AddToTail( s_LightHash[dl->index] );
+	}
+}
+
+bool LightCache_BoxLightingChanged( const Vector &mins, const Vector &maxs, const uint64 *pOldLights, int nOldLights )
+{
+	if ( !s_bChangesKnown )
+		return true;
+
+	// A light that reached it last time changed or went away
+	CUtlMap<int, bool> oldLights( DefLessFunc( int ) );		// by directlight_t::index
+	for ( int i = 0; i < nOldLights; i++ )
+	{
+		int iMap = s_LightByHash.Find( pOldLights[i] );
+		if ( s_LightBalance.IsChanged( pOldLights[i] ) || iMap == s_LightByHash.InvalidIndex() )
+			return true;
+		oldLights.InsertOrReplace( s_LightByHash[iMap], true );
+	}
+
+	// A light that's new (or changed) can reach it now
+	CClusterList clusterList;
+	ToolBSPTree()->EnumerateLeavesInBox( mins, maxs, &clusterList, 0 );
+	CUtlVector<const directlight_t *> lights;
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		if ( LightCanReachBox( dl, clusterList.m_Clusters ) )
+		{
+			if ( s_LightBalance.IsChanged( s_LightHash[dl->index] ) )
+				return true;
+			lights.AddToTail( dl );
+		}
+		else if ( oldLights.Find( dl->index ) != oldLights.InvalidIndex() )
+		{
+			lights.AddToTail( dl );
+		}
+	}
+
+	// A changed occluder can be in the way of a light that reached it last time or can now
+	for ( int i = 0; i < lights.Count(); i++ )
+	{
+		for ( int j = 0; j < s_ChangedBoxes.Count(); j++ )
+		{
+			if ( BoxCanShadowBox( lights[i], mins, maxs, s_ChangedBoxes[j].m_vecMins, s_ChangedBoxes[j].m_vecMaxs ) )
+				return true;
+		}
+	}
+	return false;
+}
+
+
+void SaveLightCache()
+{
+	CUtlBuffer buf;
+
+	LightCacheHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.id = LIGHTCACHE_ID;
+	header.version = LIGHTCACHE_VERSION;
+	header.settings = LightingSettingsHash();
+	header.numlights = s_LightHash.Count();
+	header.numoccluders = s_Occluders.Count();
+	header.numfaces = numfaces;
+	buf.Put( &header, sizeof( header ) );
+
+	for ( int i = 0; i < s_LightHash.Count(); i++ )
+	{
+		buf.PutInt64( s_LightHash[i] );
+	}
+	buf.Put( s_Occluders.Base(), s_Occluders.Count() * sizeof( LightCacheOccluder_t ) );
+
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		const FaceRecord_t &record = s_FaceRecords[i];
+		buf.PutInt64( s_FaceKey[i] );
+		buf.Put( record.styles, sizeof( record.styles ) );
+		buf.PutInt( record.numsamples );
+		buf.PutInt( record.normalcount );
+		buf.PutInt( record.lights.Count() );
+		buf.Put( record.lights.Base(), record.lights.Count() * sizeof( int ) );
+		buf.Put( record.data.Base(), record.data.Count() * sizeof( LightingValue_t ) );
+
+		// Only the bounces are in totallight after BounceLight. If it stopped at
+		// numbounce they aren't the converged bounced light, the next run starts
+		// from the direct light alone.
+		int nPatches = 0;
+		if ( numbounce > 0 && g_bBounceConverged && g_FacePatches[i] != g_FacePatches.InvalidIndex() )
+		{
+			for ( int iPatch = g_FacePatches[i]; iPatch != g_Patches.InvalidIndex(); iPatch = g_Patches[iPatch].ndxNext )
+			{
+				nPatches++;
+			}
+		}
+		buf.PutInt( nPatches );
+		if ( nPatches )
+		{
+			for ( int iPatch = g_FacePatches[i]; iPatch != g_Patches.InvalidIndex(); iPatch = g_Patches[iPatch].ndxNext )
+			{
+				buf.Put( &g_Patches[iPatch].totallight.light[0], sizeof( Vector ) );
+			}
+		}
+	}
+
+	ResetLightCache();
+
+	char szFileName[MAX_PATH];
+	GetLightCacheFileName( szFileName, sizeof( szFileName ) );
+	FileHandle_t f = g_pFileSystem->Open( szFileName, "wb" );
+	if ( !f )
+	{
+		Warning( "Couldn't write light cache %s\n", szFileName );
+		return;
+	}
+	g_pFileSystem->Write( buf.Base(), buf.TellPut(), f );
+	g_pFileSystem->Close( f );
+}
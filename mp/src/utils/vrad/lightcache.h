@@ -0,0 +1,80 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: -incremental: keeps the direct lighting and bounced light of the
+//			last compile of a map so the next one only relights the faces an
+//			edit could have changed.
+//
+//=============================================================================//
+
+#ifndef LIGHTCACHE_H
+#define LIGHTCACHE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+#include "mathlib/vector.h"
+#include "checksum_md5.h"
+
+
+struct directlight_t;
+
+
+// Something shadow rays can hit: a brush, a sky or displacement face, or a
+// static prop. The hash covers everything about it that changes the
+// triangles it adds to g_RtEnv.
+struct LightCacheOccluder_t
+{
+	uint64	m_nHash;
+	Vector	m_vecMins;
+	Vector	m_vecMaxs;
+};
+
+extern bool g_bLightCache;
+
+// Call at the start of RadWorld_Go, after the lights and patches exist. Decides
+// which faces can keep their direct lighting from the last run.
+void LoadLightCache();
+
+// Call after BounceLight. Writes this run's lighting for the next one.
+void SaveLightCache();
+
+// BuildFacelights. RestoreFace fills in the facelight and styles of a face that
+// hasn't changed and returns true, otherwise the face has to be lit as usual.
+// RecordFace keeps the facelight (before BuildPatchLights adds the ambient term)
+// for SaveLightCache.
+bool LightCache_RestoreFace( int facenum, int normalCount );
+void LightCache_RecordFace( int iThread, int facenum, int normalCount );
+
+// Notes that a light added something to a face while it was being lit.
+void LightCache_AddFaceLight( int iThread, int facenum, const directlight_t *dl );
+
+// Last run's bounced light for each patch, or NULL (also when last run's
+// bouncing stopped at -bounce before it converged). BounceLight sends it out
+// with the direct light on the first bounce so it only has to iterate on the
+// difference.
+const Vector *LightCache_GetWarmStart();
+
+// The settings the final lighting of the world comes out of besides the faces,
+// lights and occluders, bouncing included. Valid after LoadLightCache, 0 when
+// there's no light cache. None of the static props keep their lighting when it
+// changes.
+uint64 LightCache_GetSettingsHash();
+
+// For the static props, by their bounds. The lights that can reach a box now
+// (their hashes), and whether its direct light can be different from last run:
+// a light that reached it then changed or went away, a new or changed light
+// reaches it now, or a changed occluder can be in the way of one that does.
+// Always changed when there was no light cache to compare with.
+void LightCache_GetLightsReachingBox( const Vector &mins, const Vector &maxs, CUtlVector<uint64> &lights );
+bool LightCache_BoxLightingChanged( const Vector &mins, const Vector &maxs, const uint64 *pOldLights, int nOldLights );
+
+// The brushes that cast shadows (trace.cpp). The props come from
+// IVradStaticPropMgr::GetOccludersForLightCache.
+void GetBrushOccludersForLightCache( CUtlVector<LightCacheOccluder_t> &occluders );
+
+// MD5Final, cut down to the 64 bit hashes the cache uses
+uint64 FinalizeLightCacheHash( MD5Context_t *pContext );
+
+
+#endif // LIGHTCACHE_H
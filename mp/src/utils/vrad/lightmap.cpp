@@ -8,6 +8,8 @@
 
 #include "vrad.h"
 #include "lightmap.h"
+#include "lightcache.h"
+#include "progressive.h"
 #include "radial.h"
 #include "mathlib/bumpvects.h"
 #include "tier1/utlvector.h"
@@ -58,7 +60,7 @@ private:
 };
 
 
-int g_iCurFace;
+CThreadShards<int> g_iCurFace;
 edgeshare_t	edgeshare[MAX_MAP_EDGES];
 
 Vector	face_centroids[MAX_MAP_EDGES];
@@ -516,27 +518,21 @@ void WriteCoordWinding (FILE *out, lightinfo_t *l, winding_t *w, Vector& color )
 }
 
 
+// -dump output of BuildFacelights, written out by FlushFacelightDumps
+static CThreadedDumpFile s_FaceDump;
+static CThreadedDumpFile s_SampleDump[4][4];
+
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 void DumpFaces( lightinfo_t *pLightInfo, int ndxFace )
 {
-	static	FileHandle_t out;
+	CUtlBuffer &out = s_FaceDump.GetBuffer( GetCurrentThreadIndex() );
 
 	// get face data
 	faceneighbor_t *fn = &faceneighbor[ndxFace];
 	Vector &centroid = face_centroids[ndxFace];
 
-	// disable threading (not a multi-threadable function!)
-	ThreadLock();
-	
-	if( !out )
-	{
-		// open the file
-		out = g_pFileSystem->Open( "face.txt", "w" );
-		if( !out )
-			return;
-	}
-	
 	//
 	// write out face
 	//
@@ -551,13 +547,13 @@ void DumpFaces( lightinfo_t *pLightInfo, int ndxFace )
 		Vector &n1 = fn->normal[ndxEdge];
 		Vector &n2 = fn->normal[(ndxEdge+1)%pLightInfo->face->numedges];
 		
-		CmdLib_FPrintf( out, "3\n");
+		out.Printf( "3\n");
 		
-		CmdLib_FPrintf(out, "%f %f %f %f %f %f\n", p1[0], p1[1], p1[2], n1[0] * 0.5 + 0.5, n1[1] * 0.5 + 0.5, n1[2] * 0.5 + 0.5 );
+		out.Printf( "%f %f %f %f %f %f\n", p1[0], p1[1], p1[2], n1[0] * 0.5 + 0.5, n1[1] * 0.5 + 0.5, n1[2] * 0.5 + 0.5 );
 		
-		CmdLib_FPrintf(out, "%f %f %f %f %f %f\n", p2[0], p2[1], p2[2], n2[0] * 0.5 + 0.5, n2[1] * 0.5 + 0.5, n2[2] * 0.5 + 0.5 );
+		out.Printf( "%f %f %f %f %f %f\n", p2[0], p2[1], p2[2], n2[0] * 0.5 + 0.5, n2[1] * 0.5 + 0.5, n2[2] * 0.5 + 0.5 );
 		
-		CmdLib_FPrintf(out, "%f %f %f %f %f %f\n", centroid[0] + pLightInfo->modelorg[0], 
+		out.Printf( "%f %f %f %f %f %f\n", centroid[0] + pLightInfo->modelorg[0], 
 					   centroid[1] + pLightInfo->modelorg[1], 
 					   centroid[2] + pLightInfo->modelorg[2], 
 					   fn->facenormal[0] * 0.5 + 0.5, 
@@ -565,9 +561,27 @@ void DumpFaces( lightinfo_t *pLightInfo, int ndxFace )
 					   fn->facenormal[2] * 0.5 + 0.5 );
 		
 	}
-	
-	// enable threading
-	ThreadUnlock();
+}
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+void FlushFacelightDumps()
+{
+	static FileHandle_t out;
+	if( !out )
+	{
+		out = g_pFileSystem->Open( "face.txt", "w" );
+	}
+	s_FaceDump.Flush( out );
+
+	for( int iStyle = 0; iStyle < 4; ++iStyle )
+	{
+		for ( int iBump = 0; iBump < 4; ++iBump )
+		{
+			s_SampleDump[iStyle][iBump].Flush( pFileSamples[iStyle][iBump] );
+		}
+	}
 }
 
 
@@ -823,6 +837,28 @@ void FreeSampleWindings( facelight_t *fl )
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Free everything CalcPoints and the lighting allocated for this facelight
+//-----------------------------------------------------------------------------
+void FreeFacelight( facelight_t *fl )
+{
+	FreeSampleWindings( fl );
+
+	for ( int i = 0; i < MAXLIGHTMAPS; i++ )
+	{
+		for ( int n = 0; n < NUM_BUMP_VECTS+1; n++ )
+		{
+			free( fl->light[i][n] );
+		}
+	}
+
+	free( fl->sample );
+	free( fl->luxel );
+	free( fl->luxelNormals );
+	memset( fl, 0, sizeof( *fl ) );
+}
+
+
 
 //-----------------------------------------------------------------------------
 // Purpose: build the sample data for each lightmapped primitive type
@@ -1673,7 +1709,7 @@ void ExportDirectLightsToWorldLights()
 void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum, 
 							 FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
 							 int nLFlags, int static_prop_index_to_ignore,
-							 float flEpsilon )
+							 float flEpsilon, CShadowRayQueue *pQueue )
 {
 	bool bIgnoreNormals = ( nLFlags & GATHERLFLAGS_IGNORE_NORMALS ) != 0;
 	bool force_fast = ( nLFlags & GATHERLFLAGS_FORCE_FAST ) != 0;
@@ -1720,7 +1756,10 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 		delta4.DuplicateVector ( delta );
 		delta4 += pos;
 
-		TestLine_DoesHitSky ( pos, delta4, &fractionVisible, true, static_prop_index_to_ignore );
+		if ( pQueue )
+			pQueue->TestLine_DoesHitSky( pos, delta4, &fractionVisible );
+		else
+			TestLine_DoesHitSky ( pos, delta4, &fractionVisible, true, static_prop_index_to_ignore );
 
 		totalFractionVisible = AddSIMD ( totalFractionVisible, fractionVisible );
 	}
@@ -1745,7 +1784,7 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum, 
 							   FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
 							   int nLFlags, int static_prop_index_to_ignore,
-							   float flEpsilon )
+							   float flEpsilon, CShadowRayQueue *pQueue )
 {
 
 	bool bIgnoreNormals = ( nLFlags & GATHERLFLAGS_IGNORE_NORMALS ) != 0;
@@ -1810,7 +1849,10 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 		surfacePos -= offset;
 
 		fltx4 fractionVisible = Four_Ones;
-		TestLine_DoesHitSky( surfacePos, delta, &fractionVisible, true, static_prop_index_to_ignore );
+		if ( pQueue )
+			pQueue->TestLine_DoesHitSky( surfacePos, delta, &fractionVisible );
+		else
+			TestLine_DoesHitSky( surfacePos, delta, &fractionVisible, true, static_prop_index_to_ignore );
 		for ( int i = 0; i < normalCount; i++ )
 		{
 			fltx4 addedAmount = MulSIMD( fractionVisible, dots[i] );
@@ -1836,7 +1878,7 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum, 
 								  FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
 								  int nLFlags, int static_prop_index_to_ignore,
-								  float flEpsilon )
+								  float flEpsilon, CShadowRayQueue *pQueue )
 {
 	bool bIgnoreNormals = ( nLFlags & GATHERLFLAGS_IGNORE_NORMALS ) != 0;
 
@@ -1978,7 +2020,10 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *
 
 	// Raytrace for visibility function
 	fltx4 fractionVisible = Four_Ones;
-	TestLine( pos, src, &fractionVisible, static_prop_index_to_ignore);
+	if ( pQueue )
+		pQueue->TestLine( pos, src, &fractionVisible );
+	else
+		TestLine( pos, src, &fractionVisible, static_prop_index_to_ignore);
 	dot = MulSIMD( fractionVisible, dot );
 	out.m_flDot[0] = dot;
 
@@ -2004,8 +2049,10 @@ void GatherSampleLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int
 					   FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
 					   int nLFlags,
 					   int static_prop_index_to_ignore,
-					   float flEpsilon )
+					   float flEpsilon,
+					   CShadowRayQueue *pQueue )
 {
+	Assert( !pQueue || static_prop_index_to_ignore == -1 );
 	for ( int b = 0; b < normalCount; b++ )
 		out.m_flDot[b] = Four_Zeros;
 	out.m_flFalloff = Four_Zeros;
@@ -2017,17 +2064,17 @@ void GatherSampleLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int
 	{
 	case emit_skylight:
 		GatherSampleSkyLightSSE( out, dl, facenum, pos, pNormals, normalCount,
-		                         iThread, nLFlags, static_prop_index_to_ignore, flEpsilon );
+		                         iThread, nLFlags, static_prop_index_to_ignore, flEpsilon, pQueue );
 		break;
 	case emit_skyambient:
 		GatherSampleAmbientSkySSE( out, dl, facenum, pos, pNormals, normalCount,
-		                           iThread, nLFlags, static_prop_index_to_ignore, flEpsilon );
+		                           iThread, nLFlags, static_prop_index_to_ignore, flEpsilon, pQueue );
 		break;
 	case emit_point:
 	case emit_surface:
 	case emit_spotlight:
 		GatherSampleStandardLightSSE( out, dl, facenum, pos, pNormals, normalCount,
-		                              iThread, nLFlags, static_prop_index_to_ignore, flEpsilon );
+		                              iThread, nLFlags, static_prop_index_to_ignore, flEpsilon, pQueue );
 		break;
 	default:
 		Error ("Bad dl->light.type");
@@ -2343,10 +2390,8 @@ int GetVisCache( int lastoffset, int cluster, byte *pvs )
 
 void BuildPatchLights( int facenum );
 
-void DumpSamples( int ndxFace, facelight_t *pFaceLight )
+void DumpSamples( int iThread, int ndxFace, facelight_t *pFaceLight )
 {
-	ThreadLock();
-
 	dface_t *pFace = &g_pFaces[ndxFace];
 	if( pFace )
 	{
@@ -2363,10 +2408,11 @@ void DumpSamples( int ndxFace, facelight_t *pFaceLight )
 						for( int iSample = 0; iSample < pFaceLight->numsamples; ++iSample )
 						{
 							sample_t *pSample = &pFaceLight->sample[iSample];
-							WriteWinding( pFileSamples[iStyle][iBump], pSample->w, pFaceLight->light[iStyle][iBump][iSample].m_vecLighting );
+							CUtlBuffer &out = s_SampleDump[iStyle][iBump].GetBuffer( iThread );
+							WriteWinding( out, pSample->w, pFaceLight->light[iStyle][iBump][iSample].m_vecLighting );
 							if( bDumpNormals )
 							{
-								WriteNormal( pFileSamples[iStyle][iBump], pSample->pos, pSample->normal, 15.0f, pSample->normal * 255.0f );
+								WriteNormal( out, pSample->pos, pSample->normal, 15.0f, pSample->normal * 255.0f );
 							}
 						}
 					}
@@ -2374,8 +2420,6 @@ void DumpSamples( int ndxFace, facelight_t *pFaceLight )
 			}
 		}
 	}
-
-	ThreadUnlock();
 }
 
 
@@ -2485,6 +2529,86 @@ static void ComputeIlluminationPointAndNormalsSSE( lightinfo_t const& l, FourVec
 		pInfo->m_Clusters[i] = ClusterFromPoint( pos.Vec( i ) );
 }
 
+//-----------------------------------------------------------------------------
+// Is the light's cluster visible from the samples? Returns false if it can't
+// be seen from any of them, otherwise dotMask gets 1 for each sample that can.
+//-----------------------------------------------------------------------------
+static inline bool ComputeLightPVSMask( directlight_t *dl, SSE_SampleInfo_t const& info, int numSamples, fltx4 &dotMask )
+{
+	dotMask = Four_Zeros;
+	bool bVisible = false;
+	for( int s = 0; s < numSamples; s++ )
+	{
+		if( PVSCheck( dl->pvs, info.m_Clusters[s] ) )
+		{
+			dotMask = SetComponentSIMD( dotMask, s, 1.0f );
+			bVisible = true;
+		}
+	}
+	return bVisible;
+}
+
+//-----------------------------------------------------------------------------
+// Adds one light's contribution to up to 4 samples
+//-----------------------------------------------------------------------------
+static void AddSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, int numSamples,
+									directlight_t *dl, SSE_sampleLightOutput_t const& out, fltx4 dotMask )
+{
+	// Apply the PVS check filter and compute falloff x dot
+	fltx4 fxdot[NUM_BUMP_VECTS + 1];
+	bool skipLight = true;
+	for ( int b = 0; b < info.m_NormalCount; b++ )
+	{
+		fxdot[b] = MulSIMD( out.m_flDot[b], dotMask );
+		fxdot[b] = MulSIMD( fxdot[b], out.m_flFalloff );
+		if ( !IsAllZeros( fxdot[b] ) )
+		{
+			skipLight = false;
+		}
+	}
+	if ( skipLight )
+		return;
+
+	// Figure out the lightstyle for this particular sample
+	int lightStyleIndex = FindOrAllocateLightstyleSamples( info.m_pFace, info.m_pFaceLight, 
+		dl->light.style, info.m_NormalCount );
+	if (lightStyleIndex < 0)
+	{
+		if (info.m_WarnFace != info.m_FaceNum)
+		{
+			Warning ("\nWARNING: Too many light styles on a face at (%f, %f, %f)\n",
+				info.m_Points.x.m128_f32[0], info.m_Points.y.m128_f32[0], info.m_Points.z.m128_f32[0] );
+			info.m_WarnFace = info.m_FaceNum;
+		}
+		return;
+	}
+
+	// pLightmaps is an array of the lightmaps for each normal direction,
+	// here's where the result of the sample gathering goes
+	LightingValue_t** pLightmaps = info.m_pFaceLight->light[lightStyleIndex];
+
+	if ( g_bLightCache )
+		LightCache_AddFaceLight( info.m_iThread, info.m_FaceNum, dl );
+
+	// Incremental lighting only cares about lightstyle zero
+	if( g_pIncremental && (dl->light.style == 0) )
+	{
+		for ( int i = 0; i < numSamples; i++ )
+		{
+			g_pIncremental->AddLightToFace( dl->m_IncrementalID, info.m_FaceNum, sampleIdx + i, 
+				info.m_LightmapSize, SubFloat( fxdot[0], i ), info.m_iThread );
+		}
+	}
+
+	for( int n = 0; n < info.m_NormalCount; ++n )
+	{
+		for ( int i = 0; i < numSamples; i++ )
+		{
+			pLightmaps[n][sampleIdx + i].AddLight( SubFloat( fxdot[n], i ), dl->light.intensity, SubFloat( out.m_flSunAmount, i ) );
+		}
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Iterates over all lights and computes lighting at up to 4 sample points
 //-----------------------------------------------------------------------------
@@ -2496,72 +2620,64 @@ static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, i
 	for (directlight_t *dl = activelights; dl != NULL; dl = dl->next)
 	{	    
 		// is this lights cluster visible?
-		fltx4 dotMask = Four_Zeros;
-		bool skipLight = true;
-		for( int s = 0; s < numSamples; s++ )
-		{
-			if( PVSCheck( dl->pvs, info.m_Clusters[s] ) )
-			{
-				dotMask = SetComponentSIMD( dotMask, s, 1.0f );
-				skipLight = false;
-			}
-		}
-		if ( skipLight )
+		fltx4 dotMask;
+		if ( !ComputeLightPVSMask( dl, info, numSamples, dotMask ) )
 			continue;
 
 		GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
-		
-		// Apply the PVS check filter and compute falloff x dot
-		fltx4 fxdot[NUM_BUMP_VECTS + 1];
-		skipLight = true;
-		for ( int b = 0; b < info.m_NormalCount; b++ )
-		{
-			fxdot[b] = MulSIMD( out.m_flDot[b], dotMask );
-			fxdot[b] = MulSIMD( fxdot[b], out.m_flFalloff );
-			if ( !IsAllZeros( fxdot[b] ) )
-			{
-				skipLight = false;
-			}
-		}
-		if ( skipLight )
-			continue;
-
-		// Figure out the lightstyle for this particular sample
-		int lightStyleIndex = FindOrAllocateLightstyleSamples( info.m_pFace, info.m_pFaceLight, 
-			dl->light.style, info.m_NormalCount );
-		if (lightStyleIndex < 0)
-		{
-			if (info.m_WarnFace != info.m_FaceNum)
-			{
-				Warning ("\nWARNING: Too many light styles on a face at (%f, %f, %f)\n",
-					info.m_Points.x.m128_f32[0], info.m_Points.y.m128_f32[0], info.m_Points.z.m128_f32[0] );
-				info.m_WarnFace = info.m_FaceNum;
-			}
-			continue;
-		}
+		AddSampleLightAt4Points( info, sampleIdx, numSamples, dl, out, dotMask );
+	}
+}
 
-		// pLightmaps is an array of the lightmaps for each normal direction,
-		// here's where the result of the sample gathering goes
-		LightingValue_t** pLightmaps = info.m_pFaceLight->light[lightStyleIndex];
+//-----------------------------------------------------------------------------
+// Same as GatherSampleLightAt4Points, for several groups of up to 4 sample
+// points on the same face. The shadow rays of all the groups and lights are
+// traced together through the thread's CShadowRayQueue.
+//-----------------------------------------------------------------------------
+static void GatherSampleLightAtPointGroups( SSE_SampleInfo_t *pInfo, int numGroups, int sampleIdx, int const *pNumSamples )
+{
+	CShadowRayQueue *pQueue = GetShadowRayQueue( pInfo[0].m_iThread );
+	SSE_sampleLightOutput_t out;
+	fltx4 dotMask;
 
-		// Incremental lighting only cares about lightstyle zero
-		if( g_pIncremental && (dl->light.style == 0) )
+	// Queue up the shadow rays
+	pQueue->BeginRecord();
+	for ( int g = 0; g < numGroups; g++ )
+	{
+		SSE_SampleInfo_t &info = pInfo[g];
+		for (directlight_t *dl = activelights; dl != NULL; dl = dl->next)
 		{
-			for ( int i = 0; i < numSamples; i++ )
+			if ( ComputeLightPVSMask( dl, info, pNumSamples[g], dotMask ) )
 			{
-				g_pIncremental->AddLightToFace( dl->m_IncrementalID, info.m_FaceNum, sampleIdx + i, 
-					info.m_LightmapSize, SubFloat( fxdot[0], i ), info.m_iThread );
+				GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount,
+					info.m_iThread, 0, -1, 0.0f, pQueue );
 			}
 		}
+	}
 
-		for( int n = 0; n < info.m_NormalCount; ++n )
+	pQueue->Trace();
+
+	// Now do it all again with the real visibility
+	pQueue->BeginReplay();
+	int nWarnFace = pInfo[0].m_WarnFace;
+	for ( int g = 0; g < numGroups; g++ )
+	{
+		SSE_SampleInfo_t &info = pInfo[g];
+		info.m_WarnFace = nWarnFace;
+		for (directlight_t *dl = activelights; dl != NULL; dl = dl->next)
 		{
-			for ( int i = 0; i < numSamples; i++ )
+			if ( ComputeLightPVSMask( dl, info, pNumSamples[g], dotMask ) )
 			{
-				pLightmaps[n][sampleIdx + i].AddLight( SubFloat( fxdot[n], i ), dl->light.intensity, SubFloat( out.m_flSunAmount, i ) );
+				GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount,
+					info.m_iThread, 0, -1, 0.0f, pQueue );
+				AddSampleLightAt4Points( info, sampleIdx + 4 * g, pNumSamples[g], dl, out, dotMask );
 			}
 		}
+		nWarnFace = info.m_WarnFace;
 	}
+	pQueue->EndReplay();
+
+	pInfo[0].m_WarnFace = nWarnFace;
 }
 
 
@@ -2619,12 +2735,17 @@ static void ResampleLightAt4Points( SSE_SampleInfo_t& info, int lightStyleIndex,
 
 		// Apply the PVS check filter and compute falloff x dot
 		fltx4 fxdot[NUM_BUMP_VECTS + 1];
+		bool bAdded = false;
 		for ( int b = 0; b < info.m_NormalCount; b++ )
 		{
 			fxdot[b] = MulSIMD( out.m_flFalloff, out.m_flDot[b] );
 			fxdot[b] = MulSIMD( fxdot[b], dotMask );
+			bAdded = bAdded || !IsAllZeros( fxdot[b] );
 		}
 
+		if ( bAdded && g_bLightCache )
+			LightCache_AddFaceLight( info.m_iThread, info.m_FaceNum, dl );
+
 		// Compute the contributions to each of the bumped lightmaps
 		// The first sample is for non-bumped lighting.
 		// The other sample are for bumpmapping.
@@ -2976,6 +3097,35 @@ static void BuildSupersampleFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info,
 	}
 }
 
+//-----------------------------------------------------------------------------
+// -progressive: how far off the preview lighting of a face is likely to be.
+// Uses the same gradients the supersampling looks for, weighted by the area
+// of the samples they're on.
+//-----------------------------------------------------------------------------
+static float EstimateFaceLightError( SSE_SampleInfo_t& info )
+{
+	int processedSampleSize = info.m_LightmapSize * sizeof(bool);
+	bool* pHasProcessedSample = (bool*)stackalloc( processedSampleSize );
+	memset( pHasProcessedSample, 0, processedSampleSize );
+
+	float* pGradient = (float*)stackalloc( info.m_pFaceLight->numsamples * sizeof(float) );
+	float* pSampleIntensity = (float*)stackalloc( info.m_NormalCount * info.m_LightmapSize * sizeof(float) );
+
+	float flError = 0.0f;
+	for ( int i = 0; i < MAXLIGHTMAPS && info.m_pFace->styles[i] != 255; ++i )
+	{
+		ComputeSampleIntensities( info, info.m_pFaceLight->light[i], pSampleIntensity );
+		ComputeLightmapGradients( info, pHasProcessedSample, pSampleIntensity, pGradient );
+
+		for ( int j = 0; j < info.m_pFaceLight->numsamples; ++j )
+		{
+			flError += pGradient[j] * info.m_pFaceLight->sample[j].area;
+		}
+	}
+
+	return flError;
+}
+
 void InitLightinfo( lightinfo_t *pl, int facenum )
 {
 	dface_t		*f;
@@ -3056,6 +3206,44 @@ static void InitSampleInfo( lightinfo_t const& l, int iThread, SSE_SampleInfo_t&
 	}
 }
 
+// Number of groups of 4 spots whose shadow rays are queued up and traced together
+#define SHADOW_RAY_QUEUE_GROUPS		8
+
+//-----------------------------------------------------------------------------
+// Loads the positions + normals of sample group grp into info.
+// Returns the number of samples in the group.
+//-----------------------------------------------------------------------------
+static int SetupSampleGroupSSE( lightinfo_t const& l, SSE_SampleInfo_t& info, int grp )
+{
+	int nSample = 4 * grp;
+
+	sample_t *sample = info.m_pFaceLight->sample + nSample;
+	int numSamples = min ( 4, info.m_pFaceLight->numsamples - nSample );
+
+	FourVectors positions;
+	FourVectors normals;
+	Vector v[4], n[4];
+
+	for ( int i = 0; i < 4; i++ )
+	{
+		v[i] = ( i < numSamples ) ? sample[i].pos : sample[numSamples - 1].pos;
+		n[i] = ( i < numSamples ) ? sample[i].normal : sample[numSamples - 1].normal;
+	}
+	positions.LoadAndSwizzle( v[0], v[1], v[2], v[3] );
+	normals.LoadAndSwizzle( n[0], n[1], n[2], n[3] );
+
+	ComputeIlluminationPointAndNormalsSSE( l, positions, normals, &info, numSamples );
+
+	// Fixup sample normals in case of smooth faces
+	if ( !l.isflat )
+	{
+		for ( int i = 0; i < numSamples; i++ )
+			sample[i].normal = info.m_PointNormals[0].Vec( i );
+	}
+
+	return numSamples;
+}
+
 void BuildFacelights (int iThread, int facenum)
 {
 	int	i, j;
@@ -3066,21 +3254,18 @@ void BuildFacelights (int iThread, int facenum)
 	SSE_SampleInfo_t sampleInfo;
 	directlight_t *dl;
 	Vector spot;
-	Vector v[4], n[4];
 
 	if( g_bInterrupt )
 		return;
 
-	// FIXME: Is there a better way to do this? Like, in RunThreadsOn, for instance?
-	// Don't pay this cost unless we have to; this is super perf-critical code.
-	if (g_pIncremental)
+	++g_iCurFace[iThread];
+
+	// -progressive refinement levels only relight some of the faces, the rest
+	// keep what they have and just send it out to the patches again
+	if ( g_bProgressive && !Progressive_RelightFace( facenum ) )
 	{
-		// Both threads will be accessing this so it needs to be protected or else thread A
-		// will load it in and thread B will increment it but its increment will be
-		// overwritten by thread A when thread A writes it back.
-		ThreadLock();
-		++g_iCurFace;
-		ThreadUnlock();
+		RebuildPatchLights( facenum );
+		return;
 	}
 
 	// some surfaces don't need lightmaps
@@ -3102,6 +3287,9 @@ void BuildFacelights (int iThread, int facenum)
 
 	fl = &facelight[facenum];
 
+	// In case -progressive lit this face at an earlier level
+	FreeFacelight( fl );
+
 	InitLightinfo( &l, facenum );
 	CalcPoints( &l, fl, facenum );
 	InitSampleInfo( l, iThread, sampleInfo );
@@ -3109,40 +3297,53 @@ void BuildFacelights (int iThread, int facenum)
 	// Allocate sample positions/normals to SSE
 	int numGroups = ( fl->numsamples & 0x3) ? ( fl->numsamples / 4 ) + 1 : ( fl->numsamples / 4 );
 
-	// always allocate style 0 lightmap
-	f->styles[0] = 0;
-	AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
+	// Faces -incremental says haven't changed get their direct lighting from the last run
+	bool bRestored = g_bLightCache && LightCache_RestoreFace( facenum, sampleInfo.m_NormalCount );
 
-	// sample the lights at each sample location
-	for ( int grp = 0; grp < numGroups; ++grp )
+	if ( !bRestored )
 	{
-		int nSample = 4 * grp;
-
-		sample_t *sample = sampleInfo.m_pFaceLight->sample + nSample;
-		int numSamples = min ( 4, sampleInfo.m_pFaceLight->numsamples - nSample );
-
-		FourVectors positions;
-		FourVectors normals;
+		// always allocate style 0 lightmap
+		f->styles[0] = 0;
+		AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
+	}
 
-		for ( int i = 0; i < 4; i++ )
+	// sample the lights at each sample location
+	if ( bRestored )
+	{
+		// Nothing to sample, they were all restored above
+	}
+	else if ( g_bShadowRayQueue )
+	{
+		// Light a batch of groups of spots at a time so their shadow rays can be sorted and traced together
+		SSE_SampleInfo_t batchInfo[SHADOW_RAY_QUEUE_GROUPS];
+		int batchNumSamples[SHADOW_RAY_QUEUE_GROUPS];
+		for ( int b = 0; b < SHADOW_RAY_QUEUE_GROUPS; ++b )
 		{
-			v[i] = ( i < numSamples ) ? sample[i].pos : sample[numSamples - 1].pos;
-			n[i] = ( i < numSamples ) ? sample[i].normal : sample[numSamples - 1].normal;
+			batchInfo[b] = sampleInfo;
 		}
-		positions.LoadAndSwizzle( v[0], v[1], v[2], v[3] );
-		normals.LoadAndSwizzle( n[0], n[1], n[2], n[3] );
-
-		ComputeIlluminationPointAndNormalsSSE( l, positions, normals, &sampleInfo, numSamples );
 
-		// Fixup sample normals in case of smooth faces
-		if ( !l.isflat )
+		for ( int grp = 0; grp < numGroups; grp += SHADOW_RAY_QUEUE_GROUPS )
 		{
-			for ( int i = 0; i < numSamples; i++ )
-				sample[i].normal = sampleInfo.m_PointNormals[0].Vec( i );
+			int numBatchGroups = min( SHADOW_RAY_QUEUE_GROUPS, numGroups - grp );
+			for ( int b = 0; b < numBatchGroups; ++b )
+			{
+				batchNumSamples[b] = SetupSampleGroupSSE( l, batchInfo[b], grp + b );
+			}
+
+			batchInfo[0].m_WarnFace = sampleInfo.m_WarnFace;
+			GatherSampleLightAtPointGroups( batchInfo, numBatchGroups, 4 * grp, batchNumSamples );
+			sampleInfo.m_WarnFace = batchInfo[0].m_WarnFace;
 		}
+	}
+	else
+	{
+		for ( int grp = 0; grp < numGroups; ++grp )
+		{
+			int numSamples = SetupSampleGroupSSE( l, sampleInfo, grp );
 
-		// Iterate over all the lights and add their contribution to this group of spots
-		GatherSampleLightAt4Points( sampleInfo, nSample, numSamples );
+			// Iterate over all the lights and add their contribution to this group of spots
+			GatherSampleLightAt4Points( sampleInfo, 4 * grp, numSamples );
+		}
 	}
 	
 	// Tell the incremental light manager that we're done with this face.
@@ -3161,7 +3362,7 @@ void BuildFacelights (int iThread, int facenum)
 	}
 
 	// get rid of the -extra functionality on displacement surfaces
-	if (do_extra && !sampleInfo.m_IsDispFace)
+	if (do_extra && !sampleInfo.m_IsDispFace && !bRestored)
 	{
 		// For each lightstyle, perform a supersampling pass
 		for ( i = 0; i < MAXLIGHTMAPS; ++i )
@@ -3174,6 +3375,15 @@ void BuildFacelights (int iThread, int facenum)
 		}
 	}
 
+	// The -progressive preview decides which faces to refine first from this
+	if ( g_bProgressive && Progressive_IsPreview() )
+	{
+		Progressive_SetFaceError( facenum, EstimateFaceLightError( sampleInfo ) );
+	}
+
+	if ( g_bLightCache )
+		LightCache_RecordFace( iThread, facenum, sampleInfo.m_NormalCount );
+
 	if (!g_bUseMPI) 
 	{
 		//
@@ -3184,7 +3394,7 @@ void BuildFacelights (int iThread, int facenum)
 
 	if( g_bDumpPatches )
 	{
-		DumpSamples( facenum, fl );
+		DumpSamples( iThread, facenum, fl );
 	}
 	else
 	{
@@ -3193,7 +3403,12 @@ void BuildFacelights (int iThread, int facenum)
 
 }
 
-void BuildPatchLights( int facenum )
+//-----------------------------------------------------------------------------
+// Averages the direct light on a face's samples into its patches. vecAmbient is
+// taken back off the samples first, for faces BuildPatchLights already added the
+// ambient term to. Returns false if the face has no style 0 light or no patches.
+//-----------------------------------------------------------------------------
+static bool AddFacelightToPatches( int facenum, const Vector &vecAmbient )
 {
 	int i, k;
 
@@ -3209,16 +3424,18 @@ void BuildPatchLights( int facenum )
 	}
 
 	if (k >= MAXLIGHTMAPS)
-		return;
+		return false;
 
 	for (i = 0; i < fl->numsamples; i++)
 	{
-		AddSampleToPatch( &fl->sample[i], fl->light[k][0][i], facenum);
+		LightingValue_t light = fl->light[k][0][i];
+		light.m_vecLighting -= vecAmbient;
+		AddSampleToPatch( &fl->sample[i], light, facenum);
 	}
 
 	// check for a valid face
 	if( g_FacePatches.Element( facenum ) == g_FacePatches.InvalidIndex() )
-		return;
+		return false;
 
 	// push up sampled light to parents (children always exist first in the list)
 	CPatch *pNextPatch;
@@ -3296,6 +3513,19 @@ void BuildPatchLights( int facenum )
 		}
 	}
 
+	return true;
+}
+
+void BuildPatchLights( int facenum )
+{
+	int i;
+
+	dface_t	*f = &g_pFaces[facenum];
+	facelight_t	*fl = &facelight[facenum];
+
+	if ( !AddFacelightToPatches( facenum, vec3_origin ) )
+		return;
+
 	bool needsBumpmap = false;
 	if( texinfo[f->texinfo].flags & SURF_BUMPLIGHT )
 	{
@@ -3354,6 +3584,11 @@ void BuildPatchLights( int facenum )
 #endif
 }
 
+void RebuildPatchLights( int facenum )
+{
+	AddFacelightToPatches( facenum, ambient );
+}
+
 
 /*
   =============
@@ -31,8 +31,9 @@ extern edgeshare_t	edgeshare[MAX_MAP_EDGES];
 //==============================================
 
 // This is incremented each time BuildFaceLights and FinalLightFace
-// are called. It's used for a status bar in WorldCraft.
-extern int g_iCurFace;
+// are called. It's used for a status bar in WorldCraft. Each thread
+// counts its own faces; Sum() them for the total.
+extern CThreadShards<int> g_iCurFace;
 
 extern int vertexref[MAX_MAP_VERTS];
 extern int *vertexface[MAX_MAP_VERTS];
@@ -50,6 +51,9 @@ struct faceneighbor_t
 
 extern faceneighbor_t faceneighbor[MAX_MAP_FACES];
 
+// Index into dvertexes of the face's vertex at the start of edge (wraps around)
+int EdgeVertex( dface_t *f, int edge );
+
 //==============================================
 
 
@@ -137,5 +141,12 @@ void FreeDLights();
 
 void ExportDirectLightsToWorldLights();
 
+// Frees the samples, luxels and lighting of a face so BuildFacelights can light it again
+void FreeFacelight( facelight_t *fl );
+
+// -progressive: sends a face's direct light out to its patches again after they
+// were reset, without lighting the face again
+void RebuildPatchLights( int facenum );
+
 
 #endif // LIGHTMAP_H
@@ -0,0 +1,387 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: -progressive: writes a quick preview of the lighting first, then
+//			refines it a few faces at a time and updates the bsp as it goes.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmap.h"
+#include "progressive.h"
+#include "leaf_ambient_lighting.h"
+#include "telemetry.h"
+
+
+/*
+
+The preview is a whole lighting pass with everything turned down:
+
+  - no -extra supersampling
+  - a quarter of the sky ambient directions
+  - light bounces between coarse patches. The patch tree is built to the usual
+	-maxchop, but the preview cuts it off at patches four times that size, so
+	there are far fewer patches to make transfers between. Displacements keep
+	their own subdivision.
+
+That's enough to write a bsp with lighting someone can walk around in. While
+the preview lights each face it notes how big the gradients in its lightmap
+are (the same ones -extra looks for), times the area they cover. Faces that
+are big and have a lot going on are the ones most likely to look different
+when they're done properly.
+
+The refinement levels then relight the faces in that order, at full quality:
+the worst eighth of them first, then up to half, then the rest. The faces a
+level doesn't relight keep the samples they have and only send their light
+out to the patches again. Each level bounces the light again (starting from
+the bounced light of the level before, so it doesn't take many bounces) and
+writes the faces and lighting lumps back over the ones in the bsp. The last
+level is the same as a normal compile and goes on to the rest of vrad as
+usual.
+
+Starting from the level before is only right when its bouncing converged.
+With a -bounce that stops it first, the bounced light is a partial sum and
+each level would add its bounces on top, so then every level bounces from the
+direct light alone.
+
+*/
+
+// The preview uses this fraction of the usual sky ambient directions
+#define PROGRESSIVE_PREVIEW_SKY_SCALE	0.25f
+
+// The preview bounces light between patches this many times -maxchop
+#define PROGRESSIVE_PREVIEW_CHOP_SCALE	4.0f
+
+// Each refinement level relights faces, worst first, up to this fraction of
+// all of them
+static const float s_flLevelFaceFraction[] = { 0.125f, 0.5f, 1.0f };
+
+
+bool g_bProgressive = false;
+
+extern int total_transfer;
+extern int max_transfer;
+
+// 0 is the preview, -1 when RadWorld_GoProgressive isn't running
+static int s_nLevel = -1;
+static bool s_bNeedsTransfers;
+
+static CUtlVector<float>	s_FaceError;
+static CUtlVector<int>		s_FaceOrder;		// worst faces first
+static CUtlVector<byte>		s_RelightFace;
+static CUtlVector<Vector>	s_WarmStart;
+
+// The patches the preview cut the children off, and what the children were
+struct CutPatch_t
+{
+	int		m_nPatch;
+	int		m_nChild1;
+	int		m_nChild2;
+};
+
+static CUtlVector<CutPatch_t>	s_CutPatches;
+static CUtlVector<byte>			s_HiddenPatch;
+
+
+//-----------------------------------------------------------------------------
+// The coarse patch tree for the preview
+//-----------------------------------------------------------------------------
+static void HidePatches_r( int iPatch )
+{
+	if ( iPatch == g_Patches.InvalidIndex() )
+		return;
+
+	s_HiddenPatch[iPatch] = true;
+	HidePatches_r( g_Patches[iPatch].child1 );
+	HidePatches_r( g_Patches[iPatch].child2 );
+}
+
+static void CutPatchTree_r( int iPatch, float flCoarseChop )
+{
+	CPatch *pPatch = &g_Patches[iPatch];
+	if ( pPatch->child1 == g_Patches.InvalidIndex() )
+		return;
+
+	// Measured the way SubdividePatch does
+	Vector vecSize;
+	VectorSubtract( pPatch->maxs, pPatch->mins, vecSize );
+	VectorScale( vecSize, pPatch->luxscale, vecSize );
+	if ( vecSize.x >= flCoarseChop || vecSize.y >= flCoarseChop || vecSize.z >= flCoarseChop )
+	{
+		CutPatchTree_r( pPatch->child1, flCoarseChop );
+		CutPatchTree_r( pPatch->child2, flCoarseChop );
+		return;
+	}
+
+	CutPatch_t cut = { iPatch, pPatch->child1, pPatch->child2 };
+	s_CutPatches.AddToTail( cut );
+
+	HidePatches_r( pPatch->child1 );
+	HidePatches_r( pPatch->child2 );
+	pPatch->child1 = g_Patches.InvalidIndex();
+	pPatch->child2 = g_Patches.InvalidIndex();
+}
+
+static void CutPatchTree()
+{
+	// SubdividePatches doesn't subdivide anything without bounces
+	if ( numbounce == 0 )
+		return;
+
+	s_HiddenPatch.SetCount( g_Patches.Count() );
+	memset( s_HiddenPatch.Base(), 0, s_HiddenPatch.Count() );
+
+	float flCoarseChop = maxchop * PROGRESSIVE_PREVIEW_CHOP_SCALE;
+	for ( int i = 0; i < g_Patches.Count(); i++ )
+	{
+		// Displacements subdivide in CVRADDispColl, by their own rules
+		if ( g_Patches[i].parent == g_Patches.InvalidIndex() && !ValidDispFace( &g_pFaces[g_Patches[i].faceNumber] ) )
+		{
+			CutPatchTree_r( i, flCoarseChop );
+		}
+	}
+
+	// The faces and clusters only get the patches left over
+	LinkPatches( s_HiddenPatch.Base() );
+
+	int nPreviewPatches = 0;
+	for ( int i = 0; i < s_HiddenPatch.Count(); i++ )
+	{
+		if ( !s_HiddenPatch[i] )
+			++nPreviewPatches;
+	}
+	qprintf( "%d of %d patches in the preview\n", nPreviewPatches, g_Patches.Count() );
+}
+
+static void RestorePatchTree()
+{
+	if ( numbounce == 0 )
+		return;
+
+	for ( int i = 0; i < s_CutPatches.Count(); i++ )
+	{
+		CPatch *pPatch = &g_Patches[s_CutPatches[i].m_nPatch];
+		pPatch->child1 = s_CutPatches[i].m_nChild1;
+		pPatch->child2 = s_CutPatches[i].m_nChild2;
+	}
+
+	s_CutPatches.Purge();
+	s_HiddenPatch.Purge();
+
+	LinkPatches( NULL );
+
+	// The patches the preview made transfers for aren't all leaves any more,
+	// and CTransferMatrix::Build goes by numtransfers
+	for ( int i = 0; i < g_Patches.Count(); i++ )
+	{
+		g_Patches[i].numtransfers = 0;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Keeps the bounced light for the next level to start from
+//-----------------------------------------------------------------------------
+static void SetWarmStart_r( int iPatch, const Vector &vecLight )
+{
+	if ( iPatch == g_Patches.InvalidIndex() )
+		return;
+
+	s_WarmStart[iPatch] = vecLight;
+	SetWarmStart_r( g_Patches[iPatch].child1, vecLight );
+	SetWarmStart_r( g_Patches[iPatch].child2, vecLight );
+}
+
+static void SaveWarmStart()
+{
+	if ( numbounce == 0 || !g_bBounceConverged )
+	{
+		s_WarmStart.Purge();
+		return;
+	}
+
+	// After BounceLight only the bounced light is in totallight
+	s_WarmStart.SetCount( g_Patches.Count() );
+	for ( int i = 0; i < g_Patches.Count(); i++ )
+	{
+		s_WarmStart[i] = g_Patches[i].totallight.light[0];
+	}
+
+	// The patches the preview left out start with what the patch they're in got
+	for ( int i = 0; i < s_CutPatches.Count(); i++ )
+	{
+		const Vector &vecLight = g_Patches[s_CutPatches[i].m_nPatch].totallight.light[0];
+		SetWarmStart_r( s_CutPatches[i].m_nChild1, vecLight );
+		SetWarmStart_r( s_CutPatches[i].m_nChild2, vecLight );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Clears out what BuildPatchLights and BounceLight put in the patches
+//-----------------------------------------------------------------------------
+static void ResetPatchLighting()
+{
+	for ( int i = 0; i < g_Patches.Count(); i++ )
+	{
+		CPatch *pPatch = &g_Patches[i];
+		pPatch->samplearea = 0.0f;
+		pPatch->samplelight.Init();
+		pPatch->directlight.Init();
+		for ( int j = 0; j < NUM_BUMP_VECTS+1; j++ )
+		{
+			pPatch->totallight.light[j].Init();
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Puts this level's lighting into the bsp the preview wrote. The lightmaps
+// don't move around unless a face picked up or lost a light style, and if one
+// did the whole file gets written again.
+//-----------------------------------------------------------------------------
+static void WriteLightingLumps()
+{
+	int nLightingLump = g_bHDR ? LUMP_LIGHTING_HDR : LUMP_LIGHTING;
+	int nFacesLump = g_bHDR ? LUMP_FACES_HDR : LUMP_FACES;
+
+	if ( RewriteBSPFileLump( source, nLightingLump, pdlightdata->Base(), pdlightdata->Count() ) &&
+		 RewriteBSPFileLump( source, nFacesLump, g_pFaces, numfaces * sizeof( dface_t ) ) )
+	{
+		Msg( "Updated the lighting in %s\n", source );
+		return;
+	}
+
+	Msg( "Writing %s\n", source );
+	WriteBSPFile( source );
+}
+
+
+static int CompareFaceError( const int *pFace1, const int *pFace2 )
+{
+	float flError1 = s_FaceError[*pFace1];
+	float flError2 = s_FaceError[*pFace2];
+	if ( flError1 != flError2 )
+		return ( flError1 > flError2 ) ? -1 : 1;
+
+	return *pFace1 - *pFace2;
+}
+
+
+void RadWorld_GoProgressive()
+{
+	s_FaceError.SetCount( numfaces );
+	memset( s_FaceError.Base(), 0, numfaces * sizeof( float ) );
+	s_RelightFace.SetCount( numfaces );
+	memset( s_RelightFace.Base(), 1, numfaces );
+
+	//
+	// The preview
+	//
+	Telemetry_BeginPhase( "Progressive preview" );
+
+	qboolean bDoExtra = do_extra;
+	float flSkySampleScale = g_flSkySampleScale;
+	do_extra = false;
+	g_flSkySampleScale *= PROGRESSIVE_PREVIEW_SKY_SCALE;
+
+	CutPatchTree();
+
+	Msg( "Lighting the preview\n" );
+	s_nLevel = 0;
+	s_bNeedsTransfers = true;
+	RadWorld_Go();
+
+	// Static props and detail props keep whatever lighting they had
+	ComputePerLeafAmbientLighting();
+
+	Msg( "Writing preview %s\n", source );
+	WriteBSPFile( source );
+
+	SaveWarmStart();
+	RestorePatchTree();
+
+	do_extra = bDoExtra;
+	g_flSkySampleScale = flSkySampleScale;
+
+	Telemetry_EndPhase( numfaces );
+
+	//
+	// The refinement levels
+	//
+	s_FaceOrder.SetCount( numfaces );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		s_FaceOrder[i] = i;
+	}
+	s_FaceOrder.Sort( CompareFaceError );
+
+	// The patches are all there now, so the transfers have to be made again
+	s_bNeedsTransfers = true;
+	total_transfer = 0;
+	max_transfer = 0;
+
+	int nLevels = ARRAYSIZE( s_flLevelFaceFraction );
+	int nFirstFace = 0;
+	for ( s_nLevel = 1; s_nLevel <= nLevels; s_nLevel++ )
+	{
+		int nLastFace = ( s_nLevel == nLevels ) ? numfaces : (int)( s_flLevelFaceFraction[s_nLevel-1] * numfaces );
+
+		Telemetry_BeginPhase( "Progressive refinement" );
+
+		memset( s_RelightFace.Base(), 0, numfaces );
+		for ( int i = nFirstFace; i < nLastFace; i++ )
+		{
+			s_RelightFace[s_FaceOrder[i]] = true;
+		}
+
+		Msg( "Refinement level %d of %d: relighting %d faces\n", s_nLevel, nLevels, nLastFace - nFirstFace );
+
+		ResetPatchLighting();
+		RadWorld_Go();
+		s_bNeedsTransfers = false;
+
+		// The last level gets written with everything else by VRAD_Finish
+		if ( s_nLevel < nLevels )
+		{
+			SaveWarmStart();
+			WriteLightingLumps();
+		}
+
+		Telemetry_EndPhase( nLastFace - nFirstFace );
+
+		nFirstFace = nLastFace;
+	}
+
+	s_nLevel = -1;
+	s_FaceError.Purge();
+	s_FaceOrder.Purge();
+	s_RelightFace.Purge();
+	s_WarmStart.Purge();
+}
+
+
+bool Progressive_IsPreview()
+{
+	return s_nLevel == 0;
+}
+
+bool Progressive_RelightFace( int facenum )
+{
+	return s_nLevel < 0 || s_RelightFace[facenum] != 0;
+}
+
+void Progressive_SetFaceError( int facenum, float flError )
+{
+	s_FaceError[facenum] = flError;
+}
+
+bool Progressive_NeedsTransfers()
+{
+	return s_bNeedsTransfers;
+}
+
+const Vector *Progressive_GetWarmStart()
+{
+	return ( s_nLevel > 0 && s_WarmStart.Count() ) ? s_WarmStart.Base() : NULL;
+}
@@ -0,0 +1,41 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: -progressive: writes a quick preview of the lighting first, then
+//			refines it a few faces at a time and updates the bsp as it goes.
+//
+//=============================================================================//
+
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "mathlib/vector.h"
+
+
+extern bool g_bProgressive;
+
+// Runs in place of RadWorld_Go. Writes the bsp after the preview and updates
+// the lighting in it after each refinement level but the last one, which the
+// usual VRAD_ComputeOtherLighting and VRAD_Finish finish off.
+void RadWorld_GoProgressive();
+
+// True while the preview is being lit
+bool Progressive_IsPreview();
+
+// BuildFacelights. Faces the current level doesn't relight keep their samples
+// from the level before. The preview notes how much each face could still
+// change for the refinement levels to go by.
+bool Progressive_RelightFace( int facenum );
+void Progressive_SetFaceError( int facenum, float flError );
+
+// RadWorld_Go only builds the transfers when the patches they go between changed
+bool Progressive_NeedsTransfers();
+
+// The bounced light of each patch from the level before, for BounceLight to
+// start from, or NULL when that level's bouncing didn't converge
+const Vector *Progressive_GetWarmStart();
+
+
+#endif // PROGRESSIVE_H
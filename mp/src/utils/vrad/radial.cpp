@@ -595,15 +595,18 @@ void DumpLuxels( facelight_t *pFaceLight, Vector *luxelColors, int ndxFace )
 
 
 static FileHandle_t pFileLuxels[4] = { NULL, NULL, NULL, NULL };
+static CThreadedDumpFile s_LuxelDump[4];
 
-void DumpDispLuxels( int iFace, Vector &color, int iLuxel, int nBump )
+void DumpDispLuxels( int iThread, int iFace, Vector &color, int iLuxel, int nBump )
 {
-	// Lock the thread and dump the luxel data.
-	ThreadLock();
-
 	// Get the face and facelight data.
 	facelight_t *pFaceLight = &facelight[iFace];
 
+	WriteWinding( s_LuxelDump[nBump].GetBuffer( iThread ), pFaceLight->sample[iLuxel].w, color );
+}
+
+void FlushDispLuxels()
+{
 	// Open the luxel files.
 	char szFileName[512];
 	for ( int iBump = 0; iBump < ( NUM_BUMP_VECTS+1 ); ++iBump )
@@ -613,11 +616,9 @@ void DumpDispLuxels( int iFace, Vector &color, int iLuxel, int nBump )
 			sprintf( szFileName, "luxels_bump%d.txt", iBump );
 			pFileLuxels[iBump] = g_pFileSystem->Open( szFileName, "w" );
 		}
-	}
-
-	WriteWinding( pFileLuxels[nBump], pFaceLight->sample[iLuxel].w, color );
 
-	ThreadUnlock();
+		s_LuxelDump[iBump].Flush( pFileLuxels[iBump] );
+	}
 }
 
 void CloseDispLuxels()
@@ -790,7 +791,7 @@ void FinalLightFace( int iThread, int facenum )
 			{
 				for( bumpSample = 0; bumpSample < bumpSampleCount; ++bumpSample )
 				{
-					DumpDispLuxels( facenum, lb[bumpSample].m_vecLighting, j, bumpSample );
+					DumpDispLuxels( iThread, facenum, lb[bumpSample].m_vecLighting, j, bumpSample );
 				}
 			}
 
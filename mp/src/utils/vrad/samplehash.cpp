@@ -9,148 +9,307 @@
 #include "vrad.h"
 #include "lightmap.h"
 
-#define SAMPLEHASH_NUM_BUCKETS			65536
-#define SAMPLEHASH_GROW_SIZE			0
-#define SAMPLEHASH_INIT_SIZE			0
-
 int samplesAdded = 0;
 int patchSamplesAdded = 0;
 static unsigned short g_PatchIterationKey = 0;
 
+CSampleGrid g_SampleGrid;
+CSampleGrid g_PatchSampleGrid;
+
+
+//=============================================================================
+//=============================================================================
+//
+// CSampleGrid
+//
+//=============================================================================
+//=============================================================================
+
+// Rounds down for negative coordinates too, unlike >> and / on some compilers
+static inline int BlockFromVoxel( int v )
+{
+	return ( v >= 0 ) ? ( v >> SAMPLEGRID_BLOCK_SHIFT ) : -( ( -v - 1 ) >> SAMPLEGRID_BLOCK_SHIFT ) - 1;
+}
+
+static inline int VoxelInBlock( int v )
+{
+	return v & ( SAMPLEGRID_BLOCK_SIZE - 1 );
+}
+
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
-bool SampleData_CompareFunc( SampleData_t const &src1, SampleData_t const &src2 )
+CSampleGrid::CSampleGrid()
 {
-	return ( ( src1.x == src2.x ) &&
-		     ( src1.y == src2.y ) &&
-			 ( src1.z == src2.z ) );
+	Purge();
 }
 
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
-unsigned int SampleData_KeyFunc( SampleData_t const &src )
+void CSampleGrid::Purge()
 {
-	return ( src.x + src.y + src.z );
+	m_Pending.Purge();
+	m_BlockIndex.Purge();
+	m_VoxelStart.Purge();
+	m_Entries.Purge();
+	m_nBlocks = 0;
+	for ( int axis = 0; axis < 3; axis++ )
+	{
+		m_BlockMins[axis] = 0;
+		m_BlockCounts[axis] = 0;
+	}
 }
 
 
-CUtlHash<SampleData_t> g_SampleHashTable( SAMPLEHASH_NUM_BUCKETS, 
-										  SAMPLEHASH_GROW_SIZE, 
-										  SAMPLEHASH_INIT_SIZE, 
-										  SampleData_CompareFunc, SampleData_KeyFunc );
-
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+void CSampleGrid::AddEntry( const int voxel[3], unsigned int value )
+{
+	PendingEntry_t &entry = m_Pending[m_Pending.AddToTail()];
+	entry.m_Voxel[0] = voxel[0];
+	entry.m_Voxel[1] = voxel[1];
+	entry.m_Voxel[2] = voxel[2];
+	entry.m_nValue = value;
+}
 
 
 //-----------------------------------------------------------------------------
+// A counting sort of the pending entries by block and voxel. It's stable, so
+// each voxel keeps its entries in the order they were added.
 //-----------------------------------------------------------------------------
-UtlHashHandle_t SampleData_Find( sample_t *pSample )
+void CSampleGrid::Finish()
 {
-	SampleData_t sampleData;	
-	sampleData.x = ( int )( pSample->pos.x / SAMPLEHASH_VOXEL_SIZE ) * 100;
-	sampleData.y = ( int )( pSample->pos.y / SAMPLEHASH_VOXEL_SIZE ) * 10;
-	sampleData.z = ( int )( pSample->pos.z / SAMPLEHASH_VOXEL_SIZE );
+	int nPending = m_Pending.Count();
+	if ( !nPending )
+	{
+		Purge();
+		return;
+	}
+
+	int blockMins[3] = { INT_MAX, INT_MAX, INT_MAX };
+	int blockMaxs[3] = { INT_MIN, INT_MIN, INT_MIN };
+	for ( int i = 0; i < nPending; i++ )
+	{
+		for ( int axis = 0; axis < 3; axis++ )
+		{
+			int block = BlockFromVoxel( m_Pending[i].m_Voxel[axis] );
+			blockMins[axis] = min( blockMins[axis], block );
+			blockMaxs[axis] = max( blockMaxs[axis], block );
+		}
+	}
+
+	for ( int axis = 0; axis < 3; axis++ )
+	{
+		m_BlockMins[axis] = blockMins[axis];
+		m_BlockCounts[axis] = blockMaxs[axis] - blockMins[axis] + 1;
+	}
+
+	// Mark the blocks with anything in them, then number them in grid order
+	m_BlockIndex.SetCount( m_BlockCounts[0] * m_BlockCounts[1] * m_BlockCounts[2] );
+	memset( m_BlockIndex.Base(), 0xff, m_BlockIndex.Count() * sizeof( int ) );
+
+	CUtlVector<int> blockOfEntry;
+	blockOfEntry.SetCount( nPending );
+	for ( int i = 0; i < nPending; i++ )
+	{
+		const int *voxel = m_Pending[i].m_Voxel;
+		int iBlock = ( ( BlockFromVoxel( voxel[2] ) - m_BlockMins[2] ) * m_BlockCounts[1] +
+			( BlockFromVoxel( voxel[1] ) - m_BlockMins[1] ) ) * m_BlockCounts[0] +
+			( BlockFromVoxel( voxel[0] ) - m_BlockMins[0] );
+		blockOfEntry[i] = iBlock;
+		m_BlockIndex[iBlock] = 0;
+	}
+
+	m_nBlocks = 0;
+	for ( int i = 0; i < m_BlockIndex.Count(); i++ )
+	{
+		if ( m_BlockIndex[i] == 0 )
+			m_BlockIndex[i] = m_nBlocks++;
+	}
+
+	// Count the entries in each voxel, one slot past where its run starts...
+	m_VoxelStart.SetCount( m_nBlocks * SAMPLEGRID_BLOCK_VOXELS + 1 );
+	memset( m_VoxelStart.Base(), 0, m_VoxelStart.Count() * sizeof( int ) );
+
+	CUtlVector<int> slotOfEntry;
+	slotOfEntry.SetCount( nPending );
+	for ( int i = 0; i < nPending; i++ )
+	{
+		const int *voxel = m_Pending[i].m_Voxel;
+		int iSlot = m_BlockIndex[blockOfEntry[i]] * SAMPLEGRID_BLOCK_VOXELS +
+			( VoxelInBlock( voxel[2] ) * SAMPLEGRID_BLOCK_SIZE + VoxelInBlock( voxel[1] ) ) * SAMPLEGRID_BLOCK_SIZE +
+			VoxelInBlock( voxel[0] );
+		slotOfEntry[i] = iSlot;
+		m_VoxelStart[iSlot + 1]++;
+	}
+
+	// ...so summing them up gives the starts
+	for ( int i = 1; i < m_VoxelStart.Count(); i++ )
+	{
+		m_VoxelStart[i] += m_VoxelStart[i - 1];
+	}
+
+	CUtlVector<int> fill;
+	fill.CopyArray( m_VoxelStart.Base(), m_VoxelStart.Count() - 1 );
+
+	m_Entries.SetCount( nPending );
+	for ( int i = 0; i < nPending; i++ )
+	{
+		m_Entries[fill[slotOfEntry[i]]++] = m_Pending[i].m_nValue;
+	}
 
-	return g_SampleHashTable.Find( sampleData );
+	m_Pending.Purge();
 }
 
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
-UtlHashHandle_t SampleData_InsertIntoHashTable( sample_t *pSample, SampleHandle_t sampleHandle )
+void CSampleGrid::VoxelFromPoint( const Vector &vPoint, int voxel[3] )
 {
-	SampleData_t sampleData;
-	sampleData.x = ( int )( pSample->pos.x / SAMPLEHASH_VOXEL_SIZE ) * 100;
-	sampleData.y = ( int )( pSample->pos.y / SAMPLEHASH_VOXEL_SIZE ) * 10;
-	sampleData.z = ( int )( pSample->pos.z / SAMPLEHASH_VOXEL_SIZE );
+	for ( int axis = 0; axis < 3; axis++ )
+	{
+		voxel[axis] = ( int )floor( vPoint[axis] * ( 1.0f / SAMPLEHASH_VOXEL_SIZE ) );
+	}
+}
 
-	UtlHashHandle_t handle = g_SampleHashTable.AllocEntryFromKey( sampleData );
 
-	SampleData_t *pSampleData = &g_SampleHashTable.Element( handle );
-	pSampleData->x = sampleData.x;
-	pSampleData->y = sampleData.y;
-	pSampleData->z = sampleData.z;
-	pSampleData->m_Samples.AddToTail( sampleHandle );
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+void CSampleGrid::VoxelsInBox( const Vector &vMins, const Vector &vMaxs, int voxelMins[3], int voxelMaxs[3] )
+{
+	VoxelFromPoint( vMins, voxelMins );
+	VoxelFromPoint( vMaxs, voxelMaxs );
+}
 
-	samplesAdded++;
 
-	return handle;
+//-----------------------------------------------------------------------------
+// Conservative, so rounding never drops a voxel the sphere really touches.
+//-----------------------------------------------------------------------------
+bool CSampleGrid::VoxelTouchesSphere( int x, int y, int z, const Vector &vCenter, float flRadius )
+{
+	int voxel[3] = { x, y, z };
+	float flDist2 = 0.0f;
+	for ( int axis = 0; axis < 3; axis++ )
+	{
+		float flMin = voxel[axis] * SAMPLEHASH_VOXEL_SIZE;
+		float flMax = flMin + SAMPLEHASH_VOXEL_SIZE;
+		float flDelta = 0.0f;
+		if ( vCenter[axis] < flMin )
+			flDelta = flMin - vCenter[axis];
+		else if ( vCenter[axis] > flMax )
+			flDelta = vCenter[axis] - flMax;
+		flDist2 += flDelta * flDelta;
+	}
+
+	float flRadiusPad = flRadius + 1.0f;
+	return flDist2 <= flRadiusPad * flRadiusPad;
 }
 
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
-UtlHashHandle_t SampleData_AddSample( sample_t *pSample, SampleHandle_t sampleHandle )
+int CSampleGrid::VoxelSlot( int x, int y, int z ) const
 {
+	int bx = BlockFromVoxel( x ) - m_BlockMins[0];
+	int by = BlockFromVoxel( y ) - m_BlockMins[1];
+	int bz = BlockFromVoxel( z ) - m_BlockMins[2];
+	if ( bx < 0 || bx >= m_BlockCounts[0] || by < 0 || by >= m_BlockCounts[1] || bz < 0 || bz >= m_BlockCounts[2] )
+		return -1;
+
+	int iBlock = m_BlockIndex[( bz * m_BlockCounts[1] + by ) * m_BlockCounts[0] + bx];
+	if ( iBlock < 0 )
+		return -1;
+
+	return iBlock * SAMPLEGRID_BLOCK_VOXELS +
+		( VoxelInBlock( z ) * SAMPLEGRID_BLOCK_SIZE + VoxelInBlock( y ) ) * SAMPLEGRID_BLOCK_SIZE + VoxelInBlock( x );
+}
 
-	// find the key -- if it doesn't exist add new sample data to the
-	// hash table
-	UtlHashHandle_t handle = SampleData_Find( pSample );
-	if( handle == g_SampleHashTable.InvalidHandle() )
-	{
-		handle = SampleData_InsertIntoHashTable( pSample, sampleHandle );
-	}
-	else
-	{
-		SampleData_t *pSampleData = &g_SampleHashTable.Element( handle );
-		pSampleData->m_Samples.AddToTail( sampleHandle );
 
-		samplesAdded++;
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+int CSampleGrid::GetVoxel( int x, int y, int z, const unsigned int **ppEntries ) const
+{
+	int iSlot = VoxelSlot( x, y, z );
+	if ( iSlot < 0 )
+	{
+		*ppEntries = NULL;
+		return 0;
 	}
 
-	return handle;
+	*ppEntries = m_Entries.Base() + m_VoxelStart[iSlot];
+	return m_VoxelStart[iSlot + 1] - m_VoxelStart[iSlot];
 }
 
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
-void SampleData_Log( void )
+void CSampleGrid::Log( const char *pFileName ) const
 {
-	if( g_bLogHashData )
+	FILE *pDebugFp = fopen( pFileName, "w" );
+	if ( !pDebugFp )
+		return;
+
+	int nVoxelsUsed = 0;
+	int nMaxVoxelSize = 0;
+	for ( int i = 0; i < m_nBlocks * SAMPLEGRID_BLOCK_VOXELS; i++ )
 	{
-		g_SampleHashTable.Log( "samplehash.txt" );
+		int count = m_VoxelStart[i + 1] - m_VoxelStart[i];
+		if ( count )
+			nVoxelsUsed++;
+		nMaxVoxelSize = max( nMaxVoxelSize, count );
 	}
+
+	fprintf( pDebugFp, "\n%d Blocks of %d Voxels (%d x %d x %d grid)\n", m_nBlocks, SAMPLEGRID_BLOCK_VOXELS,
+		m_BlockCounts[0], m_BlockCounts[1], m_BlockCounts[2] );
+	fprintf( pDebugFp, "Entries: %d\n", m_Entries.Count() );
+	fprintf( pDebugFp, "Voxels Used: %d\n", nVoxelsUsed );
+	fprintf( pDebugFp, "Max Voxel Size: %d\n", nMaxVoxelSize );
+	fprintf( pDebugFp, "Memory: %d bytes\n", (int)( m_BlockIndex.Count() * sizeof( int ) +
+		m_VoxelStart.Count() * sizeof( int ) + m_Entries.Count() * sizeof( unsigned int ) ) );
+
+	fclose( pDebugFp );
 }
 
 
 //=============================================================================
 //=============================================================================
 //
-// PatchSample Functions
+// Sample Functions
 //
 //=============================================================================
 //=============================================================================
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
-bool PatchSampleData_CompareFunc( PatchSampleData_t const &src1, PatchSampleData_t const &src2 )
+void SampleData_AddSample( sample_t *pSample, SampleHandle_t sampleHandle )
 {
-	return ( ( src1.x == src2.x ) &&
-		     ( src1.y == src2.y ) &&
-			 ( src1.z == src2.z ) );
+	int voxel[3];
+	CSampleGrid::VoxelFromPoint( pSample->pos, voxel );
+	g_SampleGrid.AddEntry( voxel, sampleHandle );
+
+	samplesAdded++;
 }
 
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
-unsigned int PatchSampleData_KeyFunc( PatchSampleData_t const &src )
+void SampleData_Log( void )
 {
-	return ( src.x + src.y + src.z );
+	if( g_bLogHashData )
+	{
+		g_SampleGrid.Log( "samplehash.txt" );
+	}
 }
 
 
-CUtlHash<PatchSampleData_t>	g_PatchSampleHashTable( SAMPLEHASH_NUM_BUCKETS,
-												    SAMPLEHASH_GROW_SIZE,
-													SAMPLEHASH_INIT_SIZE,
-													PatchSampleData_CompareFunc, PatchSampleData_KeyFunc );
-
-void GetPatchSampleHashXYZ( const Vector &vOrigin, int &x, int &y, int &z )
-{
-	x = ( int )( vOrigin.x / SAMPLEHASH_VOXEL_SIZE );
-	y = ( int )( vOrigin.y / SAMPLEHASH_VOXEL_SIZE );
-	z = ( int )( vOrigin.z / SAMPLEHASH_VOXEL_SIZE );
-}
-
+//=============================================================================
+//=============================================================================
+//
+// PatchSample Functions
+//
+//=============================================================================
+//=============================================================================
 
 unsigned short IncrementPatchIterationKey()
 {
@@ -175,11 +334,10 @@ void PatchSampleData_AddSample( CPatch *pPatch, int ndxPatch )
 	int patchSampleMins[3], patchSampleMaxs[3];
 
 #if defined( SAMPLEHASH_USE_AREA_PATCHES )
-	GetPatchSampleHashXYZ( pPatch->mins, patchSampleMins[0], patchSampleMins[1], patchSampleMins[2] );
-	GetPatchSampleHashXYZ( pPatch->maxs, patchSampleMaxs[0], patchSampleMaxs[1], patchSampleMaxs[2] );
+	CSampleGrid::VoxelsInBox( pPatch->mins, pPatch->maxs, patchSampleMins, patchSampleMaxs );
 #else
 	// If not using area patches, just use the patch's origin to add it to the voxels.
-	GetPatchSampleHashXYZ( pPatch->origin, patchSampleMins[0], patchSampleMins[1], patchSampleMins[2] );
+	CSampleGrid::VoxelFromPoint( pPatch->origin, patchSampleMins );
 	memcpy( patchSampleMaxs, patchSampleMins, sizeof( patchSampleMaxs ) );
 #endif
 	
@@ -196,35 +354,10 @@ void PatchSampleData_AddSample( CPatch *pPatch, int ndxPatch )
 		{
 			for ( iterateCoords[2]=patchSampleMins[2]; iterateCoords[2] <= patchSampleMaxs[2]; iterateCoords[2]++ )
 			{
-				// find the key -- if it doesn't exist add new sample data to the
-				// hash table
-				PatchSampleData_t iteratePatch;
-				iteratePatch.x = iterateCoords[0] * 100;
-				iteratePatch.y = iterateCoords[1] * 10;
-				iteratePatch.z = iterateCoords[2];
-
-				UtlHashHandle_t handle = g_PatchSampleHashTable.Find( iteratePatch );
-				if( handle == g_PatchSampleHashTable.InvalidHandle() )
-				{
-					UtlHashHandle_t handle = g_PatchSampleHashTable.AllocEntryFromKey( iteratePatch );
-
-					PatchSampleData_t *pPatchData = &g_PatchSampleHashTable.Element( handle );
-					pPatchData->x = iteratePatch.x;
-					pPatchData->y = iteratePatch.y;
-					pPatchData->z = iteratePatch.z;
-					pPatchData->m_ndxPatches.AddToTail( ndxPatch );
-
-					patchSamplesAdded++;
-				}
-				else
-				{
-					PatchSampleData_t *pPatchData = &g_PatchSampleHashTable.Element( handle );
-					pPatchData->m_ndxPatches.AddToTail( ndxPatch );
-
-					patchSamplesAdded++;
-				}
+				g_PatchSampleGrid.AddEntry( iterateCoords, ndxPatch );
+
+				patchSamplesAdded++;
 			}
 		}
 	}
 }
-
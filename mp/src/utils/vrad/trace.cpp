@@ -11,8 +11,10 @@
 
 #include "vrad.h"
 #include "trace.h"
+#include "lightcache.h"
 #include "Cmodel.h"
 #include "mathlib/vmatrix.h"
+#include "vstdlib/random.h"
 
 
 //=============================================================================
@@ -179,6 +181,48 @@ void TestLine( const FourVectors& start, const FourVectors& stop,
 		*pFractionVisible = MinSIMD( *pFractionVisible, coverageCallback.GetFractionVisible() );
 }
 
+void TestLine8( FourVectors const *pStart, FourVectors const *pStop,
+				fltx4 *pFractionVisible, int static_prop_index_to_ignore )
+{
+	// The coverage callback only understands 4 ray packets
+	if ( g_bTextureShadows )
+	{
+		TestLine( pStart[0], pStop[0], &pFractionVisible[0], static_prop_index_to_ignore );
+		TestLine( pStart[1], pStop[1], &pFractionVisible[1], static_prop_index_to_ignore );
+		return;
+	}
+
+	EightRays myrays;
+	fltx4 tmin[2], len[2];
+	for ( int h = 0; h < 2; h++ )
+	{
+		myrays.Rays[h].origin = pStart[h];
+		myrays.Rays[h].direction = pStop[h];
+		myrays.Rays[h].direction -= myrays.Rays[h].origin;
+		len[h] = myrays.Rays[h].direction.length();
+		myrays.Rays[h].direction *= ReciprocalSIMD( len[h] );
+		tmin[h] = Four_Zeros;
+	}
+
+	RayTracingResult rt_result[2];
+	g_RtEnv.Trace8Rays( myrays, tmin, len, rt_result, TRACE_ID_STATICPROP | static_prop_index_to_ignore );
+
+	// Assume we can see the targets unless we get hits
+	for ( int h = 0; h < 2; h++ )
+	{
+		fltx4 visibility = Four_Ones;
+		for ( int i = 0; i < 4; i++ )
+		{
+			if ( ( rt_result[h].HitIds[i] != -1 ) &&
+				 ( SubFloat( rt_result[h].HitDistance, i ) < SubFloat( len[h], i ) ) )
+			{
+				SubFloat( visibility, i ) = 0.0f;
+			}
+		}
+		pFractionVisible[h] = visibility;
+	}
+}
+
 
 
 /*
@@ -429,6 +473,424 @@ void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 }
 
 
+//-----------------------------------------------------------------------------
+// Deferred shadow rays
+//-----------------------------------------------------------------------------
+
+// Packets are sorted by direction octant, then by direction (this many bits
+// per axis), then by which cell their origin is in (this many bits per axis).
+#define SHADOW_RAY_DIR_BITS		4
+#define SHADOW_RAY_CELL_BITS	5
+#define SHADOW_RAY_CELL_SIZE	( COORD_EXTENT >> SHADOW_RAY_CELL_BITS )
+#define SHADOW_RAY_OCTANT_SHIFT	( 3 * ( SHADOW_RAY_DIR_BITS + SHADOW_RAY_CELL_BITS ) )
+
+static CShadowRayQueue g_ShadowRayQueues[MAX_TOOL_THREADS];
+
+CShadowRayQueue *GetShadowRayQueue( int iThread )
+{
+	Assert( iThread >= 0 && iThread < MAX_TOOL_THREADS );
+	return &g_ShadowRayQueues[iThread];
+}
+
+// Spreads the low 5 bits of n out to every third bit
+static inline uint32 SpreadBitsBy3( uint32 n )
+{
+	n &= ( 1 << SHADOW_RAY_CELL_BITS ) - 1;
+	n = ( n | ( n << 8 ) ) & 0x0000f00f;
+	n = ( n | ( n << 4 ) ) & 0x000c30c3;
+	n = ( n | ( n << 2 ) ) & 0x00249249;
+	return n;
+}
+
+// Sign bits, same as FourRays::CalculateDirectionSignMask. FloatBits is 64 bits wide on 64 bit linux.
+static inline uint32 ShadowRaySignBit( float const& f )
+{
+	return *reinterpret_cast< uint32 const * >( &f ) >> 31;
+}
+
+static inline uint32 ShadowRayOctant( Vector const& direction )
+{
+	return ShadowRaySignBit( direction.x ) |
+		( ShadowRaySignBit( direction.y ) << 1 ) |
+		( ShadowRaySignBit( direction.z ) << 2 );
+}
+
+static inline uint32 ShadowRayDirectionBits( float flDir )
+{
+	int nBin = (int)( ( flDir + 1.0f ) * ( 0.5f * ( 1 << SHADOW_RAY_DIR_BITS ) ) );
+	return clamp( nBin, 0, ( 1 << SHADOW_RAY_DIR_BITS ) - 1 );
+}
+
+static inline uint32 ShadowRayCell( float flCoord )
+{
+	int nCell = (int)( ( flCoord + MAX_COORD_INTEGER ) * ( 1.0f / SHADOW_RAY_CELL_SIZE ) );
+	return clamp( nCell, 0, ( 1 << SHADOW_RAY_CELL_BITS ) - 1 );
+}
+
+static inline uint32 ShadowRaySortKey( Vector const& origin, Vector const& direction )
+{
+	uint32 nDir = ShadowRayDirectionBits( direction.x ) |
+		( ShadowRayDirectionBits( direction.y ) << SHADOW_RAY_DIR_BITS ) |
+		( ShadowRayDirectionBits( direction.z ) << ( 2 * SHADOW_RAY_DIR_BITS ) );
+
+	// morton order, so nearby cells stay close together
+	uint32 nCell = SpreadBitsBy3( ShadowRayCell( origin.x ) ) |
+		( SpreadBitsBy3( ShadowRayCell( origin.y ) ) << 1 ) |
+		( SpreadBitsBy3( ShadowRayCell( origin.z ) ) << 2 );
+
+	return ( ShadowRayOctant( direction ) << SHADOW_RAY_OCTANT_SHIFT ) |
+		( nDir << ( 3 * SHADOW_RAY_CELL_BITS ) ) | nCell;
+}
+
+CShadowRayQueue::CShadowRayQueue()
+{
+	m_nRecordedQueries = 0;
+	m_iReplayQuery = 0;
+	m_bRecording = false;
+	m_bReplaying = false;
+	m_bTrace8 = false;
+	m_nHeldRays = 0;
+	m_nHeldOctant = 0;
+}
+
+void CShadowRayQueue::BeginRecord()
+{
+	Assert( !m_bRecording && !m_bReplaying );
+	m_Queries.RemoveAll();
+	m_Rays.RemoveAll();
+	m_nRecordedQueries = 0;
+	m_bRecording = true;
+}
+
+void CShadowRayQueue::BeginReplay()
+{
+	Assert( !m_bRecording );
+	m_iReplayQuery = 0;
+	m_bReplaying = true;
+}
+
+void CShadowRayQueue::EndReplay()
+{
+	// If this goes off, the lighting code didn't make the same calls both times
+	Assert( m_iReplayQuery == m_nRecordedQueries );
+	m_bReplaying = false;
+}
+
+void CShadowRayQueue::AddQuery( FourVectors const& start, FourVectors const& stop, int nType, int iParent )
+{
+	int iQuery = m_Queries.AddToTail();
+	m_Queries[iQuery].m_nType = nType;
+	m_Queries[iQuery].m_iParent = iParent;
+
+	FourVectors dir = stop;
+	dir -= start;
+	fltx4 len = dir.length();
+	dir *= ReciprocalSIMD( len );
+
+	// Ray i always belongs to query i / 4
+	int iRay = m_Rays.AddMultipleToTail( 4 );
+	Assert( iRay == 4 * iQuery );
+	for ( int i = 0; i < 4; i++ )
+	{
+		Ray_t &ray = m_Rays[iRay + i];
+		ray.m_Origin = start.Vec( i );
+		ray.m_Direction = dir.Vec( i );
+		ray.m_flLength = SubFloat( len, i );
+	}
+}
+
+void CShadowRayQueue::TestLine( FourVectors const& start, FourVectors const& stop, fltx4 *pFractionVisible )
+{
+	if ( m_bReplaying )
+	{
+		Assert( m_iReplayQuery < m_nRecordedQueries );
+		Query_t const &query = m_Queries[m_iReplayQuery++];
+		Assert( query.m_nType == QUERY_LINE );
+		*pFractionVisible = SubSIMD( Four_Ones, LoadUnalignedSIMD( query.m_flOcclusion ) );
+		return;
+	}
+
+	Assert( m_bRecording );
+	AddQuery( start, stop, QUERY_LINE, -1 );
+	*pFractionVisible = Four_Ones;
+}
+
+void CShadowRayQueue::TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop, fltx4 *pFractionVisible )
+{
+	if ( m_bReplaying )
+	{
+		Assert( m_iReplayQuery < m_nRecordedQueries );
+		Query_t const &query = m_Queries[m_iReplayQuery++];
+		Assert( query.m_nType == QUERY_SKY );
+		*pFractionVisible = SubSIMD( Four_Ones, LoadUnalignedSIMD( query.m_flOcclusion ) );
+		return;
+	}
+
+	Assert( m_bRecording );
+	AddQuery( start, stop, QUERY_SKY, -1 );
+	*pFractionVisible = Four_Ones;
+}
+
+int __cdecl CShadowRayQueue::CompareSortEntries( const SortEntry_t *pA, const SortEntry_t *pB )
+{
+	if ( pA->m_nKey != pB->m_nKey )
+		return ( pA->m_nKey < pB->m_nKey ) ? -1 : 1;
+
+	// Keep queue order otherwise
+	return pA->m_iRay - pB->m_iRay;
+}
+
+//-----------------------------------------------------------------------------
+// Traces one or two packets of up to 4 rays (by index into m_Rays) and writes
+// the occlusion of each ray into its query. Short packets get padded out.
+//-----------------------------------------------------------------------------
+void CShadowRayQueue::TracePacket( int const *pRays0, int nRays0, int const *pRays1, int nRays1 )
+{
+	int const *pPacketRays[2] = { pRays0, pRays1 };
+	int nPacketRays[2] = { nRays0, nRays1 };
+	int nPackets = pRays1 ? 2 : 1;
+
+	EightRays rays;
+	fltx4 tmin[2], tmax[2];
+	for ( int h = 0; h < nPackets; h++ )
+	{
+		Ray_t const *pRays[4];
+		for ( int j = 0; j < 4; j++ )
+		{
+			pRays[j] = &m_Rays[ pPacketRays[h][ min( j, nPacketRays[h] - 1 ) ] ];
+		}
+
+		float flLength[4] = { pRays[0]->m_flLength, pRays[1]->m_flLength, pRays[2]->m_flLength, pRays[3]->m_flLength };
+		rays.Rays[h].origin.LoadAndSwizzle( pRays[0]->m_Origin, pRays[1]->m_Origin, pRays[2]->m_Origin, pRays[3]->m_Origin );
+		rays.Rays[h].direction.LoadAndSwizzle( pRays[0]->m_Direction, pRays[1]->m_Direction, pRays[2]->m_Direction, pRays[3]->m_Direction );
+		tmin[h] = Four_Zeros;
+		tmax[h] = LoadUnalignedSIMD( flLength );
+	}
+
+	RayTracingResult rt_result[2];
+	fltx4 coverage = Four_Zeros;
+	if ( nPackets == 2 )
+	{
+		g_RtEnv.Trace8Rays( rays, tmin, tmax, rt_result );
+	}
+	else
+	{
+		CCoverageCountTexture coverageCallback;
+		g_RtEnv.Trace4Rays( rays.Rays[0], tmin[0], tmax[0], &rt_result[0], -1, g_bTextureShadows ? &coverageCallback : 0 );
+		coverage = coverageCallback.GetCoverage();
+	}
+
+	for ( int h = 0; h < nPackets; h++ )
+	{
+		RayTracingResult const &result = rt_result[h];
+		for ( int s = 0; s < nPacketRays[h]; s++ )
+		{
+			int iRay = pPacketRays[h][s];
+			Query_t &query = m_Queries[iRay >> 2];
+
+			float flOcclusion = 0.0f;
+			if ( ( result.HitIds[s] != -1 ) && ( SubFloat( result.HitDistance, s ) < m_Rays[iRay].m_flLength ) )
+			{
+				flOcclusion = 1.0f;
+				if ( query.m_nType != QUERY_LINE )
+				{
+					int id = g_RtEnv.OptimizedTriangleList[result.HitIds[s]].m_Data.m_IntersectData.m_nTriangleID;
+					if ( id & TRACE_ID_SKY )
+						flOcclusion = 0.0f;
+				}
+			}
+			if ( g_bTextureShadows )
+				flOcclusion = max( flOcclusion, SubFloat( coverage, s ) );
+
+			query.m_flOcclusion[iRay & 3] = flOcclusion;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Hands a packet to the tracer. When we can trace 8 rays at once, packets are
+// held back until another one going into the same octant shows up.
+//-----------------------------------------------------------------------------
+void CShadowRayQueue::AddPacket( int const *pRays, int nRays, uint32 nOctant )
+{
+	if ( !m_bTrace8 )
+	{
+		TracePacket( pRays, nRays, NULL, 0 );
+		return;
+	}
+
+	if ( m_nHeldRays && ( m_nHeldOctant == nOctant ) )
+	{
+		TracePacket( m_iHeldRays, m_nHeldRays, pRays, nRays );
+		m_nHeldRays = 0;
+		return;
+	}
+
+	FlushHeldPacket();
+	memcpy( m_iHeldRays, pRays, nRays * sizeof( int ) );
+	m_nHeldRays = nRays;
+	m_nHeldOctant = nOctant;
+}
+
+void CShadowRayQueue::FlushHeldPacket()
+{
+	if ( m_nHeldRays )
+	{
+		TracePacket( m_iHeldRays, m_nHeldRays, NULL, 0 );
+		m_nHeldRays = 0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Sorts and traces the rays of the queries from iFirstRay on.
+// The 4 rays of a query usually go the same way (nearby samples towards the
+// same light, or the same sky direction), so they're kept together as a
+// packet. Queries whose rays don't all go into the same octant are split up
+// and their rays repacked with other rays of the same octant; Trace4Rays
+// would trace them one by one otherwise.
+//-----------------------------------------------------------------------------
+void CShadowRayQueue::TraceRays( int iFirstRay )
+{
+	m_SortedRays.RemoveAll();
+	for ( int iRay = iFirstRay; iRay < m_Rays.Count(); iRay += 4 )
+	{
+		Ray_t const *pRays = &m_Rays[iRay];
+		uint32 nOctant = ShadowRayOctant( pRays[0].m_Direction );
+		bool bCoherent = ( ShadowRayOctant( pRays[1].m_Direction ) == nOctant ) &&
+			( ShadowRayOctant( pRays[2].m_Direction ) == nOctant ) &&
+			( ShadowRayOctant( pRays[3].m_Direction ) == nOctant );
+
+		for ( int i = 0; i < ( bCoherent ? 1 : 4 ); i++ )
+		{
+			SortEntry_t &entry = m_SortedRays[ m_SortedRays.AddToTail() ];
+			entry.m_nKey = ShadowRaySortKey( pRays[i].m_Origin, pRays[i].m_Direction );
+			entry.m_iRay = iRay + i;
+			entry.m_nRays = bCoherent ? 4 : 1;
+		}
+	}
+	m_SortedRays.Sort( CompareSortEntries );
+
+	// The coverage callback only understands 4 ray packets
+	m_bTrace8 = !g_bTextureShadows && g_RtEnv.SupportsTrace8Rays();
+	m_nHeldRays = 0;
+
+	// Loose rays wait here, by octant, until there are 4 of them
+	int iLooseRays[8][4];
+	int nLooseRays[8];
+	memset( nLooseRays, 0, sizeof( nLooseRays ) );
+
+	for ( int i = 0; i < m_SortedRays.Count(); i++ )
+	{
+		SortEntry_t const &entry = m_SortedRays[i];
+		uint32 nOctant = entry.m_nKey >> SHADOW_RAY_OCTANT_SHIFT;
+		if ( entry.m_nRays == 4 )
+		{
+			int iRays[4] = { entry.m_iRay, entry.m_iRay + 1, entry.m_iRay + 2, entry.m_iRay + 3 };
+			AddPacket( iRays, 4, nOctant );
+			continue;
+		}
+
+		iLooseRays[nOctant][ nLooseRays[nOctant]++ ] = entry.m_iRay;
+		if ( nLooseRays[nOctant] == 4 )
+		{
+			AddPacket( iLooseRays[nOctant], 4, nOctant );
+			nLooseRays[nOctant] = 0;
+		}
+	}
+
+	for ( int nOctant = 0; nOctant < 8; nOctant++ )
+	{
+		if ( nLooseRays[nOctant] )
+		{
+			AddPacket( iLooseRays[nOctant], nLooseRays[nOctant], nOctant );
+		}
+	}
+	FlushHeldPacket();
+}
+
+//-----------------------------------------------------------------------------
+// Same as the recursion in TestLine_DoesHitSky: sky queries that aren't fully
+// blocked and aren't in a sky camera's area carry on into the 3d skyboxes.
+//-----------------------------------------------------------------------------
+void CShadowRayQueue::AddSkyCameraQueries( int iFirstQuery, int nQueries )
+{
+	for ( int q = iFirstQuery; q < iFirstQuery + nQueries; q++ )
+	{
+		if ( m_Queries[q].m_nType != QUERY_SKY )
+			continue;
+
+		fltx4 occlusion = LoadUnalignedSIMD( m_Queries[q].m_flOcclusion );
+		if ( TestSignSIMD( CmpGeSIMD( occlusion, Four_Ones ) ) == 0xF )
+			continue;
+
+		FourVectors start, dir;
+		Ray_t const *pRays = &m_Rays[4 * q];
+		start.LoadAndSwizzle( pRays[0].m_Origin, pRays[1].m_Origin, pRays[2].m_Origin, pRays[3].m_Origin );
+		dir.LoadAndSwizzle( pRays[0].m_Direction, pRays[1].m_Direction, pRays[2].m_Direction, pRays[3].m_Direction );
+
+		int leafIndex = PointLeafnum( pRays[0].m_Origin );
+		if ( leafIndex < 0 )
+			continue;
+
+		int area = dleafs[leafIndex].area;
+		if ( area < 0 || area >= numareas || area_sky_cameras[area] >= 0 )
+			continue;
+
+		for ( int cam = 0; cam < num_sky_cameras; ++cam )
+		{
+			FourVectors skystart, skystop;
+			skystart.DuplicateVector( sky_cameras[cam].origin );
+			skystop = start;
+			skystop *= sky_cameras[cam].world_to_sky;
+			skystart += skystop;
+
+			skystop = dir;
+			skystop *= MAX_TRACE_LENGTH;
+			skystop += skystart;
+			AddQuery( skystart, skystop, QUERY_SKY_CAMERA, q );
+		}
+	}
+}
+
+void CShadowRayQueue::Trace()
+{
+	Assert( m_bRecording );
+	m_bRecording = false;
+	m_nRecordedQueries = m_Queries.Count();
+
+	TraceRays( 0 );
+
+	if ( !g_bNoSkyRecurse )
+	{
+		int iFirstCameraRay = m_Rays.Count();
+		AddSkyCameraQueries( 0, m_nRecordedQueries );
+		if ( m_Rays.Count() > iFirstCameraRay )
+		{
+			TraceRays( iFirstCameraRay );
+
+			// Whatever the skybox blocks adds to the occlusion of the query it continues
+			for ( int q = m_nRecordedQueries; q < m_Queries.Count(); q++ )
+			{
+				Query_t const &camQuery = m_Queries[q];
+				Query_t &parent = m_Queries[camQuery.m_iParent];
+				for ( int s = 0; s < 4; s++ )
+				{
+					parent.m_flOcclusion[s] += clamp( camQuery.m_flOcclusion[s], 0.0f, 1.0f );
+				}
+			}
+		}
+	}
+
+	for ( int q = 0; q < m_nRecordedQueries; q++ )
+	{
+		for ( int s = 0; s < 4; s++ )
+		{
+			m_Queries[q].m_flOcclusion[s] = clamp( m_Queries[q].m_flOcclusion[s], 0.0f, 1.0f );
+		}
+	}
+}
+
+
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
@@ -651,3 +1113,295 @@ void AddBrushesForRayTrace( void )
 		}
 	}
 }
+
+
+//-----------------------------------------------------------------------------
+// Ray trace cache key. Only the parts of the bsp that end up as triangles are
+// hashed - the lighting data vrad writes back into the faces, leaves and
+// displacements must not change the key, or the cache would miss every other run.
+//-----------------------------------------------------------------------------
+static void HashRayTraceData( MD5Context_t *pContext, const void *pData, int nBytes )
+{
+	MD5Update( pContext, (const unsigned char *)&nBytes, sizeof( nBytes ) );
+	if ( nBytes )
+		MD5Update( pContext, (const unsigned char *)pData, nBytes );
+}
+
+void ComputeRayTraceCacheKey( uint8 *pKey )
+{
+	COMPILE_TIME_ASSERT( RTE_CACHE_KEY_SIZE == MD5_DIGEST_LENGTH );
+
+	MD5Context_t ctx;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+
+	// Brushes, through the world and brush entity trees
+	HashRayTraceData( &ctx, dmodels, nummodels * sizeof( dmodels[0] ) );
+	HashRayTraceData( &ctx, dnodes, numnodes * sizeof( dnodes[0] ) );
+	for ( int i = 0; i < numleafs; i++ )
+	{
+		HashRayTraceData( &ctx, &dleafs[i].firstleafbrush, sizeof( dleafs[i].firstleafbrush ) );
+		HashRayTraceData( &ctx, &dleafs[i].numleafbrushes, sizeof( dleafs[i].numleafbrushes ) );
+	}
+	HashRayTraceData( &ctx, dleafbrushes, numleafbrushes * sizeof( dleafbrushes[0] ) );
+	HashRayTraceData( &ctx, dbrushes, numbrushes * sizeof( dbrushes[0] ) );
+	HashRayTraceData( &ctx, dbrushsides, numbrushsides * sizeof( dbrushsides[0] ) );
+	HashRayTraceData( &ctx, dplanes, numplanes * sizeof( dplanes[0] ) );
+	for ( int i = 0; i < texinfo.Count(); i++ )
+		HashRayTraceData( &ctx, &texinfo[i].flags, sizeof( texinfo[i].flags ) );
+
+	// Sky faces and displacement base faces
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		const dface_t &face = g_pFaces[i];
+		HashRayTraceData( &ctx, &face.planenum, sizeof( face.planenum ) );
+		HashRayTraceData( &ctx, &face.firstedge, sizeof( face.firstedge ) );
+		HashRayTraceData( &ctx, &face.numedges, sizeof( face.numedges ) );
+		HashRayTraceData( &ctx, &face.texinfo, sizeof( face.texinfo ) );
+		HashRayTraceData( &ctx, &face.dispinfo, sizeof( face.dispinfo ) );
+	}
+	HashRayTraceData( &ctx, dsurfedges, numsurfedges * sizeof( dsurfedges[0] ) );
+	HashRayTraceData( &ctx, dedges, numedges * sizeof( dedges[0] ) );
+	HashRayTraceData( &ctx, dvertexes, numvertexes * sizeof( dvertexes[0] ) );
+
+	// Displacements
+	for ( int i = 0; i < g_dispinfo.Count(); i++ )
+	{
+		const ddispinfo_t &disp = g_dispinfo[i];
+		HashRayTraceData( &ctx, &disp.startPosition, sizeof( disp.startPosition ) );
+		HashRayTraceData( &ctx, &disp.m_iDispVertStart, sizeof( disp.m_iDispVertStart ) );
+		HashRayTraceData( &ctx, &disp.m_iDispTriStart, sizeof( disp.m_iDispTriStart ) );
+		HashRayTraceData( &ctx, &disp.power, sizeof( disp.power ) );
+		HashRayTraceData( &ctx, &disp.contents, sizeof( disp.contents ) );
+		HashRayTraceData( &ctx, &disp.m_iMapFace, sizeof( disp.m_iMapFace ) );
+	}
+	HashRayTraceData( &ctx, g_DispVerts.Base(), g_DispVerts.Count() * sizeof( CDispVert ) );
+	HashRayTraceData( &ctx, g_DispTris.Base(), g_DispTris.Count() * sizeof( CDispTri ) );
+
+	// Shadow casting brush entities (see ExtractBrushEntityShadowCasters)
+	for ( int i = 0; i < num_entities; i++ )
+	{
+		if ( IntForKey( &entities[i], "vrad_brush_cast_shadows" ) == 0 )
+			continue;
+
+		Vector origin;
+		QAngle angles;
+		GetVectorForKey( &entities[i], "origin", origin );
+		GetAnglesForKey( &entities[i], "angles", angles );
+		const char *pModel = ValueForKey( &entities[i], "model" );
+		HashRayTraceData( &ctx, &origin, sizeof( origin ) );
+		HashRayTraceData( &ctx, &angles, sizeof( angles ) );
+		HashRayTraceData( &ctx, pModel, Q_strlen( pModel ) );
+	}
+
+	// Static props
+	HashRayTraceData( &ctx, &g_bStaticPropPolys, sizeof( g_bStaticPropPolys ) );
+	for ( int i = 0; i < g_NonShadowCastingMaterialStrings.Count(); i++ )
+	{
+		const char *pString = g_NonShadowCastingMaterialStrings[i];
+		HashRayTraceData( &ctx, pString, Q_strlen( pString ) );
+	}
+	StaticPropMgr()->HashPolysForRayTrace( &ctx );
+
+	MD5Final( pKey, &ctx );
+}
+
+
+//-----------------------------------------------------------------------------
+// The brushes AddBrushesForRayTrace and ExtractBrushEntityShadowCasters turn
+// into triangles, as -incremental occluders
+//-----------------------------------------------------------------------------
+static void MarkBrushes_r( int node, CUtlVector<byte> &marked )
+{
+	if ( node < 0 )
+	{
+		int leafIndex = -1 - node;
+		for ( int i = 0; i < dleafs[leafIndex].numleafbrushes; i++ )
+		{
+			marked[dleafbrushes[dleafs[leafIndex].firstleafbrush + i]] = 1;
+		}
+		return;
+	}
+
+	MarkBrushes_r( dnodes[node].children[0], marked );
+	MarkBrushes_r( dnodes[node].children[1], marked );
+}
+
+static void AddBrushOccluders( int headnode, const VMatrix &xform, CUtlVector<LightCacheOccluder_t> &occluders )
+{
+	CUtlVector<byte> marked;
+	marked.SetSize( numbrushes );
+	memset( marked.Base(), 0, numbrushes );
+	MarkBrushes_r( headnode, marked );
+
+	for ( int ndxBrush = 0; ndxBrush < numbrushes; ndxBrush++ )
+	{
+		dbrush_t *pBrush = &dbrushes[ndxBrush];
+		if ( !marked[ndxBrush] || !( pBrush->contents & MASK_OPAQUE ) )
+			continue;
+
+		MD5Context_t ctx;
+		memset( &ctx, 0, sizeof( ctx ) );
+		MD5Init( &ctx );
+		MD5Update( &ctx, (const unsigned char *)&xform, sizeof( xform ) );
+		MD5Update( &ctx, (const unsigned char *)&pBrush->contents, sizeof( pBrush->contents ) );
+
+		// vbsp gives every brush its axial planes (as bevels if need be), so those are its bounds
+		Vector mins( MIN_COORD_INTEGER, MIN_COORD_INTEGER, MIN_COORD_INTEGER );
+		Vector maxs( MAX_COORD_INTEGER, MAX_COORD_INTEGER, MAX_COORD_INTEGER );
+		for ( int i = 0; i < pBrush->numsides; i++ )
+		{
+			dbrushside_t *side = &dbrushsides[pBrush->firstside + i];
+			dplane_t *plane = &dplanes[side->planenum];
+			int nSky = ( side->texinfo >= 0 ) ? ( texinfo[side->texinfo].flags & SURF_SKY ) : 0;
+			int nDisp = ( side->dispinfo != 0 );
+			MD5Update( &ctx, (const unsigned char *)&plane->normal, sizeof( plane->normal ) );
+			MD5Update( &ctx, (const unsigned char *)&plane->dist, sizeof( plane->dist ) );
+			MD5Update( &ctx, (const unsigned char *)&side->bevel, sizeof( side->bevel ) );
+			MD5Update( &ctx, (const unsigned char *)&nSky, sizeof( nSky ) );
+			MD5Update( &ctx, (const unsigned char *)&nDisp, sizeof( nDisp ) );
+
+			if ( plane->type > PLANE_Z )
+				continue;
+			if ( plane->normal[plane->type] > 0 )
+				maxs[plane->type] = min( maxs[plane->type], plane->dist );
+			else
+				mins[plane->type] = max( mins[plane->type], -plane->dist );
+		}
+
+		LightCacheOccluder_t &occluder = occluders[occluders.AddToTail()];
+		occluder.m_nHash = FinalizeLightCacheHash( &ctx );
+		TransformAABB( xform.As3x4(), mins, maxs, occluder.m_vecMins, occluder.m_vecMaxs );
+	}
+}
+
+void GetBrushOccludersForLightCache( CUtlVector<LightCacheOccluder_t> &occluders )
+{
+	if ( !nummodels )
+		return;
+
+	VMatrix identity;
+	identity.Identity();
+	AddBrushOccluders( dmodels[0].headnode, identity, occluders );
+
+	for ( int i = 0; i < num_entities; i++ )
+	{
+		if ( IntForKey( &entities[i], "vrad_brush_cast_shadows" ) == 0 )
+			continue;
+
+		dmodel_t *pModel = BrushmodelForEntity( &entities[i] );
+		if ( !pModel )
+			continue;
+
+		Vector origin;
+		QAngle angles;
+		GetVectorForKey( &entities[i], "origin", origin );
+		GetAnglesForKey( &entities[i], "angles", angles );
+		VMatrix xform;
+		xform.SetupMatrixOrgAngles( origin, angles );
+		AddBrushOccluders( pModel->headnode, xform, occluders );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// -rtbenchmark
+//-----------------------------------------------------------------------------
+
+#define RT_BENCHMARK_PACKETS	(1<<18)
+
+static Vector RandomBenchmarkDirection( CUniformRandomStream &random )
+{
+	Vector dir;
+	do
+	{
+		dir.Init( random.RandomFloat( -1, 1 ), random.RandomFloat( -1, 1 ), random.RandomFloat( -1, 1 ) );
+	} while ( dir.LengthSqr() > 1.0f || dir.LengthSqr() < 0.01f );
+	VectorNormalize( dir );
+	return dir;
+}
+
+void BenchmarkRayTracer( void )
+{
+	typedef CUtlVector< FourRays, CUtlMemoryAligned< FourRays, 16 > > FourRaysVector_t;
+	typedef CUtlVector< RayTracingResult, CUtlMemoryAligned< RayTracingResult, 16 > > ResultVector_t;
+
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+
+	// Odd packets share an origin and nearly share a direction, like the direct lighting
+	// rays do. Even ones go every which way, like the bounce and ambient rays.
+	FourRaysVector_t rays;
+	rays.SetCount( RT_BENCHMARK_PACKETS );
+	Vector extent = g_RtEnv.m_MaxBound - g_RtEnv.m_MinBound;
+	for ( int i = 0; i < rays.Count(); i++ )
+	{
+		Vector origin( g_RtEnv.m_MinBound.x + random.RandomFloat( 0, extent.x ),
+			g_RtEnv.m_MinBound.y + random.RandomFloat( 0, extent.y ),
+			g_RtEnv.m_MinBound.z + random.RandomFloat( 0, extent.z ) );
+		Vector baseDir = RandomBenchmarkDirection( random );
+
+		rays[i].origin.DuplicateVector( origin );
+		for ( int j = 0; j < 4; j++ )
+		{
+			Vector dir;
+			if ( i & 1 )
+			{
+				dir = baseDir + 0.05f * RandomBenchmarkDirection( random );
+				VectorNormalize( dir );
+			}
+			else
+			{
+				dir = RandomBenchmarkDirection( random );
+			}
+			rays[i].direction.X( j ) = dir.x;
+			rays[i].direction.Y( j ) = dir.y;
+			rays[i].direction.Z( j ) = dir.z;
+		}
+	}
+
+	fltx4 TMax = ReplicateX4( extent.Length() );
+	uint32 oldFlags = g_RtEnv.Flags;
+
+	ResultVector_t results[2];
+	float flTime[2];
+	for ( int pass = 0; pass < 2; pass++ )
+	{
+		if ( pass == 0 )
+			g_RtEnv.Flags &= ~RTE_FLAGS_WIDE_BVH;
+		else
+			g_RtEnv.Flags |= RTE_FLAGS_WIDE_BVH;
+
+		results[pass].SetCount( rays.Count() );
+		double flStart = Plat_FloatTime();
+		for ( int i = 0; i < rays.Count(); i++ )
+		{
+			g_RtEnv.Trace4Rays( rays[i], Four_Zeros, TMax, &results[pass][i] );
+		}
+		flTime[pass] = Plat_FloatTime() - flStart;
+	}
+	g_RtEnv.Flags = oldFlags;
+
+	// Hits on shared edges can legitimately go to either triangle, so only count
+	// the rays that hit in one structure and missed in the other.
+	int nMismatches = 0;
+	for ( int i = 0; i < rays.Count(); i++ )
+	{
+		for ( int j = 0; j < 4; j++ )
+		{
+			if ( ( results[0][i].HitIds[j] == -1 ) != ( results[1][i].HitIds[j] == -1 ) )
+				nMismatches++;
+		}
+	}
+
+	int nRays = rays.Count() * 4;
+	Msg( "Ray tracer benchmark, %d rays:\n", nRays );
+	Msg( "  kd-tree  (%7d nodes) : %.2f seconds, %.2f Mrays/sec\n", g_RtEnv.OptimizedKDTree.Count(),
+		flTime[0], nRays / ( flTime[0] * 1000000.0f ) );
+	Msg( "  wide bvh (%7d nodes) : %.2f seconds, %.2f Mrays/sec\n", g_RtEnv.WideBVHTree.Count(),
+		flTime[1], nRays / ( flTime[1] * 1000000.0f ) );
+	if ( nMismatches )
+	{
+		Warning( "  %d rays hit in one structure and missed in the other!\n", nMismatches );
+	}
+}
@@ -0,0 +1,679 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compact storage for the patch to patch transfers used by the
+//			bounce passes, laid out for the SIMD GatherLight kernels.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "transfermatrix.h"
+
+
+CTransferMatrix g_TransferMatrix;
+
+
+//-----------------------------------------------------------------------------
+// Loads 4 floats from pBase through 4 indices.
+//-----------------------------------------------------------------------------
+static FORCEINLINE fltx4 GatherSIMD( const float *pBase, const int *pIndex )
+{
+	fltx4 result = Four_Zeros;
+	SubFloat( result, 0 ) = pBase[ pIndex[0] ];
+	SubFloat( result, 1 ) = pBase[ pIndex[1] ];
+	SubFloat( result, 2 ) = pBase[ pIndex[2] ];
+	SubFloat( result, 3 ) = pBase[ pIndex[3] ];
+	return result;
+}
+
+static FORCEINLINE float SumSIMD( const fltx4 &a )
+{
+	return ( SubFloat( a, 0 ) + SubFloat( a, 1 ) ) + ( SubFloat( a, 2 ) + SubFloat( a, 3 ) );
+}
+
+static FORCEINLINE void SumFourVectors( const FourVectors &v, Vector &out )
+{
+	out.x = SumSIMD( v.x );
+	out.y = SumSIMD( v.y );
+	out.z = SumSIMD( v.z );
+}
+
+
+// Compressed rows are carved out of blocks this big.
+#define TRANSFER_ARENA_BLOCK_SIZE	( 16 * 1024 * 1024 )
+
+// Compressed row layout:
+//	float			scale				transfer = quantized * scale
+//	unsigned short	quantized[n]
+//	byte			indices[]			patch indices, ascending, delta coded as varints
+struct CompressedRowHeader_t
+{
+	float m_flScale;
+};
+
+
+static int CompareTransferPatch( const transfer_t *pA, const transfer_t *pB )
+{
+	return pA->patch - pB->patch;
+}
+
+static inline byte *WriteVarInt( byte *pOut, unsigned int nValue )
+{
+	while ( nValue >= 0x80 )
+	{
+		*pOut++ = (byte)( nValue | 0x80 );
+		nValue >>= 7;
+	}
+	*pOut++ = (byte)nValue;
+	return pOut;
+}
+
+static inline const byte *ReadVarInt( const byte *pIn, unsigned int &nValue )
+{
+	nValue = 0;
+	int nShift = 0;
+	byte b;
+	do
+	{
+		b = *pIn++;
+		nValue |= (unsigned int)( b & 0x7f ) << nShift;
+		nShift += 7;
+	} while ( b & 0x80 );
+	return pIn;
+}
+
+
+CTransferMatrix::CTransferMatrix()
+{
+	m_bCompressed = false;
+	for ( int i = 0; i < MAX_TOOL_THREADS+1; i++ )
+	{
+		m_Arenas[i].m_nBlockUsed = 0;
+		m_Arenas[i].m_nBlockSize = 0;
+		m_Arenas[i].m_nBytes = 0;
+		m_Arenas[i].m_nRoundedUp = 0;
+	}
+	m_bKeepExactRows = false;
+	m_nTransfers = 0;
+}
+
+
+CTransferMatrix::~CTransferMatrix()
+{
+	Purge();
+}
+
+
+void CTransferMatrix::Init( int nPatches )
+{
+	Purge();
+
+	if ( m_bCompressed )
+	{
+		m_CompressedRows.SetCount( nPatches );
+		memset( m_CompressedRows.Base(), 0, nPatches * sizeof( byte* ) );
+
+		if ( m_bKeepExactRows )
+		{
+			m_ExactRows.SetCount( nPatches );
+		}
+	}
+}
+
+
+byte *CTransferMatrix::AllocFromArena( Arena_t &arena, int nBytes )
+{
+	// Rows are kept 4 byte aligned.
+	nBytes = ALIGN_VALUE( nBytes, 4 );
+
+	if ( !arena.m_Blocks.Count() || arena.m_nBlockUsed + nBytes > arena.m_nBlockSize )
+	{
+		arena.m_nBlockSize = max( nBytes, TRANSFER_ARENA_BLOCK_SIZE );
+		byte *pBlock = (byte*)malloc( arena.m_nBlockSize );
+		if ( !pBlock )
+			Error( "Memory allocation failure" );
+
+		arena.m_Blocks.AddToTail( pBlock );
+		arena.m_nBlockUsed = 0;
+	}
+
+	byte *pRet = arena.m_Blocks.Tail() + arena.m_nBlockUsed;
+	arena.m_nBlockUsed += nBytes;
+	arena.m_nBytes += nBytes;
+
+	return pRet;
+}
+
+
+void CTransferMatrix::AddCompressedRow( int iThread, int ndxPatch, const transfer_t *pTransfers, int nTransfers, float flScale )
+{
+	Assert( m_bCompressed && m_CompressedRows.IsValidIndex( ndxPatch ) );
+	if ( nTransfers <= 0 )
+		return;
+
+	Arena_t &arena = m_Arenas[iThread];
+
+	// Sort by patch so the indices delta code into a byte or two each.
+	CUtlVector< transfer_t > &sorted = arena.m_Sorted;
+	sorted.CopyArray( pTransfers, nTransfers );
+	sorted.Sort( CompareTransferPatch );
+
+	float flMax = 0.0f;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		flMax = max( flMax, sorted[i].transfer * flScale );
+	}
+
+	// Worst case is 5 bytes per index.
+	CUtlVector< byte > &encoded = arena.m_Encoded;
+	encoded.SetCount( sizeof( CompressedRowHeader_t ) + nTransfers * ( sizeof( unsigned short ) + 5 ) );
+
+	CompressedRowHeader_t *pHeader = (CompressedRowHeader_t*)encoded.Base();
+	pHeader->m_flScale = flMax / 65535.0f;
+
+	unsigned short *pQuantized = (unsigned short*)( pHeader + 1 );
+	float flQuantize = ( flMax > 0.0f ) ? 65535.0f / flMax : 0.0f;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		float flValue = sorted[i].transfer * flScale * flQuantize + 0.5f;
+		pQuantized[i] = (unsigned short)clamp( flValue, 0.0f, 65535.0f );
+
+		// Rounding a tiny transfer down to 0 would drop its light altogether
+		if ( !pQuantized[i] && sorted[i].transfer * flScale > 0.0f )
+		{
+			pQuantized[i] = 1;
+			arena.m_nRoundedUp++;
+		}
+	}
+
+	if ( m_bKeepExactRows )
+	{
+		ExactRow_t &exact = m_ExactRows[ndxPatch];
+		exact.m_Patch.SetCount( nTransfers );
+		exact.m_Transfer.SetCount( nTransfers );
+		for ( int i = 0; i < nTransfers; i++ )
+		{
+			exact.m_Patch[i] = sorted[i].patch;
+			exact.m_Transfer[i] = sorted[i].transfer * flScale;
+		}
+	}
+
+	byte *pOut = (byte*)( pQuantized + nTransfers );
+	int ndxPrev = 0;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		pOut = WriteVarInt( pOut, sorted[i].patch - ndxPrev );
+		ndxPrev = sorted[i].patch;
+	}
+
+	int nBytes = pOut - encoded.Base();
+	byte *pRow = AllocFromArena( arena, nBytes );
+	memcpy( pRow, encoded.Base(), nBytes );
+	m_CompressedRows[ndxPatch] = pRow;
+}
+
+
+void CTransferMatrix::Build()
+{
+	int nPatches = g_Patches.Count();
+
+	m_nTransfers = 0;
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		m_nTransfers += g_Patches[i].numtransfers;
+	}
+
+	if ( m_bCompressed )
+	{
+		if ( m_CompressedRows.Count() != nPatches )
+		{
+			Init( nPatches );
+		}
+
+		// Anything MakeScales didn't encode directly (the MPI master receives
+		// plain transfer lists from the workers) gets encoded now.
+		for ( int i = 0; i < nPatches; i++ )
+		{
+			CPatch *pPatch = &g_Patches[i];
+			if ( pPatch->transfers )
+			{
+				AddCompressedRow( THREADINDEX_MAIN, i, pPatch->transfers, pPatch->numtransfers, 1.0f );
+				free( pPatch->transfers );
+				pPatch->transfers = NULL;
+			}
+		}
+	}
+	else
+	{
+		// Lay out the rows.
+		m_RowStart.SetCount( nPatches + 1 );
+		int nEntries = 0;
+		for ( int i = 0; i < nPatches; i++ )
+		{
+			m_RowStart[i] = nEntries;
+			nEntries += ALIGN_VALUE( g_Patches[i].numtransfers, 4 );
+		}
+		m_RowStart[nPatches] = nEntries;
+
+		m_Patch.SetCount( nEntries );
+		m_Transfer.SetCount( nEntries );
+
+		// Move the transfers in. Padding points back at the receiving patch
+		// so it's always a valid index, and carries no light.
+		for ( int i = 0; i < nPatches; i++ )
+		{
+			CPatch *pPatch = &g_Patches[i];
+
+			int iEntry = m_RowStart[i];
+			for ( int j = 0; j < pPatch->numtransfers; j++, iEntry++ )
+			{
+				m_Patch[iEntry] = pPatch->transfers[j].patch;
+				m_Transfer[iEntry] = pPatch->transfers[j].transfer;
+			}
+			for ( ; iEntry < m_RowStart[i+1]; iEntry++ )
+			{
+				m_Patch[iEntry] = i;
+				m_Transfer[iEntry] = 0.0f;
+			}
+
+			if ( pPatch->transfers )
+			{
+				free( pPatch->transfers );
+				pPatch->transfers = NULL;
+			}
+		}
+	}
+
+	// Per patch streams.
+	for ( int iAxis = 0; iAxis < 3; iAxis++ )
+	{
+		m_Origin[iAxis].SetCount( nPatches );
+		m_Reflectivity[iAxis].SetCount( nPatches );
+		m_Radiance[iAxis].SetCount( nPatches );
+
+		for ( int i = 0; i < nPatches; i++ )
+		{
+			m_Origin[iAxis][i] = g_Patches[i].origin[iAxis];
+			m_Reflectivity[iAxis][i] = g_Patches[i].reflectivity[iAxis];
+			m_Radiance[iAxis][i] = 0.0f;
+		}
+	}
+}
+
+
+void CTransferMatrix::Purge()
+{
+	m_RowStart.Purge();
+	m_Patch.Purge();
+	m_Transfer.Purge();
+
+	m_CompressedRows.Purge();
+	m_ExactRows.Purge();
+	for ( int i = 0; i < MAX_TOOL_THREADS+1; i++ )
+	{
+		Arena_t &arena = m_Arenas[i];
+		for ( int j = 0; j < arena.m_Blocks.Count(); j++ )
+		{
+			free( arena.m_Blocks[j] );
+		}
+		arena.m_Blocks.Purge();
+		arena.m_nBlockUsed = 0;
+		arena.m_nBlockSize = 0;
+		arena.m_nBytes = 0;
+		arena.m_nRoundedUp = 0;
+		arena.m_Sorted.Purge();
+		arena.m_Encoded.Purge();
+	}
+
+	for ( int iAxis = 0; iAxis < 3; iAxis++ )
+	{
+		m_Origin[iAxis].Purge();
+		m_Reflectivity[iAxis].Purge();
+		m_Radiance[iAxis].Purge();
+	}
+	m_nTransfers = 0;
+}
+
+
+size_t CTransferMatrix::GetMemoryUsage() const
+{
+	size_t nBytes = m_RowStart.Count() * sizeof( int );
+	nBytes += m_Patch.Count() * ( sizeof( int ) + sizeof( float ) );
+	nBytes += m_CompressedRows.Count() * sizeof( byte* );
+	for ( int i = 0; i < MAX_TOOL_THREADS+1; i++ )
+	{
+		nBytes += m_Arenas[i].m_nBytes;
+	}
+	nBytes += m_Origin[0].Count() * sizeof( float ) * 9;
+	return nBytes;
+}
+
+
+int CTransferMatrix::GetRoundedUpCount() const
+{
+	int nCount = 0;
+	for ( int i = 0; i < MAX_TOOL_THREADS+1; i++ )
+	{
+		nCount += m_Arenas[i].m_nRoundedUp;
+	}
+	return nCount;
+}
+
+
+size_t CTransferMatrix::GetUncompressedMemoryUsage() const
+{
+	return (size_t)m_nTransfers * sizeof( transfer_t );
+}
+
+
+void CTransferMatrix::PrepareBounce( const CUtlVector<Vector> &emitlight )
+{
+	int nPatches = m_Origin[0].Count();
+	Assert( emitlight.Count() >= nPatches );
+
+	for ( int iAxis = 0; iAxis < 3; iAxis++ )
+	{
+		float *pRadiance = m_Radiance[iAxis].Base();
+		const float *pReflectivity = m_Reflectivity[iAxis].Base();
+		for ( int i = 0; i < nPatches; i++ )
+		{
+			pRadiance[i] = emitlight[i][iAxis] * pReflectivity[i];
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Kernels
+//-----------------------------------------------------------------------------
+void CTransferMatrix::GatherRow( const int *pPatch, const float *pTransfer, int nCount, Vector &sum ) const
+{
+	Assert( ( nCount & 3 ) == 0 );
+
+	const float *pRadianceX = m_Radiance[0].Base();
+	const float *pRadianceY = m_Radiance[1].Base();
+	const float *pRadianceZ = m_Radiance[2].Base();
+
+	FourVectors sum4;
+	sum4.x = sum4.y = sum4.z = Four_Zeros;
+
+	for ( int k = 0; k < nCount; k += 4 )
+	{
+		fltx4 transfer = LoadAlignedSIMD( pTransfer + k );
+		sum4.x = MaddSIMD( GatherSIMD( pRadianceX, pPatch + k ), transfer, sum4.x );
+		sum4.y = MaddSIMD( GatherSIMD( pRadianceY, pPatch + k ), transfer, sum4.y );
+		sum4.z = MaddSIMD( GatherSIMD( pRadianceZ, pPatch + k ), transfer, sum4.z );
+	}
+
+	Vector rowSum;
+	SumFourVectors( sum4, rowSum );
+	sum += rowSum;
+}
+
+
+void CTransferMatrix::GatherBumpRow( int ndxPatch, const int *pPatch, const float *pTransfer, int nCount,
+	const Vector *pNormals, Vector *pBumpSum ) const
+{
+	Assert( ( nCount & 3 ) == 0 );
+
+	const float *pOriginX = m_Origin[0].Base();
+	const float *pOriginY = m_Origin[1].Base();
+	const float *pOriginZ = m_Origin[2].Base();
+	const float *pRadianceX = m_Radiance[0].Base();
+	const float *pRadianceY = m_Radiance[1].Base();
+	const float *pRadianceZ = m_Radiance[2].Base();
+
+	FourVectors origin;
+	origin.DuplicateVector( Vector( pOriginX[ndxPatch], pOriginY[ndxPatch], pOriginZ[ndxPatch] ) );
+
+	FourVectors normals[NUM_BUMP_VECTS+1];
+	FourVectors bumpSum[NUM_BUMP_VECTS+1];
+	for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+	{
+		normals[i].DuplicateVector( pNormals[i] );
+		bumpSum[i].x = bumpSum[i].y = bumpSum[i].z = Four_Zeros;
+	}
+
+	for ( int k = 0; k < nCount; k += 4 )
+	{
+		fltx4 transfer = LoadAlignedSIMD( pTransfer + k );
+
+		// get vector to other patch
+		FourVectors delta;
+		delta.x = GatherSIMD( pOriginX, pPatch + k );
+		delta.y = GatherSIMD( pOriginY, pPatch + k );
+		delta.z = GatherSIMD( pOriginZ, pPatch + k );
+		delta -= origin;
+
+		// Padding entries point at ourselves, so guard the zero length.
+		fltx4 len2 = MaxSIMD( delta * delta, Four_Epsilons );
+		delta *= ReciprocalSqrtSIMD( len2 );
+
+		// remove normal already factored into transfer steradian.
+		// Masking with the transfer keeps the padding's 0 * inf out of the sums.
+		fltx4 valid = CmpGtSIMD( transfer, Four_Zeros );
+		fltx4 scale = AndSIMD( valid, MulSIMD( transfer, ReciprocalSIMD( delta * normals[0] ) ) );
+
+		// find light emitted from other patch
+		FourVectors v;
+		v.x = MulSIMD( GatherSIMD( pRadianceX, pPatch + k ), scale );
+		v.y = MulSIMD( GatherSIMD( pRadianceY, pPatch + k ), scale );
+		v.z = MulSIMD( GatherSIMD( pRadianceZ, pPatch + k ), scale );
+
+		for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+		{
+			fltx4 dot = MaxSIMD( delta * normals[i], Four_Zeros );
+			FourVectors bumpTransfer = v;
+			bumpTransfer *= dot;
+			bumpSum[i] += bumpTransfer;
+		}
+	}
+
+	for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+	{
+		Vector rowSum;
+		SumFourVectors( bumpSum[i], rowSum );
+		pBumpSum[i] += rowSum;
+	}
+}
+
+
+void CTransferMatrix::GatherLight( int ndxPatch, Vector &sum ) const
+{
+	VectorFill( sum, 0 );
+
+	const int *pPatch;
+	const float *pTransfer;
+	int nCount;
+	CTransferRowReader reader( *this, ndxPatch );
+	while ( reader.NextTile( pPatch, pTransfer, nCount ) )
+	{
+		GatherRow( pPatch, pTransfer, nCount, sum );
+	}
+}
+
+
+void CTransferMatrix::GatherBumpLight( int ndxPatch, const Vector *pNormals, Vector *pBumpSum ) const
+{
+	for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+	{
+		VectorFill( pBumpSum[i], 0 );
+	}
+
+	const int *pPatch;
+	const float *pTransfer;
+	int nCount;
+	CTransferRowReader reader( *this, ndxPatch );
+	while ( reader.NextTile( pPatch, pTransfer, nCount ) )
+	{
+		GatherBumpRow( ndxPatch, pPatch, pTransfer, nCount, pNormals, pBumpSum );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Reference versions. These skip the zero transfer padding.
+//-----------------------------------------------------------------------------
+void CTransferMatrix::GatherLightReference( int ndxPatch, const CUtlVector<Vector> &emitlight, Vector &sum ) const
+{
+	Vector v;
+	VectorFill( sum, 0 );
+
+	const int *pPatch;
+	const float *pTransfer;
+	int nCount;
+	CTransferRowReader reader( *this, ndxPatch, true );
+	while ( reader.NextTile( pPatch, pTransfer, nCount ) )
+	{
+		for ( int k = 0; k < nCount; k++ )
+		{
+			if ( pTransfer[k] == 0.0f )
+				continue;
+
+			int ndxPatch2 = pPatch[k];
+			for ( int i = 0; i < 3; i++ )
+			{
+				v[i] = emitlight[ndxPatch2][i] * g_Patches[ndxPatch2].reflectivity[i];
+			}
+			VectorScale( v, pTransfer[k], v );
+			VectorAdd( sum, v, sum );
+		}
+	}
+}
+
+
+void CTransferMatrix::GatherBumpLightReference( int ndxPatch, const CUtlVector<Vector> &emitlight,
+	const Vector *pNormals, Vector *pBumpSum ) const
+{
+	CPatch *patch = &g_Patches[ndxPatch];
+	Vector delta, v;
+
+	for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+	{
+		VectorFill( pBumpSum[i], 0 );
+	}
+
+	const int *pPatch;
+	const float *pTransfer;
+	int nCount;
+	CTransferRowReader reader( *this, ndxPatch, true );
+	while ( reader.NextTile( pPatch, pTransfer, nCount ) )
+	{
+		for ( int k = 0; k < nCount; k++ )
+		{
+			if ( pTransfer[k] == 0.0f )
+				continue;
+
+			int ndxPatch2 = pPatch[k];
+			CPatch *patch2 = &g_Patches[ndxPatch2];
+
+			VectorSubtract( patch2->origin, patch->origin, delta );
+			VectorNormalize( delta );
+			for ( int i = 0; i < 3; i++ )
+			{
+				v[i] = emitlight[ndxPatch2][i] * patch2->reflectivity[i];
+			}
+			float scale = 1.0f / DotProduct( delta, patch->normal );
+			VectorScale( v, pTransfer[k] * scale, v );
+
+			for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+			{
+				float dot = DotProduct( delta, pNormals[i] );
+				if ( dot <= 0 )
+					continue;
+				VectorMA( pBumpSum[i], dot, v, pBumpSum[i] );
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CTransferRowReader
+//-----------------------------------------------------------------------------
+CTransferRowReader::CTransferRowReader( const CTransferMatrix &matrix, int ndxPatch, bool bExact ) :
+	m_Matrix( matrix ),
+	m_ndxPatch( ndxPatch )
+{
+	m_bExact = bExact && matrix.m_bCompressed && matrix.m_ExactRows.Count();
+	m_pQuantized = NULL;
+	m_pIndexStream = NULL;
+	m_flScale = 0.0f;
+	m_ndxPrevPatch = 0;
+
+	if ( !matrix.m_bCompressed )
+	{
+		m_nRemaining = matrix.m_RowStart[ndxPatch+1] - matrix.m_RowStart[ndxPatch];
+		return;
+	}
+
+	if ( m_bExact )
+	{
+		m_nRemaining = matrix.m_ExactRows[ndxPatch].m_Patch.Count();
+		return;
+	}
+
+	const byte *pRow = matrix.m_CompressedRows[ndxPatch];
+	if ( !pRow )
+	{
+		m_nRemaining = 0;
+		return;
+	}
+
+	m_nRemaining = g_Patches[ndxPatch].numtransfers;
+
+	const CompressedRowHeader_t *pHeader = (const CompressedRowHeader_t*)pRow;
+	m_flScale = pHeader->m_flScale;
+	m_pQuantized = (const unsigned short*)( pHeader + 1 );
+	m_pIndexStream = (const byte*)( m_pQuantized + m_nRemaining );
+}
+
+
+bool CTransferRowReader::NextTile( const int *&pPatch, const float *&pTransfer, int &nCount )
+{
+	if ( m_nRemaining <= 0 )
+		return false;
+
+	if ( !m_Matrix.m_bCompressed )
+	{
+		int iStart = m_Matrix.m_RowStart[m_ndxPatch];
+		pPatch = m_Matrix.m_Patch.Base() + iStart;
+		pTransfer = m_Matrix.m_Transfer.Base() + iStart;
+		nCount = m_nRemaining;
+		m_nRemaining = 0;
+		return true;
+	}
+
+	if ( m_bExact )
+	{
+		const CTransferMatrix::ExactRow_t &exact = m_Matrix.m_ExactRows[m_ndxPatch];
+		pPatch = exact.m_Patch.Base();
+		pTransfer = exact.m_Transfer.Base();
+		nCount = m_nRemaining;
+		m_nRemaining = 0;
+		return true;
+	}
+
+	int nDecode = min( m_nRemaining, TRANSFER_TILE_SIZE );
+	for ( int i = 0; i < nDecode; i++ )
+	{
+		unsigned int nDelta;
+		m_pIndexStream = ReadVarInt( m_pIndexStream, nDelta );
+		m_ndxPrevPatch += nDelta;
+
+		m_TilePatch[i] = m_ndxPrevPatch;
+		m_TileTransfer[i] = (float)m_pQuantized[i] * m_flScale;
+	}
+	m_pQuantized += nDecode;
+	m_nRemaining -= nDecode;
+
+	nCount = ALIGN_VALUE( nDecode, 4 );
+	for ( int i = nDecode; i < nCount; i++ )
+	{
+		m_TilePatch[i] = m_ndxPatch;
+		m_TileTransfer[i] = 0.0f;
+	}
+
+	pPatch = m_TilePatch;
+	pTransfer = m_TileTransfer;
+	return true;
+}
@@ -0,0 +1,187 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compact storage for the patch to patch transfers used by the
+//			bounce passes, laid out for the SIMD GatherLight kernels.
+//
+//=============================================================================//
+
+#ifndef TRANSFERMATRIX_H
+#define TRANSFERMATRIX_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+#include "mathlib/ssemath.h"
+#include "threads.h"
+
+
+struct transfer_t;
+
+
+// Compressed rows are decoded this many transfers at a time.
+#define TRANSFER_TILE_SIZE	256
+
+
+//-----------------------------------------------------------------------------
+// All the transfers of all the patches in one CSR (compressed row) matrix.
+// Row i holds the transfers that patch i receives light through. Each row
+// starts on a 16 byte boundary and is padded to a multiple of four entries
+// with zero transfers, so the kernels can always work four at a time.
+//
+// The patch data GatherLight needs from the shooting patch (origin and
+// reflectivity) lives in separate structure-of-arrays streams instead of
+// being pulled out of the ~200 byte CPatch for every transfer.
+//
+// With -compresstransfers the rows are instead stored in big arena blocks
+// with the patch indices sorted and delta coded, and the coefficients
+// quantized to 16 bits against the largest transfer in the row. Rows are
+// decoded a tile at a time while gathering.
+//-----------------------------------------------------------------------------
+class CTransferMatrix
+{
+public:
+	CTransferMatrix();
+	~CTransferMatrix();
+
+	// Must be set before any MakeScales call.
+	void SetCompressed( bool bCompressed )			{ m_bCompressed = bCompressed; }
+	bool IsCompressed() const						{ return m_bCompressed; }
+
+	// Compressed mode only: also keep the unquantized transfers of every row,
+	// so -gatherlightcheck can measure what the quantization costs. Must be
+	// set before Init.
+	void SetKeepExactRows( bool bKeep )				{ m_bKeepExactRows = bKeep; }
+
+	// Non-zero transfers too small for the row's scale, stored as the smallest
+	// code instead of 0 so their light isn't lost.
+	int GetRoundedUpCount() const;
+
+	// Call before BuildVisMatrix.
+	void Init( int nPatches );
+
+	// Compressed mode only: encodes a row straight from MakeScales' scratch transfers,
+	// so patch->transfers never gets allocated. Each thread encodes into its own
+	// arena, so this doesn't lock; iThread is the index the thread function got.
+	void AddCompressedRow( int iThread, int ndxPatch, const transfer_t *pTransfers, int nTransfers, float flScale );
+
+	// Moves patch->transfers for every patch into the matrix and frees them.
+	// Call once all the MakeScales calls are done.
+	void Build();
+	void Purge();
+
+	int GetTransferCount() const					{ return m_nTransfers; }
+	size_t GetMemoryUsage() const;
+
+	// What the old per-patch transfer_t lists would have used.
+	size_t GetUncompressedMemoryUsage() const;
+
+	// Computes the light each patch shoots this bounce (emitlight * reflectivity).
+	void PrepareBounce( const CUtlVector<Vector> &emitlight );
+
+	// Sums the light patch ndxPatch receives this bounce.
+	void GatherLight( int ndxPatch, Vector &sum ) const;
+
+	// Same thing for bumpmapped patches: one sum per normal.
+	// pNormals[0] must be the patch's flat normal.
+	void GatherBumpLight( int ndxPatch, const Vector *pNormals, Vector *pBumpSum ) const;
+
+	// Straight scalar versions of the above that read the CPatch data
+	// exactly like the old per-patch transfer lists did, from the unquantized
+	// transfers when the rows are compressed. Used by -gatherlightcheck.
+	void GatherLightReference( int ndxPatch, const CUtlVector<Vector> &emitlight, Vector &sum ) const;
+	void GatherBumpLightReference( int ndxPatch, const CUtlVector<Vector> &emitlight, const Vector *pNormals, Vector *pBumpSum ) const;
+
+	// The kernels, on raw rows. They add into sum/pBumpSum.
+	// nCount must be a multiple of 4, both arrays 16 byte aligned.
+	void GatherRow( const int *pPatch, const float *pTransfer, int nCount, Vector &sum ) const;
+	void GatherBumpRow( int ndxPatch, const int *pPatch, const float *pTransfer, int nCount,
+		const Vector *pNormals, Vector *pBumpSum ) const;
+
+private:
+	friend class CTransferRowReader;
+
+	typedef CUtlVector< int, CUtlMemoryAligned< int, 16 > > AlignedIntVector_t;
+	typedef CUtlVector< float, CUtlMemoryAligned< float, 16 > > AlignedFloatVector_t;
+
+	// Compressed rows are carved out of big blocks, a set per thread.
+	struct Arena_t
+	{
+		CUtlVector< byte* > m_Blocks;
+		int m_nBlockUsed;
+		int m_nBlockSize;
+		size_t m_nBytes;
+
+		// AddCompressedRow's scratch, kept so the rows don't go to the heap
+		CUtlVector< transfer_t > m_Sorted;
+		CUtlVector< byte > m_Encoded;
+
+		int m_nRoundedUp;
+	};
+
+	struct ExactRow_t
+	{
+		CUtlVector< int > m_Patch;
+		CUtlVector< float > m_Transfer;
+	};
+
+	byte *AllocFromArena( Arena_t &arena, int nBytes );
+
+	bool m_bCompressed;
+
+	// Uncompressed rows: row i is [ m_RowStart[i], m_RowStart[i+1] ).
+	CUtlVector< int > m_RowStart;
+	AlignedIntVector_t m_Patch;
+	AlignedFloatVector_t m_Transfer;
+
+	// Compressed rows, indexed by patch. NULL for patches with no transfers.
+	CUtlVector< byte* > m_CompressedRows;
+	CThreadShards< Arena_t > m_Arenas;
+
+	bool m_bKeepExactRows;
+	CUtlVector< ExactRow_t > m_ExactRows;		// indexed by patch, only with m_bKeepExactRows
+
+	// Per patch streams, indexed by patch.
+	AlignedFloatVector_t m_Origin[3];
+	AlignedFloatVector_t m_Reflectivity[3];
+	AlignedFloatVector_t m_Radiance[3];			// emitlight * reflectivity for the current bounce
+
+	int m_nTransfers;							// real transfers, not counting padding
+};
+
+
+//-----------------------------------------------------------------------------
+// Walks one row of the matrix. Uncompressed rows come back in one piece,
+// compressed ones are decoded TRANSFER_TILE_SIZE transfers at a time.
+// Tiles are padded out to a multiple of 4 like the uncompressed rows.
+// bExact reads the unquantized copy of a compressed row, if the matrix kept
+// one, in one unpadded piece.
+//-----------------------------------------------------------------------------
+class CTransferRowReader
+{
+public:
+	CTransferRowReader( const CTransferMatrix &matrix, int ndxPatch, bool bExact = false );
+
+	bool NextTile( const int *&pPatch, const float *&pTransfer, int &nCount );
+
+private:
+	const CTransferMatrix &m_Matrix;
+	int m_ndxPatch;
+	int m_nRemaining;
+	bool m_bExact;
+
+	// Compressed decode state.
+	const unsigned short *m_pQuantized;
+	const byte *m_pIndexStream;
+	float m_flScale;
+	int m_ndxPrevPatch;
+
+	ALIGN16 int m_TilePatch[TRANSFER_TILE_SIZE] ALIGN16_POST;
+	ALIGN16 float m_TileTransfer[TRANSFER_TILE_SIZE] ALIGN16_POST;
+};
+
+
+extern CTransferMatrix g_TransferMatrix;
+
+
+#endif // TRANSFERMATRIX_H
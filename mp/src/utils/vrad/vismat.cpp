@@ -34,61 +34,110 @@ Use the PVS to accelerate if available
 #define PLANE_TEST_EPSILON  0.01 // patch must be this much in front of the plane to be considered "in front"
 #define PATCH_FACE_OFFSET  0.1 // push patch origins off from the face by this amount to avoid self collisions
 
-#define STREAM_SIZE 512
-
+//-----------------------------------------------------------------------------
+// Collects the patches a patch might get light from, then traces them all in
+// FourRays packets and makes the transfers for the ones it can see. There's
+// one per thread, reused row after row, so building the rows never locks or
+// goes to the heap once the arrays have grown.
+//-----------------------------------------------------------------------------
 class CTransferMaker
 {
 public:
 
-	CTransferMaker( transfer_t *all_transfers );
-	~CTransferMaker();
-
-	FORCEINLINE void TestMakeTransfer( Vector start, Vector stop, int ndxShooter, int ndxReciever )
+	FORCEINLINE void TestMakeTransfer( const Vector &start, const Vector &stop, int ndxShooter, int ndxReciever )
 	{
-		g_RtEnv.AddToRayStream( m_RayStream, start, stop, &m_pResults[m_nTests] );
-		m_pShooterPatches[m_nTests] = ndxShooter;
-		m_pRecieverPatches[m_nTests] = ndxReciever;
-		++m_nTests;
+		int i = m_Tests.AddToTail();
+		m_Tests[i].m_vecStart = start;
+		m_Tests[i].m_vecStop = stop;
+		m_Tests[i].m_ndxShooter = ndxShooter;
+		m_Tests[i].m_ndxReciever = ndxReciever;
 	}
 
-	void Finish();
+	int Count() const	{ return m_Tests.Count(); }
+
+	void Finish( transfer_t *all_transfers );
+
+	void Purge();
 
 private:
 
-	int m_nTests;
-	RayTracingSingleResult *m_pResults;
-	int *m_pShooterPatches;
-	int *m_pRecieverPatches;
-	RayStream m_RayStream;
-	transfer_t *m_AllTransfers;
+	struct Test_t
+	{
+		Vector m_vecStart;
+		Vector m_vecStop;
+		int m_ndxShooter;
+		int m_ndxReciever;
+		bool m_bVisible;
+	};
+
+	CUtlVector<Test_t> m_Tests;
+
+	// m_Tests indices by ray direction signs, so every packet can take the
+	// same path through the tree
+	CUtlVector<int> m_SignTests[8];
 };
 
-CTransferMaker::CTransferMaker( transfer_t *all_transfers ) :
-	m_AllTransfers( all_transfers ), m_nTests( 0 )
+void CTransferMaker::Finish( transfer_t *all_transfers )
 {
-	m_pResults = (RayTracingSingleResult *)calloc( 1, MAX_PATCHES * sizeof ( RayTracingSingleResult ) );
-	m_pShooterPatches = (int *)calloc( 1, MAX_PATCHES * sizeof( int ) );
-	m_pRecieverPatches = (int *)calloc( 1, MAX_PATCHES * sizeof( int ) );
-}
+	for ( int i = 0; i < m_Tests.Count(); ++i )
+	{
+		Vector delta = m_Tests[i].m_vecStop - m_Tests[i].m_vecStart;
+		int nSignMask = ( delta.x < 0 ? 1 : 0 ) | ( delta.y < 0 ? 2 : 0 ) | ( delta.z < 0 ? 4 : 0 );
+		m_SignTests[nSignMask].AddToTail( i );
+	}
 
-CTransferMaker::~CTransferMaker()
-{
-	free ( m_pResults );
-	free ( m_pShooterPatches );
-	free (m_pRecieverPatches );
-}
+	for ( int nSignMask = 0; nSignMask < 8; ++nSignMask )
+	{
+		CUtlVector<int> &tests = m_SignTests[nSignMask];
+		for ( int i = 0; i < tests.Count(); i += 4 )
+		{
+			// a short last packet repeats its last ray
+			int nRays = min( 4, tests.Count() - i );
 
-void CTransferMaker::Finish()
-{
-	g_RtEnv.FinishRayStream( m_RayStream );
-	for ( int i = 0; i < m_nTests; ++i )
+			FourRays rays;
+			for ( int j = 0; j < 4; ++j )
+			{
+				const Test_t &test = m_Tests[ tests[ i + min( j, nRays - 1 ) ] ];
+				rays.origin.X( j ) = test.m_vecStart.x;
+				rays.origin.Y( j ) = test.m_vecStart.y;
+				rays.origin.Z( j ) = test.m_vecStart.z;
+				rays.direction.X( j ) = test.m_vecStop.x - test.m_vecStart.x;
+				rays.direction.Y( j ) = test.m_vecStop.y - test.m_vecStart.y;
+				rays.direction.Z( j ) = test.m_vecStop.z - test.m_vecStart.z;
+			}
+
+			fltx4 tmax = rays.direction.length();
+			rays.direction *= ReciprocalSaturateSIMD( tmax );
+
+			RayTracingResult result;
+			g_RtEnv.Trace4Rays( rays, Four_Zeros, tmax, nSignMask, &result );
+
+			for ( int j = 0; j < nRays; ++j )
+			{
+				m_Tests[ tests[i + j] ].m_bVisible = ( result.HitIds[j] == -1 || SubFloat( result.HitDistance, j ) >= SubFloat( tmax, j ) );
+			}
+		}
+		tests.RemoveAll();
+	}
+
+	// make the transfers in the order they were tested, same as tracing them one at a time would
+	for ( int i = 0; i < m_Tests.Count(); ++i )
 	{
-		if ( m_pResults[i].HitID == -1 || m_pResults[i].HitDistance >= m_pResults[i].ray_length )
+		if ( m_Tests[i].m_bVisible )
 		{
-			MakeTransfer( m_pShooterPatches[i], m_pRecieverPatches[i], m_AllTransfers );
+			MakeTransfer( m_Tests[i].m_ndxShooter, m_Tests[i].m_ndxReciever, all_transfers );
 		}
 	}
-	m_nTests = 0;
+	m_Tests.RemoveAll();
+}
+
+void CTransferMaker::Purge()
+{
+	m_Tests.Purge();
+	for ( int i = 0; i < 8; ++i )
+	{
+		m_SignTests[i].Purge();
+	}
 }
 
 
@@ -155,7 +204,7 @@ void PvsForOrigin (Vector& org, byte *pvs)
 }
 
 
-void TestPatchToPatch( int ndxPatch1, int ndxPatch2, int head, transfer_t *transfers, CTransferMaker &transferMaker, int iThread )
+void TestPatchToPatch( int ndxPatch1, int ndxPatch2, CTransferMaker &transferMaker )
 {
 	Vector tmp;
 
@@ -177,8 +226,8 @@ void TestPatchToPatch( int ndxPatch1, int ndxPatch2, int head, transfer_t *trans
 		// FIXME: should be based on form-factor (ie. include visible angle, etc)
 		if ( DotProduct(tmp, tmp) * 0.0625 < patch2->area )
 		{
-			TestPatchToPatch( ndxPatch1, patch2->child1, head, transfers, transferMaker, iThread );
-			TestPatchToPatch( ndxPatch1, patch2->child2, head, transfers, transferMaker, iThread );
+			TestPatchToPatch( ndxPatch1, patch2->child1, transferMaker );
+			TestPatchToPatch( ndxPatch1, patch2->child2, transferMaker );
 			return;
 		}
 	}
@@ -186,8 +235,10 @@ void TestPatchToPatch( int ndxPatch1, int ndxPatch2, int head, transfer_t *trans
 	// check vis between patch and patch2
 	// if bit has not already been set
 	//  && v2 is not behind light plane
+	//  && the form factor is big enough to keep
 	//  && v2 is visible from v1
-	if ( DotProduct( patch2->origin, patch->normal ) > patch->planeDist + PLANE_TEST_EPSILON )
+	if ( DotProduct( patch2->origin, patch->normal ) > patch->planeDist + PLANE_TEST_EPSILON &&
+		 CanMakeTransfer( patch, patch2 ) )
 	{
 		// push out origins from face so that don't intersect their owners
 		Vector p1, p2;
@@ -205,7 +256,7 @@ TestPatchToFace
 Sets vis bits for all patches in the face
 ==============
 */
-void TestPatchToFace (unsigned patchnum, int facenum, int head, transfer_t *transfers, CTransferMaker &transferMaker, int iThread )
+void TestPatchToFace (unsigned patchnum, int facenum, CTransferMaker &transferMaker )
 {
 	if( faceParents.Element( facenum ) == g_Patches.InvalidIndex() || patchnum == g_Patches.InvalidIndex() )
 		return;
@@ -237,7 +288,7 @@ void TestPatchToFace (unsigned patchnum, int facenum, int head, transfer_t *tran
 			*/
 
 			int ndxPatch2 = patch2 - g_Patches.Base();
-			TestPatchToPatch( patchnum, ndxPatch2, head, transfers, transferMaker, iThread );
+			TestPatchToPatch( patchnum, ndxPatch2, transferMaker );
 		}
 	}
 }
@@ -296,25 +347,77 @@ void AddDispsToClusterTable( void )
 }
 
 
+// -hierarchical: pReciever gets light from pShooter
+struct HierarchicalLink_t
+{
+	int m_ndxReciever;
+	int m_ndxShooter;
+};
+
+//-----------------------------------------------------------------------------
+// What each BuildVisLeafs thread works with, kept from cluster to cluster.
+//-----------------------------------------------------------------------------
+struct VisLeafsThreadData_t
+{
+	CTransferMaker m_TransferMaker;
+
+	// The faces the patches of the current cluster get tested against
+	CUtlVector<int> m_Faces;
+
+	// Which faces are in m_Faces already. Set to m_nStamp rather than
+	// cleared for every cluster.
+	CUtlVector<int> m_FaceTested;
+	CUtlVector<int> m_DispTested;
+	int m_nStamp;
+
+	// -hierarchical: the patch tree of the face being built, parents first,
+	// and the links out of each of its patches
+	CUtlVector<int> m_TreePatches;
+	CUtlVector<int> m_TreeIndex;			// by patch, where it is in m_TreePatches
+	CUtlVector<int> m_TreeClusters;
+	CUtlVector<HierarchicalLink_t> m_Links;
+	CUtlVector<HierarchicalLink_t> m_SortedLinks;
+	CUtlVector<int> m_LinkStart;			// by m_TreePatches index, into m_SortedLinks
+	CUtlVector<transfer_t> m_Transfers;		// the rows of the whole tree, unscaled
+	CUtlVector<int> m_TransferStart;
+	CUtlVector<float> m_TransferTotal;		// energy of the patch's row plus its parents'
+	CUtlVector<float> m_TransferScale;
+};
+
+static CThreadShards<VisLeafsThreadData_t> s_VisLeafsThreadData;
+
+// Rays traced and patch pairs culled before tracing, for -verbose
+static CThreadShards<int> s_VisRayShards;
+static CThreadShards<int> s_VisCulledFaceShards;
+
+
 /*
 ==============
-BuildVisRow
+GatherVisibleFaces
 
-Calc vis bits from a single patch
+Finds the faces that the patches inside vecMins/vecMaxs can get light from.
+Everything the pvs leaves out, the sky, and faces all of them are behind are
+left out, so the rows only loop over what's left.
 ==============
 */
-void BuildVisRow (int patchnum, byte *pvs, int head, transfer_t *transfers, CTransferMaker &transferMaker, int iThread )
+void GatherVisibleFaces( byte *pvs, const Vector &vecMins, const Vector &vecMaxs, VisLeafsThreadData_t &data, int iThread )
 {
 	int		j, k, l, leafIndex;
-	CPatch	*patch;
 	dleaf_t	*leaf;
-	byte	face_tested[MAX_MAP_FACES];
-	byte	disp_tested[MAX_MAP_FACES];
 
-	patch = &g_Patches.Element( patchnum );
-
-	memset( face_tested, 0, numfaces ) ;
-	memset( disp_tested, 0, numfaces );
+	data.m_Faces.RemoveAll();
+	if ( data.m_FaceTested.Count() != numfaces )
+	{
+		data.m_FaceTested.SetCount( numfaces );
+		data.m_DispTested.SetCount( numfaces );
+		for ( j = 0; j < numfaces; j++ )
+		{
+			data.m_FaceTested[j] = 0;
+			data.m_DispTested[j] = 0;
+		}
+		data.m_nStamp = 0;
+	}
+	int nStamp = ++data.m_nStamp;
 
 	for (j=0; j<dvis->numclusters; j++)
 	{
@@ -332,16 +435,12 @@ void BuildVisRow (int patchnum, byte *pvs, int head, transfer_t *transfers, CTra
 				l = dleaffaces[leaf->firstleafface + k];
 				// faces can be marksurfed by multiple leaves, but
 				// don't bother testing again
-				if (face_tested[l])
+				if (data.m_FaceTested[l] == nStamp)
 				{
 					continue;
 				}
-				face_tested[l] = 1;
-
-				// don't check patches on the same face
-				if (patch->faceNumber == l)
-					continue;
-				TestPatchToFace (patchnum, l, head, transfers, transferMaker, iThread );
+				data.m_FaceTested[l] = nStamp;
+				data.m_Faces.AddToTail( l );
 			}
 		}
 
@@ -349,19 +448,84 @@ void BuildVisRow (int patchnum, byte *pvs, int head, transfer_t *transfers, CTra
 		for( int ndxDisp = 0; ndxDisp < dispCount; ndxDisp++ )
 		{
 			int ndxFace = g_ClusterDispFaces[j].dispFaces[ndxDisp];
-			if( disp_tested[ndxFace] )
+			if( data.m_DispTested[ndxFace] == nStamp )
 				continue;
 
-			disp_tested[ndxFace] = 1;
+			data.m_DispTested[ndxFace] = nStamp;
+			data.m_Faces.AddToTail( ndxFace );
+		}
+	}
 
-			// don't check patches on the same face
-			if( patch->faceNumber == ndxFace )
-				continue;
+	// TestPatchToFace skips the whole face when the patch is behind it, and
+	// MakeTransfer drops anything going to the sky, so those can go for all
+	// the patches at once
+	int nFaces = 0;
+	for ( j = 0; j < data.m_Faces.Count(); j++ )
+	{
+		int ndxFace = data.m_Faces[j];
+		int ndxParent = faceParents.Element( ndxFace );
+		if ( ndxParent == g_Patches.InvalidIndex() )
+			continue;
+
+		const CPatch *pParent = &g_Patches[ndxParent];
+		if ( pParent->sky )
+			continue;
 
-			TestPatchToFace( patchnum, ndxFace, head, transfers, transferMaker, iThread );
+		Vector vecFar;
+		for ( k = 0; k < 3; k++ )
+		{
+			vecFar[k] = ( pParent->normal[k] > 0 ) ? vecMaxs[k] : vecMins[k];
 		}
+		if ( DotProduct( vecFar, pParent->normal ) < pParent->planeDist )
+			continue;
+
+		data.m_Faces[nFaces++] = ndxFace;
 	}
+	s_VisCulledFaceShards[iThread] += data.m_Faces.Count() - nFaces;
+	data.m_Faces.SetCountNonDestructively( nFaces );
+}
+
+
+/*
+==============
+GatherClusterFaces
+
+The faces the patches in a cluster get tested against
+==============
+*/
+void GatherClusterFaces( int iCluster, byte *pvs, VisLeafsThreadData_t &data, int iThread )
+{
+	// bounds of the patch origins in the cluster
+	Vector vecMins, vecMaxs;
+	ClearBounds( vecMins, vecMaxs );
+	for ( int ndxPatch = clusterChildren.Element( iCluster ); ndxPatch != g_Patches.InvalidIndex(); ndxPatch = g_Patches[ndxPatch].ndxNextClusterChild )
+	{
+		AddPointToBounds( g_Patches[ndxPatch].origin, vecMins, vecMaxs );
+	}
+
+	GatherVisibleFaces( pvs, vecMins, vecMaxs, data, iThread );
+}
+
+
+/*
+==============
+BuildVisRow
+
+Calc vis bits from a single patch
+==============
+*/
+void BuildVisRow (int patchnum, const CUtlVector<int> &faces, CTransferMaker &transferMaker )
+{
+	CPatch	*patch = &g_Patches.Element( patchnum );
 
+	for ( int i = 0; i < faces.Count(); i++ )
+	{
+		// don't check patches on the same face
+		if ( patch->faceNumber == faces[i] )
+			continue;
+
+		TestPatchToFace( patchnum, faces[i], transferMaker );
+	}
 
 	// Msg("%d) Transfers: %5d\n", patchnum, patch->numtransfers);
 }
@@ -392,42 +556,43 @@ void BuildVisLeafs_Cluster(
 {
 	byte	pvs[(MAX_MAP_CLUSTERS+7)/8];
 	CPatch	*patch;
-	int		head;
 	unsigned	patchnum;
-	
-	DecompressVis( &dvisdata[ dvis->bitofs[ iCluster ][DVIS_PVS] ], pvs);
-	head = 0;
 
-	CTransferMaker transferMaker( transfers );
+	if( clusterChildren.Element( iCluster ) == clusterChildren.InvalidIndex() )
+		return;
+
+	VisLeafsThreadData_t &data = s_VisLeafsThreadData[threadnum];
+
+	// the faces are the same for every patch in the cluster, so find them once
+	DecompressVis( &dvisdata[ dvis->bitofs[ iCluster ][DVIS_PVS] ], pvs);
+	GatherClusterFaces( iCluster, pvs, data, threadnum );
 
 	// light every patch in the cluster
-	if( clusterChildren.Element( iCluster ) != clusterChildren.InvalidIndex() )
+	CPatch *pNextPatch;
+	for( patch = &g_Patches.Element( clusterChildren.Element( iCluster ) ); patch; patch = pNextPatch )
 	{
-		CPatch *pNextPatch;
-		for( patch = &g_Patches.Element( clusterChildren.Element( iCluster ) ); patch; patch = pNextPatch )
+		//
+		// next patch
+		//
+		pNextPatch = NULL;
+		if( patch->ndxNextClusterChild != g_Patches.InvalidIndex() )
 		{
-			//
-			// next patch
-			//
-			pNextPatch = NULL;
-			if( patch->ndxNextClusterChild != g_Patches.InvalidIndex() )
-			{
-				pNextPatch = &g_Patches.Element( patch->ndxNextClusterChild );
-			}
-			
-			patchnum = patch - g_Patches.Base();
-
-			// build to all other world clusters
-			BuildVisRow (patchnum, pvs, head, transfers, transferMaker, threadnum );
-			transferMaker.Finish();
-			
-			// do the transfers
-			MakeScales( patchnum, transfers );
-
-			// Let MPI aggregate the data if it's being used.
-			if ( PatchCB )
-				PatchCB( threadnum, patchnum, patch );
+			pNextPatch = &g_Patches.Element( patch->ndxNextClusterChild );
 		}
+		
+		patchnum = patch - g_Patches.Base();
+
+		// build to all other world clusters
+		BuildVisRow (patchnum, data.m_Faces, data.m_TransferMaker );
+		s_VisRayShards[threadnum] += data.m_TransferMaker.Count();
+		data.m_TransferMaker.Finish( transfers );
+		
+		// do the transfers
+		MakeScales( threadnum, patchnum, transfers );
+
+		// Let MPI aggregate the data if it's being used.
+		if ( PatchCB )
+			PatchCB( threadnum, patchnum, patch );
 	}
 }
 
@@ -438,6 +603,233 @@ void BuildVisLeafs_End( transfer_t *transfers )
 }
 
 
+/*
+==============
+RefineLink
+
+-hierarchical: links pReciever to pShooter if both are small next to the
+distance between them, otherwise tries again with the children of whichever
+one is bigger. With the receivers always split down to the leaves, this is
+the same choice TestPatchToPatch makes.
+==============
+*/
+void RefineLink( int ndxReciever, int ndxShooter, VisLeafsThreadData_t &data )
+{
+	CPatch *pReciever = &g_Patches.Element( ndxReciever );
+	CPatch *pShooter = &g_Patches.Element( ndxShooter );
+
+	Vector delta;
+	VectorSubtract( pReciever->origin, pShooter->origin, delta );
+	float flMaxArea = DotProduct( delta, delta ) * g_flHierarchicalError;
+
+	bool bSplitShooter = ( pShooter->child1 != g_Patches.InvalidIndex() && pShooter->area > flMaxArea );
+	bool bSplitReciever = ( pReciever->child1 != g_Patches.InvalidIndex() && pReciever->area > flMaxArea );
+
+	if ( bSplitShooter && ( !bSplitReciever || pShooter->area >= pReciever->area ) )
+	{
+		RefineLink( ndxReciever, pShooter->child1, data );
+		RefineLink( ndxReciever, pShooter->child2, data );
+		return;
+	}
+
+	if ( bSplitReciever )
+	{
+		RefineLink( pReciever->child1, ndxShooter, data );
+		RefineLink( pReciever->child2, ndxShooter, data );
+		return;
+	}
+
+	// each has to be in front of the other, like TestPatchToFace and TestPatchToPatch check
+	if ( DotProduct( pShooter->origin, pReciever->normal ) <= pReciever->planeDist + PLANE_TEST_EPSILON ||
+		 DotProduct( pReciever->origin, pShooter->normal ) <= pShooter->planeDist + PLANE_TEST_EPSILON )
+		return;
+
+	if ( !CanMakeTransfer( pReciever, pShooter ) )
+		return;
+
+	int i = data.m_Links.AddToTail();
+	data.m_Links[i].m_ndxReciever = ndxReciever;
+	data.m_Links[i].m_ndxShooter = ndxShooter;
+}
+
+
+/*
+==============
+BuildVisLeafs_Face
+
+-hierarchical: builds the rows of every patch in a face's patch trees, parents
+included. A leaf ends up with the light of its own row and all its parents'
+rows (see PushLight), so the rows are scaled together.
+==============
+*/
+void BuildVisLeafs_Face( int threadnum, transfer_t *transfers, int iFace )
+{
+	byte	pvs[(MAX_MAP_CLUSTERS+7)/8];
+	byte	clusterPvs[(MAX_MAP_CLUSTERS+7)/8];
+	int		i, j;
+
+	int ndxRoot = faceParents.Element( iFace );
+	if ( ndxRoot == g_Patches.InvalidIndex() || g_Patches[ndxRoot].sky )
+		return;
+
+	VisLeafsThreadData_t &data = s_VisLeafsThreadData[threadnum];
+	if ( data.m_TreeIndex.Count() != g_Patches.Count() )
+	{
+		data.m_TreeIndex.SetCount( g_Patches.Count() );
+	}
+
+	// the patch trees, parents before their children
+	data.m_TreePatches.RemoveAll();
+	for ( int ndxPatch = ndxRoot; ndxPatch != g_Patches.InvalidIndex(); ndxPatch = g_Patches[ndxPatch].ndxNextParent )
+	{
+		data.m_TreePatches.AddToTail( ndxPatch );
+	}
+	for ( i = 0; i < data.m_TreePatches.Count(); i++ )
+	{
+		CPatch *patch = &g_Patches[ data.m_TreePatches[i] ];
+		if ( patch->child1 != g_Patches.InvalidIndex() )
+		{
+			data.m_TreePatches.AddToTail( patch->child1 );
+			data.m_TreePatches.AddToTail( patch->child2 );
+		}
+	}
+	int nTree = data.m_TreePatches.Count();
+
+	// everything the leaves' clusters can see
+	Vector vecMins, vecMaxs;
+	ClearBounds( vecMins, vecMaxs );
+	data.m_TreeClusters.RemoveAll();
+	for ( i = 0; i < nTree; i++ )
+	{
+		CPatch *patch = &g_Patches[ data.m_TreePatches[i] ];
+		data.m_TreeIndex[ data.m_TreePatches[i] ] = i;
+		AddPointToBounds( patch->origin, vecMins, vecMaxs );
+
+		if ( patch->child1 == g_Patches.InvalidIndex() && patch->clusterNumber != -1 &&
+			 data.m_TreeClusters.Find( patch->clusterNumber ) == -1 )
+		{
+			data.m_TreeClusters.AddToTail( patch->clusterNumber );
+		}
+	}
+
+	// the leaves outside the world don't get lit without -hierarchical either
+	if ( !data.m_TreeClusters.Count() )
+		return;
+
+	int nPvsBytes = ( dvis->numclusters + 7 ) / 8;
+	memset( pvs, 0, nPvsBytes );
+	for ( i = 0; i < data.m_TreeClusters.Count(); i++ )
+	{
+		DecompressVis( &dvisdata[ dvis->bitofs[ data.m_TreeClusters[i] ][DVIS_PVS] ], clusterPvs );
+		for ( j = 0; j < nPvsBytes; j++ )
+		{
+			pvs[j] |= clusterPvs[j];
+		}
+	}
+
+	GatherVisibleFaces( pvs, vecMins, vecMaxs, data, threadnum );
+
+	// link the trees to the trees of every other face
+	data.m_Links.RemoveAll();
+	for ( i = 0; i < data.m_Faces.Count(); i++ )
+	{
+		if ( data.m_Faces[i] == iFace )
+			continue;
+
+		for ( int ndxReciever = ndxRoot; ndxReciever != g_Patches.InvalidIndex(); ndxReciever = g_Patches[ndxReciever].ndxNextParent )
+		{
+			for ( int ndxShooter = faceParents.Element( data.m_Faces[i] ); ndxShooter != g_Patches.InvalidIndex(); ndxShooter = g_Patches[ndxShooter].ndxNextParent )
+			{
+				RefineLink( ndxReciever, ndxShooter, data );
+			}
+		}
+	}
+
+	// sort the links by receiver
+	data.m_LinkStart.SetCount( nTree + 1 );
+	memset( data.m_LinkStart.Base(), 0, ( nTree + 1 ) * sizeof( int ) );
+	for ( i = 0; i < data.m_Links.Count(); i++ )
+	{
+		data.m_LinkStart[ data.m_TreeIndex[ data.m_Links[i].m_ndxReciever ] + 1 ]++;
+	}
+	for ( i = 0; i < nTree; i++ )
+	{
+		data.m_LinkStart[i+1] += data.m_LinkStart[i];
+	}
+	data.m_SortedLinks.SetCount( data.m_Links.Count() );
+	for ( i = 0; i < data.m_Links.Count(); i++ )
+	{
+		data.m_SortedLinks[ data.m_LinkStart[ data.m_TreeIndex[ data.m_Links[i].m_ndxReciever ] ]++ ] = data.m_Links[i];
+	}
+	for ( i = nTree; i > 0; i-- )
+	{
+		data.m_LinkStart[i] = data.m_LinkStart[i-1];
+	}
+	data.m_LinkStart[0] = 0;
+
+	// trace the rows
+	data.m_Transfers.RemoveAll();
+	data.m_TransferStart.SetCount( nTree );
+	data.m_TransferTotal.SetCount( nTree );
+	for ( i = 0; i < nTree; i++ )
+	{
+		int ndxPatch = data.m_TreePatches[i];
+		CPatch *patch = &g_Patches[ndxPatch];
+
+		for ( j = data.m_LinkStart[i]; j < data.m_LinkStart[i+1]; j++ )
+		{
+			CPatch *pShooter = &g_Patches[ data.m_SortedLinks[j].m_ndxShooter ];
+
+			// push out origins from face so that don't intersect their owners
+			Vector p1, p2;
+			VectorAdd( patch->origin, patch->normal, p1 );
+			VectorAdd( pShooter->origin, pShooter->normal, p2 );
+			data.m_TransferMaker.TestMakeTransfer( p1, p2, ndxPatch, data.m_SortedLinks[j].m_ndxShooter );
+		}
+		s_VisRayShards[threadnum] += data.m_TransferMaker.Count();
+		data.m_TransferMaker.Finish( transfers );
+
+		float total = 0;
+		for ( j = 0; j < patch->numtransfers; j++ )
+		{
+			total += transfers[j].transfer;
+		}
+		if ( patch->parent != g_Patches.InvalidIndex() )
+		{
+			total += data.m_TransferTotal[ data.m_TreeIndex[patch->parent] ];
+		}
+
+		data.m_TransferStart[i] = data.m_Transfers.Count();
+		data.m_Transfers.AddMultipleToTail( patch->numtransfers, transfers );
+		data.m_TransferTotal[i] = total;
+	}
+
+	// the most any leaf under each patch gets
+	data.m_TransferScale.CopyArray( data.m_TransferTotal.Base(), nTree );
+	for ( i = nTree - 1; i >= 0; i-- )
+	{
+		CPatch *patch = &g_Patches[ data.m_TreePatches[i] ];
+		if ( patch->child1 != g_Patches.InvalidIndex() )
+		{
+			data.m_TransferScale[i] = max( data.m_TransferScale[ data.m_TreeIndex[patch->child1] ],
+										   data.m_TransferScale[ data.m_TreeIndex[patch->child2] ] );
+		}
+	}
+
+	for ( i = 0; i < nTree; i++ )
+	{
+		// the total transfer should be PI, but we need to correct errors due to overlaping surfaces
+		float total = data.m_TransferScale[i];
+		if (total > M_PI)
+			total = 1.0f/total;
+		else
+			total = 1.0f/M_PI;
+
+		StoreTransfers( threadnum, data.m_TreePatches[i], data.m_Transfers.Base() + data.m_TransferStart[i], total );
+	}
+}
+
+
 void BuildVisLeafs( int threadnum, void *pUserData )
 {
 	transfer_t *transfers = BuildVisLeafs_Start();
@@ -460,6 +852,20 @@ void BuildVisLeafs( int threadnum, void *pUserData )
 }
 
 
+void BuildVisLeafs_Hierarchical( int threadnum, void *pUserData )
+{
+	transfer_t *transfers = BuildVisLeafs_Start();
+
+	int iFace;
+	while ( ( iFace = GetThreadWork() ) != -1 )
+	{
+		BuildVisLeafs_Face( threadnum, transfers, iFace );
+	}
+
+	BuildVisLeafs_End( transfers );
+}
+
+
 /*
 ==============
 BuildVisMatrix
@@ -467,17 +873,43 @@ BuildVisMatrix
 */
 void BuildVisMatrix (void)
 {
+	s_VisRayShards.Reset( 0 );
+	s_VisCulledFaceShards.Reset( 0 );
+
 	if ( g_bUseMPI )
 	{
 		RunMPIBuildVisLeafs();
 	}
+	else if ( g_bHierarchical )
+	{
+		RunThreadsOn (numfaces, true, BuildVisLeafs_Hierarchical);
+	}
 	else 
 	{
 		RunThreadsOn (dvis->numclusters, true, BuildVisLeafs);
 	}
+
+	qprintf( "%d visibility rays, %d cluster/face pairs culled\n", s_VisRayShards.Sum(), s_VisCulledFaceShards.Sum() );
 }
 
 void FreeVisMatrix (void)
 {
-
+	for ( int i = 0; i < MAX_TOOL_THREADS+1; i++ )
+	{
+		VisLeafsThreadData_t &data = s_VisLeafsThreadData[i];
+		data.m_TransferMaker.Purge();
+		data.m_Faces.Purge();
+		data.m_FaceTested.Purge();
+		data.m_DispTested.Purge();
+		data.m_TreePatches.Purge();
+		data.m_TreeIndex.Purge();
+		data.m_TreeClusters.Purge();
+		data.m_Links.Purge();
+		data.m_SortedLinks.Purge();
+		data.m_LinkStart.Purge();
+		data.m_Transfers.Purge();
+		data.m_TransferStart.Purge();
+		data.m_TransferTotal.Purge();
+		data.m_TransferScale.Purge();
+	}
 }
@@ -19,6 +19,11 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "transfermatrix.h"
+#include "lightcache.h"
+#include "progressive.h"
+#include "irradiance_probes.h"
+#include "telemetry.h"
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -49,6 +54,7 @@ Vector		face_offset[MAX_MAP_FACES];		// for rotating bmodels
 int			fakeplanes;
 
 unsigned	numbounce = 100; // 25; /* Originally this was 8 */
+bool		g_bBounceConverged = false;	// the last BounceLight stopped because little was left to add, not at numbounce
 
 float		maxchop = 4; // coarsest allowed number of luxel widths for a patch
 float		minchop = 4; // "-chop" tightest number of luxel widths for a patch, used on edges
@@ -61,6 +67,13 @@ bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
 bool		g_bDumpPropLightmaps = false;
+bool		g_bGatherLightCheck = false;
+bool		g_bRtBenchmark = false;
+bool		g_bShadowRayQueue = true;
+bool		g_bRtCache = true;
+bool		g_bTelemetry = false;
+bool		g_bHierarchical = false;
+float		g_flHierarchicalError = 0.0625f;
 
 
 int			junk;
@@ -80,6 +93,7 @@ char		level_lights[MAX_PATH] = "";
 
 char		vismatfile[_MAX_PATH] = "";
 char		incrementfile[_MAX_PATH] = "";
+char		rtcachefile[_MAX_PATH] = "";
 
 IIncremental *g_pIncremental = 0;
 bool		g_bInterrupt = false;	// Wsed with background lighting in WC. Tells VRAD
@@ -918,6 +932,58 @@ void SubdividePatch( int ndxPatch )
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: build the list of patches on each face and the list of leaf patches
+//          to light in each cluster, leaving out the patches pSkip marks (NULL
+//          for none)
+//-----------------------------------------------------------------------------
+void LinkPatches( const byte *pSkip )
+{
+	int i;
+
+	// fixup next pointers
+	for (i = 0; i < numfaces; i++)
+	{
+		g_FacePatches[i] = g_FacePatches.InvalidIndex();
+	}
+
+	for (i = 0; i < clusterChildren.Count(); i++)
+	{
+		clusterChildren[i] = clusterChildren.InvalidIndex();
+	}
+
+	int nPatchCount = g_Patches.Count();
+	for (i = 0; i < nPatchCount; i++)
+	{
+		if ( pSkip && pSkip[i] )
+			continue;
+
+		CPatch *pCur = &g_Patches.Element( i );
+		pCur->ndxNext = g_FacePatches.Element( pCur->faceNumber );
+		g_FacePatches[pCur->faceNumber] = i;
+	}
+
+	// build the list of patches that need to be lit
+	// do them in reverse order
+	for ( i = nPatchCount - 1; i >= 0; i-- )
+	{
+		if ( pSkip && pSkip[i] )
+			continue;
+
+		// skip patches with children
+		CPatch *pCur = &g_Patches.Element( i );
+		if( pCur->child1 == g_Patches.InvalidIndex() )
+		{
+			if( pCur->clusterNumber != - 1 )
+			{
+				pCur->ndxNextClusterChild = clusterChildren.Element( pCur->clusterNumber );
+				clusterChildren[pCur->clusterNumber] = i;
+			}
+		}
+	}
+}
+
+
 /*
 =============
 SubdividePatches
@@ -925,7 +991,7 @@ SubdividePatches
 */
 void SubdividePatches (void)
 {
-	unsigned		i, num;
+	unsigned		i;
 
 	if (numbounce == 0)
 		return;
@@ -962,26 +1028,7 @@ void SubdividePatches (void)
 		}
 	}
 
-	// fixup next pointers
-	for (i = 0; i < (unsigned)numfaces; i++)
-	{
-		g_FacePatches[i] = g_FacePatches.InvalidIndex();
-	}
-
 	uiPatchCount = g_Patches.Size();
-	for (i = 0; i < uiPatchCount; i++)
-	{
-		CPatch *pCur = &g_Patches.Element( i );
-		pCur->ndxNext = g_FacePatches.Element( pCur->faceNumber );
-		g_FacePatches[pCur->faceNumber] = pCur - g_Patches.Base();
-
-#if 0
-		CPatch *prev;
-		prev = face_g_Patches[g_Patches[i].faceNumber];
-		g_Patches[i].next = prev;
-		face_g_Patches[g_Patches[i].faceNumber] = &g_Patches[i];
-#endif
-	}
 
 	// Cache off the leaf number:
 	// We have to do this after subdivision because some patches span leaves.
@@ -1012,34 +1059,7 @@ void SubdividePatches (void)
 		}
 	}
 
-	// build the list of patches that need to be lit
-	for ( num = 0; num < uiPatchCount; num++ )
-	{
-		// do them in reverse order
-		i = uiPatchCount - num - 1;
-
-		// skip patches with children
-		CPatch *pCur = &g_Patches.Element( i );
-		if( pCur->child1 == g_Patches.InvalidIndex() )
-		{
-			if( pCur->clusterNumber != - 1 )
-			{
-				pCur->ndxNextClusterChild = clusterChildren.Element( pCur->clusterNumber );
-				clusterChildren[pCur->clusterNumber] = pCur - g_Patches.Base();
-			}
-		}
-
-#if 0
-		if (g_Patches[i].child1 == g_Patches.InvalidIndex() )
-		{
-			if( g_Patches[i].clusterNumber != -1 )
-			{
-				g_Patches[i].nextclusterchild = cluster_children[g_Patches[i].clusterNumber];
-				cluster_children[g_Patches[i].clusterNumber] = &g_Patches[i];
-			}
-		}
-#endif
-	}
+	LinkPatches( NULL );
 
 	qprintf ("%i patches after subdivision\n", uiPatchCount);
 }
@@ -1058,6 +1078,10 @@ MakeScales
 int	total_transfer;
 int max_transfer;
 
+// MakeScales' per-thread part of the above, folded in by MakeAllScales
+static CThreadShards<int> s_TotalTransferShards;
+static CThreadShards<int> s_MaxTransferShards;
+
 
 //-----------------------------------------------------------------------------
 // Purpose: Computes the form factor from a polygon patch to a differential patch
@@ -1111,6 +1135,44 @@ float FormFactorDiffToDiff ( CPatch *pDiff1, CPatch* pDiff2 )
 
 
 
+//-----------------------------------------------------------------------------
+// Purpose: False when MakeTransfer would throw the transfer away whether or not
+//          the patches can see each other, so BuildVisMatrix doesn't trace it.
+//          Otherwise pScale gets the form factor, or 0 for close patches, which
+//          need the polygon form factor. That one isn't bounded here.
+//-----------------------------------------------------------------------------
+bool CanMakeTransfer( CPatch *pPatch1, CPatch *pPatch2, float *pScale )
+{
+	// hack for patch areas that area <= 0 (degenerate)
+	if ( pPatch2->area <= 0 )
+		return false;
+
+	// patch normals may be > 90 due to smoothing groups
+	float scale = FormFactorDiffToDiff( pPatch2, pPatch1 );
+	if ( scale <= 0 )
+		return false;
+
+	// Test 5 times rule
+	Vector vDelta;
+	VectorSubtract( pPatch1->origin, pPatch2->origin, vDelta );
+	float flThreshold = ( M_PI * 0.04 ) * DotProduct( vDelta, vDelta );
+	if ( flThreshold < pPatch2->area )
+	{
+		scale = 0;
+	}
+	else if ( pPatch2->area * scale <= TRANSFER_EPSILON )
+	{
+		return false;
+	}
+
+	if ( pScale )
+	{
+		*pScale = scale;
+	}
+	return true;
+}
+
+
 void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers )
 //void MakeTransfer (CPatch *patch, CPatch *patch2, transfer_t *all_transfers )
 {
@@ -1137,29 +1199,15 @@ void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers )
 		return;
 	}
 
-	// hack for patch areas that area <= 0 (degenerate)
-	if ( pPatch2->area <= 0)
+	if ( !CanMakeTransfer( pPatch1, pPatch2, &scale ) )
 	{
 		return;
 	}
 
 	transfer = &all_transfers[pPatch1->numtransfers];
 
-	scale = FormFactorDiffToDiff( pPatch2, pPatch1 );
-
-	// patch normals may be > 90 due to smoothing groups
-	if (scale <= 0)
-	{
-		//Msg("scale <= 0\n");
-		return;
-	}
-
-	// Test 5 times rule
-	Vector vDelta;
-	VectorSubtract( pPatch1->origin, pPatch2->origin, vDelta );
-	float flThreshold = ( M_PI * 0.04 ) * DotProduct( vDelta, vDelta );
-
-	if (flThreshold < pPatch2->area)
+	// Close enough that the patch can't be treated as a point
+	if (scale == 0)
 	{
 		scale = FormFactorPolyToDiff( pPatch2, pPatch1 );
 		if (scale <= 0.0)
@@ -1199,55 +1247,73 @@ void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers )
 }
 
 
-void MakeScales ( int ndxPatch, transfer_t *all_transfers )
+void MakeScales ( int iThread, int ndxPatch, transfer_t *all_transfers )
 {
 	int		j;
 	float	total;
-	transfer_t	*t, *t2;
+	transfer_t	*t2;
 	total = 0;
 
 	if( ndxPatch == g_Patches.InvalidIndex() )
 		return;
 	CPatch *patch = &g_Patches.Element( ndxPatch );
 
-	// copy the transfers out
-	if (patch->numtransfers)
+	// get total transfer energy
+	t2 = all_transfers;
+
+	// overflow check!
+	for (j=0 ; j<patch->numtransfers ; j++, t2++)
 	{
-		if (patch->numtransfers > max_transfer)
-		{
-			max_transfer = patch->numtransfers;
-		}
+		total += t2->transfer;
+	}
+
+	// the total transfer should be PI, but we need to correct errors due to overlaping surfaces
+	if (total > M_PI)
+		total = 1.0f/total;
+	else	
+		total = 1.0f/M_PI;
+
+	StoreTransfers( iThread, ndxPatch, all_transfers, total );
+}
 
 
-		patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
-		if (!patch->transfers)
-			Error ("Memory allocation failure");
+//-----------------------------------------------------------------------------
+// Purpose: scales the patch's transfers by total and copies them out to where
+//          the bounce passes will find them
+//-----------------------------------------------------------------------------
+void StoreTransfers( int iThread, int ndxPatch, transfer_t *all_transfers, float total )
+{
+	int		j;
+	transfer_t	*t, *t2;
 
-		// get total transfer energy
-		t2 = all_transfers;
+	CPatch *patch = &g_Patches.Element( ndxPatch );
 
-		// overflow check!
-		for (j=0 ; j<patch->numtransfers ; j++, t2++)
+	// copy the transfers out
+	if (patch->numtransfers)
+	{
+		if (patch->numtransfers > s_MaxTransferShards[iThread])
 		{
-			total += t2->transfer;
+			s_MaxTransferShards[iThread] = patch->numtransfers;
 		}
 
-		// the total transfer should be PI, but we need to correct errors due to overlaping surfaces
-		if (total > M_PI)
-			total = 1.0f/total;
-		else	
-			total = 1.0f/M_PI;
-
-		t = patch->transfers;
-		t2 = all_transfers;
-		for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
+		if ( g_TransferMatrix.IsCompressed() && !g_bUseMPI )
 		{
-			t->transfer = t2->transfer*total;
-			t->patch = t2->patch;
+			// encode straight into the transfer matrix, the full precision list never exists
+			g_TransferMatrix.AddCompressedRow( iThread, ndxPatch, all_transfers, patch->numtransfers, total );
 		}
-		if (patch->numtransfers > max_transfer)
+		else
 		{
-			max_transfer = patch->numtransfers;
+			patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
+			if (!patch->transfers)
+				Error ("Memory allocation failure");
+
+			t = patch->transfers;
+			t2 = all_transfers;
+			for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
+			{
+				t->transfer = t2->transfer*total;
+				t->patch = t2->patch;
+			}
 		}
 	}
 	else
@@ -1256,9 +1322,7 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		// patch->totallight[2] = 255;
 	}
 
-	ThreadLock ();
-	total_transfer += patch->numtransfers;
-	ThreadUnlock ();
+	s_TotalTransferShards[iThread] += patch->numtransfers;
 }
 
 /*
@@ -1366,6 +1430,54 @@ void WriteNormal( FileHandle_t out, Vector const &nPos, Vector const &nDir,
 		color.x / 256, color.y / 256, color.z / 256 );
 }
 
+CThreadedDumpFile::CThreadedDumpFile()
+{
+	for ( int i = 0; i < MAX_TOOL_THREADS+1; i++ )
+	{
+		m_Buffers[i].SetBufferType( true, false );
+	}
+}
+
+void CThreadedDumpFile::Flush( FileHandle_t out )
+{
+	for ( int i = 0; i < MAX_TOOL_THREADS+1; i++ )
+	{
+		if ( out && m_Buffers[i].TellPut() )
+		{
+			g_pFileSystem->Write( m_Buffers[i].Base(), m_Buffers[i].TellPut(), out );
+		}
+		m_Buffers[i].Purge();
+	}
+}
+
+void WriteWinding( CUtlBuffer &out, winding_t *w, Vector const &color )
+{
+	out.Printf( "%i\n", w->numpoints );
+	for ( int i = 0; i < w->numpoints; i++ )
+	{
+		out.Printf( "%5.2f %5.2f %5.2f %5.3f %5.3f %5.3f\n",
+			w->p[i][0],
+			w->p[i][1],
+			w->p[i][2],
+			color[ 0 ] / 256,
+			color[ 1 ] / 256,
+			color[ 2 ] / 256 );
+	}
+}
+
+void WriteNormal( CUtlBuffer &out, Vector const &nPos, Vector const &nDir, float length, Vector const &color )
+{
+	out.Printf( "2\n" );
+	out.Printf( "%5.2f %5.2f %5.2f %5.3f %5.3f %5.3f\n", 
+		nPos.x, nPos.y, nPos.z,
+		color.x / 256, color.y / 256, color.z / 256 );
+	out.Printf( "%5.2f %5.2f %5.2f %5.3f %5.3f %5.3f\n", 
+		nPos.x + ( nDir.x * length ), 
+		nPos.y + ( nDir.y * length ), 
+		nPos.z + ( nDir.z * length ),
+		color.x / 256, color.y / 256, color.z / 256 );
+}
+
 void WriteLine( FileHandle_t out, const Vector &vecPos1, const Vector &vecPos2, const Vector &color )
 {
 	CmdLib_FPrintf( out, "2\n" );
@@ -1407,10 +1519,10 @@ CollectLight
 =============
 */
 // patch's totallight += new light received to each patch
-// patch's emitlight = addlight (newly received light from GatherLight)
+// patch's emitlight = addlight (newly received light from GatherLight), less pWarmStart if given
 // patch's addlight = 0
 // pull received light from children.
-void CollectLight( Vector& total )
+void CollectLight( Vector& total, const Vector *pWarmStart )
 {
 	int i, j;
 	CPatch	*patch;
@@ -1436,7 +1548,17 @@ void CollectLight( Vector& total )
 				VectorAdd( patch->totallight.light[j], addlight[i].light[j], patch->totallight.light[j] );
 			}
 			VectorCopy( addlight[i].light[0], emitlight[i] );
-			VectorAdd( total, emitlight[i], total );
+
+			// The first -incremental bounce sent last run's bounced light out again, so
+			// what it got is already (about) the bounced light. Only the difference
+			// from last run goes on, which can be negative.
+			if ( pWarmStart )
+			{
+				VectorSubtract( emitlight[i], pWarmStart[i], emitlight[i] );
+			}
+			total.x += fabs( emitlight[i].x );
+			total.y += fabs( emitlight[i].y );
+			total.z += fabs( emitlight[i].z );
 		}
 		else
 		{
@@ -1474,6 +1596,33 @@ void CollectLight( Vector& total )
 	}
 }
 
+/*
+=============
+PushLight
+
+-hierarchical links gather light into interior patches too. Hand it down to
+the leaves, which are the only ones CollectLight takes received light from.
+=============
+*/
+void PushLight( void )
+{
+	// children always come after their parents
+	unsigned int uiPatchCount = g_Patches.Size();
+	for ( unsigned int i = 0; i < uiPatchCount; i++ )
+	{
+		CPatch *patch = &g_Patches.Element( i );
+		if ( patch->child1 == g_Patches.InvalidIndex() )
+			continue;
+
+		int normalCount = patch->needsBumpmap ? NUM_BUMP_VECTS+1 : 1;
+		for ( int j = 0; j < normalCount; j++ )
+		{
+			VectorAdd( addlight[patch->child1].light[j], addlight[i].light[j], addlight[patch->child1].light[j] );
+			VectorAdd( addlight[patch->child2].light[j], addlight[i].light[j], addlight[patch->child2].light[j] );
+		}
+	}
+}
+
 /*
 =============
 GatherLight
@@ -1532,13 +1681,41 @@ void PreGetBumpNormalsForDisp( texinfo_t *pTexinfo, Vector &vecU, Vector &vecV,
 	vecV = vecTexV;
 }
 
+// Builds the normals a bumpmapped patch gathers light along. normals[0] is the flat normal.
+static void GetPatchBumpNormals( CPatch *patch, Vector normals[NUM_BUMP_VECTS+1] )
+{
+	// Disps
+	bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 ); 
+	if ( bDisp )
+	{
+		normals[0] = patch->normal;
+		texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+		Vector vecTexU, vecTexV;
+		PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
+
+		// use facenormal along with the smooth normal to build the three bump map vectors
+		GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] ); 
+	}
+	else
+	{
+		GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
+
+		texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+		// use facenormal along with the smooth normal to build the three bump map vectors
+		GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0], 
+			pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal, 
+			normals[0], &normals[1] );
+	}
+
+	// force the base lightmap to use the flat normal instead of the phong normal
+	// FIXME: why does the patch not use the phong normal?
+	normals[0] = patch->normal;
+}
+
 void GatherLight (int threadnum, void *pUserData)
 {
-	int			i, j, k;
-	transfer_t	*trans;
-	int			num;
+	int			j;
 	CPatch		*patch;
-	Vector		sum, v;
 
 	while (1)
 	{
@@ -1548,94 +1725,58 @@ void GatherLight (int threadnum, void *pUserData)
 
 		patch = &g_Patches[j];
 
-		trans = patch->transfers;
-		num = patch->numtransfers;
 		if ( patch->needsBumpmap )
 		{
-			Vector delta;
-			Vector bumpSum[NUM_BUMP_VECTS+1];
 			Vector normals[NUM_BUMP_VECTS+1];
+			GetPatchBumpNormals( patch, normals );
+			g_TransferMatrix.GatherBumpLight( j, normals, addlight[j].light );
+		}
+		else
+		{
+			g_TransferMatrix.GatherLight( j, addlight[j].light[0] );
+		}
+	}
+}
 
-			// Disps
-			bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 ); 
-			if ( bDisp )
-			{
-				normals[0] = patch->normal;
-				texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				Vector vecTexU, vecTexV;
-				PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
-
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] ); 
-			}
-			else
-			{
-				GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
-
-				texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0], 
-					pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal, 
-					normals[0], &normals[1] );
-			}
-
-			// force the base lightmap to use the flat normal instead of the phong normal
-			// FIXME: why does the patch not use the phong normal?
-			normals[0] = patch->normal;
 
-			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
-			{
-				VectorFill( bumpSum[i], 0 );
-			}
+// -gatherlightcheck: reruns the gather with the old scalar math on the
+// unquantized transfers and compares, so with -compresstransfers the error
+// includes what the quantization costs.
+static CThreadShards<float> s_MaxGatherLightErrorShards;
+static CThreadShards<double> s_GatherLightErrorShards;		// sum of | simd - reference |
+static CThreadShards<double> s_GatherLightReferenceShards;	// sum of | reference |
 
-			float dot;
-			for (k=0 ; k<num ; k++, trans++)
-			{
-				CPatch *patch2 = &g_Patches[trans->patch];
+void GatherLightCheck (int threadnum, void *pUserData)
+{
+	int j;
+	while ( (j = GetThreadWork()) != -1 )
+	{
+		CPatch *patch = &g_Patches[j];
 
-				// get vector to other patch
-				VectorSubtract (patch2->origin, patch->origin, delta);
-				VectorNormalize (delta);
-				// find light emitted from other patch
-				for(i=0; i<3; i++)
-				{
-					v[i] = emitlight[trans->patch][i] * patch2->reflectivity[i];
-				}
-				// remove normal already factored into transfer steradian
-				float scale = 1.0f / DotProduct (delta, patch->normal);
-				VectorScale( v, trans->transfer * scale, v );
-				
-				Vector bumpTransfer;
-				for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
-				{
-					dot = DotProduct( delta, normals[i] );
-					if ( dot <= 0 )
-					{
-//						Assert( i > 0 ); // if this hits, then the transfer shouldn't be here.  It doesn't face the flat normal of this face!
-						continue;
-					}
-					bumpTransfer = v * dot;
-					VectorAdd( bumpSum[i], bumpTransfer, bumpSum[i] );
-				}
-			}
-			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
-			{
-				VectorCopy( bumpSum[i], addlight[j].light[i] );
-			}
+		Vector reference[NUM_BUMP_VECTS+1];
+		int normalCount = 1;
+		if ( patch->needsBumpmap )
+		{
+			Vector normals[NUM_BUMP_VECTS+1];
+			GetPatchBumpNormals( patch, normals );
+			g_TransferMatrix.GatherBumpLightReference( j, emitlight, normals, reference );
+			normalCount = NUM_BUMP_VECTS+1;
 		}
 		else
 		{
-			VectorFill( sum, 0 );
-			for (k=0 ; k<num ; k++, trans++)
+			g_TransferMatrix.GatherLightReference( j, emitlight, reference[0] );
+		}
+
+		for ( int i = 0; i < normalCount; i++ )
+		{
+			for ( int iAxis = 0; iAxis < 3; iAxis++ )
 			{
-				for(i=0; i<3; i++)
-				{
-					v[i] = emitlight[trans->patch][i] * g_Patches[trans->patch].reflectivity[i];
-				}
-				VectorScale( v, trans->transfer, v );
-				VectorAdd( sum, v, sum );
+				float flDelta = fabs( addlight[j].light[i][iAxis] - reference[i][iAxis] );
+				float flError = flDelta / max( fabs( reference[i][iAxis] ), 1.0f );
+				s_MaxGatherLightErrorShards[threadnum] = max( s_MaxGatherLightErrorShards[threadnum], flError );
+				s_GatherLightErrorShards[threadnum] += flDelta;
+				s_GatherLightReferenceShards[threadnum] += fabs( reference[i][iAxis] );
 			}
-			VectorCopy( sum, addlight[j].light[0] );
 		}
 	}
 }
@@ -1657,11 +1798,27 @@ void BounceLight (void)
 	char		name[64];
 	qboolean	bouncing = numbounce > 0;
 
+	g_bBounceConverged = false;
+
+	const Vector *pWarmStart = NULL;
+	if ( g_bLightCache )
+	{
+		pWarmStart = LightCache_GetWarmStart();
+	}
+	else if ( g_bProgressive )
+	{
+		pWarmStart = Progressive_GetWarmStart();
+	}
+
 	unsigned int uiPatchCount = g_Patches.Size();
 	for (i=0 ; i<uiPatchCount; i++)
 	{
 		// totallight has a copy of the direct lighting.  Move it to the emitted light and zero it out (to integrate bounces only)
 		VectorCopy( g_Patches[i].totallight.light[0], emitlight[i] );
+		if ( pWarmStart )
+		{
+			VectorAdd( emitlight[i], pWarmStart[i], emitlight[i] );
+		}
 
 		// NOTE: This means that only the bounced light is integrated into totallight!
 		VectorFill( g_Patches[i].totallight.light[0], 0 );
@@ -1706,16 +1863,46 @@ void BounceLight (void)
 		// transfer light from to the leaf patches from other patches via transfers
 		// this moves shooter->emitlight to receiver->addlight
 		unsigned int uiPatchCount = g_Patches.Size();
+		g_TransferMatrix.PrepareBounce( emitlight );
 		RunThreadsOn (uiPatchCount, true, GatherLight);
+
+		if ( g_bGatherLightCheck && i == 0 )
+		{
+			s_MaxGatherLightErrorShards.Reset( 0 );
+			s_GatherLightErrorShards.Reset( 0 );
+			s_GatherLightReferenceShards.Reset( 0 );
+			RunThreadsOn (uiPatchCount, true, GatherLightCheck);
+
+			double flReference = s_GatherLightReferenceShards.Sum();
+			Msg( "GatherLight vs. scalar path on exact transfers: max relative error %g, total relative error %g\n",
+				s_MaxGatherLightErrorShards.Max(), flReference > 0 ? s_GatherLightErrorShards.Sum() / flReference : 0.0 );
+			if ( g_TransferMatrix.IsCompressed() )
+			{
+				Msg( "  %d small transfers kept at the smallest quantized value\n", g_TransferMatrix.GetRoundedUpCount() );
+			}
+		}
+
+		if ( g_bHierarchical )
+		{
+			PushLight();
+		}
+
 		// move newly received light (addlight) to light to be sent out (emitlight)
 		// start at children and pull light up to parents
 		// light is always received to leaf patches
-		CollectLight( added );
+		CollectLight( added, ( i == 0 ) ? pWarmStart : NULL );
 
 		qprintf ("\tBounce #%i added RGB(%.0f, %.0f, %.0f)\n", i+1, added[0], added[1], added[2] );
 
-		if ( i+1 == numbounce || (added[0] < 1.0 && added[1] < 1.0 && added[2] < 1.0) )
+		if ( added[0] < 1.0 && added[1] < 1.0 && added[2] < 1.0 )
+		{
+			g_bBounceConverged = true;
+			bouncing = false;
+		}
+		else if ( i+1 == numbounce )
+		{
 			bouncing = false;
+		}
 
 		i++;
 		if ( g_bDumpPatches && !bouncing && i != 1)
@@ -1924,16 +2111,36 @@ void BuildFacesVisibleToLights( bool bAllVisible )
 
 void MakeAllScales (void)
 {
+	CTelemetryPhase phase( "MakeAllScales" );
+
+	g_TransferMatrix.SetKeepExactRows( g_bGatherLightCheck );
+	g_TransferMatrix.Init( g_Patches.Count() );
+
 	// determine visibility between patches
+	s_TotalTransferShards.Reset( 0 );
+	s_MaxTransferShards.Reset( 0 );
 	BuildVisMatrix ();
+	total_transfer += s_TotalTransferShards.Sum();
+	max_transfer = max( max_transfer, s_MaxTransferShards.Max() );
 	
 	// release visibility matrix
 	FreeVisMatrix ();
 
+	// pack the per-patch transfer lists into the matrix the bounce passes read
+	g_TransferMatrix.Build();
+
 	Msg("transfers %d, max %d\n", total_transfer, max_transfer );
 
 	qprintf ("transfer lists: %5.1f megs\n"
-		, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+		, (float)g_TransferMatrix.GetMemoryUsage() / (1024*1024));
+
+	if ( g_TransferMatrix.IsCompressed() )
+	{
+		float flUncompressed = (float)g_TransferMatrix.GetUncompressedMemoryUsage() / (1024*1024);
+		float flCompressed = (float)g_TransferMatrix.GetMemoryUsage() / (1024*1024);
+		Msg( "compressed transfers: %.1f megs (%.1f megs uncompressed, %.1f megs saved)\n",
+			flCompressed, flUncompressed, flUncompressed - flCompressed );
+	}
 }
 
 
@@ -2000,9 +2207,13 @@ void MakeAllScales (void)
 
 bool RadWorld_Go()
 {
-	g_iCurFace = 0;
+	g_iCurFace.Reset( 0 );
 
-	InitMacroTexture( source );
+	// -progressive comes back here for each refinement level
+	if ( !g_bProgressive || Progressive_IsPreview() )
+	{
+		InitMacroTexture( source );
+	}
 
 	if( g_pIncremental )
 	{
@@ -2017,6 +2228,13 @@ bool RadWorld_Go()
 		// likely that all faces are going to be touched by at least one light so don't
 		// waste time here.
 		BuildFacesVisibleToLights( true );
+
+		if ( g_bLightCache )
+		{
+			Telemetry_BeginPhase( "LoadLightCache" );
+			LoadLightCache();
+			Telemetry_EndPhase( numfaces );
+		}
 	}
 
 	// build initial facelights
@@ -2030,8 +2248,11 @@ bool RadWorld_Go()
 		RunThreadsOnIndividual (numfaces, true, BuildFacelights);
 	}
 
+	if ( g_bDumpPatches )
+		FlushFacelightDumps();
+
 	// Was the process interrupted?
-	if( g_pIncremental && (g_iCurFace != numfaces) )
+	if( g_pIncremental && (g_iCurFace.Sum() != numfaces) )
 		return false;
 
 	// Figure out the offset into lightmap data for each face.
@@ -2065,12 +2286,21 @@ bool RadWorld_Go()
 			addlight.SetSize( g_Patches.Size() );
 			memset( addlight.Base(), 0, g_Patches.Size() * sizeof( bumplights_t ) );
 
-			MakeAllScales ();
+			// -progressive keeps the transfers from one level to the next
+			if ( !g_bProgressive || Progressive_NeedsTransfers() )
+			{
+				MakeAllScales ();
+			}
 
 			// spread light around
+			Telemetry_BeginPhase( "BounceLight" );
 			BounceLight ();
+			Telemetry_EndPhase( numbounce );
 		}
 
+		if ( g_bLightCache )
+			SaveLightCache();
+
 		//
 		// displacement surface luxel accumulation (make threaded!!!)
 		//
@@ -2083,6 +2313,9 @@ bool RadWorld_Go()
 		VMPI_SetCurrentStage( "FinalLightFace" );
 		if ( !g_bUseMPI || g_bMPIMaster )
 			RunThreadsOnIndividual (numfaces, true, FinalLightFace);
+
+		if ( g_bDumpPatches )
+			FlushDispLuxels();
 		
 		// Distribute the lighting data to workers.
 		VMPI_DistributeLightData();
@@ -2178,11 +2411,15 @@ void VRAD_LoadBSP( char const *pFilename )
 
 	strcpy(incrementfile, source);
 	Q_DefaultExtension(incrementfile, ".r0", sizeof(incrementfile));
+	Q_StripExtension(source, rtcachefile, sizeof(rtcachefile));
+	Q_strncat(rtcachefile, ".rtcache", sizeof(rtcachefile), COPY_ALL_CHARACTERS);
 	Q_DefaultExtension(source, ".bsp", sizeof( source ));
 
 	Msg( "Loading %s\n", source );
 	VMPI_SetCurrentStage( "LoadBSPFile" );
+	Telemetry_BeginPhase( "LoadBSPFile" );
 	LoadBSPFile (source);
+	Telemetry_EndPhase();
 
 	// Add this bsp to our search path so embedded resources can be found
 	if ( g_bUseMPI && g_bMPIMaster )
@@ -2223,7 +2460,6 @@ void VRAD_LoadBSP( char const *pFilename )
 
 
 	ParseEntities ();
-	ExtractBrushEntityShadowCasters();
 
 	StaticPropMgr()->Init();
 	StaticDispMgr()->Init();
@@ -2259,27 +2495,71 @@ void VRAD_LoadBSP( char const *pFilename )
 		clusterChildren[ndx] = clusterChildren.InvalidIndex();
 	}
 
-	// Setup ray tracer
-	AddBrushesForRayTrace();
-	StaticDispMgr()->AddPolysForRayTrace();
-	StaticPropMgr()->AddPolysForRayTrace();
+	// Setup ray tracer. The cache can't hold the texture shadow materials, and the
+	// debug options need the triangles before the tree is built.
+	Telemetry_BeginPhase( "Ray tracer setup" );
+	bool bWideBVH = ( g_RtEnv.Flags & RTE_FLAGS_WIDE_BVH ) != 0;
+	if ( g_bRtBenchmark )
+		g_RtEnv.Flags |= RTE_FLAGS_WIDE_BVH;		// need both structures to compare them
 
-	// Dump raytracer for glview
-	if ( g_bDumpRtEnv )
-		WriteRTEnv("trace.txt");
+	bool bUseRtCache = g_bRtCache && !g_bTextureShadows && !g_bDumpRtEnv && !g_bRtBenchmark;
+	uint8 rtCacheKey[RTE_CACHE_KEY_SIZE];
+	bool bRtCacheLoaded = false;
+	if ( bUseRtCache )
+	{
+		float start = Plat_FloatTime();
+		ComputeRayTraceCacheKey( rtCacheKey );
+		bRtCacheLoaded = g_RtEnv.LoadCache( rtcachefile, rtCacheKey );
+		if ( bRtCacheLoaded )
+		{
+			Msg( "Loaded ray-trace acceleration structure from %s (%.2f seconds)\n", rtcachefile, Plat_FloatTime() - start );
+		}
+	}
+
+	if ( !bRtCacheLoaded )
+	{
+		ExtractBrushEntityShadowCasters();
+		AddBrushesForRayTrace();
+		StaticDispMgr()->AddPolysForRayTrace();
+		StaticPropMgr()->AddPolysForRayTrace();
+
+		// Dump raytracer for glview
+		if ( g_bDumpRtEnv )
+			WriteRTEnv("trace.txt");
+
+		// Build acceleration structure
+		printf ( "Setting up ray-trace acceleration structure... ");
+		float start = Plat_FloatTime();
+		g_RtEnv.NumBuildThreads = numthreads;
+		g_RtEnv.SetupAccelerationStructure();
+		float end = Plat_FloatTime();
+		printf ( "Done (%.2f seconds)\n", end-start );
 
-	// Build acceleration structure
-	printf ( "Setting up ray-trace acceleration structure... ");
-	float start = Plat_FloatTime();
-	g_RtEnv.SetupAccelerationStructure();
-	float end = Plat_FloatTime();
-	printf ( "Done (%.2f seconds)\n", end-start );
+		// VMPI workers all share the master's directory, so only the master writes it
+		if ( bUseRtCache && ( !g_bUseMPI || g_bMPIMaster ) )
+		{
+			if ( g_RtEnv.SaveCache( rtcachefile, rtCacheKey ) )
+				Msg( "Saved ray-trace acceleration structure to %s\n", rtcachefile );
+			else
+				Warning( "Couldn't write ray-trace cache file %s\n", rtcachefile );
+		}
+	}
+
+	if ( g_bRtBenchmark )
+	{
+		BenchmarkRayTracer();
+		if ( !bWideBVH )
+			g_RtEnv.Flags &= ~RTE_FLAGS_WIDE_BVH;
+	}
+	Telemetry_EndPhase( g_RtEnv.OptimizedTriangleList.Count() );
 
 #if 0  // To test only k-d build
 	exit(0);
 #endif
 
+	Telemetry_BeginPhase( "RadWorld_Start" );
 	RadWorld_Start();
+	Telemetry_EndPhase( g_Patches.Count() );
 
 	// Setup incremental lighting.
 	if( g_pIncremental )
@@ -2295,17 +2575,34 @@ void VRAD_LoadBSP( char const *pFilename )
 
 void VRAD_ComputeOtherLighting()
 {
+	// The detail props and the leaf ambient share the probes, anything from
+	// the -progressive preview is out of date
+	if ( g_bIrradianceProbes )
+	{
+		IrradianceProbes_Clear();
+	}
+
 	// Compute lighting for the bsp file
 	if ( !g_bNoDetailLighting )
 	{
+		CTelemetryPhase phase( "Detail prop lighting" );
 		ComputeDetailPropLighting( THREADINDEX_MAIN );
 	}
 
+	Telemetry_BeginPhase( "Per leaf ambient lighting" );
 	ComputePerLeafAmbientLighting();
+	Telemetry_EndPhase( numleafs );
+
+	if ( g_bIrradianceProbes )
+	{
+		IrradianceProbes_PrintStats();
+		IrradianceProbes_Clear();
+	}
 
 	// bake the static props high quality vertex lighting into the bsp
 	if ( !do_fast && g_bStaticPropLighting )
 	{
+		CTelemetryPhase phase( "Static prop lighting" );
 		StaticPropMgr()->ComputeLighting( THREADINDEX_MAIN );
 	}
 }
@@ -2320,11 +2617,14 @@ void VRAD_Finish()
 	if ( verbose )
 	{
 		PrintBSPFileSizes();
+		PrintThreadLockContention();
 	}
 
 	Msg( "Writing %s\n", source );
 	VMPI_SetCurrentStage( "WriteBSPFile" );
+	Telemetry_BeginPhase( "WriteBSPFile" );
 	WriteBSPFile(source);
+	Telemetry_EndPhase();
 
 	if ( g_bDumpPatches )
 	{
@@ -2424,6 +2724,92 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bDumpPropLightmaps = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-compresstransfers" ) )
+		{
+			g_TransferMatrix.SetCompressed( true );
+		}
+		else if ( !Q_stricmp( argv[i], "-hierarchical" ) )
+		{
+			g_bHierarchical = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-hierarchicalerror" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_flHierarchicalError = (float)atof( argv[i] );
+				if ( g_flHierarchicalError <= 0.0f )
+				{
+					Warning( "Error: expected positive value after '-hierarchicalerror'\n" );
+					return -1;
+				}
+			}
+			else
+			{
+				Warning( "Error: expected a value after '-hierarchicalerror'\n" );
+				return -1;
+			}
+		}
+		else if ( !Q_stricmp( argv[i], "-gatherlightcheck" ) )
+		{
+			g_bGatherLightCheck = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-rtwidebvh" ) )
+		{
+			g_RtEnv.Flags |= RTE_FLAGS_WIDE_BVH;
+		}
+		else if ( !Q_stricmp( argv[i], "-rtexacttree" ) )
+		{
+			g_RtEnv.Flags |= RTE_FLAGS_EXACT_TREE_GENERATION;
+		}
+		else if ( !Q_stricmp( argv[i], "-rtbenchmark" ) )
+		{
+			g_bRtBenchmark = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-noavx2" ) )
+		{
+			g_RtEnv.Flags |= RTE_FLAGS_NO_AVX2;
+		}
+		else if ( !Q_stricmp( argv[i], "-noshadowqueue" ) )
+		{
+			g_bShadowRayQueue = false;
+		}
+		else if ( !Q_stricmp( argv[i], "-nortcache" ) )
+		{
+			g_bRtCache = false;
+		}
+		else if ( !Q_stricmp( argv[i], "-incremental" ) )
+		{
+			g_bLightCache = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-progressive" ) )
+		{
+			g_bProgressive = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-probes" ) )
+		{
+			g_bIrradianceProbes = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-probeerror" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_flIrradianceProbeError = (float)atof( argv[i] );
+				if ( g_flIrradianceProbeError < 0.0f )
+				{
+					Warning( "Error: expected non-negative value after '-probeerror'\n" );
+					return -1;
+				}
+			}
+			else
+			{
+				Warning( "Error: expected a value after '-probeerror'\n" );
+				return -1;
+			}
+		}
+		else if ( !Q_stricmp( argv[i], "-telemetry" ) )
+		{
+			g_bTelemetry = true;
+		}
 		else if (!Q_stricmp(argv[i],"-bounce"))
 		{
 			if ( ++i < argc )
@@ -2854,6 +3240,39 @@ void PrintUsage( int argc, char **argv )
 		"  -textureshadows : Allows texture alpha channels to block light - rays intersecting alpha surfaces will sample the texture\n"
 		"  -noskyboxrecurse : Turn off recursion into 3d skybox (skybox shadows on world)\n"
 		"  -nossprops      : Globally disable self-shadowing on static props\n"
+		"  -compresstransfers : Store bounce transfers with 16 bit coefficients and delta coded\n"
+		"                    patch indices. Uses much less memory on big maps.\n"
+		"  -hierarchical   : Link patches to each other at the coarsest level of the patch\n"
+		"                    trees that's still accurate enough, instead of always lighting\n"
+		"                    the smallest patches. Far fewer transfers on big open maps.\n"
+		"  -hierarchicalerror # : How big patches can get, relative to the distance squared\n"
+		"                    between them, before -hierarchical splits them (default 0.0625).\n"
+		"  -gatherlightcheck : Compare the SIMD bounce gather against the scalar math on\n"
+		"                    the unquantized transfers on the first bounce and print the\n"
+		"                    max and total relative error (vrad debug option)\n"
+		"  -rtwidebvh      : Trace rays through a 4-wide bounding volume hierarchy instead\n"
+		"                    of the kd-tree.\n"
+		"  -rtexacttree    : Build the kd-tree with the old single threaded exact builder.\n"
+		"  -rtbenchmark    : Time random rays through both the kd-tree and the 4-wide\n"
+		"                    bvh after building them (vrad debug option)\n"
+		"  -noavx2         : Don't trace 8 ray packets with avx2 even if the cpu supports it.\n"
+		"  -noshadowqueue  : Trace the direct lighting shadow rays of each group of 4 samples\n"
+		"                    right away instead of sorting them into coherent packets.\n"
+		"  -nortcache      : Always rebuild the ray-trace acceleration structure instead of\n"
+		"                    loading it from (and saving it to) <mapname>.rtcache.\n"
+		"  -incremental    : Keep the lighting in <mapname>.lightcache and only relight the\n"
+		"                    faces that changed lights or geometry could affect next time.\n"
+		"                    Static props keep theirs in <mapname>.propcache while the\n"
+		"                    rest of the map is unchanged.\n"
+		"  -progressive    : Write a quick preview of the lighting first, then keep refining\n"
+		"                    it, worst faces first, and update the bsp after each level.\n"
+		"  -probes         : Interpolate the ambient light of detail props and per-leaf\n"
+		"                    ambient samples from a sparse grid of probes, refined where\n"
+		"                    the light changes quickly, instead of tracing rays from each.\n"
+		"  -probeerror #   : How far apart, in gamma space, the probes -probes blends can\n"
+		"                    be before it tries a finer level (default 3).\n"
+		"  -telemetry      : Write the time, cpu time, throughput and memory use of each\n"
+		"                    phase of the compile to <mapname>.vrad.json.\n"
 		"\n"
 #if 1 // Disabled for the initial SDK release with VMPI so we can get feedback from selected users.
 		);
@@ -2911,17 +3330,66 @@ int RunVRAD( int argc, char **argv )
 	CmdLib_InitFileSystem( argv[ i ] );
 	Q_FileBase( source, source, sizeof( source ) );
 
+	Telemetry_BeginPhase( "vrad" );
+
+	// BuildFacelights runs on the VMPI workers, which don't keep anything between runs
+	if ( g_bLightCache && g_bUseMPI )
+	{
+		Warning( "-incremental doesn't work with -mpi, ignoring it\n" );
+		g_bLightCache = false;
+	}
+
+	// The refinement levels need the facelights of the earlier ones, which VMPI
+	// doesn't bring back to the master
+	if ( g_bProgressive && g_bUseMPI )
+	{
+		Warning( "-progressive doesn't work with -mpi, ignoring it\n" );
+		g_bProgressive = false;
+	}
+
+	// The links are built a face at a time, which the VMPI work units don't know about
+	if ( g_bHierarchical && g_bUseMPI )
+	{
+		Warning( "-hierarchical doesn't work with -mpi, ignoring it\n" );
+		g_bHierarchical = false;
+	}
+
+	// Both replace the facelights and the bounce warm start, -progressive wins
+	if ( g_bProgressive && g_bLightCache )
+	{
+		Warning( "-incremental doesn't work with -progressive, ignoring it\n" );
+		g_bLightCache = false;
+	}
+
 	VRAD_LoadBSP( argv[i] );
 
 	if ( (! onlydetail) && (! g_bOnlyStaticProps ) )
 	{
-		RadWorld_Go();
+		if ( g_bProgressive )
+		{
+			RadWorld_GoProgressive();
+		}
+		else
+		{
+			RadWorld_Go();
+		}
 	}
 
 	VRAD_ComputeOtherLighting();
 
 	VRAD_Finish();
 
+	Telemetry_EndPhase();
+
+	// VMPI workers only run pieces of the compile, so their numbers aren't worth writing
+	if ( g_bTelemetry && ( !g_bUseMPI || g_bMPIMaster ) )
+	{
+		char telemetryFile[MAX_PATH];
+		Q_StripExtension( source, telemetryFile, sizeof( telemetryFile ) );
+		Q_strncat( telemetryFile, ".vrad.json", sizeof( telemetryFile ), COPY_ALL_CHARACTERS );
+		Telemetry_WriteReport( telemetryFile, "vrad" );
+	}
+
 	VMPI_SetCurrentStage( "master done" );
 
 	DeleteCmdLine( argc, argv );
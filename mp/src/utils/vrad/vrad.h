@@ -28,8 +28,10 @@
 #include "UtlMemory.h"
 #include "UtlHash.h"
 #include "utlvector.h"
+#include "utlbuffer.h"
 #include "iincremental.h"
 #include "raytrace.h"
+#include "checksum_md5.h"
 
 
 #ifdef _WIN32
@@ -276,6 +278,7 @@ extern bool         g_bNoSkyRecurse;
 extern bool			bDumpNormals;
 extern bool			g_bFastAmbient;
 extern float		maxchop;
+extern float		minchop;
 extern FileHandle_t	pFileSamples[4][4];
 extern qboolean		g_bLowPriority;
 extern qboolean		do_fast;
@@ -288,6 +291,7 @@ extern float g_flSkySampleScale;								// extra sampling factor for indirect li
 extern bool g_bLargeDispSampleRadius;
 extern bool g_bStaticPropPolys;
 extern bool g_bTextureShadows;
+extern bool g_bShadowRayQueue;
 extern bool g_bShowStaticPropNormals;
 extern bool g_bDisablePropSelfShadowing;
 
@@ -324,6 +328,7 @@ extern  int extrapasses;
 extern	Vector ambient;
 extern  float maxlight;
 extern	unsigned numbounce;
+extern	bool	g_bBounceConverged;
 extern  qboolean g_bLogHashData;
 extern  bool	debug_extra;
 extern	directlight_t	*activelights;
@@ -339,6 +344,7 @@ extern bool g_bMPIProps;
 extern	byte	nodehit[MAX_MAP_NODES];
 extern  float	gamma_value;
 extern	float	indirect_sun;
+extern	float	reflectivityScale;
 extern	float	smoothing_threshold;
 extern	int		dlight_map;
 
@@ -347,6 +353,11 @@ extern float	g_SunAngularExtent;
 
 extern char		source[MAX_PATH];
 
+// -hierarchical: build the transfers between whatever levels of the patch trees
+// are accurate enough, see BuildVisMatrix
+extern bool		g_bHierarchical;
+extern float	g_flHierarchicalError;
+
 // Used by incremental lighting to trivial-reject faces.
 // There is a bit in here for each face telling whether or not any of the
 // active lights can see the face.
@@ -386,20 +397,117 @@ inline byte PVSCheck( const byte *pvs, int iCluster )
 // outputs 1 in fractionVisible if no occlusion, 0 if full occlusion, and in-between values
 void TestLine( FourVectors const& start, FourVectors const& stop, fltx4 *pFractionVisible, int static_prop_index_to_ignore=-1);
 
+// same thing for 8 rays, passed as two groups of 4. Traced as one packet when the cpu has avx2.
+void TestLine8( FourVectors const *pStart, FourVectors const *pStop, fltx4 *pFractionVisible, int static_prop_index_to_ignore=-1);
+
 // returns 1 if the ray sees the sky, 0 if it doesn't, and in-between values for partial coverage
 void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
                           fltx4 *pFractionVisible, bool canRecurse = true, int static_prop_to_skip=-1, bool bDoDebug = false );
 
+//-----------------------------------------------------------------------------
+// Deferred shadow rays. The lighting code runs twice over a batch of samples:
+// while recording, TestLine/TestLine_DoesHitSky calls are queued up and report
+// everything visible. Trace() then sorts all the queued rays by direction
+// octant and origin cell and traces them in coherent packets. While replaying,
+// the same calls, made in the same order, get the real visibility back.
+// Nothing the lighting code does may depend on visibility while recording.
+// Static props can't be skipped on queued rays.
+//-----------------------------------------------------------------------------
+class CShadowRayQueue
+{
+public:
+	CShadowRayQueue();
+
+	void BeginRecord();
+	void Trace();
+	void BeginReplay();
+	void EndReplay();
+
+	// Same as the global functions above
+	void TestLine( FourVectors const& start, FourVectors const& stop, fltx4 *pFractionVisible );
+	void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop, fltx4 *pFractionVisible );
+
+	int GetRecordedRayCount() const		{ return m_Rays.Count(); }
+
+private:
+	enum QueryType_t
+	{
+		QUERY_LINE = 0,
+		QUERY_SKY,				// hits on sky triangles don't occlude
+		QUERY_SKY_CAMERA,		// continuation of a QUERY_SKY through a 3d skybox
+	};
+
+	// One TestLine call: 4 rays
+	struct Query_t
+	{
+		int m_nType;
+		int m_iParent;			// QUERY_SKY_CAMERA: the query it continues
+		float m_flOcclusion[4];
+	};
+
+	struct Ray_t
+	{
+		Vector m_Origin;
+		Vector m_Direction;
+		float m_flLength;
+		float m_flOcclusion;
+	};
+
+	// A whole query, or a single ray of one
+	struct SortEntry_t
+	{
+		uint32 m_nKey;
+		int m_iRay;
+		int m_nRays;
+	};
+
+	static int __cdecl CompareSortEntries( const SortEntry_t *pA, const SortEntry_t *pB );
+
+	void AddQuery( FourVectors const& start, FourVectors const& stop, int nType, int iParent );
+	void TraceRays( int iFirstRay );
+	void AddPacket( int const *pRays, int nRays, uint32 nOctant );
+	void FlushHeldPacket();
+	void TracePacket( int const *pRays0, int nRays0, int const *pRays1, int nRays1 );
+	void AddSkyCameraQueries( int iFirstQuery, int nQueries );
+
+	CUtlVector< Query_t > m_Queries;
+	CUtlVector< Ray_t > m_Rays;
+	CUtlVector< SortEntry_t > m_SortedRays;
+	int m_nRecordedQueries;
+	int m_iReplayQuery;
+	bool m_bRecording;
+	bool m_bReplaying;
+
+	// Packet waiting for a partner to be traced with, see AddPacket
+	bool m_bTrace8;
+	int m_iHeldRays[4];
+	int m_nHeldRays;
+	uint32 m_nHeldOctant;
+};
+
+// One per thread
+CShadowRayQueue *GetShadowRayQueue( int iThread );
+
 // converts any marked brush entities to triangles for shadow casting
 void ExtractBrushEntityShadowCasters ( void );
 void AddBrushesForRayTrace ( void );
 
+// Hash of all the geometry the above and the static prop and displacement managers add to
+// g_RtEnv. Keys the ray trace cache file.
+void ComputeRayTraceCacheKey( uint8 *pKey );
+
+// -rtbenchmark: times the same random rays through the kd-tree and the 4-wide bvh
+void BenchmarkRayTracer( void );
+
 void BaseLightForFace( dface_t *f, Vector& light, float *parea, Vector& reflectivity );
 void CreateDirectLights (void);
 void GetPhongNormal( int facenum, Vector const& spot, Vector& phongnormal );
 int LightForString( char *pLight, Vector& intensity );
+bool CanMakeTransfer( CPatch *pPatch1, CPatch *pPatch2, float *pScale = NULL );
 void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers );
-void MakeScales( int ndxPatch, transfer_t *all_transfers );
+void MakeScales( int iThread, int ndxPatch, transfer_t *all_transfers );
+void StoreTransfers( int iThread, int ndxPatch, transfer_t *all_transfers, float total );
+void LinkPatches( const byte *pSkip );
 
 // Run startup code like initialize mathlib.
 void VRAD_Init();
@@ -424,6 +532,30 @@ void WriteNormal( FileHandle_t out, Vector const &nPos, Vector const &nDir,
 void WriteLine( FileHandle_t out, const Vector &vecPos1, const Vector &vecPos2, const Vector &color );
 void WriteTrace( const char *pFileName, const FourRays &rays, const RayTracingResult& result );
 
+//-----------------------------------------------------------------------------
+// Text for one of the -dump debug files. Each thread writes into its own
+// buffer so the dump code doesn't need ThreadLock, and Flush appends all the
+// buffers to the file once the threads are done.
+//-----------------------------------------------------------------------------
+class CThreadedDumpFile
+{
+public:
+	CThreadedDumpFile();
+
+	CUtlBuffer &GetBuffer( int iThread )		{ return m_Buffers[iThread]; }
+	void Flush( FileHandle_t out );
+
+private:
+	CUtlBuffer m_Buffers[MAX_TOOL_THREADS+1];
+};
+
+void WriteWinding( CUtlBuffer &out, winding_t *w, Vector const &color );
+void WriteNormal( CUtlBuffer &out, Vector const &nPos, Vector const &nDir, float length, Vector const &color );
+
+// Write out the -dump text BuildFacelights and FinalLightFace buffered up
+void FlushFacelightDumps();
+void FlushDispLuxels();
+
 #ifdef STATIC_FOG
 qboolean IsFog( dface_t * f );
 #endif
@@ -458,7 +590,8 @@ void GatherSampleLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int
 					   FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
 					   int nLFlags = 0,					// GATHERLFLAGS_xxx
 					   int static_prop_to_skip=-1,
-					   float flEpsilon = 0.0 );
+					   float flEpsilon = 0.0,
+					   CShadowRayQueue *pQueue = NULL );	// defer the shadow rays, see CShadowRayQueue
 //void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum, 
 //							 FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
 //							 int nLFlags = 0,
@@ -552,25 +685,67 @@ inline bool ValidDispFace( dface_t *pFace )
 typedef unsigned int SampleHandle_t;				// the upper 16 bits = facelight index (works because max face are 65536)
 													// the lower 16 bits = sample index inside of facelight
 struct sample_t;
-struct SampleData_t
-{
-	unsigned short				x, y, z;
-	CUtlVector<SampleHandle_t>	m_Samples;
-};
 
-struct PatchSampleData_t
+//-----------------------------------------------------------------------------
+// Spatial index of the samples and patches used by the displacement radials.
+// Entries are bucketed by the SAMPLEHASH_VOXEL_SIZE voxel they're in, and the
+// voxels are grouped into blocks of 8x8x8. A dense array over the blocks the
+// entries span says which blocks have anything in them, and each of those has
+// the start of every voxel's run of entries in one packed array, so finding a
+// voxel's entries is two array reads with no hashing or collisions.
+//
+// AddEntry everything, then Finish to build it. It's read only after that.
+//-----------------------------------------------------------------------------
+#define SAMPLEGRID_BLOCK_SHIFT		3
+#define SAMPLEGRID_BLOCK_SIZE		( 1 << SAMPLEGRID_BLOCK_SHIFT )
+#define SAMPLEGRID_BLOCK_VOXELS		( SAMPLEGRID_BLOCK_SIZE * SAMPLEGRID_BLOCK_SIZE * SAMPLEGRID_BLOCK_SIZE )
+
+class CSampleGrid
 {
-	unsigned short				x, y, z;
-	CUtlVector<int>				m_ndxPatches;
+public:
+	CSampleGrid();
+
+	void Purge();
+	void AddEntry( const int voxel[3], unsigned int value );
+	void Finish();
+
+	// The voxel a point is in, and the range of voxels (inclusive) a box touches
+	static void VoxelFromPoint( const Vector &vPoint, int voxel[3] );
+	static void VoxelsInBox( const Vector &vMins, const Vector &vMaxs, int voxelMins[3], int voxelMaxs[3] );
+	static bool VoxelTouchesSphere( int x, int y, int z, const Vector &vCenter, float flRadius );
+
+	// The entries in a voxel, in the order they were added. Returns the count.
+	int GetVoxel( int x, int y, int z, const unsigned int **ppEntries ) const;
+
+	void Log( const char *pFileName ) const;
+
+private:
+	struct PendingEntry_t
+	{
+		int				m_Voxel[3];
+		unsigned int	m_nValue;
+	};
+
+	// Index into m_VoxelStart, or -1 if the voxel's block is empty or outside the grid
+	int VoxelSlot( int x, int y, int z ) const;
+
+	CUtlVector<PendingEntry_t>	m_Pending;
+
+	int							m_BlockMins[3];
+	int							m_BlockCounts[3];
+	int							m_nBlocks;			// non-empty blocks
+	CUtlVector<int>				m_BlockIndex;		// dense over the blocks, -1 for empty ones
+	CUtlVector<int>				m_VoxelStart;		// SAMPLEGRID_BLOCK_VOXELS per non-empty block, plus one
+	CUtlVector<unsigned int>	m_Entries;
 };
 
-UtlHashHandle_t SampleData_AddSample( sample_t *pSample, SampleHandle_t sampleHandle );
+void SampleData_AddSample( sample_t *pSample, SampleHandle_t sampleHandle );
 void PatchSampleData_AddSample( CPatch *pPatch, int ndxPatch );
 unsigned short IncrementPatchIterationKey();
 void SampleData_Log( void );
 
-extern CUtlHash<SampleData_t>		g_SampleHashTable;
-extern CUtlHash<PatchSampleData_t>	g_PatchSampleHashTable;
+extern CSampleGrid	g_SampleGrid;
+extern CSampleGrid	g_PatchSampleGrid;
 
 extern int samplesAdded;
 extern int patchSamplesAdded;
@@ -594,6 +769,8 @@ struct PropTested_t
 	IPhysicsCollision *pThreadedCollision;
 };
 
+struct LightCacheOccluder_t;
+
 class IVradStaticPropMgr
 {
 public:
@@ -602,6 +779,12 @@ public:
 	virtual void Shutdown() = 0;
 	virtual void ComputeLighting( int iThread ) = 0;
 	virtual void AddPolysForRayTrace() = 0;
+
+	// Adds everything AddPolysForRayTrace depends on to the ray trace cache key
+	virtual void HashPolysForRayTrace( MD5Context_t *pContext ) = 0;
+
+	// Adds the props that cast shadows to the -incremental occluder list
+	virtual void GetOccludersForLightCache( CUtlVector<LightCacheOccluder_t> &occluders ) = 0;
 };
 
 //extern PropTested_t s_PropTested[MAX_TOOL_THREADS+1];
@@ -18,6 +18,7 @@
 #include "studio.h"
 #include "pacifier.h"
 #include "vraddetailprops.h"
+#include "irradiance_probes.h"
 #include "mathlib/halton.h"
 #include "messbuf.h"
 #include "byteswap.h"
@@ -655,6 +656,10 @@ static void ComputeAmbientLightingAtPoint( int iThread, const Vector &origin, Ve
 //-----------------------------------------------------------------------------
 // Trace hemispherical rays from a vertex, accumulating indirect
 // sources at each ray termination.
+// This stays one point at a time even where the direct lighting is done four
+// at a time: the rays walk the bsp with CLightSurface to find the face and luxel
+// they hit, and the kd-tree Trace4Rays uses doesn't know which face a triangle
+// came from.
 //-----------------------------------------------------------------------------
 void ComputeIndirectLightingAtPoint( Vector &position, Vector &normal, Vector &outColor,
 									 int iThread, bool force_fast, bool bIgnoreNormals )
@@ -750,8 +755,19 @@ void ComputeIndirectLightingAtPoint( Vector &position, Vector &normal, Vector &o
 	}
 }
 
-static void ComputeAmbientLighting( int iThread, DetailObjectLump_t& prop, Vector color[MAX_LIGHTSTYLES] )
+static void ComputeAmbientLighting( int iThread, DetailObjectLump_t& prop, Vector color[MAX_LIGHTSTYLES], const Vector *pProbeAmbient )
 {
+	// -probes already interpolated it, see ThreadSampleDetailPropProbes
+	if ( pProbeAmbient )
+	{
+		color[0] = *pProbeAmbient;
+		for ( int i = 1; i < MAX_LIGHTSTYLES; ++i)
+		{
+			color[i].Init( 0,0,0 );
+		}
+		return;
+	}
+
 	Vector origin, normal;
 	ComputeWorldCenter( prop, origin, normal );
 
@@ -781,7 +797,7 @@ static void ComputeAmbientLighting( int iThread, DetailObjectLump_t& prop, Vecto
 // Computes lighting for a single detal prop
 //-----------------------------------------------------------------------------
 
-static void ComputeLighting( DetailObjectLump_t& prop, int iThread )
+static void ComputeLighting( DetailObjectLump_t& prop, int iThread, const Vector *pProbeAmbient = NULL )
 {
 	// We're going to take the maximum of the ambient lighting and 
 	// the strongest directional light. This works because we're assuming
@@ -794,7 +810,7 @@ static void ComputeLighting( DetailObjectLump_t& prop, int iThread )
 	ComputeMaxDirectLighting( prop, directColor, iThread );
 
 	// Get the ambient lighting + lightstyles	  
-	ComputeAmbientLighting( iThread, prop, ambColor );
+	ComputeAmbientLighting( iThread, prop, ambColor, pProbeAmbient );
 
 	// Base lighting
 	Vector totalColor;
@@ -1002,6 +1018,45 @@ void VMPI_ReceiveDetailPropWU( int iWorkUnit, MessageBuffer *pBuf, int iWorker )
 	}
 }
 	
+//-----------------------------------------------------------------------------
+// -probes: the ambient light of each prop, interpolated by the threads before
+// the props are lit one at a time
+//-----------------------------------------------------------------------------
+struct DetailPropProbe_t
+{
+	Vector	m_vecAmbient;
+	bool	m_bValid;		// false when the prop has to shoot its own rays
+};
+
+static DetailObjectLump_t *s_pProbeDetailProps = NULL;
+static CUtlVector<DetailPropProbe_t> s_DetailPropProbes;
+
+static void ThreadSampleDetailPropProbes( int iThread, void *pUserData )
+{
+	while (1)
+	{
+		int i = GetThreadWork();
+		if ( i == -1 )
+			break;
+
+		DetailPropProbe_t &probe = s_DetailPropProbes[i];
+		probe.m_bValid = false;
+
+		Vector origin, normal;
+		ComputeWorldCenter( s_pProbeDetailProps[i], origin, normal );
+		if ( !origin.IsValid() || !normal.IsValid() )
+			continue;
+
+		// The probes only keep light style 0
+		IrradianceSample_t sample;
+		if ( IrradianceProbes_Sample( iThread, origin, sample ) && !sample.m_bLightStyles )
+		{
+			probe.m_vecAmbient = sample.m_vecAverage * 255.0f;
+			probe.m_bValid = true;
+		}
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Computes lighting for the detail props
 //-----------------------------------------------------------------------------
@@ -1023,14 +1078,25 @@ void ComputeDetailPropLighting( int iThread )
 		UnserializeDetailPropLighting( GAMELUMP_DETAIL_PROP_LIGHTING_HDR, GAMELUMP_DETAIL_PROP_LIGHTING_HDR_VERSION, s_DetailPropLightStyleLumpHDR );
 	}
 
+	if ( g_bIrradianceProbes )
+	{
+		s_pProbeDetailProps = pProps;
+		s_DetailPropProbes.SetCount( count );
+		RunThreadsOn( count, true, ThreadSampleDetailPropProbes );
+	}
+
 	StartPacifier("Computing detail prop lighting : ");
 
 	for (int i = 0; i < count; ++i)
 	{
 		UpdatePacifier( (float)i / (float)count );
-		ComputeLighting( pProps[i], iThread );
+		bool bProbe = g_bIrradianceProbes && s_DetailPropProbes[i].m_bValid;
+		ComputeLighting( pProps[i], iThread, bProbe ? &s_DetailPropProbes[i].m_vecAmbient : NULL );
 	}
 
+	s_DetailPropProbes.Purge();
+	s_pProbeDetailProps = NULL;
+
 	// Write detail prop lightstyle lump...
 	WriteDetailLightingLumps();
 	EndPacifier( true );
@@ -18,6 +18,7 @@
 #include "utlrbtree.h"
 #include "tier0/fasttimer.h"
 #include "disp_vrad.h"
+#include "telemetry.h"
 
 class CBSPDispRayDistanceEnumerator;
 
@@ -928,38 +929,26 @@ bool CVRadDispMgr::IsNeighbor( int iFace, int iNeighborFace )
 void CVRadDispMgr::RadialLuxelAddSamples( int ndxFace, Vector const &luxelPt, Vector const &luxelNormal, float radius,
 									      radial_t *pRadial, int ndxRadial, bool bBump, int lightStyle )
 {
-	// calculate one over the voxel size
-	float ooVoxelSize = 1.0f / SAMPLEHASH_VOXEL_SIZE;
-
 	//
 	// find voxel info
 	//
 	int voxelMin[3], voxelMax[3];
-	for( int axis = 0; axis < 3; axis++ )
-	{
-		voxelMin[axis] = ( int )( ( luxelPt[axis] - radius ) * ooVoxelSize );
-		voxelMax[axis] = ( int )( ( luxelPt[axis] + radius ) * ooVoxelSize ) + 1;
-	}
+	Vector vRadius( radius, radius, radius );
+	CSampleGrid::VoxelsInBox( luxelPt - vRadius, luxelPt + vRadius, voxelMin, voxelMax );
 
-	SampleData_t sampleData;	
-	for( int ndxZ = voxelMin[2]; ndxZ < voxelMax[2] + 1; ndxZ++ )
+	for( int ndxZ = voxelMin[2]; ndxZ <= voxelMax[2]; ndxZ++ )
 	{
-		for( int ndxY = voxelMin[1]; ndxY < voxelMax[1] + 1; ndxY++ )
+		for( int ndxY = voxelMin[1]; ndxY <= voxelMax[1]; ndxY++ )
 		{
-			for( int ndxX = voxelMin[0]; ndxX < voxelMax[0] + 1; ndxX++ )
+			for( int ndxX = voxelMin[0]; ndxX <= voxelMax[0]; ndxX++ )
 			{
-				sampleData.x = ndxX * 100;
-				sampleData.y = ndxY * 10;
-				sampleData.z = ndxZ;
-				
-				UtlHashHandle_t handle = g_SampleHashTable.Find( sampleData );
-				if( handle != g_SampleHashTable.InvalidHandle() )
+				const unsigned int *pSamples;
+				int count = g_SampleGrid.GetVoxel( ndxX, ndxY, ndxZ, &pSamples );
+				if( count && CSampleGrid::VoxelTouchesSphere( ndxX, ndxY, ndxZ, luxelPt, radius ) )
 				{
-					SampleData_t *pSampleData = &g_SampleHashTable.Element( handle );
-					int count = pSampleData->m_Samples.Count();
 					for( int ndx = 0; ndx < count; ndx++ )
 					{
-						SampleHandle_t sampleHandle = pSampleData->m_Samples.Element( ndx );
+						SampleHandle_t sampleHandle = pSamples[ndx];
 						int ndxSample = ( sampleHandle & 0x0000ffff );
 						int ndxFaceLight = ( ( sampleHandle >> 16 ) & 0x0000ffff );
 
@@ -1190,39 +1179,27 @@ void CVRadDispMgr::RadialLuxelAddPatch( int ndxFace, Vector const &luxelPt,
 								luxelPt, luxelNormal, pRadial, ndxRadial, bBump, bNeighborBump );
 	}
 #else
-	// calculate one over the voxel size
-	float ooVoxelSize = 1.0f / SAMPLEHASH_VOXEL_SIZE;
-
 	//
 	// find voxel info
 	//
 	int voxelMin[3], voxelMax[3];
-	for ( int axis = 0; axis < 3; axis++ )
-	{
-		voxelMin[axis] = ( int )( ( luxelPt[axis] - radius ) * ooVoxelSize );
-		voxelMax[axis] = ( int )( ( luxelPt[axis] + radius ) * ooVoxelSize ) + 1;
-	}
+	Vector vRadius( radius, radius, radius );
+	CSampleGrid::VoxelsInBox( luxelPt - vRadius, luxelPt + vRadius, voxelMin, voxelMax );
 
 	unsigned short curIterationKey = IncrementPatchIterationKey();
-	PatchSampleData_t patchData;	
-	for ( int ndxZ = voxelMin[2]; ndxZ < voxelMax[2] + 1; ndxZ++ )
+	for ( int ndxZ = voxelMin[2]; ndxZ <= voxelMax[2]; ndxZ++ )
 	{
-		for ( int ndxY = voxelMin[1]; ndxY < voxelMax[1] + 1; ndxY++ )
+		for ( int ndxY = voxelMin[1]; ndxY <= voxelMax[1]; ndxY++ )
 		{
-			for ( int ndxX = voxelMin[0]; ndxX < voxelMax[0] + 1; ndxX++ )
+			for ( int ndxX = voxelMin[0]; ndxX <= voxelMax[0]; ndxX++ )
 			{
-				patchData.x = ndxX * 100;
-				patchData.y = ndxY * 10;
-				patchData.z = ndxZ;
-				
-				UtlHashHandle_t handle = g_PatchSampleHashTable.Find( patchData );
-				if ( handle != g_PatchSampleHashTable.InvalidHandle() )
+				const unsigned int *pPatches;
+				int count = g_PatchSampleGrid.GetVoxel( ndxX, ndxY, ndxZ, &pPatches );
+				if ( count )
 				{
-					PatchSampleData_t *pPatchData = &g_PatchSampleHashTable.Element( handle );
-					int count = pPatchData->m_ndxPatches.Count();
 					for ( int ndx = 0; ndx < count; ndx++ )
 					{
-						int ndxPatch = pPatchData->m_ndxPatches.Element( ndx );
+						int ndxPatch = pPatches[ndx];
 						CPatch *pPatch = &g_Patches.Element( ndxPatch );
 						if ( pPatch && pPatch->m_IterationKey != curIterationKey )
 						{
@@ -1263,13 +1240,10 @@ void CVRadDispMgr::GetInterestingPatchesForLuxels(
 		VectorMax( pFaceLight->luxel[i], vLuxelMax, vLuxelMax );
 	}
 		
+	Vector vRadius( patchSampleRadius, patchSampleRadius, patchSampleRadius );
 	int allVoxelMin[3], allVoxelMax[3];
-	for ( int axis = 0; axis < 3; axis++ )
-	{
-		allVoxelMin[axis] = ( int )( ( vLuxelMin[axis] - patchSampleRadius ) / SAMPLEHASH_VOXEL_SIZE );
-		allVoxelMax[axis] = ( int )( ( vLuxelMax[axis] + patchSampleRadius ) / SAMPLEHASH_VOXEL_SIZE ) + 1;
-	}
-	int allVoxelSize[3] = { allVoxelMax[0] - allVoxelMin[0], allVoxelMax[1] - allVoxelMin[1], allVoxelMax[2] - allVoxelMin[2] };
+	CSampleGrid::VoxelsInBox( vLuxelMin - vRadius, vLuxelMax + vRadius, allVoxelMin, allVoxelMax );
+	int allVoxelSize[3] = { allVoxelMax[0] - allVoxelMin[0] + 1, allVoxelMax[1] - allVoxelMin[1] + 1, allVoxelMax[2] - allVoxelMin[2] + 1 };
 
 
 	// Now figure out exactly which voxels these luxels touch.
@@ -1280,17 +1254,13 @@ void CVRadDispMgr::GetInterestingPatchesForLuxels(
 	for ( int i=0; i < pFaceLight->numluxels; i++ )
 	{
 		int voxelMin[3], voxelMax[3];
-		for ( int axis=0; axis < 3; axis++ )
-		{
-			voxelMin[axis] = ( int )( ( pFaceLight->luxel[i][axis] - patchSampleRadius ) / SAMPLEHASH_VOXEL_SIZE );
-			voxelMax[axis] = ( int )( ( pFaceLight->luxel[i][axis] + patchSampleRadius ) / SAMPLEHASH_VOXEL_SIZE ) + 1;
-		}
+		CSampleGrid::VoxelsInBox( pFaceLight->luxel[i] - vRadius, pFaceLight->luxel[i] + vRadius, voxelMin, voxelMax );
 
-		for ( int x=voxelMin[0]; x < voxelMax[0]; x++ )
+		for ( int x=voxelMin[0]; x <= voxelMax[0]; x++ )
 		{
-			for	( int y=voxelMin[1]; y < voxelMax[1]; y++ )
+			for	( int y=voxelMin[1]; y <= voxelMax[1]; y++ )
 			{
-				for ( int z=voxelMin[2]; z < voxelMax[2]; z++ )
+				for ( int z=voxelMin[2]; z <= voxelMax[2]; z++ )
 				{
 					int iBit = (z - allVoxelMin[2])*(allVoxelSize[0]*allVoxelSize[1]) + 
 						(y-allVoxelMin[1])*allVoxelSize[0] + 
@@ -1302,8 +1272,12 @@ void CVRadDispMgr::GetInterestingPatchesForLuxels(
 	}
 	
 	
-	// Now get the list of patches that touch those voxels.	
+	// Now get the list of patches that touch those voxels. Point patches are only
+	// in one voxel each, so they can't come up twice, and they don't need the
+	// iteration key the FinalLightFace threads would otherwise share.
+#if defined( SAMPLEHASH_USE_AREA_PATCHES )
 	unsigned short curIterationKey = IncrementPatchIterationKey();
+#endif
 
 	for ( int x=0; x < allVoxelSize[0]; x++ )
 	{
@@ -1317,32 +1291,23 @@ void CVRadDispMgr::GetInterestingPatchesForLuxels(
 				if ( !val )
 					continue;
 				
-				PatchSampleData_t patchData;	
-				patchData.x = (x + allVoxelMin[0]) * 100;
-				patchData.y = (y + allVoxelMin[1]) * 10;
-				patchData.z = (z + allVoxelMin[2]);
-				
-				UtlHashHandle_t handle = g_PatchSampleHashTable.Find( patchData );
-				if ( handle != g_PatchSampleHashTable.InvalidHandle() )
-				{
-					PatchSampleData_t *pPatchData = &g_PatchSampleHashTable.Element( handle );
+				const unsigned int *pPatches;
+				int count = g_PatchSampleGrid.GetVoxel( x + allVoxelMin[0], y + allVoxelMin[1], z + allVoxelMin[2], &pPatches );
 					
-					// For all patches that touch this hash table element..
-					for ( int ndx = 0; ndx < pPatchData->m_ndxPatches.Count(); ndx++ )
+				// For all patches that touch this voxel..
+				for ( int ndx = 0; ndx < count; ndx++ )
+				{
+					CPatch *pPatch = &g_Patches.Element( pPatches[ndx] );
+
+#if defined( SAMPLEHASH_USE_AREA_PATCHES )
+					// A patch can be in several voxels, so skip the ones we've touched already.
+					if ( pPatch->m_IterationKey == curIterationKey )
+						continue;
+					pPatch->m_IterationKey = curIterationKey;
+#endif
+					if ( IsNeighbor( ndxFace, pPatch->faceNumber ) )
 					{
-						int ndxPatch = pPatchData->m_ndxPatches.Element( ndx );
-						CPatch *pPatch = &g_Patches.Element( ndxPatch );
-						
-						// If we haven't touched the patch already and it's a valid neighbor, then we want to use it.
-						if ( pPatch && pPatch->m_IterationKey != curIterationKey )
-						{
-							pPatch->m_IterationKey = curIterationKey;
-							
-							if ( IsNeighbor( ndxFace, pPatch->faceNumber ) )
-							{
-								interestingPatches.AddToTail( pPatch );
-							}
-						}
+						interestingPatches.AddToTail( pPatch );
 					}
 				}
 			}
@@ -1429,6 +1394,8 @@ void CVRadDispMgr::InsertSamplesDataIntoHashTable( void )
 	int totalSamplesInSolid = 0;
 #endif
 
+	g_SampleGrid.Purge();
+
 	for( int ndxFace = 0; ndxFace < numfaces; ndxFace++ )
 	{
 		dface_t *pFace = &g_pFaces[ndxFace];
@@ -1479,6 +1446,8 @@ void CVRadDispMgr::InsertSamplesDataIntoHashTable( void )
 	Msg( "%d samples in solid\n", totalSamplesInSolid );
 #endif
 
+	g_SampleGrid.Finish();
+
 	// log the distribution
 	SampleData_Log();
 }
@@ -1488,6 +1457,8 @@ void CVRadDispMgr::InsertSamplesDataIntoHashTable( void )
 //-----------------------------------------------------------------------------
 void CVRadDispMgr::InsertPatchSampleDataIntoHashTable( void )
 {
+	g_PatchSampleGrid.Purge();
+
 	// don't insert patch samples if we are not bouncing light
 	if( numbounce <= 0 )
 		return;
@@ -1530,6 +1501,8 @@ void CVRadDispMgr::InsertPatchSampleDataIntoHashTable( void )
 			}
 		}
 	}
+
+	g_PatchSampleGrid.Finish();
 }
 
 
@@ -1538,6 +1511,7 @@ void CVRadDispMgr::InsertPatchSampleDataIntoHashTable( void )
 void CVRadDispMgr::StartTimer( const char *name )
 {
 	Msg( name );
+	Telemetry_BeginPhase( name );
 	m_Timer.Start();
 }
 
@@ -1549,6 +1523,7 @@ void CVRadDispMgr::EndTimer( void )
 	m_Timer.End();
 	CCycleCount duration = m_Timer.GetDuration();
 	double seconds = duration.GetSeconds();
+	Telemetry_EndPhase();
 
 	Msg( "Done<%1.4lf sec>\n", seconds );
 }
@@ -202,7 +202,7 @@ bool CVRadDLL::DoIncrementalLight( char const *pVMFFile )
 	}
 	else
 	{
-		g_iCurFace = 0;
+		g_iCurFace.Reset( 0 );
 		return false;
 	}
 }
@@ -231,7 +231,7 @@ bool CVRadDLL::Serialize()
 
 float CVRadDLL::GetPercentComplete()
 {
-	return (float)g_iCurFace / numfaces;
+	return (float)g_iCurFace.Sum() / numfaces;
 }
 
 
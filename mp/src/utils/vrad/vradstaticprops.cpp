@@ -10,6 +10,7 @@
 //=============================================================================//
 
 #include "vrad.h"
+#include "lightcache.h"
 #include "mathlib/vector.h"
 #include "UtlBuffer.h"
 #include "utlvector.h"
@@ -33,7 +34,9 @@
 #include "vtf/vtf.h"
 #include "tier1/utldict.h"
 #include "tier1/utlsymbol.h"
+#include "tier1/utlmap.h"
 #include "bitmap/tgawriter.h"
+#include "checksum_crc.h"
 
 #include "messbuf.h"
 #include "vmpi.h"
@@ -42,6 +45,35 @@
 
 #define ALIGN_TO_POW2(x,y) (((x)+(y-1))&~(y-1))
 
+#define PROPCACHE_ID		(('C'<<24)+('P'<<16)+('R'<<8)+'V')	// little-endian "VRPC"
+#define PROPCACHE_VERSION	2
+
+// How much the indirect light around a prop can change before it's relit: this
+// fraction of the brighter of the two, plus a little so dark props don't flicker
+#define PROPCACHE_INDIRECT_TOLERANCE	0.02f
+#define PROPCACHE_INDIRECT_FLOOR		0.5f
+
+// The -incremental static prop cache: the final lighting of each prop, found
+// again by PropLightingKey, with the lights that could reach it and the
+// indirect light around it. A prop is relit when its direct light can have
+// changed (LightCache_BoxLightingChanged) or the indirect light around it
+// changed by more than the tolerance above. All of them are relit when the
+// lighting settings changed (LightCache_GetSettingsHash).
+struct PropCacheHeader_t
+{
+	int		id;
+	int		version;
+	uint64	settings;
+	int		numprops;
+	int		unused;
+};
+
+// The indirect light coming in on each side of a prop's bounds (-x, +x, -y, ...)
+struct PropIndirectProbe_t
+{
+	Vector	m_Light[6];
+};
+
 // identifies a vertex embedded in solid
 // lighting will be copied from nearest valid neighbor
 struct badVertex_t
@@ -71,6 +103,17 @@ struct colorTexel_t
 
 };
 
+// A run of lightmap rows of one texel array that still has to be lit
+struct texelTile_t
+{
+	int		m_nTexelsArray;
+	int		m_nFirstRow;
+	int		m_nRows;
+};
+
+// Texels per tile, rounded to whole rows
+#define TEXEL_TILE_SIZE		1024
+
 class CComputeStaticPropLightingResults
 {
 public:
@@ -82,6 +125,14 @@ public:
 	
 	CUtlVector< CUtlVector<colorVertex_t>* > m_ColorVertsArrays;
 	CUtlVector< CUtlVector<colorTexel_t>* > m_ColorTexelsArrays;
+
+	// ComputeLighting rasterizes the texels and leaves lighting them to
+	// LightTexelTile, so the tiles of one prop can go to all the threads
+	CUtlVector< texelTile_t > m_TexelTiles;
+	int		m_nLightmapResX;
+	int		m_nLightmapResY;
+	int		m_nSkipProp;
+	int		m_nLightFlags;
 };
 
 //-----------------------------------------------------------------------------
@@ -132,25 +183,9 @@ private:
 	CUtlVector< Location > mRasterizedLocations;
 };
 
-//-----------------------------------------------------------------------------
-inline Vector ComputeBarycentric( Vector2D _edgeC, Vector2D _edgeA, Vector2D _edgeB, float _dAA, float _dAB, float _dBB, float _invDenom )
-{
-	float dCA = _edgeC.Dot(_edgeA);
-	float dCB = _edgeC.Dot(_edgeB);
-	
-	Vector retVal;
-	retVal.y = (_dBB * dCA - _dAB * dCB) * _invDenom;
-	retVal.z = (_dAA * dCB - _dAB * dCA) * _invDenom;
-	retVal.x = 1.0f - retVal.y - retVal.z;
-
-	return retVal;
-}
-
 //-----------------------------------------------------------------------------
 void Rasterizer::Build()
 {
-	// For now, use the barycentric method. It's easy, I'm lazy. 
-	// We can optimize later if it's a performance issue.
 	const float baseX = mUvStepX / 2.0f;
 	const float baseY = mUvStepY / 2.0f;
 
@@ -192,28 +227,51 @@ void Rasterizer::Build()
 	mRasterizedLocations.EnsureCount(count);
 	memset( mRasterizedLocations.Base(), 0, mRasterizedLocations.Count() * sizeof( Location ) );
 	
-	// Computing Barycentrics adapted from here http://gamedev.stackexchange.com/questions/23743/whats-the-most-efficient-way-to-find-barycentric-coordinates
+	// Half-space edge functions: each barycentric coordinate is an affine function of
+	// the texel position, so a row is done four texels at a time.
+	//   y = ( dx * edgeB.y - dy * edgeB.x ) / area
+	//   z = ( dy * edgeA.x - dx * edgeA.y ) / area
 	Vector2D edgeA = mT1 - mT0;
 	Vector2D edgeB = mT2 - mT0;
 
-	float dAA = edgeA.Dot(edgeA);
-	float dAB = edgeA.Dot(edgeB);
-	float dBB = edgeB.Dot(edgeB);
-	float invDenom = 1.0f / (dAA * dBB - dAB * dAB);
+	const fltx4 invArea = ReplicateX4( 1.0f / (edgeA.x * edgeB.y - edgeA.y * edgeB.x) );
+	const fltx4 originX = ReplicateX4( mT0.x );
+	const fltx4 edgeAY = ReplicateX4( edgeA.y );
+	const fltx4 edgeBY = ReplicateX4( edgeB.y );
 
 	int linearPos = 0; 
 	for (int j = iMinY; j <= iMaxY; ++j) {
-		for (int i = iMinX; i <= iMaxX; ++i) {
-			Vector2D testPt( i * mUvStepX + baseX, j * mUvStepY + baseY );
-			Vector barycentric = ComputeBarycentric( testPt - mT0, edgeA, edgeB, dAA, dAB, dBB, invDenom );
+		const float testY = j * mUvStepY + baseY;
+		const float dy = testY - mT0.y;
+		const fltx4 rowY = ReplicateX4( -dy * edgeB.x );
+		const fltx4 rowZ = ReplicateX4( dy * edgeA.x );
+
+		for (int i = iMinX; i <= iMaxX; i += 4) {
+			// Lanes past the end of the row are computed and thrown away
+			fltx4 testX;
+			for (int k = 0; k < 4; ++k) {
+				SubFloat( testX, k ) = (i + k) * mUvStepX + baseX;
+			}
+
+			fltx4 dx = SubSIMD( testX, originX );
+			fltx4 baryY = MulSIMD( AddSIMD( MulSIMD( dx, edgeBY ), rowY ), invArea );
+			fltx4 baryZ = MulSIMD( SubSIMD( rowZ, MulSIMD( dx, edgeAY ) ), invArea );
+			fltx4 baryX = SubSIMD( SubSIMD( Four_Ones, baryY ), baryZ );
 
 			// Test whether the point is inside the triangle. 
 			// MCJOHNTODO: Edge rules and whatnot--right now we re-rasterize points on the edge.
-			Location& newLoc = mRasterizedLocations[linearPos++];
-			newLoc.barycentric = barycentric;
-			newLoc.uv = testPt;
-
-			newLoc.insideTriangle = (barycentric.x >= 0.0f && barycentric.x <= 1.0f && barycentric.y >= 0.0f && barycentric.y <= 1.0f && barycentric.z >= 0.0f && barycentric.z <= 1.0f);
+			fltx4 inside = AndSIMD( CmpGeSIMD( baryX, Four_Zeros ), CmpLeSIMD( baryX, Four_Ones ) );
+			inside = AndSIMD( inside, AndSIMD( CmpGeSIMD( baryY, Four_Zeros ), CmpLeSIMD( baryY, Four_Ones ) ) );
+			inside = AndSIMD( inside, AndSIMD( CmpGeSIMD( baryZ, Four_Zeros ), CmpLeSIMD( baryZ, Four_Ones ) ) );
+			int insideMask = TestSignSIMD( inside );
+
+			int nLanes = min( 4, iMaxX - i + 1 );
+			for (int k = 0; k < nLanes; ++k) {
+				Location& newLoc = mRasterizedLocations[linearPos++];
+				newLoc.barycentric.Init( SubFloat( baryX, k ), SubFloat( baryY, k ), SubFloat( baryZ, k ) );
+				newLoc.uv.Init( SubFloat( testX, k ), testY );
+				newLoc.insideTriangle = ( insideMask & ( 1 << k ) ) != 0;
+			}
 		}
 	}
 }
@@ -231,10 +289,13 @@ IPhysicsCollision *s_pPhysCollision = NULL;
 static void ConvertTexelDataToTexture(unsigned int _resX, unsigned int _resY, ImageFormat _destFmt, const CUtlVector<colorTexel_t>& _srcTexels, CUtlMemory<byte>* _outTexture);
 
 // Such a monstrosity. :(
-static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const matrix3x4_t& _matNormal, int _iThread, int _skipProp, int _nFlags, int _lightmapResX, int _lightmapResY, 
+static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const matrix3x4_t& _matNormal, int _lightmapResX, int _lightmapResY, 
 											studiohdr_t* _pStudioHdr, mstudiomodel_t* _pStudioModel, OptimizedModel::ModelHeader_t* _pVtxModel, int _meshID, 
 											CComputeStaticPropLightingResults *_pResults );
 
+// Lights the texels of a tile that GenerateLightmapSamplesForMesh left for it
+static void LightTexelTile( CComputeStaticPropLightingResults *_pResults, int _tile, int _iThread );
+
 // Debug function, converts lightmaps to linear space then dumps them out. 
 // TODO: Write out the file in a .dds instead of a .tga, in whatever format we're supposed to use.
 static void DumpLightmapLinear( const char* _dstFilename, const CUtlVector<colorTexel_t>& _srcTexels, int _width, int _height );
@@ -267,7 +328,9 @@ private:
 	
 	// local thread version
 	static void ThreadComputeStaticPropLighting( int iThread, void *pUserData );
+	static void ThreadComputePropIndirectProbe( int iThread, int iStaticProp );
 	void ComputeLightingForProp( int iThread, int iStaticProp );
+	bool LightNextTexelTile( int iThread );
 
 	// Methods associated with unserializing static props
 	void UnserializeModelDict( CUtlBuffer& buf );
@@ -278,6 +341,14 @@ private:
 	void CreateCollisionModel( char const* pModelName );
 
 private:
+	// The vertices of one body part model, unpacked from the vvd before the
+	// lighting threads start so they don't all go loading it
+	struct ModelVertices_t
+	{
+		CUtlVector<Vector>	m_Positions;
+		CUtlVector<Vector>	m_Normals;
+	};
+
 	// Unique static prop models
 	struct StaticPropDict_t
 	{
@@ -287,8 +358,10 @@ private:
 		Vector			m_Maxs;
 		studiohdr_t*	m_pStudioHdr;
 		CUtlBuffer		m_VtxBuf;
+		CRC32_t			m_ModelCRC;		// mdl, phy and vtx files, for the ray trace cache
 		CUtlVector<int>	m_textureShadowIndex;	// each texture has an index if this model casts texture shadows
 		CUtlVector<int>	m_triangleMaterialIndex;// each triangle has an index if this model casts texture shadows
+		CUtlVector<ModelVertices_t>	m_Vertices;	// each body part model in turn, see BuildVertexCache
 	};
 
 	struct MeshData_t
@@ -332,15 +405,48 @@ private:
 	// The list of all static props
 	CUtlVector <StaticPropDict_t>	m_StaticPropDict;
 	CUtlVector <CStaticProp>		m_StaticProps;
+	CUtlVector <bool>				m_PropRestored;		// lighting came from the -incremental prop cache
+	CUtlVector <PropIndirectProbe_t>	m_PropIndirect;		// for the -incremental prop cache
 
 	bool m_bIgnoreStaticPropTrace;
 
+	// A prop whose texels the threads are lighting. Whoever lights its last
+	// tile builds its lightmap while the others go on to the next prop.
+	struct TexelJob_t
+	{
+		int									m_iStaticProp;
+		CComputeStaticPropLightingResults	m_Results;
+		CInterlockedInt						m_nTilesLeft;
+	};
+
+	struct QueuedTexelTile_t
+	{
+		TexelJob_t	*m_pJob;
+		int			m_nTile;
+	};
+
+	CThreadFastMutex				m_TexelTileLock;
+	CUtlVector<QueuedTexelTile_t>	m_TexelTileQueue;
+	int								m_nNextTexelTile;
+	CInterlockedInt					m_nPropsInSetup;	// props being rasterized, which may still add tiles
+
+	void BuildVertexCache( StaticPropDict_t &dict );
 	void ComputeLighting( CStaticProp &prop, int iThread, int prop_index, CComputeStaticPropLightingResults *pResults );
 	void ApplyLightingToStaticProp( int iStaticProp, CStaticProp &prop, const CComputeStaticPropLightingResults *pResults );
 
 	void SerializeLighting();
 	void AddPolysForRayTrace();
+	void HashPolysForRayTrace( MD5Context_t *pContext );
+	void GetOccludersForLightCache( CUtlVector<LightCacheOccluder_t> &occluders );
 	void BuildTriList( CStaticProp &prop );
+
+	// -incremental keeps the lighting of props that didn't change
+	void GetPropBounds( const CStaticProp &prop, Vector &mins, Vector &maxs );
+	void GetPropLightingBounds( const CStaticProp &prop, Vector &mins, Vector &maxs );
+	void ComputePropIndirectProbe( int iThread, int iStaticProp );
+	uint64 PropLightingKey( int iStaticProp );
+	int LoadPropLightingCache();
+	void SavePropLightingCache();
 };
 
 
@@ -363,6 +469,7 @@ CVradStaticPropMgr::CVradStaticPropMgr()
 {
 	// set to ignore static prop traces
 	m_bIgnoreStaticPropTrace = false;
+	m_nNextTexelTile = 0;
 }
 
 CVradStaticPropMgr::~CVradStaticPropMgr()
@@ -946,6 +1053,7 @@ void CVradStaticPropMgr::CreateCollisionModel( char const* pModelName )
 	int i = m_StaticPropDict.AddToTail();
 	m_StaticPropDict[i].m_pModel = NULL;
 	m_StaticPropDict[i].m_pStudioHdr = NULL;
+	m_StaticPropDict[i].m_ModelCRC = 0;
 
 	if ( !LoadStudioModel( pModelName, buf ) )
 	{
@@ -995,6 +1103,15 @@ void CVradStaticPropMgr::CreateCollisionModel( char const* pModelName )
 		m_StaticPropDict[i].m_VtxBuf.Purge();
 	}
 
+	// The vvd isn't loaded yet, but studiomdl stamps the same checksum into it as into the mdl
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	CRC32_ProcessBuffer( &crc, buf.Base(), buf.TellPut() );
+	CRC32_ProcessBuffer( &crc, bufphy.Base(), bufphy.TellPut() );
+	CRC32_ProcessBuffer( &crc, m_StaticPropDict[i].m_VtxBuf.Base(), m_StaticPropDict[i].m_VtxBuf.TellPut() );
+	CRC32_Final( &crc );
+	m_StaticPropDict[i].m_ModelCRC = crc;
+
 	if ( g_bTextureShadows )
 	{
 		if ( (pHdr->flags & STUDIOHDR_FLAGS_CAST_TEXTURE_SHADOWS) || IsModelTextureShadowsForced(pModelName) )
@@ -1145,17 +1262,34 @@ bool PositionInSolid( Vector &position )
 }
 
 //-----------------------------------------------------------------------------
-// Trace from a vertex to each direct light source, accumulating its contribution.
+// Trace from up to four vertexes to each direct light source, accumulating their
+// contributions. They go through GatherSampleLightSSE together, so four cost
+// about the same as one.
 //-----------------------------------------------------------------------------
-void ComputeDirectLightingAtPoint( Vector &position, Vector &normal, Vector &outColor, int iThread,
-								   int static_prop_id_to_skip=-1, int nLFlags = 0)
+static void ComputeDirectLightingAtPoints( const Vector *pPositions, const Vector *pNormals, int nPoints, Vector *pOutColors,
+										   int iThread, int static_prop_id_to_skip, int nLFlags )
 {
+	Assert( nPoints >= 1 && nPoints <= 4 );
+
 	SSE_sampleLightOutput_t	sampleOutput;
 
-	outColor.Init();
+	// unused lanes repeat the last point
+	int lane[4];
+	int cluster[4];
+	for ( int i = 0; i < 4; i++ )
+	{
+		lane[i] = min( i, nPoints - 1 );
+	}
+	for ( int i = 0; i < nPoints; i++ )
+	{
+		cluster[i] = ClusterFromPoint( pPositions[i] );
+		pOutColors[i].Init();
+	}
+
+	FourVectors normal4;
+	normal4.LoadAndSwizzle( pNormals[lane[0]], pNormals[lane[1]], pNormals[lane[2]], pNormals[lane[3]] );
 
 	// Iterate over all direct lights and accumulate their contribution
-	int cluster = ClusterFromPoint( position );
 	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
 	{
 		if ( dl->light.style )
@@ -1165,46 +1299,68 @@ void ComputeDirectLightingAtPoint( Vector &position, Vector &normal, Vector &out
 		}
 
 		// is this lights cluster visible?
-		if ( !PVSCheck( dl->pvs, cluster ) )
+		bool bVisible[4];
+		bool bAnyVisible = false;
+		for ( int i = 0; i < nPoints; i++ )
+		{
+			bVisible[i] = PVSCheck( dl->pvs, cluster[i] );
+			bAnyVisible = bAnyVisible || bVisible[i];
+		}
+		if ( !bAnyVisible )
 			continue;
 
-		// push the vertex towards the light to avoid surface acne
-		Vector adjusted_pos = position;
-		float flEpsilon = 0.0;
-
-		if  (dl->light.type != emit_skyambient)
+		// push the vertexes towards the light to avoid surface acne
+		Vector adjusted_pos[4];
+		for ( int i = 0; i < nPoints; i++ )
 		{
-			// push towards the light
-			Vector fudge;
-			if ( dl->light.type == emit_skylight )
-				fudge = -( dl->light.normal);
-			else
+			adjusted_pos[i] = pPositions[i];
+
+			if  (dl->light.type != emit_skyambient)
 			{
-				fudge = dl->light.origin-position;
-				VectorNormalize( fudge );
+				// push towards the light
+				Vector fudge;
+				if ( dl->light.type == emit_skylight )
+					fudge = -( dl->light.normal);
+				else
+				{
+					fudge = dl->light.origin-pPositions[i];
+					VectorNormalize( fudge );
+				}
+				fudge *= 4.0;
+				adjusted_pos[i] += fudge;
+			}
+			else 
+			{
+				// push out along normal
+				adjusted_pos[i] += 4.0 * pNormals[i];
 			}
-			fudge *= 4.0;
-			adjusted_pos += fudge;
-		}
-		else 
-		{
-			// push out along normal
-			adjusted_pos += 4.0 * normal;
-//			flEpsilon = 1.0;
 		}
 
 		FourVectors adjusted_pos4;
-		FourVectors normal4;
-		adjusted_pos4.DuplicateVector( adjusted_pos );
-		normal4.DuplicateVector( normal );
+		adjusted_pos4.LoadAndSwizzle( adjusted_pos[lane[0]], adjusted_pos[lane[1]], adjusted_pos[lane[2]], adjusted_pos[lane[3]] );
 
 		GatherSampleLightSSE( sampleOutput, dl, -1, adjusted_pos4, &normal4, 1, iThread, nLFlags | GATHERLFLAGS_FORCE_FAST,
-		                      static_prop_id_to_skip, flEpsilon );
-		
-		VectorMA( outColor, sampleOutput.m_flFalloff.m128_f32[0] * sampleOutput.m_flDot[0].m128_f32[0], dl->light.intensity, outColor );
+		                      static_prop_id_to_skip, 0.0f );
+
+		for ( int i = 0; i < nPoints; i++ )
+		{
+			if ( bVisible[i] )
+			{
+				VectorMA( pOutColors[i], SubFloat( sampleOutput.m_flFalloff, i ) * SubFloat( sampleOutput.m_flDot[0], i ), dl->light.intensity, pOutColors[i] );
+			}
+		}
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Trace from a vertex to each direct light source, accumulating its contribution.
+//-----------------------------------------------------------------------------
+void ComputeDirectLightingAtPoint( Vector &position, Vector &normal, Vector &outColor, int iThread,
+								   int static_prop_id_to_skip=-1, int nLFlags = 0)
+{
+	ComputeDirectLightingAtPoints( &position, &normal, 1, &outColor, iThread, static_prop_id_to_skip, nLFlags );
+}
+
 //-----------------------------------------------------------------------------
 // Takes the results from a ComputeLighting call and applies it to the static prop in question.
 //-----------------------------------------------------------------------------
@@ -1301,6 +1457,43 @@ void CVradStaticPropMgr::ApplyLightingToStaticProp( int iStaticProp, CStaticProp
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Unpacks the vertexes of every body part model in the order ComputeLighting
+// lights them. Loading the vvd isn't thread safe, so this has to happen before
+// the threads start.
+//-----------------------------------------------------------------------------
+void CVradStaticPropMgr::BuildVertexCache( StaticPropDict_t &dict )
+{
+	studiohdr_t	*pStudioHdr = dict.m_pStudioHdr;
+	if ( !pStudioHdr || dict.m_Vertices.Count() )
+		return;
+
+	for ( int bodyID = 0; bodyID < pStudioHdr->numbodyparts; ++bodyID )
+	{
+		mstudiobodyparts_t *pBodyPart = pStudioHdr->pBodypart( bodyID );
+		for ( int modelID = 0; modelID < pBodyPart->nummodels; ++modelID )
+		{
+			mstudiomodel_t *pStudioModel = pBodyPart->pModel( modelID );
+			ModelVertices_t &modelVerts = dict.m_Vertices[dict.m_Vertices.AddToTail()];
+			modelVerts.m_Positions.EnsureCapacity( pStudioModel->numvertices );
+			modelVerts.m_Normals.EnsureCapacity( pStudioModel->numvertices );
+
+			for ( int meshID = 0; meshID < pStudioModel->nummeshes; ++meshID )
+			{
+				mstudiomesh_t *pStudioMesh = pStudioModel->pMesh( meshID );
+				const mstudio_meshvertexdata_t *vertData = pStudioMesh->GetVertexData( (void *)pStudioHdr );
+				Assert( vertData ); // This can only return NULL on X360 for now
+
+				for ( int vertexID = 0; vertexID < pStudioMesh->numvertices; ++vertexID )
+				{
+					modelVerts.m_Positions.AddToTail( *vertData->Position( vertexID ) );
+					modelVerts.m_Normals.AddToTail( *vertData->Normal( vertexID ) );
+				}
+			}
+		}
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Trace rays from each unique vertex, accumulating direct and indirect
 // sources at each ray termination. Use the winding data to distribute the unique vertexes
@@ -1331,10 +1524,16 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 
 	VMPI_SetCurrentStage( "ComputeLighting" );
 
+	pResults->m_nLightmapResX = prop.m_LightmapImageWidth;
+	pResults->m_nLightmapResY = prop.m_LightmapImageHeight;
+	pResults->m_nSkipProp = skip_prop;
+	pResults->m_nLightFlags = nFlags;
+
 	matrix3x4_t	matPos, matNormal;
 	AngleMatrix(prop.m_Angles, prop.m_Origin, matPos);
 	AngleMatrix(prop.m_Angles, matNormal);
 	
+	int iModelVerts = 0;
 	for ( int bodyID = 0; bodyID < pStudioHdr->numbodyparts; ++bodyID )
 	{
 		OptimizedModel::BodyPartHeader_t* pVtxBodyPart = pVtxHdr->pBodyPart( bodyID );
@@ -1359,71 +1558,98 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 			colorVerts.EnsureCount( pStudioModel->numvertices );
 			memset( colorVerts.Base(), 0, colorVerts.Count() * sizeof(colorVertex_t) );
 
-			int numVertexes = 0;
-			for ( int meshID = 0; meshID < pStudioModel->nummeshes; ++meshID )
+			// TODO: Move this into its own function. In fact, refactor this whole function.
+			if (withTexelLighting)
 			{
-				mstudiomesh_t *pStudioMesh = pStudioModel->pMesh( meshID );
-				const mstudio_meshvertexdata_t *vertData = pStudioMesh->GetVertexData((void *)pStudioHdr);
+				for ( int meshID = 0; meshID < pStudioModel->nummeshes; ++meshID )
+				{
+					GenerateLightmapSamplesForMesh( matPos, matNormal, prop.m_LightmapImageWidth, prop.m_LightmapImageHeight, pStudioHdr, pStudioModel, pVtxModel, meshID, pResults );
+				}
 
-				Assert(vertData); // This can only return NULL on X360 for now
-				
-				// TODO: Move this into its own function. In fact, refactor this whole function.
-				if (withTexelLighting)
+				// Each mesh starts the texels over, so they're lit once the last one is done
+				int nRowsPerTile = max( 1, TEXEL_TILE_SIZE / max( 1, (int)prop.m_LightmapImageWidth ) );
+				for ( int nRow = 0; pStudioModel->nummeshes && nRow < (int)prop.m_LightmapImageHeight; nRow += nRowsPerTile )
 				{
-					GenerateLightmapSamplesForMesh( matPos, matNormal, iThread, skip_prop, nFlags, prop.m_LightmapImageWidth, prop.m_LightmapImageHeight, pStudioHdr, pStudioModel, pVtxModel, meshID, pResults );
+					texelTile_t &tile = pResults->m_TexelTiles[pResults->m_TexelTiles.AddToTail()];
+					tile.m_nTexelsArray = pResults->m_ColorTexelsArrays.Count() - 1;
+					tile.m_nFirstRow = nRow;
+					tile.m_nRows = min( nRowsPerTile, (int)prop.m_LightmapImageHeight - nRow );
 				}
+			}
 
-				// If we do lightmapping, we also do vertex lighting as a potential fallback. This may change.
-				for ( int vertexID = 0; vertexID < pStudioMesh->numvertices; ++vertexID )
+			// If we do lightmapping, we also do vertex lighting as a potential fallback. This may change.
+			const ModelVertices_t &modelVerts = dict.m_Vertices[iModelVerts++];
+			int numVertexes = modelVerts.m_Positions.Count();
+			Assert( numVertexes <= colorVerts.Count() );
+
+			CUtlVector<Vector> sampleNormals;
+			CUtlVector<int> litVertexes;
+			sampleNormals.SetSize( numVertexes );
+			litVertexes.EnsureCapacity( numVertexes );
+
+			for ( int vertexID = 0; vertexID < numVertexes; ++vertexID )
+			{
+				Vector samplePosition;
+				// transform position and normal into world coordinate system
+				VectorTransform(modelVerts.m_Positions[vertexID], matPos, samplePosition);
+				VectorTransform(modelVerts.m_Normals[vertexID], matNormal, sampleNormals[vertexID]);
+
+				if ( PositionInSolid( samplePosition ) )
+				{
+					// vertex is in solid, add to the bad list, and recover later
+					badVertex_t badVertex;
+					badVertex.m_ColorVertex = vertexID;
+					badVertex.m_Position = samplePosition;
+					badVertex.m_Normal = sampleNormals[vertexID];
+					badVerts.AddToTail( badVertex );			
+				}
+				else
+				{
+					colorVerts[vertexID].m_bValid = true;
+					colorVerts[vertexID].m_Position = samplePosition;
+					litVertexes.AddToTail( vertexID );
+				}
+			}
+
+			// light the vertexes out in the open four at a time
+			for ( int i = 0; i < litVertexes.Count(); i += 4 )
+			{
+				int nPoints = min( 4, litVertexes.Count() - i );
+				Vector samplePositions[4];
+				Vector normals[4];
+				Vector directColors[4];
+				for ( int j = 0; j < nPoints; j++ )
 				{
-					Vector sampleNormal;
-					Vector samplePosition;
-					// transform position and normal into world coordinate system
-					VectorTransform(*vertData->Position(vertexID), matPos, samplePosition);
-					VectorTransform(*vertData->Normal(vertexID), matNormal, sampleNormal);
+					samplePositions[j] = colorVerts[litVertexes[i+j]].m_Position;
+					normals[j] = sampleNormals[litVertexes[i+j]];
+				}
+
+				if ( !g_bShowStaticPropNormals )
+				{
+					ComputeDirectLightingAtPoints( samplePositions, normals, nPoints, directColors, iThread, skip_prop, nFlags );
+				}
+
+				for ( int j = 0; j < nPoints; j++ )
+				{
+					Vector &directColor = directColors[j];
+					Vector indirectColor(0,0,0);
 
-					if ( PositionInSolid( samplePosition ) )
+					if (g_bShowStaticPropNormals)
 					{
-						// vertex is in solid, add to the bad list, and recover later
-						badVertex_t badVertex;
-						badVertex.m_ColorVertex = numVertexes;
-						badVertex.m_Position = samplePosition;
-						badVertex.m_Normal = sampleNormal;
-						badVerts.AddToTail( badVertex );			
+						directColor= normals[j];
+						directColor += Vector(1.0,1.0,1.0);
+						directColor *= 50.0;
 					}
 					else
 					{
-						Vector direct_pos=samplePosition;
-							
-						
-
-						Vector directColor(0,0,0);
-						ComputeDirectLightingAtPoint( direct_pos,
-														sampleNormal, directColor, iThread,
-														skip_prop, nFlags );
-						Vector indirectColor(0,0,0);
-
-						if (g_bShowStaticPropNormals)
-						{
-							directColor= sampleNormal;
-							directColor += Vector(1.0,1.0,1.0);
-							directColor *= 50.0;
-						}
-						else
-						{
-							if (numbounce >= 1)
-								ComputeIndirectLightingAtPoint( 
-									samplePosition, sampleNormal, 
-									indirectColor, iThread, true,
-									( prop.m_Flags & STATIC_PROP_IGNORE_NORMALS) != 0 );
-						}
-						
-						colorVerts[numVertexes].m_bValid = true;
-						colorVerts[numVertexes].m_Position = samplePosition;
-						VectorAdd( directColor, indirectColor, colorVerts[numVertexes].m_Color );
+						if (numbounce >= 1)
+							ComputeIndirectLightingAtPoint( 
+								samplePositions[j], normals[j], 
+								indirectColor, iThread, true,
+								( prop.m_Flags & STATIC_PROP_IGNORE_NORMALS) != 0 );
 					}
-					
-					numVertexes++;
+
+					VectorAdd( directColor, indirectColor, colorVerts[litVertexes[i+j]].m_Color );
 				}
 			}
 			
@@ -1674,6 +1900,10 @@ void CVradStaticPropMgr::VMPI_ProcessStaticProp( int iThread, int iStaticProp, M
 	// Compute the lighting.
 	CComputeStaticPropLightingResults results;
 	ComputeLighting( m_StaticProps[iStaticProp], iThread, iStaticProp, &results );
+	for ( int i = 0; i < results.m_TexelTiles.Count(); i++ )
+	{
+		LightTexelTile( &results, i, iThread );
+	}
 
 	VMPI_SetCurrentStage( "EncodeLightingResults" );
 	
@@ -1743,20 +1973,88 @@ void CVradStaticPropMgr::VMPI_ReceiveStaticPropResults( int iStaticProp, Message
 
 void CVradStaticPropMgr::ComputeLightingForProp( int iThread, int iStaticProp )
 {
+	if ( m_PropRestored.Count() && m_PropRestored[iStaticProp] )
+		return;
+
+	++m_nPropsInSetup;
+
 	// Compute the lighting.
-	CComputeStaticPropLightingResults results;
-	ComputeLighting( m_StaticProps[iStaticProp], iThread, iStaticProp, &results );
-	ApplyLightingToStaticProp( iStaticProp, m_StaticProps[iStaticProp], &results );
+	TexelJob_t *pJob = new TexelJob_t;
+	pJob->m_iStaticProp = iStaticProp;
+	ComputeLighting( m_StaticProps[iStaticProp], iThread, iStaticProp, &pJob->m_Results );
+
+	int nTiles = pJob->m_Results.m_TexelTiles.Count();
+	if ( nTiles == 0 )
+	{
+		ApplyLightingToStaticProp( iStaticProp, m_StaticProps[iStaticProp], &pJob->m_Results );
+		delete pJob;
+	}
+	else
+	{
+		// Hand the texels out to all the threads
+		pJob->m_nTilesLeft = nTiles;
+		m_TexelTileLock.Lock();
+		for ( int i = 0; i < nTiles; i++ )
+		{
+			QueuedTexelTile_t &queued = m_TexelTileQueue[m_TexelTileQueue.AddToTail()];
+			queued.m_pJob = pJob;
+			queued.m_nTile = i;
+		}
+		m_TexelTileLock.Unlock();
+	}
+
+	--m_nPropsInSetup;
+}
+
+//-----------------------------------------------------------------------------
+// Lights the oldest queued tile of texels, if there is one
+//-----------------------------------------------------------------------------
+bool CVradStaticPropMgr::LightNextTexelTile( int iThread )
+{
+	m_TexelTileLock.Lock();
+	if ( m_nNextTexelTile >= m_TexelTileQueue.Count() )
+	{
+		m_TexelTileLock.Unlock();
+		return false;
+	}
+	QueuedTexelTile_t queued = m_TexelTileQueue[m_nNextTexelTile++];
+	m_TexelTileLock.Unlock();
+
+	TexelJob_t *pJob = queued.m_pJob;
+	LightTexelTile( &pJob->m_Results, queued.m_nTile, iThread );
+
+	// Build the lightmap (mips and format conversion) while the other threads
+	// go on lighting
+	if ( --pJob->m_nTilesLeft == 0 )
+	{
+		ApplyLightingToStaticProp( pJob->m_iStaticProp, m_StaticProps[pJob->m_iStaticProp], &pJob->m_Results );
+		delete pJob;
+	}
+	return true;
 }
 
 void CVradStaticPropMgr::ThreadComputeStaticPropLighting( int iThread, void *pUserData )
 {
 	while (1)
 	{
+		// Texels of props that are already rasterized come first, so one big
+		// lightmap gets all the threads instead of just the one that started it
+		if ( g_StaticPropMgr.LightNextTexelTile( iThread ) )
+			continue;
+
 		int j = GetThreadWork ();
 		if (j == -1)
+		{
+			// Out of props, but the ones still being rasterized may add tiles
+			if ( g_StaticPropMgr.m_nPropsInSetup > 0 )
+			{
+				ThreadSleep( 1 );
+				continue;
+			}
+			if ( g_StaticPropMgr.LightNextTexelTile( iThread ) )
+				continue;
 			break;
-		CComputeStaticPropLightingResults results;
+		}
 		g_StaticPropMgr.ComputeLightingForProp( iThread, j );
 	}
 }
@@ -1775,6 +2073,25 @@ void CVradStaticPropMgr::ComputeLighting( int iThread )
 		return;
 	}
 
+	for ( int i = 0; i < m_StaticPropDict.Count(); i++ )
+	{
+		BuildVertexCache( m_StaticPropDict[i] );
+	}
+
+	// -incremental keeps the lighting of the props that didn't change and
+	// wouldn't get different light. Texture shadows depend on what's in the
+	// textures, which the cache doesn't look at.
+	bool bPropCache = g_bLightCache && !g_bUseMPI && !g_bTextureShadows && LightCache_GetSettingsHash() != 0;
+	m_PropRestored.Purge();
+	if ( bPropCache )
+	{
+		m_PropIndirect.SetCount( count );
+		RunThreadsOnIndividual( count, false, ThreadComputePropIndirectProbe );
+
+		int nRestored = LoadPropLightingCache();
+		Msg( "Kept the lighting of %d of %d static props\n", nRestored, count );
+	}
+
 	StartPacifier( "Computing static prop lighting : " );
 
 	// ensure any traces against us are ignored because we have no inherit lighting contribution
@@ -1793,7 +2110,11 @@ void CVradStaticPropMgr::ComputeLighting( int iThread )
 	}
 	else
 	{
+		m_TexelTileQueue.RemoveAll();
+		m_nNextTexelTile = 0;
+		m_nPropsInSetup = 0;
 		RunThreadsOn(count, true, ThreadComputeStaticPropLighting);
+		m_TexelTileQueue.Purge();
 	}
 
 	// restore default
@@ -1803,6 +2124,318 @@ void CVradStaticPropMgr::ComputeLighting( int iThread )
 	SerializeLighting();
 
 	EndPacifier( true );
+
+	if ( bPropCache )
+	{
+		SavePropLightingCache();
+	}
+	m_PropRestored.Purge();
+	m_PropIndirect.Purge();
+}
+
+//-----------------------------------------------------------------------------
+// The world space bounds of a prop, as an occluder and as something that's lit.
+// Bad vertices get lit at the lighting origin.
+//-----------------------------------------------------------------------------
+void CVradStaticPropMgr::GetPropBounds( const CStaticProp &prop, Vector &mins, Vector &maxs )
+{
+	const StaticPropDict_t &dict = m_StaticPropDict[prop.m_ModelIdx];
+
+	// The hull doesn't always hold the render mesh, which is what -staticproppolys traces
+	Vector localMins = dict.m_Mins;
+	Vector localMaxs = dict.m_Maxs;
+	if ( dict.m_pStudioHdr )
+	{
+		VectorMin( localMins, dict.m_pStudioHdr->view_bbmin, localMins );
+		VectorMax( localMaxs, dict.m_pStudioHdr->view_bbmax, localMaxs );
+	}
+
+	matrix3x4_t xform;
+	AngleMatrix( prop.m_Angles, prop.m_Origin, xform );
+	TransformAABB( xform, localMins, localMaxs, mins, maxs );
+}
+
+void CVradStaticPropMgr::GetPropLightingBounds( const CStaticProp &prop, Vector &mins, Vector &maxs )
+{
+	GetPropBounds( prop, mins, maxs );
+	if ( prop.m_bLightingOriginValid )
+	{
+		VectorMin( mins, prop.m_LightingOrigin, mins );
+		VectorMax( maxs, prop.m_LightingOrigin, maxs );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Samples the indirect light just outside the middle of each side of a prop's
+// bounds, looking out. A few hundred rays instead of the prop's every vertex
+// and texel, but they see most of what the prop does.
+//-----------------------------------------------------------------------------
+void CVradStaticPropMgr::ComputePropIndirectProbe( int iThread, int iStaticProp )
+{
+	Vector mins, maxs;
+	GetPropBounds( m_StaticProps[iStaticProp], mins, maxs );
+	Vector center = ( mins + maxs ) * 0.5f;
+
+	PropIndirectProbe_t &probe = m_PropIndirect[iStaticProp];
+	for ( int i = 0; i < 6; i++ )
+	{
+		int nAxis = i >> 1;
+		Vector normal( 0, 0, 0 );
+		normal[nAxis] = ( i & 1 ) ? 1.0f : -1.0f;
+		Vector position = center;
+		position[nAxis] = ( i & 1 ) ? maxs[nAxis] + 1.0f : mins[nAxis] - 1.0f;
+		ComputeIndirectLightingAtPoint( position, normal, probe.m_Light[i], iThread, true );
+	}
+}
+
+void CVradStaticPropMgr::ThreadComputePropIndirectProbe( int iThread, int iStaticProp )
+{
+	g_StaticPropMgr.ComputePropIndirectProbe( iThread, iStaticProp );
+}
+
+static bool PropIndirectChanged( const PropIndirectProbe_t &oldProbe, const PropIndirectProbe_t &newProbe )
+{
+	for ( int i = 0; i < 6; i++ )
+	{
+		for ( int j = 0; j < 3; j++ )
+		{
+			float flOld = oldProbe.m_Light[i][j];
+			float flNew = newProbe.m_Light[i][j];
+			if ( fabs( flNew - flOld ) > PROPCACHE_INDIRECT_TOLERANCE * max( flOld, flNew ) + PROPCACHE_INDIRECT_FLOOR )
+				return true;
+		}
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Hashes everything about a prop its lighting depends on besides the rest of
+// the map: its model, where it is and how it's lit. Its index doesn't matter:
+// it's only used to skip its own triangles.
+//-----------------------------------------------------------------------------
+uint64 CVradStaticPropMgr::PropLightingKey( int iStaticProp )
+{
+	const CStaticProp &prop = m_StaticProps[iStaticProp];
+	const StaticPropDict_t &dict = m_StaticPropDict[prop.m_ModelIdx];
+
+	MD5Context_t ctx;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+	MD5Update( &ctx, (const unsigned char *)&dict.m_ModelCRC, sizeof( dict.m_ModelCRC ) );
+	MD5Update( &ctx, (const unsigned char *)&prop.m_Origin, sizeof( prop.m_Origin ) );
+	MD5Update( &ctx, (const unsigned char *)&prop.m_Angles, sizeof( prop.m_Angles ) );
+	MD5Update( &ctx, (const unsigned char *)&prop.m_Flags, sizeof( prop.m_Flags ) );
+	MD5Update( &ctx, (const unsigned char *)&prop.m_LightingOrigin, sizeof( prop.m_LightingOrigin ) );
+	MD5Update( &ctx, (const unsigned char *)&prop.m_LightmapImageFormat, sizeof( prop.m_LightmapImageFormat ) );
+	MD5Update( &ctx, (const unsigned char *)&prop.m_LightmapImageWidth, sizeof( prop.m_LightmapImageWidth ) );
+	MD5Update( &ctx, (const unsigned char *)&prop.m_LightmapImageHeight, sizeof( prop.m_LightmapImageHeight ) );
+	MD5Update( &ctx, (const unsigned char *)&g_bShowStaticPropNormals, sizeof( g_bShowStaticPropNormals ) );
+	MD5Update( &ctx, (const unsigned char *)&g_bDisablePropSelfShadowing, sizeof( g_bDisablePropSelfShadowing ) );
+	return FinalizeLightCacheHash( &ctx );
+}
+
+static void GetPropCacheFileName( char *pFileName, int nMaxLen )
+{
+	Q_StripExtension( source, pFileName, nMaxLen );
+	Q_strncat( pFileName, g_bHDR ? ".hdr.propcache" : ".propcache", nMaxLen, COPY_ALL_CHARACTERS );
+}
+
+//-----------------------------------------------------------------------------
+// Fills in the lighting of the props the last run already lit and marks them
+// in m_PropRestored. Returns how many there were.
+//-----------------------------------------------------------------------------
+int CVradStaticPropMgr::LoadPropLightingCache()
+{
+	int count = m_StaticProps.Count();
+	m_PropRestored.SetSize( count );
+	for ( int i = 0; i < count; i++ )
+	{
+		m_PropRestored[i] = false;
+	}
+
+	char szFileName[MAX_PATH];
+	GetPropCacheFileName( szFileName, sizeof( szFileName ) );
+	CUtlBuffer buf;
+	if ( !FileExists( szFileName ) || !LoadFile( szFileName, buf ) )
+		return 0;
+
+	PropCacheHeader_t header;
+	buf.Get( &header, sizeof( header ) );
+	if ( !buf.IsValid() || header.id != PROPCACHE_ID || header.version != PROPCACHE_VERSION || header.numprops < 0 )
+	{
+		Msg( "Ignoring out of date prop cache %s\n", szFileName );
+		return 0;
+	}
+	if ( header.settings != LightCache_GetSettingsHash() )
+	{
+		qprintf( "The lighting settings changed, relighting all static props\n" );
+		return 0;
+	}
+
+	// Props that hash the same are lit the same. Any after the first are
+	// just relit.
+	CUtlMap<uint64, int> propByKey( DefLessFunc( uint64 ) );
+	for ( int i = 0; i < count; i++ )
+	{
+		uint64 key = PropLightingKey( i );
+		if ( propByKey.Find( key ) == propByKey.InvalidIndex() )
+		{
+			propByKey.Insert( key, i );
+		}
+	}
+
+	int nRestored = 0;
+	int nDirectChanged = 0;
+	int nIndirectChanged = 0;
+	bool bDamaged = false;
+	CUtlVector<uint64> lights;
+	for ( int i = 0; i < header.numprops && !bDamaged; i++ )
+	{
+		uint64 key = buf.GetInt64();
+		int nLights = buf.GetInt();
+		if ( !buf.IsValid() || nLights < 0 || nLights > buf.GetBytesRemaining() / (int)sizeof( uint64 ) )
+		{
+			bDamaged = true;
+			break;
+		}
+		lights.SetCount( nLights );
+		buf.Get( lights.Base(), nLights * sizeof( uint64 ) );
+		PropIndirectProbe_t probe;
+		buf.Get( &probe, sizeof( probe ) );
+		int nMeshes = buf.GetInt();
+		if ( !buf.IsValid() || nMeshes < 0 || nMeshes > buf.GetBytesRemaining() )
+		{
+			bDamaged = true;
+			break;
+		}
+
+		int iMap = propByKey.Find( key );
+		CStaticProp *pProp = NULL;
+		if ( iMap != propByKey.InvalidIndex() )
+		{
+			int iProp = propByKey[iMap];
+			Vector mins, maxs;
+			GetPropLightingBounds( m_StaticProps[iProp], mins, maxs );
+			if ( LightCache_BoxLightingChanged( mins, maxs, lights.Base(), lights.Count() ) )
+			{
+				nDirectChanged++;
+				propByKey.RemoveAt( iMap );
+			}
+			else if ( PropIndirectChanged( probe, m_PropIndirect[iProp] ) )
+			{
+				nIndirectChanged++;
+				propByKey.RemoveAt( iMap );
+			}
+			else
+			{
+				pProp = &m_StaticProps[iProp];
+				pProp->m_MeshData.Purge();
+				pProp->m_MeshData.AddMultipleToTail( nMeshes );
+			}
+		}
+
+		for ( int j = 0; j < nMeshes && !bDamaged; j++ )
+		{
+			int nLod = buf.GetInt();
+			int nColors = buf.GetInt();
+			int nTexelBytes = buf.GetInt();
+			if ( !buf.IsValid() || nColors < 0 || nTexelBytes < 0 ||
+				 nColors > buf.GetBytesRemaining() / (int)sizeof( Vector ) ||
+				 nTexelBytes > buf.GetBytesRemaining() - nColors * (int)sizeof( Vector ) )
+			{
+				bDamaged = true;
+				break;
+			}
+
+			if ( !pProp )
+			{
+				buf.SeekGet( CUtlBuffer::SEEK_CURRENT, nColors * sizeof( Vector ) + nTexelBytes );
+				continue;
+			}
+
+			MeshData_t &meshData = pProp->m_MeshData[j];
+			meshData.m_nLod = nLod;
+			meshData.m_VertexColors.SetSize( nColors );
+			buf.Get( meshData.m_VertexColors.Base(), nColors * sizeof( Vector ) );
+			if ( nTexelBytes )
+			{
+				meshData.m_TexelsEncoded.EnsureCapacity( nTexelBytes );
+				buf.Get( meshData.m_TexelsEncoded.Base(), nTexelBytes );
+			}
+		}
+
+		if ( pProp && !bDamaged )
+		{
+			m_PropRestored[propByKey[iMap]] = true;
+			propByKey.RemoveAt( iMap );
+			nRestored++;
+		}
+	}
+
+	if ( bDamaged )
+	{
+		Warning( "Prop cache %s is damaged, relighting all static props\n", szFileName );
+		for ( int i = 0; i < count; i++ )
+		{
+			m_StaticProps[i].m_MeshData.Purge();
+			m_PropRestored[i] = false;
+		}
+		return 0;
+	}
+
+	qprintf( "%d static props relit for their direct light, %d for the indirect light around them\n", nDirectChanged, nIndirectChanged );
+	return nRestored;
+}
+
+//-----------------------------------------------------------------------------
+// Writes the lighting of every prop for the next run
+//-----------------------------------------------------------------------------
+void CVradStaticPropMgr::SavePropLightingCache()
+{
+	CUtlBuffer buf;
+
+	PropCacheHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.id = PROPCACHE_ID;
+	header.version = PROPCACHE_VERSION;
+	header.settings = LightCache_GetSettingsHash();
+	header.numprops = m_StaticProps.Count();
+	buf.Put( &header, sizeof( header ) );
+
+	CUtlVector<uint64> lights;
+	for ( int i = 0; i < m_StaticProps.Count(); i++ )
+	{
+		const CStaticProp &prop = m_StaticProps[i];
+		Vector mins, maxs;
+		GetPropLightingBounds( prop, mins, maxs );
+		LightCache_GetLightsReachingBox( mins, maxs, lights );
+
+		buf.PutInt64( PropLightingKey( i ) );
+		buf.PutInt( lights.Count() );
+		buf.Put( lights.Base(), lights.Count() * sizeof( uint64 ) );
+		buf.Put( &m_PropIndirect[i], sizeof( PropIndirectProbe_t ) );
+		buf.PutInt( prop.m_MeshData.Count() );
+		for ( int j = 0; j < prop.m_MeshData.Count(); j++ )
+		{
+			const MeshData_t &meshData = prop.m_MeshData[j];
+			buf.PutInt( meshData.m_nLod );
+			buf.PutInt( meshData.m_VertexColors.Count() );
+			buf.PutInt( meshData.m_TexelsEncoded.Count() );
+			buf.Put( meshData.m_VertexColors.Base(), meshData.m_VertexColors.Count() * sizeof( Vector ) );
+			buf.Put( meshData.m_TexelsEncoded.Base(), meshData.m_TexelsEncoded.Count() );
+		}
+	}
+
+	char szFileName[MAX_PATH];
+	GetPropCacheFileName( szFileName, sizeof( szFileName ) );
+	FileHandle_t f = g_pFileSystem->Open( szFileName, "wb" );
+	if ( !f )
+	{
+		Warning( "Couldn't write prop cache %s\n", szFileName );
+		return;
+	}
+	g_pFileSystem->Write( buf.Base(), buf.TellPut(), f );
+	g_pFileSystem->Close( f );
 }
 
 //-----------------------------------------------------------------------------
@@ -2057,6 +2690,60 @@ void AddTriVertsToList( CUtlVector< tl_vert_t > &triListVerts, int vertIndex, Ve
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Hashes everything AddPolysForRayTrace depends on: the models and where the
+// shadow casting props are.
+//-----------------------------------------------------------------------------
+void CVradStaticPropMgr::HashPolysForRayTrace( MD5Context_t *pContext )
+{
+	for ( int i = 0; i < m_StaticPropDict.Count(); i++ )
+	{
+		const StaticPropDict_t &dict = m_StaticPropDict[i];
+		MD5Update( pContext, (const unsigned char *)&dict.m_ModelCRC, sizeof( dict.m_ModelCRC ) );
+		MD5Update( pContext, (const unsigned char *)&dict.m_Mins, sizeof( dict.m_Mins ) );
+		MD5Update( pContext, (const unsigned char *)&dict.m_Maxs, sizeof( dict.m_Maxs ) );
+	}
+
+	// The triangle ids hold the prop index, so props that don't cast shadows still count
+	int count = m_StaticProps.Count();
+	MD5Update( pContext, (const unsigned char *)&count, sizeof( count ) );
+	for ( int i = 0; i < count; i++ )
+	{
+		const CStaticProp &prop = m_StaticProps[i];
+		int nNoShadow = prop.m_Flags & STATIC_PROP_NO_SHADOW;
+		MD5Update( pContext, (const unsigned char *)&prop.m_Origin, sizeof( prop.m_Origin ) );
+		MD5Update( pContext, (const unsigned char *)&prop.m_Angles, sizeof( prop.m_Angles ) );
+		MD5Update( pContext, (const unsigned char *)&prop.m_ModelIdx, sizeof( prop.m_ModelIdx ) );
+		MD5Update( pContext, (const unsigned char *)&nNoShadow, sizeof( nNoShadow ) );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// The shadow casting props, as -incremental occluders
+//-----------------------------------------------------------------------------
+void CVradStaticPropMgr::GetOccludersForLightCache( CUtlVector<LightCacheOccluder_t> &occluders )
+{
+	for ( int i = 0; i < m_StaticProps.Count(); i++ )
+	{
+		const CStaticProp &prop = m_StaticProps[i];
+		const StaticPropDict_t &dict = m_StaticPropDict[prop.m_ModelIdx];
+		if ( prop.m_Flags & STATIC_PROP_NO_SHADOW )
+			continue;
+
+		MD5Context_t ctx;
+		memset( &ctx, 0, sizeof( ctx ) );
+		MD5Init( &ctx );
+		MD5Update( &ctx, (const unsigned char *)&dict.m_ModelCRC, sizeof( dict.m_ModelCRC ) );
+		MD5Update( &ctx, (const unsigned char *)&prop.m_Origin, sizeof( prop.m_Origin ) );
+		MD5Update( &ctx, (const unsigned char *)&prop.m_Angles, sizeof( prop.m_Angles ) );
+		MD5Update( &ctx, (const unsigned char *)&g_bStaticPropPolys, sizeof( g_bStaticPropPolys ) );
+
+		LightCacheOccluder_t &occluder = occluders[occluders.AddToTail()];
+		occluder.m_nHash = FinalizeLightCacheHash( &ctx );
+		GetPropBounds( prop, occluder.m_vecMins, occluder.m_vecMaxs );
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Builds a list of tris for every vertex
 //-----------------------------------------------------------------------------
@@ -2274,7 +2961,7 @@ inline float ComputeBarycentricDistanceToTri( Vector _barycentricCoord, Vector2D
 }
 
 // ------------------------------------------------------------------------------------------------
-static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const matrix3x4_t& _matNormal, int _iThread, int _skipProp, int _flags, int _lightmapResX, int _lightmapResY, studiohdr_t* _pStudioHdr, mstudiomodel_t* _pStudioModel, OptimizedModel::ModelHeader_t* _pVtxModel, int _meshID, CComputeStaticPropLightingResults *_outResults )
+static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const matrix3x4_t& _matNormal, int _lightmapResX, int _lightmapResY, studiohdr_t* _pStudioHdr, mstudiomodel_t* _pStudioModel, OptimizedModel::ModelHeader_t* _pVtxModel, int _meshID, CComputeStaticPropLightingResults *_outResults )
 {
 	// Could iterate and gen this if needed.
 	int nLod = 0;
@@ -2392,14 +3079,26 @@ static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const ma
 			}
 		}
 	}
+}
+
+// ------------------------------------------------------------------------------------------------
+static void LightTexelTile( CComputeStaticPropLightingResults *_pResults, int _tile, int _iThread )
+{
+	const texelTile_t &tile = _pResults->m_TexelTiles[_tile];
+	CUtlVector<colorTexel_t> &colorTexels = *_pResults->m_ColorTexelsArrays[tile.m_nTexelsArray];
+	const int _lightmapResX = _pResults->m_nLightmapResX;
+	const int _lightmapResY = _pResults->m_nLightmapResY;
 
 	// Process neighbors to the valid region. Walk through the existing array, look for samples that
 	// are not valid but are adjacent to valid samples. Works if we are only bilinearly sampling
 	// on the other side.
 	// First attempt: Just pretend the triangle was larger and cast a ray from this new world pos 
 	// as above.
-	int linearPos = 0;
-	for ( int j = 0; j < _lightmapResY; ++j )
+	CUtlVector<int> texelsToLight;
+	texelsToLight.EnsureCapacity( tile.m_nRows * _lightmapResX );
+
+	int linearPos = tile.m_nFirstRow * _lightmapResX;
+	for ( int j = tile.m_nFirstRow; j < tile.m_nFirstRow + tile.m_nRows; ++j )
 	{
 		for (int i = 0; i < _lightmapResX; ++i )
 		{
@@ -2423,20 +3122,36 @@ static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const ma
 
 			if (shouldProcess)
 			{
-				Vector directColor(0, 0, 0),
-					   indirectColor(0, 0, 0);
+				texelsToLight.AddToTail( linearPos );
+			}
 
+			++linearPos;
+		}
+	}
 
-				ComputeDirectLightingAtPoint( colorTexels[linearPos].m_WorldPosition, colorTexels[linearPos].m_WorldNormal, directColor, _iThread, _skipProp, _flags);
+	// Four at a time, like the vertexes
+	for ( int i = 0; i < texelsToLight.Count(); i += 4 )
+	{
+		int nPoints = min( 4, texelsToLight.Count() - i );
+		Vector positions[4];
+		Vector normals[4];
+		Vector directColors[4];
+		for ( int k = 0; k < nPoints; ++k )
+		{
+			positions[k] = colorTexels[texelsToLight[i+k]].m_WorldPosition;
+			normals[k] = colorTexels[texelsToLight[i+k]].m_WorldNormal;
+		}
 
-				if (numbounce >= 1) {
-					ComputeIndirectLightingAtPoint( colorTexels[linearPos].m_WorldPosition, colorTexels[linearPos].m_WorldNormal, indirectColor, _iThread, true, (_flags & GATHERLFLAGS_IGNORE_NORMALS) != 0 );
-				}
+		ComputeDirectLightingAtPoints( positions, normals, nPoints, directColors, _iThread, _pResults->m_nSkipProp, _pResults->m_nLightFlags );
 
-				VectorAdd(directColor, indirectColor, colorTexels[linearPos].m_Color);
+		for ( int k = 0; k < nPoints; ++k )
+		{
+			Vector indirectColor(0, 0, 0);
+			if (numbounce >= 1) {
+				ComputeIndirectLightingAtPoint( positions[k], normals[k], indirectColor, _iThread, true, (_pResults->m_nLightFlags & GATHERLFLAGS_IGNORE_NORMALS) != 0 );
 			}
 
-			++linearPos;
+			VectorAdd(directColors[k], indirectColor, colorTexels[texelsToLight[i+k]].m_Color);
 		}
 	}
 }
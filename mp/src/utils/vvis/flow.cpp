@@ -7,6 +7,10 @@
 //=============================================================================//
 #include "vis.h"
 #include "vmpi.h"
+#include "threads.h"
+#include "visbits.h"
+#include "tier0/memalloc.h"
+#include "mathlib/ssemath.h"
 
 int g_TraceClusterStart = -1;
 int g_TraceClusterStop = -1;
@@ -31,15 +35,7 @@ int g_TraceClusterStop = -1;
 
 int CountBits (byte *bits, int numbits)
 {
-	int		i;
-	int		c;
-
-	c = 0;
-	for (i=0 ; i<numbits ; i++)
-		if ( CheckBit( bits, i ) )
-			c++;
-
-	return c;
+	return VisBits_Count (bits, numbits);
 }
 
 int		c_fullskip;
@@ -102,6 +98,111 @@ void FreeStackWinding (winding_t *w, pstack_t *stack)
 	stack->freewindings[i] = 1;
 }
 
+
+// RecursiveLeafFlow frames, indexed by depth-1. They're kept around from one
+// PortalFlow to the next, so a thread only ever allocates as many as its
+// deepest chain needs.
+static CUtlVector<pstack_t *> g_StackFrames[MAX_TOOL_THREADS+1];
+
+pstack_t *GetStackFrame (threaddata_t *thread, int depth)
+{
+	CUtlVector<pstack_t *> &frames = g_StackFrames[thread->iThread];
+	while (frames.Count() < depth)
+	{
+		// the frame and its mightsee words in one block, 16 byte aligned for the
+		// SIMD loads out of its windings
+		pstack_t *frame = (pstack_t *)MemAlloc_AllocAligned (sizeof(pstack_t) + portalbytes, 16);
+		frame->mightsee = (uint64 *)(frame + 1);
+		frames.AddToTail (frame);
+	}
+	return frames[depth-1];
+}
+
+
+inline bool StackMightSee (const pstack_t *stack, int pnum)
+{
+	int word = pnum >> 6;
+	if (word < stack->mightfirst || word >= stack->mightlast)
+		return false;
+	return CheckBit ((byte *)stack->mightsee, pnum) != 0;
+}
+
+/*
+==============
+SwizzleWinding
+
+The windings are classified against planes four points at a time, so the
+points get transposed into FourVectors first. The last block is padded with
+copies of the last point; ClassifyWinding masks those lanes off.
+==============
+*/
+struct simdwinding_t
+{
+	int			numpoints;
+	FourVectors	blocks[MAX_POINTS_ON_WINDING/4];
+};
+
+static inline void SwizzleWinding (const winding_t *w, simdwinding_t *out)
+{
+	int		i, n;
+
+	n = w->numpoints;
+	out->numpoints = n;
+
+	// LoadAndSwizzle reads 16 bytes of each point, so only whole blocks with a
+	// point after them are loaded in place
+	for (i=0 ; i+4<n ; i+=4)
+	{
+		out->blocks[i>>2].LoadAndSwizzle (w->points[i], w->points[i+1], w->points[i+2], w->points[i+3]);
+	}
+
+	Vector	tail[5];
+	for (int j=0 ; j<4 ; j++)
+	{
+		tail[j] = w->points[min (i+j, n-1)];
+	}
+	tail[4] = tail[3];
+	out->blocks[i>>2].LoadAndSwizzle (tail[0], tail[1], tail[2], tail[3]);
+}
+
+// One bit per point of a numpoints winding
+static inline uint64 WindingPointMask (int numpoints)
+{
+	return (numpoints >= 64) ? ~0ull : ((1ull << numpoints) - 1);
+}
+
+/*
+==============
+ClassifyWinding
+
+Sets bit i of front or back for each point i more than ON_VIS_EPSILON in front
+of or behind the plane, and stores the distances in dists if it isn't NULL.
+The distances come out the same as DotProduct (p, normal) - dist.
+==============
+*/
+static inline void ClassifyWinding (const simdwinding_t &w, const Vector &normal, vec_t dist,
+	vec_t *dists, uint64 *front, uint64 *back)
+{
+	fltx4	dist4 = ReplicateX4 (dist);
+	fltx4	eps = ReplicateX4 (ON_VIS_EPSILON);
+	fltx4	negeps = ReplicateX4 (-ON_VIS_EPSILON);
+	uint64	f = 0, b = 0;
+
+	for (int i=0 ; i<w.numpoints ; i+=4)
+	{
+		fltx4 d = SubSIMD (w.blocks[i>>2] * normal, dist4);
+		if (dists)
+			StoreAlignedSIMD (dists + i, d);
+		f |= (uint64)TestSignSIMD (CmpGtSIMD (d, eps)) << i;
+		b |= (uint64)TestSignSIMD (CmpLtSIMD (d, negeps)) << i;
+	}
+
+	uint64 valid = WindingPointMask (w.numpoints);
+	*front = f & valid;
+	*back = b & valid;
+}
+
+
 /*
 ==============
 ChopWinding
@@ -115,42 +216,38 @@ ChopWinding
 
 winding_t	*ChopWinding (winding_t *in, pstack_t *stack, plane_t *split)
 {
-	vec_t	dists[128];
-	int		sides[128];
-	int		counts[3];
+	ALIGN16 vec_t	dists[MAX_POINTS_ON_WINDING+4] ALIGN16_POST;
+	int		sides[MAX_POINTS_ON_WINDING+1];
+	uint64	front, back;
+	simdwinding_t	sw;
 	vec_t	dot;
 	int		i, j;
 	Vector	mid;
 	winding_t	*neww;
 
-	counts[0] = counts[1] = counts[2] = 0;
-
 // determine sides for each point
-	for (i=0 ; i<in->numpoints ; i++)
-	{
-		dot = DotProduct (in->points[i], split->normal);
-		dot -= split->dist;
-		dists[i] = dot;
-		if (dot > ON_VIS_EPSILON)
-			sides[i] = SIDE_FRONT;
-		else if (dot < -ON_VIS_EPSILON)
-			sides[i] = SIDE_BACK;
-		else
-		{
-			sides[i] = SIDE_ON;
-		}
-		counts[sides[i]]++;
-	}
+	SwizzleWinding (in, &sw);
+	ClassifyWinding (sw, split->normal, split->dist, dists, &front, &back);
 
-	if (!counts[1])
+	if (!back)
 		return in;		// completely on front side
 	
-	if (!counts[0])
+	if (!front)
 	{
 		FreeStackWinding (in, stack);
 		return NULL;
 	}
 
+	for (i=0 ; i<in->numpoints ; i++)
+	{
+		if (front & (1ull << i))
+			sides[i] = SIDE_FRONT;
+		else if (back & (1ull << i))
+			sides[i] = SIDE_BACK;
+		else
+			sides[i] = SIDE_ON;
+	}
+
 	sides[i] = sides[0];
 	dists[i] = dists[0];
 	
@@ -238,134 +335,120 @@ winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *targ
 {
 	int			i, j, k, l;
 	plane_t		plane;
-	Vector		v1, v2;
-	float		d;
+	Vector		v1;
 	vec_t		length;
-	int			counts[3];
 	bool		fliptest;
+	simdwinding_t	src, pas;
+	FourVectors	v1x4, srcx4, v2, normals;
+	fltx4		lengths;
+	int			valid;
+	uint64		srcfront, srcback, srcmask;
+	uint64		passfront, passback, t;
+	fltx4		eps = ReplicateX4 (ON_VIS_EPSILON);
+
+	SwizzleWinding (source, &src);
+	SwizzleWinding (pass, &pas);
 
 // check all combinations	
 	for (i=0 ; i<source->numpoints ; i++)
 	{
 		l = (i+1)%source->numpoints;
 		VectorSubtract (source->points[l] , source->points[i], v1);
+		v1x4.DuplicateVector (v1);
+		srcx4.DuplicateVector (source->points[i]);
+
+		// the source points that can tell which side source is on
+		srcmask = WindingPointMask (source->numpoints) & ~(1ull << i) & ~(1ull << l);
 
 	// fing a vertex of pass that makes a plane that puts all of the
 	// vertexes of pass on the front side and all of the vertexes of
 	// source on the back side
-		for (j=0 ; j<pass->numpoints ; j++)
+		for (k=0 ; k<pass->numpoints ; k+=4)
 		{
-			VectorSubtract (pass->points[j], source->points[i], v2);
+		// the planes through this edge and the next four pass vertexes
+			v2 = pas.blocks[k>>2];
+			v2 -= srcx4;
 
-			plane.normal[0] = v1[1]*v2[2] - v1[2]*v2[1];
-			plane.normal[1] = v1[2]*v2[0] - v1[0]*v2[2];
-			plane.normal[2] = v1[0]*v2[1] - v1[1]*v2[0];
-			
-		// if points don't make a valid plane, skip it
+			normals.x = SubSIMD (MulSIMD (v1x4.y, v2.z), MulSIMD (v1x4.z, v2.y));
+			normals.y = SubSIMD (MulSIMD (v1x4.z, v2.x), MulSIMD (v1x4.x, v2.z));
+			normals.z = SubSIMD (MulSIMD (v1x4.x, v2.y), MulSIMD (v1x4.y, v2.x));
 
-			length = plane.normal[0] * plane.normal[0]
-			+ plane.normal[1] * plane.normal[1]
-			+ plane.normal[2] * plane.normal[2];
-			
-			if (length < ON_VIS_EPSILON)
-				continue;
+		// if points don't make a valid plane, skip it
+			lengths = normals * normals;
+			valid = ~TestSignSIMD (CmpLtSIMD (lengths, eps)) & 15;
 
-			length = 1/sqrt(length);
-			
-			plane.normal[0] *= length;
-			plane.normal[1] *= length;
-			plane.normal[2] *= length;
-
-			plane.dist = DotProduct (pass->points[j], plane.normal);
-
-		//
-		// find out which side of the generated seperating plane has the
-		// source portal
-		//
-#if 1
-			fliptest = false;
-			for (k=0 ; k<source->numpoints ; k++)
+			for (j=k ; j<k+4 && j<pass->numpoints ; j++)
 			{
-				if (k == i || k == l)
+				if (!(valid & (1 << (j-k))))
 					continue;
-				d = DotProduct (source->points[k], plane.normal) - plane.dist;
-				if (d < -ON_VIS_EPSILON)
-				{	// source is on the negative side, so we want all
-					// pass and target on the positive side
-					fliptest = false;
-					break;
-				}
-				else if (d > ON_VIS_EPSILON)
-				{	// source is on the positive side, so we want all
-					// pass and target on the negative side
-					fliptest = true;
-					break;
+
+				length = SubFloat (lengths, j-k);
+				length = 1/sqrt(length);
+
+				plane.normal[0] = normals.X(j-k) * length;
+				plane.normal[1] = normals.Y(j-k) * length;
+				plane.normal[2] = normals.Z(j-k) * length;
+
+				plane.dist = DotProduct (pass->points[j], plane.normal);
+
+			//
+			// find out which side of the generated seperating plane has the
+			// source portal: the first source point off the plane decides
+			//
+				ClassifyWinding (src, plane.normal, plane.dist, NULL, &srcfront, &srcback);
+				t = (srcfront | srcback) & srcmask;
+				if (!t)
+					continue;		// planar with source portal
+				t &= 0 - t;
+				fliptest = (srcfront & t) != 0;
+
+			//
+			// if all of the pass portal points are on the positive side,
+			// this is the seperating plane. Flipping the plane exactly
+			// negates the distances, so front and back just swap.
+			//
+				ClassifyWinding (pas, plane.normal, plane.dist, NULL, &passfront, &passback);
+				passfront &= ~(1ull << j);
+				passback &= ~(1ull << j);
+
+			//
+			// flip the normal if the source portal is backwards
+			//
+				if (fliptest)
+				{
+					VectorSubtract (vec3_origin, plane.normal, plane.normal);
+					plane.dist = -plane.dist;
+
+					t = passfront;
+					passfront = passback;
+					passback = t;
 				}
-			}
-			if (k == source->numpoints)
-				continue;		// planar with source portal
-#else
-			fliptest = flipclip;
-#endif
-		//
-		// flip the normal if the source portal is backwards
-		//
-			if (fliptest)
-			{
-				VectorSubtract (vec3_origin, plane.normal, plane.normal);
-				plane.dist = -plane.dist;
-			}
-#if 1
-		//
-		// if all of the pass portal points are now on the positive side,
-		// this is the seperating plane
-		//
-			counts[0] = counts[1] = counts[2] = 0;
-			for (k=0 ; k<pass->numpoints ; k++)
-			{
-				if (k==j)
-					continue;
-				d = DotProduct (pass->points[k], plane.normal) - plane.dist;
-				if (d < -ON_VIS_EPSILON)
-					break;
-				else if (d > ON_VIS_EPSILON)
-					counts[0]++;
-				else
-					counts[2]++;
-			}
-			if (k != pass->numpoints)
-				continue;	// points on negative side, not a seperating plane
+
+				if (passback)
+					continue;	// points on negative side, not a seperating plane
 				
-			if (!counts[0])
-				continue;	// planar with seperating plane
-#else
-			k = (j+1)%pass->numpoints;
-			d = DotProduct (pass->points[k], plane.normal) - plane.dist;
-			if (d < -ON_VIS_EPSILON)
-				continue;
-			k = (j+pass->numpoints-1)%pass->numpoints;
-			d = DotProduct (pass->points[k], plane.normal) - plane.dist;
-			if (d < -ON_VIS_EPSILON)
-				continue;			
-#endif
-		//
-		// flip the normal if we want the back side
-		//
-			if (flipclip)
-			{
-				VectorSubtract (vec3_origin, plane.normal, plane.normal);
-				plane.dist = -plane.dist;
-			}
-			
-		//
-		// clip target by the seperating plane
-		//
-			target = ChopWinding (target, stack, &plane);
-			if (!target)
-				return NULL;		// target is not visible
+				if (!passfront)
+					continue;	// planar with seperating plane
 
-			// JAY: End the loop, no need to find additional separators on this edge ?
-//			j = pass->numpoints;
+			//
+			// flip the normal if we want the back side
+			//
+				if (flipclip)
+				{
+					VectorSubtract (vec3_origin, plane.normal, plane.normal);
+					plane.dist = -plane.dist;
+				}
+			
+			//
+			// clip target by the seperating plane
+			//
+				target = ChopWinding (target, stack, &plane);
+				if (!target)
+					return NULL;		// target is not visible
+
+				// JAY: End the loop, no need to find additional separators on this edge ?
+//				j = pass->numpoints;
+			}
 		}
 	}
 	
@@ -477,13 +560,14 @@ If src_portal is NULL, this is the originating leaf
 */
 void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 {
-	pstack_t	stack;
+	pstack_t	*stack;
 	portal_t	*p;
 	plane_t		backplane;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		*test, *might, *vis, more;
+	int			i;
+	byte		*test;
 	int			pnum;
+	bool		more;
 
 	// Early-out if we're a VMPI worker that's told to exit. If we don't do this here, then the
 	// worker might spin its wheels for a while on an expensive work unit and not be available to the pool.
@@ -500,23 +584,26 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 
 	leaf = &leafs[leafnum];
 
-	prevstack->next = &stack;
+	stack = GetStackFrame (thread, prevstack->depth + 1);
+	prevstack->next = stack;
 
-	stack.next = NULL;
-	stack.leaf = leaf;
-	stack.portal = NULL;
+	stack->depth = prevstack->depth + 1;
+	stack->next = NULL;
+	stack->leaf = leaf;
+	stack->portal = NULL;
 
-	might = (long *)stack.mightsee;
-	vis = (long *)thread->base->portalvis;
-	
 	// check all portals for flowing into other leafs	
 	for (i=0 ; i<leaf->portals.Count() ; i++)
 	{
 
+		// a split portal's work unit only follows one way out of the first leaf
+		if ( thread->branch >= 0 && prevstack == &thread->pstack_head && i != thread->branch )
+			continue;
+
 		p = leaf->portals[i];
 		pnum = p - portals;
 
-		if ( ! (prevstack->mightsee[pnum >> 3] & (1<<(pnum&7)) ) )
+		if ( !StackMightSee( prevstack, pnum ) )
 		{
 			continue;	// can't possibly see it
 		}
@@ -524,35 +611,34 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		// if the portal can't see anything we haven't allready seen, skip it
 		if (p->status == stat_done)
 		{
-			test = (long *)p->portalvis;
+			test = p->portalvis;
 		}
 		else
 		{
-			test = (long *)p->portalflood;
+			test = p->portalflood;
 		}
 
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			might[j] = ((long *)prevstack->mightsee)[j] & test[j];
-			more |= (might[j] & ~vis[j]);
-		}
+		// only the words prevstack has live are worth looking at, and whatever
+		// survives the AND is usually a narrower range still
+		more = VisBits_AndHasNewRange (stack->mightsee, prevstack->mightsee, (uint64 *)test,
+			(uint64 *)thread->vis, prevstack->mightfirst, prevstack->mightlast,
+			&stack->mightfirst, &stack->mightlast);
 		
-		if ( !more && CheckBit( thread->base->portalvis, pnum ) )
+		if ( !more && CheckBit( thread->vis, pnum ) )
 		{	// can't see anything new
 			continue;
 		}
 
 		// get plane of portal, point normal into the neighbor leaf
-		stack.portalplane = p->plane;
+		stack->portalplane = p->plane;
 		VectorSubtract (vec3_origin, p->plane.normal, backplane.normal);
 		backplane.dist = -p->plane.dist;
 		
-		stack.portal = p;
-		stack.next = NULL;
-		stack.freewindings[0] = 1;
-		stack.freewindings[1] = 1;
-		stack.freewindings[2] = 1;
+		stack->portal = p;
+		stack->next = NULL;
+		stack->freewindings[0] = 1;
+		stack->freewindings[1] = 1;
+		stack->freewindings[2] = 1;
 		
 		float d = DotProduct (p->origin, thread->pstack_head.portalplane.normal);
 		d -= thread->pstack_head.portalplane.dist;
@@ -562,12 +648,12 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		}
 		else if (d > p->radius)
 		{
-			stack.pass = p->winding;
+			stack->pass = p->winding;
 		}
 		else	
 		{
-			stack.pass = ChopWinding (p->winding, &stack, &thread->pstack_head.portalplane);
-			if (!stack.pass)
+			stack->pass = ChopWinding (p->winding, stack, &thread->pstack_head.portalplane);
+			if (!stack->pass)
 				continue;
 		}
 
@@ -580,12 +666,12 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		}
 		else if (d < -thread->base->radius)
 		{
-			stack.source = prevstack->source;
+			stack->source = prevstack->source;
 		}
 		else	
 		{
-			stack.source = ChopWinding (prevstack->source, &stack, &backplane);
-			if (!stack.source)
+			stack->source = ChopWinding (prevstack->source, stack, &backplane);
+			if (!stack->source)
 				continue;
 		}
 
@@ -594,66 +680,351 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		{	// the second leaf can only be blocked if coplanar
 
 			// mark the portal as visible
-			SetBit( thread->base->portalvis, pnum );
+			SetBit( thread->vis, pnum );
 
-			RecursiveLeafFlow (p->leaf, thread, &stack);
+			RecursiveLeafFlow (p->leaf, thread, stack);
 			continue;
 		}
 
-		stack.pass = ClipToSeperators (stack.source, prevstack->pass, stack.pass, false, &stack);
-		if (!stack.pass)
+		stack->pass = ClipToSeperators (stack->source, prevstack->pass, stack->pass, false, stack);
+		if (!stack->pass)
 			continue;
 		
-		stack.pass = ClipToSeperators (prevstack->pass, stack.source, stack.pass, true, &stack);
-		if (!stack.pass)
+		stack->pass = ClipToSeperators (prevstack->pass, stack->source, stack->pass, true, stack);
+		if (!stack->pass)
 			continue;
 
 		// mark the portal as visible
-		SetBit( thread->base->portalvis, pnum );
+		SetBit( thread->vis, pnum );
 
 		// flow through it for real
-		RecursiveLeafFlow (p->leaf, thread, &stack);
+		RecursiveLeafFlow (p->leaf, thread, stack);
 	}	
 }
 
 
 /*
 ===============
-PortalFlow
+FlowPortal
 
-generates the portalvis bit vector
+Runs RecursiveLeafFlow out of p, marking what it sees in vis. If branch isn't
+-1, only leafs[p->leaf].portals[branch] is followed out of the first leaf.
+Returns the number of chains walked.
 ===============
 */
-void PortalFlow (int iThread, int portalnum)
+static int FlowPortal (int iThread, portal_t *p, int branch, byte *vis)
 {
 	threaddata_t	data;
 	int				i;
-	portal_t		*p;
-	int				c_might, c_can;
-
-	p = sorted_portals[portalnum];
-	p->status = stat_working;
-				
-	c_might = CountBits (p->portalflood, g_numportals*2);
 
 	memset (&data, 0, sizeof(data));
 	data.base = p;
+	data.iThread = iThread;
+	data.vis = vis;
+	data.branch = branch;
 	
+	// the head frame only gets read, so it can use portalflood as is
 	data.pstack_head.portal = p;
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = p->plane;
-	for (i=0 ; i<portallongs ; i++)
-		((long *)data.pstack_head.mightsee)[i] = ((long *)p->portalflood)[i];
+	data.pstack_head.mightsee = (uint64 *)p->portalflood;
+	data.pstack_head.mightfirst = portalbytes/8;
+	for (i=0 ; i<portalbytes/8 ; i++)
+	{
+		if (data.pstack_head.mightsee[i])
+		{
+			data.pstack_head.mightfirst = min (data.pstack_head.mightfirst, i);
+			data.pstack_head.mightlast = i + 1;
+		}
+	}
 
 	RecursiveLeafFlow (p->leaf, &data, &data.pstack_head);
 
+	return data.c_chains;
+}
+
+
+static void FlowWholePortal (int iThread, portal_t *p)
+{
+	int				c_might, c_can;
+
+	p->status = stat_working;
+				
+	c_might = CountBits (p->portalflood, g_numportals*2);
+
+	p->numchains = FlowPortal (iThread, p, -1, p->portalvis);
 
 	p->status = stat_done;
 
 	c_can = CountBits (p->portalvis, g_numportals*2);
 
 	qprintf ("portal:%4i  mightsee:%4i  cansee:%4i (%i chains)\n", 
-		(int)(p - portals),	c_might, c_can, data.c_chains);
+		(int)(p - portals),	c_might, c_can, p->numchains);
+}
+
+
+/*
+===============
+PortalFlow
+
+generates the portalvis bit vector
+===============
+*/
+void PortalFlow (int iThread, int portalnum)
+{
+	FlowWholePortal (iThread, sorted_portals[portalnum]);
+}
+
+
+/*
+===============================================================================
+
+PortalFlow scheduling
+
+The portals are flowed cheapest first, so the expensive ones can use the
+finished portalvis of the portals around them to cut their chains short. That
+leaves the most expensive portals for the end, so the ones that would hold up
+the other threads are split into one work unit per branch out of their leaf.
+Each branch fills its own row and the last one to finish ORs them together, so
+the result doesn't depend on which thread ran what.
+
+===============================================================================
+*/
+
+// A work unit is a whole portal, or one branch of a split portal
+struct portalflowsplit_t
+{
+	long volatile	remaining;	// branches still running
+	long volatile	chains;
+	int				numbranches;
+	byte			*rows;		// numbranches rows of portalbytes
+};
+
+struct portalflowwork_t
+{
+	portal_t			*portal;
+	int					branch;		// index into the portal's leaf's portals, -1 for all of them
+	int					row;		// which of split's rows the branch fills
+	portalflowsplit_t	*split;
+};
+
+static CUtlVector<portalflowwork_t>		g_PortalFlowWork;
+static CUtlVector<portalflowsplit_t>	g_PortalFlowSplits;
+static CUtlVector<double>				g_PortalFlowCost;
+
+
+static int PortalFlowCostCompare (const void *a, const void *b)
+{
+	portal_t	*pa = *(portal_t **)a;
+	portal_t	*pb = *(portal_t **)b;
+	double		ca = g_PortalFlowCost[pa - portals];
+	double		cb = g_PortalFlowCost[pb - portals];
+
+	if (ca != cb)
+		return ca < cb ? -1 : 1;
+	if (pa->nummightsee != pb->nummightsee)
+		return pa->nummightsee < pb->nummightsee ? -1 : 1;
+	return (pa - portals) < (pb - portals) ? -1 : 1;
+}
+
+
+void PortalFlowWork (int iThread, int workindex)
+{
+	portalflowwork_t	*work;
+	portalflowsplit_t	*split;
+	portal_t			*p;
+	int					i;
+
+	work = &g_PortalFlowWork[workindex];
+	p = work->portal;
+	split = work->split;
+	if (!split)
+	{
+		FlowWholePortal (iThread, p);
+		return;
+	}
+
+	p->status = stat_working;
+
+	int chains = FlowPortal (iThread, p, work->branch, split->rows + work->row * portalbytes);
+	ThreadInterlockedExchangeAdd (&split->chains, chains);
+
+	if (ThreadInterlockedDecrement (&split->remaining) != 0)
+		return;
+
+	// last branch in, merge them all
+	for (i=0 ; i<split->numbranches ; i++)
+		VisBits_Or (p->portalvis, split->rows + i * portalbytes, portalbytes);
+	p->numchains = split->chains;
+
+	// the other threads can't look at portalvis until the whole row is there
+	ThreadMemoryBarrier ();
+	p->status = stat_done;
+
+	qprintf ("portal:%4i  mightsee:%4i  cansee:%4i (%i chains, %i branches)\n", 
+		(int)(p - portals), p->nummightsee, CountBits (p->portalvis, g_numportals*2),
+		p->numchains, split->numbranches);
+}
+
+
+/*
+===============
+RunPortalFlow
+
+Flows sorted_portals[0] to sorted_portals[count-1] on all the threads
+===============
+*/
+void RunPortalFlow (int count)
+{
+	int			i, j, nSplit, nBranches, nKnown;
+	portal_t	*p;
+	double		knownChains, knownMightsee, chainsPerMightsee, total, threshold;
+
+	// The chain count from the last run (see LoadVisCache) is the best guess
+	// there is. Portals without one are guessed from their mightsee, scaled by
+	// the chains per mightsee of the portals that have one.
+	knownChains = knownMightsee = 0;
+	nKnown = 0;
+	for (i=0 ; i<count ; i++)
+	{
+		p = sorted_portals[i];
+		if (p->numchains > 0)
+		{
+			knownChains += p->numchains;
+			knownMightsee += p->nummightsee;
+			nKnown++;
+		}
+	}
+	chainsPerMightsee = (nKnown && knownMightsee > 0) ? knownChains / knownMightsee : 1;
+
+	g_PortalFlowCost.SetSize (g_numportals*2);
+	total = 0;
+	for (i=0 ; i<count ; i++)
+	{
+		p = sorted_portals[i];
+		double cost = p->numchains > 0 ? p->numchains : p->nummightsee * chainsPerMightsee;
+		g_PortalFlowCost[p - portals] = cost;
+		total += cost;
+	}
+
+	if (!nosort)
+		qsort (sorted_portals, count, sizeof(sorted_portals[0]), PortalFlowCostCompare);
+
+	// Split anything big enough to keep one thread busy while the rest run out of work
+	threshold = total / (numthreads * 4);
+
+	g_PortalFlowWork.RemoveAll();
+	g_PortalFlowSplits.RemoveAll();
+	g_PortalFlowSplits.EnsureCapacity (count);	// work units point into it
+	nSplit = nBranches = 0;
+	for (i=0 ; i<count ; i++)
+	{
+		p = sorted_portals[i];
+		leaf_t *leaf = &leafs[p->leaf];
+
+		int nPortalBranches = 0;
+		if (numthreads > 1 && g_PortalFlowCost[p - portals] >= threshold)
+		{
+			for (j=0 ; j<leaf->portals.Count() ; j++)
+			{
+				if (CheckBit (p->portalflood, leaf->portals[j] - portals))
+					nPortalBranches++;
+			}
+		}
+
+		if (nPortalBranches < 2)
+		{
+			portalflowwork_t &work = g_PortalFlowWork[g_PortalFlowWork.AddToTail()];
+			work.portal = p;
+			work.branch = -1;
+			work.row = 0;
+			work.split = NULL;
+			continue;
+		}
+
+		portalflowsplit_t &split = g_PortalFlowSplits[g_PortalFlowSplits.AddToTail()];
+		split.remaining = nPortalBranches;
+		split.chains = 0;
+		split.numbranches = nPortalBranches;
+		split.rows = (byte *)malloc (nPortalBranches * portalbytes);
+		memset (split.rows, 0, nPortalBranches * portalbytes);
+
+		// branch numbers are indices into leaf->portals, the rows are packed
+		int row = 0;
+		for (j=0 ; j<leaf->portals.Count() ; j++)
+		{
+			if (!CheckBit (p->portalflood, leaf->portals[j] - portals))
+				continue;
+
+			portalflowwork_t &work = g_PortalFlowWork[g_PortalFlowWork.AddToTail()];
+			work.portal = p;
+			work.branch = j;
+			work.row = row++;
+			work.split = &split;
+		}
+
+		nSplit++;
+		nBranches += nPortalBranches;
+	}
+
+	if (nSplit)
+		Msg ("Splitting %d portals into %d branches\n", nSplit, nBranches);
+
+	RunThreadsOnIndividual (g_PortalFlowWork.Count(), true, PortalFlowWork);
+
+	for (i=0 ; i<g_PortalFlowSplits.Count() ; i++)
+		free (g_PortalFlowSplits[i].rows);
+	g_PortalFlowSplits.RemoveAll();
+	g_PortalFlowWork.RemoveAll();
+}
+
+
+/*
+===============
+FlowBench
+
+Times PortalFlow on its own, for -flowbench. The portals are flowed in
+sorted_portals order on this thread alone, so the numbers only depend on the
+.prt and the flow code. Every pass starts over from BasePortalVis' results,
+since the portals that are already done cut the later chains short.
+===============
+*/
+void FlowBench (int passes)
+{
+	int			i, pass;
+	portal_t	*p;
+	double		start, elapsed, best;
+	int			chains;
+
+	best = 0;
+	chains = 0;
+	for (pass=0 ; pass<passes ; pass++)
+	{
+		for (i=0 ; i<g_numportals*2 ; i++)
+		{
+			portals[i].status = stat_none;
+			memset (portals[i].portalvis, 0, portalbytes);
+		}
+
+		chains = 0;
+		start = Plat_FloatTime();
+		for (i=0 ; i<g_numportals*2 ; i++)
+		{
+			p = sorted_portals[i];
+			p->status = stat_working;
+			p->numchains = FlowPortal (0, p, -1, p->portalvis);
+			p->status = stat_done;
+			chains += p->numchains;
+		}
+		elapsed = Plat_FloatTime() - start;
+
+		Msg ("pass %d: %.3f seconds, %.0f portals/sec, %.0f chains/sec\n", pass + 1, elapsed,
+			g_numportals*2 / max (elapsed, 1e-6), chains / max (elapsed, 1e-6));
+		if (!pass || elapsed < best)
+			best = elapsed;
+	}
+
+	Msg ("PortalFlow: %d portals, %d chains, best of %d passes %.3f seconds\n", g_numportals*2, chains, passes, best);
 }
 
 
@@ -704,92 +1075,301 @@ void SimpleFlood (portal_t *srcportal, int leafnum)
 
 /*
 ==============
-BasePortalVis
+AllocPortalBits
+
+Every portal's portalfront, portalflood and portalvis come out of zeroed
+slabs of PORTALBITS_CHUNK portals each, each row starting on a 16 byte
+boundary. One slab for all of them would be gigabytes on the biggest maps.
 ==============
 */
-void BasePortalVis (int iThread, int portalnum)
+#define PORTALBITS_CHUNK	1024
+
+static CUtlVector<byte *>	g_PortalBitChunks;
+
+void AllocPortalBits (void)
 {
-	int			j, k;
-	portal_t	*tp, *p;
+	int		i, j, count, chunkcount;
+	size_t	stride, chunksize;
+	byte	*chunk;
+	portal_t	*p;
+
+	stride = (size_t)((portalbytes + 15) & ~15);
+	count = g_numportals*2;
+
+	for (i=0, p=portals ; i<count ; i+=PORTALBITS_CHUNK)
+	{
+		chunkcount = min (count - i, PORTALBITS_CHUNK);
+		chunksize = stride * chunkcount * 3;
+
+		chunk = (byte *)MemAlloc_AllocAligned (chunksize, 16);
+		if (!chunk)
+			Error ("Out of memory. AllocPortalBits: failed to allocate %llu bytes", (unsigned long long)chunksize);
+		memset (chunk, 0, chunksize);
+		g_PortalBitChunks.AddToTail (chunk);
+
+		for (j=0 ; j<chunkcount ; j++, p++)
+		{
+			p->portalfront = chunk + stride * j;
+			p->portalflood = chunk + stride * (chunkcount + j);
+			p->portalvis = chunk + stride * (chunkcount * 2 + j);
+		}
+	}
+}
+
+
+/*
+===============================================================================
+
+Bounding box tree over the portal windings, so BasePortalVis only has to look
+at the portals that reach the front side of a portal's plane (and are inside
+the vis radius, with -radius_override).
+
+===============================================================================
+*/
+
+#define PORTALTREE_LEAF_SIZE	8
+
+struct portalnode_t
+{
+	Vector		mins, maxs;
+	int			children[2];	// node indices, -1 for a leaf
+	int			first, count;	// range of g_PortalTreeIndices for a leaf
+};
+
+static CUtlVector<portalnode_t>	g_PortalTree;
+static CUtlVector<int>			g_PortalTreeIndices;
+static CUtlVector<Vector>		g_PortalMins, g_PortalMaxs;
+
+
+static int	s_PortalSortAxis;
+
+static int PortalCenterCompare (const void *a, const void *b)
+{
+	float ca = portals[*(int *)a].origin[s_PortalSortAxis];
+	float cb = portals[*(int *)b].origin[s_PortalSortAxis];
+	if (ca < cb)
+		return -1;
+	return ca > cb;
+}
+
+
+static int BuildPortalTree_r (int first, int count)
+{
+	int		i, axis, node, mid;
+	Vector	cmins, cmaxs;
+
+	node = g_PortalTree.AddToTail();
+	ClearBounds (g_PortalTree[node].mins, g_PortalTree[node].maxs);
+	ClearBounds (cmins, cmaxs);
+	for (i=first ; i<first+count ; i++)
+	{
+		int pnum = g_PortalTreeIndices[i];
+		AddPointToBounds (g_PortalMins[pnum], g_PortalTree[node].mins, g_PortalTree[node].maxs);
+		AddPointToBounds (g_PortalMaxs[pnum], g_PortalTree[node].mins, g_PortalTree[node].maxs);
+		AddPointToBounds (portals[pnum].origin, cmins, cmaxs);
+	}
+
+	g_PortalTree[node].children[0] = g_PortalTree[node].children[1] = -1;
+	g_PortalTree[node].first = first;
+	g_PortalTree[node].count = count;
+	if (count <= PORTALTREE_LEAF_SIZE)
+		return node;
+
+	// split at the median portal center along the longest axis of the centers
+	axis = 0;
+	for (i=1 ; i<3 ; i++)
+	{
+		if (cmaxs[i] - cmins[i] > cmaxs[axis] - cmins[axis])
+			axis = i;
+	}
+
+	s_PortalSortAxis = axis;
+	qsort (g_PortalTreeIndices.Base() + first, count, sizeof(int), PortalCenterCompare);
+	mid = count / 2;
+
+	// g_PortalTree can grow during the recursion, so don't hold on to a reference
+	int child0 = BuildPortalTree_r (first, mid);
+	int child1 = BuildPortalTree_r (first + mid, count - mid);
+	g_PortalTree[node].children[0] = child0;
+	g_PortalTree[node].children[1] = child1;
+	return node;
+}
+
+
+/*
+==============
+BuildPortalTree
+
+Call after LoadPortals, before running BasePortalVis
+==============
+*/
+void BuildPortalTree (void)
+{
+	int		i, j, count;
+	winding_t	*w;
+
+	count = g_numportals*2;
+
+	g_PortalMins.SetSize (count);
+	g_PortalMaxs.SetSize (count);
+	g_PortalTreeIndices.SetSize (count);
+	for (i=0 ; i<count ; i++)
+	{
+		w = portals[i].winding;
+		ClearBounds (g_PortalMins[i], g_PortalMaxs[i]);
+		for (j=0 ; j<w->numpoints ; j++)
+			AddPointToBounds (w->points[j], g_PortalMins[i], g_PortalMaxs[i]);
+		g_PortalTreeIndices[i] = i;
+	}
+
+	g_PortalTree.RemoveAll();
+	g_PortalTree.EnsureCapacity (2 * count / PORTALTREE_LEAF_SIZE + 1);
+	if (count)
+		BuildPortalTree_r (0, count);
+}
+
+
+/*
+==============
+CanSeeIntoFront
+
+The exact BasePortalVis tests for whether tp is in front of p
+==============
+*/
+static bool CanSeeIntoFront (portal_t *p, portal_t *tp)
+{
+	int			k;
 	float		d;
 	winding_t	*w;
 	Vector		segment;
 	double		dist2, minDist2;
 
-	// get the portal
-	p = portals+portalnum;
+	// some point of tp has to be in front of p
+	w = tp->winding;
+	for (k=0 ; k<w->numpoints ; k++)
+	{
+		d = DotProduct (w->points[k], p->plane.normal) - p->plane.dist;
+		if (d > ON_VIS_EPSILON)
+			break;
+	}
+	if (k == w->numpoints)
+		return false;	// no points on front
+
+	// and some point of p behind tp. If p's sphere is all on the front, none is
+	d = DotProduct (p->origin, tp->plane.normal) - tp->plane.dist;
+	if (d - p->radius >= 0)
+		return false;
+
+	w = p->winding;
+	for (k=0 ; k<w->numpoints ; k++)
+	{
+		d = DotProduct (w->points[k], tp->plane.normal) - tp->plane.dist;
+		if (d < -ON_VIS_EPSILON)
+			break;
+	}
+	if (k == w->numpoints)
+		return false;	// no points on front
 
 	//
-	// allocate memory for bitwise vis solutions for this portal
+	// if using radius visibility -- check to see if any portal points lie inside of the
+	// radius given
 	//
-	p->portalfront = (byte*)malloc (portalbytes);
-	memset (p->portalfront, 0, portalbytes);
+	if( g_bUseRadius )
+	{
+		w = tp->winding;
+		minDist2 = 1024000000.0;			// 32000^2
+		for( k = 0; k < w->numpoints; k++ )
+		{
+			VectorSubtract( w->points[k], p->origin, segment );
+			dist2 = ( segment[0] * segment[0] ) + ( segment[1] * segment[1] ) + ( segment[2] * segment[2] );
+			if( dist2 < minDist2 )
+			{
+				minDist2 = dist2;
+			}
+		}
+
+		if( minDist2 > g_VisRadius )
+			return false;
+	}
+
+	return true;
+}
+
+
+/*
+==============
+BasePortalVis
+==============
+*/
+void BasePortalVis (int iThread, int portalnum)
+{
+	int			i, j, node, stackdepth;
+	int			stack[64];
+	portal_t	*tp, *p;
+	double		d, dist2, delta;
+	portalnode_t	*n;
+
+	// get the portal
+	p = portals+portalnum;
 
-	p->portalflood = (byte*)malloc (portalbytes);
-	memset (p->portalflood, 0, portalbytes);
-	
-	p->portalvis = (byte*)malloc (portalbytes);
-	memset (p->portalvis, 0, portalbytes);
-	
 	//
-	// test the given portal against all of the portals in the map
+	// test the given portal against the portals in the parts of the tree
+	// that reach the front side of its plane
 	//
-	for (j=0, tp = portals ; j<g_numportals*2 ; j++, tp++)
+	stackdepth = 0;
+	stack[stackdepth++] = 0;
+	while (stackdepth)
 	{
-		// don't test against itself
-		if (j == portalnum)
+		node = stack[--stackdepth];
+		n = &g_PortalTree[node];
+
+		// furthest corner of the box in front of the plane
+		d = -p->plane.dist;
+		for (i=0 ; i<3 ; i++)
+			d += p->plane.normal[i] * (p->plane.normal[i] > 0 ? n->maxs[i] : n->mins[i]);
+		if (d <= 0)
 			continue;
 
-		//
-		//
-		//
-		w = tp->winding;
-		for (k=0 ; k<w->numpoints ; k++)
-		{
-			d = DotProduct (w->points[k], p->plane.normal) - p->plane.dist;
-			if (d > ON_VIS_EPSILON)
-				break;
-		}
-		if (k == w->numpoints)
-			continue;	// no points on front
-
-		//
-		//
-		//
-		w = p->winding;
-		for (k=0 ; k<w->numpoints ; k++)
+		if (g_bUseRadius)
 		{
-			d = DotProduct (w->points[k], tp->plane.normal) - tp->plane.dist;
-			if (d < -ON_VIS_EPSILON)
-				break;
-		}
-		if (k == w->numpoints)
-			continue;	// no points on front
-
-		//
-		// if using radius visibility -- check to see if any portal points lie inside of the
-		// radius given
-		//
-		if( g_bUseRadius )
-		{
-			w = tp->winding;
-			minDist2 = 1024000000.0;			// 32000^2
-			for( k = 0; k < w->numpoints; k++ )
+			dist2 = 0;
+			for (i=0 ; i<3 ; i++)
 			{
-				VectorSubtract( w->points[k], p->origin, segment );
-				dist2 = ( segment[0] * segment[0] ) + ( segment[1] * segment[1] ) + ( segment[2] * segment[2] );
-				if( dist2 < minDist2 )
-				{
-					minDist2 = dist2;
-				}
+				if (p->origin[i] < n->mins[i])
+					delta = n->mins[i] - p->origin[i];
+				else if (p->origin[i] > n->maxs[i])
+					delta = p->origin[i] - n->maxs[i];
+				else
+					continue;
+				dist2 += delta * delta;
 			}
-
-			if( minDist2 > g_VisRadius )
+			if (dist2 > g_VisRadius)
 				continue;
 		}
 
-		// add current portal to given portal's list of visible portals
-		SetBit( p->portalfront, j );
+		if (n->children[0] >= 0)
+		{
+			Assert (stackdepth + 2 <= ARRAYSIZE(stack));
+			stack[stackdepth++] = n->children[1];
+			stack[stackdepth++] = n->children[0];
+			continue;
+		}
+
+		for (i=n->first ; i<n->first+n->count ; i++)
+		{
+			j = g_PortalTreeIndices[i];
+
+			// don't test against itself
+			if (j == portalnum)
+				continue;
+
+			tp = portals+j;
+			if (!CanSeeIntoFront (p, tp))
+				continue;
+
+			// add current portal to given portal's list of visible portals
+			SetBit( p->portalfront, j );
+		}
 	}
 	
 	SimpleFlood (p, p->leaf);
@@ -799,10 +1379,6 @@ void BasePortalVis (int iThread, int portalnum)
 	c_flood += p->nummightsee;
 }
 
-
-
-
-
 /*
 ===============================================================================
 
@@ -825,8 +1401,7 @@ void RecursiveLeafBitFlow (int leafnum, byte *mightsee, byte *cansee)
 {
 	portal_t	*p;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		more;
+	int			i;
 	int			pnum;
 	byte		newmight[MAX_PORTALS/8];
 
@@ -843,15 +1418,7 @@ void RecursiveLeafBitFlow (int leafnum, byte *mightsee, byte *cansee)
 			continue;
 
 		// if this portal can see some portals we mightsee, recurse
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			((long *)newmight)[j] = ((long *)mightsee)[j] 
-				& ((long *)p->portalflood)[j];
-			more |= ((long *)newmight)[j] & ~((long *)cansee)[j];
-		}
-
-		if (!more)
+		if (!VisBits_AndHasNew (newmight, mightsee, p->portalflood, cansee, portalbytes))
 			continue;	// can't see anything new
 
 		SetBit( cansee, pnum );
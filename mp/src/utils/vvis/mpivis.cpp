@@ -47,6 +47,7 @@ bool g_bBasePortalVisSync = false;
 bool g_bPortalFlowSync = false;
 
 CUtlVector<char> g_BasePortalVisResultsFilename;
+CUtlVector<bool> g_BasePortalVisReceived;
 
 CCycleCount g_CPUTime;
 
@@ -179,26 +180,19 @@ void ProcessBasePortalVis( int iThread, uint64 iPortal, MessageBuffer *pBuf )
 void ReceiveBasePortalVis( uint64 iWorkUnit, MessageBuffer *pBuf, int iWorker )
 {
 	portal_t * p = &portals[iWorkUnit];
-	if ( p->portalflood != 0 || p->portalfront != 0 || p->portalvis != 0) 
+	if ( g_BasePortalVisReceived[iWorkUnit] ) 
 	{
 		Msg("Duplicate portal %llu\n", iWorkUnit);
 	}
+	g_BasePortalVisReceived[iWorkUnit] = true;
 	
 	if ( pBuf->getLen() - pBuf->getOffset() != portalbytes*2 )
 		Error( "Invalid packet in ReceiveBasePortalVis." );
 
-	//
-	// allocate memory for bitwise vis solutions for this portal
-	//
-	p->portalfront = (byte*)malloc (portalbytes);
+	// the rows were allocated by AllocPortalBits
 	pBuf->read( p->portalfront, portalbytes );
-	
-	p->portalflood = (byte*)malloc (portalbytes);
 	pBuf->read( p->portalflood, portalbytes );
 
-	p->portalvis = (byte*)malloc (portalbytes);
-	memset (p->portalvis, 0, portalbytes);
-
 	p->nummightsee = CountBits( p->portalflood, g_numportals*2 );
 }
 
@@ -220,6 +214,9 @@ void RunMPIBasePortalVis()
 
 	VMPI_SetCurrentStage( "RunMPIBasePortalVis" );
 
+	g_BasePortalVisReceived.SetSize( g_numportals * 2 );
+	memset( g_BasePortalVisReceived.Base(), 0, g_BasePortalVisReceived.Count() * sizeof( bool ) );
+
 	// Note: we're aiming for about 1500 portals in a map, so about 3000 work units.
 	g_CPUTime.Init();
 	double elapsed = DistributeWork( 
@@ -286,15 +283,9 @@ void RunMPIBasePortalVis()
 		{
 			portal_t *p = &portals[i];
 
-			p->portalfront = (byte*)malloc (portalbytes);
 			g_pFileSystem->Read( p->portalfront, portalbytes, fp );
-			
-			p->portalflood = (byte*)malloc (portalbytes);
 			g_pFileSystem->Read( p->portalflood, portalbytes, fp );
 		
-			p->portalvis = (byte*)malloc (portalbytes);
-			memset (p->portalvis, 0, portalbytes);
-		
 			p->nummightsee = CountBits (p->portalflood, g_numportals*2);
 		}
 
@@ -56,6 +56,7 @@ struct portal_t
 	byte		*portalvis;		// [portals], final
 
 	int			nummightsee;	// bit count on portalflood for sort
+	int			numchains;		// RecursiveLeafFlow chains from the last PortalFlow, for scheduling
 };
 
 struct leaf_t
@@ -64,9 +65,16 @@ struct leaf_t
 };
 
 	
+// RecursiveLeafFlow frames live in a per-thread arena (see GetStackFrame) rather
+// than on the stack. mightsee only holds valid data in the words from
+// mightfirst up to mightlast. The words outside that range are never cleared,
+// they hold whatever an earlier frame left there and just aren't read.
 struct pstack_t
 {
-	byte		mightsee[MAX_PORTALS/8];		// bit string
+	uint64		*mightsee;		// bit string, portalbytes long
+	int			mightfirst;		// first non-zero 64 bit word of mightsee
+	int			mightlast;		// one past the last non-zero word
+	int			depth;			// 0 for the thread's pstack_head
 	pstack_t	*next;
 	leaf_t		*leaf;
 	portal_t	*portal;	// portal exiting
@@ -83,6 +91,9 @@ struct threaddata_t
 {
 	portal_t	*base;
 	int			c_chains;
+	int			iThread;		// whose frame arena to use
+	byte		*vis;			// where to mark the portals seen, base->portalvis unless it's split
+	int			branch;			// -1, or the one portal out of base's leaf to follow
 	pstack_t	pstack_head;
 };
 
@@ -110,12 +121,21 @@ extern	int		portalbytes, portallongs;
 void LeafFlow (int leafnum);
 
 
+void AllocPortalBits (void);
+void BuildPortalTree (void);
 void BasePortalVis (int iThread, int portalnum);
 void BetterPortalVis (int portalnum);
 void PortalFlow (int iThread, int portalnum);
+void RunPortalFlow (int count);
+void FlowBench (int passes);
 void WritePortalTrace( const char *source );
 
+// viscache.cpp
+int LoadVisCache( const char *pFileName );
+void SaveVisCache( const char *pFileName );
+
 extern	portal_t	*sorted_portals[MAX_MAP_PORTALS*2];
+extern	bool		nosort;
 extern int g_TraceClusterStart, g_TraceClusterStop;
 
 int CountBits (byte *bits, int numbits);
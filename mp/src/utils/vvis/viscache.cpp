@@ -0,0 +1,365 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Cache of the PortalFlow results of the last vvis run of a map, so
+//			the next run only has to flow the portals whose surroundings changed.
+//
+//=============================================================================//
+
+#include "vis.h"
+#include "checksum_md5.h"
+#include "utlbuffer.h"
+#include "utlmap.h"
+
+
+/*
+
+A portal's portalvis only depends on the portal itself and on the part of the
+map RecursiveLeafFlow can get to from it, which is limited to the portals in
+its portalflood and the leafs those lead into. So every portal gets a key:
+
+  geometry hash	- the portal's winding and plane, as read from the .prt
+  leaf hash		- sum of the geometry hashes of the portals out of a leaf
+  key			- the portal's geometry hash and the hash of the leaf it leads
+				  into, plus the sum of the same over every portal in its
+				  portalflood
+
+Portal and cluster numbers change whenever vbsp moves anything, so they aren't
+part of the key. The cache stores the geometry hash of every portal, and each
+cached portalvis row gets remapped from the old portal numbers to the new ones
+through them.
+
+Each portal's chain count is kept too. RunPortalFlow schedules with them, so
+those get picked up for every portal that's still there, changed or not.
+
+*/
+
+#define VISCACHE_ID			(('C'<<24)+('V'<<16)+('V'<<8)+'V')	// little-endian "VVVC"
+#define VISCACHE_VERSION	2
+
+
+struct VisCacheHeader_t
+{
+	int		id;
+	int		version;
+	int		numportals;		// g_numportals*2 of the run that wrote it
+	int		useradius;
+	double	visradius;
+};
+
+
+static CUtlVector<uint64> s_PortalGeometryHash;
+static CUtlVector<uint64> s_PortalKey;
+
+
+static uint64 DigestToHash( MD5Context_t &ctx )
+{
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	MD5Final( digest, &ctx );
+
+	uint64 hash;
+	memcpy( &hash, digest, sizeof( hash ) );
+	return hash;
+}
+
+
+static uint64 PortalGeometryHash( portal_t *p )
+{
+	MD5Context_t ctx;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+	MD5Update( &ctx, (unsigned char*)&p->winding->numpoints, sizeof( p->winding->numpoints ) );
+	MD5Update( &ctx, (unsigned char*)p->winding->points, p->winding->numpoints * sizeof( Vector ) );
+	MD5Update( &ctx, (unsigned char*)&p->plane, sizeof( p->plane ) );
+	return DigestToHash( ctx );
+}
+
+
+static uint64 CombineHash( uint64 a, uint64 b )
+{
+	MD5Context_t ctx;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+	MD5Update( &ctx, (unsigned char*)&a, sizeof( a ) );
+	MD5Update( &ctx, (unsigned char*)&b, sizeof( b ) );
+	return DigestToHash( ctx );
+}
+
+
+// Needs portalflood, so call it after BasePortalVis.
+static void ComputePortalKeys()
+{
+	int nPortals = g_numportals * 2;
+
+	s_PortalGeometryHash.SetSize( nPortals );
+	for ( int i = 0; i < nPortals; i++ )
+	{
+		s_PortalGeometryHash[i] = PortalGeometryHash( &portals[i] );
+	}
+
+	CUtlVector<uint64> leafHash;
+	leafHash.SetSize( portalclusters );
+	for ( int i = 0; i < portalclusters; i++ )
+	{
+		uint64 hash = 0;
+		for ( int j = 0; j < leafs[i].portals.Count(); j++ )
+		{
+			hash += s_PortalGeometryHash[leafs[i].portals[j] - portals];
+		}
+		leafHash[i] = hash;
+	}
+
+	// The geometry and destination leaf of each portal, summed over the portalfloods below
+	CUtlVector<uint64> localHash;
+	localHash.SetSize( nPortals );
+	for ( int i = 0; i < nPortals; i++ )
+	{
+		localHash[i] = CombineHash( s_PortalGeometryHash[i], leafHash[portals[i].leaf] );
+	}
+
+	s_PortalKey.SetSize( nPortals );
+	for ( int i = 0; i < nPortals; i++ )
+	{
+		uint64 floodHash = 0;
+		const byte *pFlood = portals[i].portalflood;
+		for ( int j = 0; j < portalbytes; j++ )
+		{
+			if ( !pFlood[j] )
+				continue;
+
+			for ( int k = 0; k < 8; k++ )
+			{
+				if ( pFlood[j] & ( 1 << k ) )
+					floodHash += localHash[( j << 3 ) + k];
+			}
+		}
+		s_PortalKey[i] = CombineHash( localHash[i], floodHash );
+	}
+}
+
+
+// Zero runs are stored as a 0 and a count, like CompressVis does for the PVS.
+static void CompressRow( const byte *pRow, int nBytes, CUtlBuffer &buf )
+{
+	for ( int j = 0; j < nBytes; j++ )
+	{
+		buf.PutUnsignedChar( pRow[j] );
+		if ( pRow[j] )
+			continue;
+
+		int rep = 1;
+		for ( j++; j < nBytes; j++ )
+		{
+			if ( pRow[j] || rep == 255 )
+				break;
+			rep++;
+		}
+		buf.PutUnsignedChar( rep );
+		j--;
+	}
+}
+
+
+static bool DecompressRow( CUtlBuffer &buf, byte *pRow, int nBytes )
+{
+	byte *pOut = pRow;
+	while ( pOut < pRow + nBytes )
+	{
+		if ( !buf.IsValid() )
+			return false;
+
+		byte c = buf.GetUnsignedChar();
+		if ( c )
+		{
+			*pOut++ = c;
+			continue;
+		}
+
+		int rep = buf.GetUnsignedChar();
+		if ( pOut + rep > pRow + nBytes )
+			return false;
+		memset( pOut, 0, rep );
+		pOut += rep;
+	}
+	return buf.IsValid();
+}
+
+
+/*
+==================
+LoadVisCache
+
+Fills in portalvis for every portal whose key matches the cache and marks it
+done. The portals that still have to go through PortalFlow are moved to the
+front of sorted_portals (keeping their order). Returns how many there are.
+==================
+*/
+int LoadVisCache( const char *pFileName )
+{
+	int nPortals = g_numportals * 2;
+
+	ComputePortalKeys();
+
+	if ( !FileExists( pFileName ) )
+		return nPortals;
+
+	byte *pFileData;
+	int nFileSize = LoadFile( pFileName, (void**)&pFileData );
+	CUtlBuffer buf( pFileData, nFileSize, CUtlBuffer::READ_ONLY );
+
+	VisCacheHeader_t header;
+	buf.Get( &header, sizeof( header ) );
+	if ( !buf.IsValid() || header.id != VISCACHE_ID || header.version != VISCACHE_VERSION ||
+		header.numportals <= 0 || header.numportals > MAX_MAP_PORTALS*2 ||
+		header.useradius != (int)g_bUseRadius || ( g_bUseRadius && header.visradius != g_VisRadius ) )
+	{
+		Msg( "Ignoring out of date vis cache %s\n", pFileName );
+		free( pFileData );
+		return nPortals;
+	}
+
+	// Old portal number -> new portal number, through the geometry hashes. A hash
+	// that shows up twice can't be remapped, so those portals never get reused.
+	CUtlMap<uint64, int> newPortalByHash( DefLessFunc( uint64 ) );
+	for ( int i = 0; i < nPortals; i++ )
+	{
+		int iMap = newPortalByHash.Find( s_PortalGeometryHash[i] );
+		if ( iMap == newPortalByHash.InvalidIndex() )
+			newPortalByHash.Insert( s_PortalGeometryHash[i], i );
+		else
+			newPortalByHash[iMap] = -1;
+	}
+
+	CUtlVector<int> oldToNew;
+	oldToNew.SetSize( header.numportals );
+	for ( int i = 0; i < header.numportals; i++ )
+	{
+		uint64 hash = buf.GetInt64();
+		int iMap = newPortalByHash.Find( hash );
+		oldToNew[i] = ( iMap == newPortalByHash.InvalidIndex() ) ? -1 : newPortalByHash[iMap];
+	}
+
+	int nOldPortalBytes = ( ( header.numportals + 63 ) & ~63 ) >> 3;
+	CUtlVector<byte> oldRow;
+	oldRow.SetSize( nOldPortalBytes );
+
+	int nReused = 0;
+	for ( int i = 0; i < header.numportals; i++ )
+	{
+		uint64 key = buf.GetInt64();
+		int chains = buf.GetInt();
+		if ( !DecompressRow( buf, oldRow.Base(), nOldPortalBytes ) )
+		{
+			Warning( "Vis cache %s is truncated\n", pFileName );
+			break;
+		}
+
+		int iNew = oldToNew[i];
+		if ( iNew < 0 )
+			continue;
+
+		portals[iNew].numchains = chains;
+		if ( s_PortalKey[iNew] != key )
+			continue;
+
+		portal_t *p = &portals[iNew];
+		memset( p->portalvis, 0, portalbytes );
+
+		bool bRemapped = true;
+		for ( int j = 0; j < nOldPortalBytes && bRemapped; j++ )
+		{
+			if ( !oldRow[j] )
+				continue;
+
+			for ( int k = 0; k < 8; k++ )
+			{
+				if ( !( oldRow[j] & ( 1 << k ) ) )
+					continue;
+
+				// Everything a portal sees is in its portalflood, which is part of the key,
+				// so this only fails on a hash collision
+				int iOld = ( j << 3 ) + k;
+				if ( iOld >= header.numportals || oldToNew[iOld] < 0 )
+				{
+					bRemapped = false;
+					break;
+				}
+				SetBit( p->portalvis, oldToNew[iOld] );
+			}
+		}
+
+		if ( !bRemapped )
+		{
+			memset( p->portalvis, 0, portalbytes );
+			continue;
+		}
+
+		p->status = stat_done;
+		nReused++;
+	}
+
+	free( pFileData );
+
+	// Portals left to flow first, in sorted order
+	int nFlow = 0;
+	CUtlVector<portal_t*> done;
+	for ( int i = 0; i < nPortals; i++ )
+	{
+		if ( sorted_portals[i]->status == stat_done )
+			done.AddToTail( sorted_portals[i] );
+		else
+			sorted_portals[nFlow++] = sorted_portals[i];
+	}
+	for ( int i = 0; i < done.Count(); i++ )
+	{
+		sorted_portals[nFlow + i] = done[i];
+	}
+
+	Msg( "Reusing %d of %d portals from %s\n", nReused, nPortals, pFileName );
+	return nFlow;
+}
+
+
+/*
+==================
+SaveVisCache
+
+Call after PortalFlow, with LoadVisCache having computed the keys.
+==================
+*/
+void SaveVisCache( const char *pFileName )
+{
+	int nPortals = g_numportals * 2;
+	Assert( s_PortalKey.Count() == nPortals );
+
+	CUtlBuffer buf;
+
+	VisCacheHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.id = VISCACHE_ID;
+	header.version = VISCACHE_VERSION;
+	header.numportals = nPortals;
+	header.useradius = g_bUseRadius;
+	header.visradius = g_VisRadius;
+	buf.Put( &header, sizeof( header ) );
+
+	for ( int i = 0; i < nPortals; i++ )
+	{
+		buf.PutInt64( s_PortalGeometryHash[i] );
+	}
+
+	for ( int i = 0; i < nPortals; i++ )
+	{
+		buf.PutInt64( s_PortalKey[i] );
+		buf.PutInt( portals[i].numchains );
+		CompressRow( portals[i].portalvis, portalbytes, buf );
+	}
+
+	FileHandle_t f = g_pFileSystem->Open( pFileName, "wb" );
+	if ( !f )
+	{
+		Warning( "Couldn't write vis cache %s\n", pFileName );
+		return;
+	}
+	g_pFileSystem->Write( buf.Base(), buf.TellPut(), f );
+	g_pFileSystem->Close( f );
+}
@@ -22,6 +22,8 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "telemetry.h"
+#include "visbits.h"
 
 
 int			g_numportals;
@@ -55,6 +57,10 @@ bool		g_bUseRadius = false;
 double		g_VisRadius = 4096.0f * 4096.0f;
 
 bool		g_bLowPriority = false;
+bool		g_bTelemetry = false;
+bool		g_bVisCache = true;
+char		g_szVisCacheFile[1024];	// <mapname>.viscache
+int			g_nFlowBenchPasses = 0;
 
 //=============================================================================
 
@@ -171,13 +177,11 @@ int LeafVectorFromPortalVector (byte *portalbits, byte *leafbits)
 
 	memset (leafbits, 0, leafbytes);
 
-	for (i=0 ; i<g_numportals*2 ; i++)
+	// walk just the set bits, a word at a time
+	for (i=VisBits_NextSet (portalbits, portalbytes, 0) ; i>=0 ; i=VisBits_NextSet (portalbits, portalbytes, i+1))
 	{
-		if ( CheckBit( portalbits, i ) )
-		{
-			p = portals+i;
-			SetBit( leafbits, p->leaf );
-		}
+		p = portals+i;
+		SetBit( leafbits, p->leaf );
 	}
 
 	c_leafs = CountBits (leafbits, portalclusters);
@@ -199,7 +203,7 @@ void ClusterMerge (int clusternum)
 //	byte		portalvector[MAX_PORTALS/8];
 	byte		portalvector[MAX_PORTALS/4];      // 4 because portal bytes is * 2
 	byte		uncompressed[MAX_MAP_LEAFS/8];
-	int			i, j;
+	int			i;
 	int			numvis;
 	portal_t	*p;
 	int			pnum;
@@ -213,8 +217,7 @@ void ClusterMerge (int clusternum)
 		p = leaf->portals[i];
 		if (p->status != stat_done)
 			Error ("portal not done %d %p %p\n", i, p, portals);
-		for (j=0 ; j<portallongs ; j++)
-			((long *)portalvector)[j] |= ((long *)p->portalvis)[j];
+		VisBits_Or (portalvector, p->portalvis, portalbytes);
 		pnum = p - portals;
 		SetBit( portalvector, pnum );
 	}
@@ -239,29 +242,74 @@ void ClusterMerge (int clusternum)
 	totalvis += numvis;
 }
 
-static int CompressAndCrosscheckClusterVis( int clusternum )
+/*
+==================
+CrosscheckClusterVis
+
+A cluster can only see another if the other one can see it back, so this ANDs
+uncompressedvis with its own transpose. It goes through the matrix in 64x64 bit
+tiles, each one together with its mirror image across the diagonal, so the rows
+are walked in cache-sized pieces instead of one column bit per row. Returns how
+many bits it cleared.
+==================
+*/
+static int CrosscheckClusterVis( void )
 {
 	int		optimized = 0;
-	byte	compressed[MAX_MAP_LEAFS/8];
-//
-// compress the bit string
-//
-	byte *uncompressed = uncompressedvis + clusternum*leafbytes;
-	for ( int i = 0; i < portalclusters; i++ )
-	{
-		if ( i == clusternum )
-			continue;
+	int		nTiles = ( portalclusters + 63 ) >> 6;
+	uint64	tile[64], mirror[64], tileT[64], mirrorT[64];
 
-		if ( CheckBit( uncompressed, i ) )
+	for ( int iTile = 0; iTile < nTiles; iTile++ )
+	{
+		for ( int jTile = iTile; jTile < nTiles; jTile++ )
 		{
-			byte *other = uncompressedvis + i*leafbytes;
-			if ( !CheckBit( other, clusternum ) )
+			// rows iTile*64.. of word jTile, and rows jTile*64.. of word iTile
+			for ( int r = 0; r < 64; r++ )
+			{
+				int iRow = ( iTile << 6 ) + r;
+				int jRow = ( jTile << 6 ) + r;
+				tile[r] = ( iRow < portalclusters ) ? ( (uint64 *)( uncompressedvis + iRow*leafbytes ) )[jTile] : 0;
+				mirror[r] = ( jRow < portalclusters ) ? ( (uint64 *)( uncompressedvis + jRow*leafbytes ) )[iTile] : 0;
+			}
+
+			memcpy( tileT, tile, sizeof( tile ) );
+			memcpy( mirrorT, mirror, sizeof( mirror ) );
+			VisBits_Transpose64( tileT );
+			VisBits_Transpose64( mirrorT );
+
+			for ( int r = 0; r < 64; r++ )
 			{
-				ClearBit( uncompressed, i );
-				optimized++;
+				int iRow = ( iTile << 6 ) + r;
+				int jRow = ( jTile << 6 ) + r;
+				if ( iRow < portalclusters )
+				{
+					uint64 bits = tile[r] & mirrorT[r];
+					optimized += VisBits_Count( (byte *)&tile[r], 64 ) - VisBits_Count( (byte *)&bits, 64 );
+					( (uint64 *)( uncompressedvis + iRow*leafbytes ) )[jTile] = bits;
+				}
+
+				// the diagonal tile is its own mirror, and that was all done above
+				if ( jTile != iTile && jRow < portalclusters )
+				{
+					uint64 bits = mirror[r] & tileT[r];
+					optimized += VisBits_Count( (byte *)&mirror[r], 64 ) - VisBits_Count( (byte *)&bits, 64 );
+					( (uint64 *)( uncompressedvis + jRow*leafbytes ) )[iTile] = bits;
+				}
 			}
 		}
 	}
+
+	return optimized;
+}
+
+
+static void CompressClusterVis( int clusternum )
+{
+	byte	compressed[MAX_MAP_LEAFS/8];
+//
+// compress the bit string
+//
+	byte *uncompressed = uncompressedvis + clusternum*leafbytes;
 	int numbytes = CompressVis( uncompressed, compressed );
 
 	byte *dest = vismap_p;
@@ -274,10 +322,11 @@ static int CompressAndCrosscheckClusterVis( int clusternum )
 
 	memcpy( dest, compressed, numbytes );
 
+#ifdef _DEBUG
 	// check vis data
 	DecompressVis( vismap + dvis->bitofs[clusternum][DVIS_PVS], compressed );
-
-	return optimized;
+	Assert( !memcmp( compressed, uncompressed, ( portalclusters + 7 ) >> 3 ) );
+#endif
 }
 
 
@@ -306,15 +355,27 @@ void CalcPortalVis (void)
 	{
  		RunMPIPortalFlow();
 	}
+	else if ( g_bVisCache )
+	{
+		// Only the portals the cache couldn't supply are left at the front of sorted_portals
+		int nFlow = LoadVisCache( g_szVisCacheFile );
+		if ( nFlow )
+		{
+			RunPortalFlow (nFlow);
+			SaveVisCache( g_szVisCacheFile );
+		}
+	}
 	else 
 	{
-		RunThreadsOnIndividual (g_numportals*2, true, PortalFlow);
+		RunPortalFlow (g_numportals*2);
 	}
 }
 
 
 void CalcVisTrace (void)
 {
+	AllocPortalBits ();
+	BuildPortalTree ();
     RunThreadsOnIndividual (g_numportals*2, true, BasePortalVis);
 	BuildTracePortals( g_TraceClusterStart );
 	// NOTE: We only schedule the one-way portals out of the start cluster here
@@ -322,6 +383,15 @@ void CalcVisTrace (void)
 	RunThreadsOnIndividual (g_numportals, true, PortalFlow);
 }
 
+void CalcFlowBench (void)
+{
+	AllocPortalBits ();
+	BuildPortalTree ();
+	RunThreadsOnIndividual (g_numportals*2, true, BasePortalVis);
+	SortPortals ();
+	FlowBench (g_nFlowBenchPasses);
+}
+
 /*
 ==================
 CalcVis
@@ -331,6 +401,9 @@ void CalcVis (void)
 {
 	int		i;
 
+	AllocPortalBits ();
+	BuildPortalTree ();
+
 	if (g_bUseMPI) 
 	{
 		RunMPIBasePortalVis();
@@ -352,11 +425,11 @@ void CalcVis (void)
 		ClusterMerge( i );
 	}
 
-	int count = 0;
 	// Now crosscheck each leaf's vis and compress
+	int count = CrosscheckClusterVis();
 	for ( i = 0; i < portalclusters; i++ )
 	{
-		count += CompressAndCrosscheckClusterVis( i );
+		CompressClusterVis( i );
 	}
 
 		
@@ -563,68 +636,84 @@ CalcPAS
 
 Calculate the PAS (Potentially Audible Set)
 by ORing together all the PVS visible from a leaf
+
+The PAS rows are built a tile at a time, with the tile sized to stay in L2.
+Each PVS row that anything in the tile can see gets read once and ORed into
+every row in the tile that wants it, and the finished rows get compressed
+straight into the vis lump.
 ================
 */
+#define PAS_TILE_BYTES	(256*1024)
+
 void CalcPAS (void)
 {
-	int		i, j, k, l, index;
-	int		bitbyte;
-	long	*dest, *src;
-	byte	*scan;
+	int		i, j, index, tile, tilerows, n;
+	byte	*dest, *row, *src;
 	int		count;
-	byte	uncompressed[MAX_MAP_LEAFS/8];
 	byte	compressed[MAX_MAP_LEAFS/8];
+	byte	*pas, *sources;
 
 	Msg ("Building PAS...\n");
 
+	tilerows = clamp (PAS_TILE_BYTES / leafbytes, 1, portalclusters);
+	pas = (byte *)malloc (tilerows * leafbytes);
+	sources = (byte *)malloc (leafbytes);
+
+	Msg ("PVS matrix: %.1f MB, PAS tile: %d rows (%d KB)\n",
+		originalvismapsize / (1024.0 * 1024.0), tilerows, (tilerows * leafbytes) >> 10);
+
 	count = 0;
-	for (i=0 ; i<portalclusters ; i++)
+	for (tile=0 ; tile<portalclusters ; tile+=tilerows)
 	{
-		scan = uncompressedvis + i*leafbytes;
-		memcpy (uncompressed, scan, leafbytes);
-		for (j=0 ; j<leafbytes ; j++)
+		n = min (tilerows, portalclusters - tile);
+
+		// each PAS row starts out as its own PVS row
+		memcpy (pas, uncompressedvis + tile*leafbytes, n * leafbytes);
+
+		// every cluster the tile can see
+		memset (sources, 0, leafbytes);
+		for (i=0 ; i<n ; i++)
+			VisBits_Or (sources, uncompressedvis + (tile+i)*leafbytes, leafbytes);
+
+		for (index=VisBits_NextSet (sources, leafbytes, 0) ; index>=0 ; index=VisBits_NextSet (sources, leafbytes, index+1))
 		{
-			bitbyte = scan[j];
-			if (!bitbyte)
-				continue;
-			for (k=0 ; k<8 ; k++)
+			// OR this pvs row into the phs
+			if (index >= portalclusters)
+				Error ("Bad bit in PVS");	// pad bits should be 0
+
+			src = uncompressedvis + index*leafbytes;
+			for (i=0 ; i<n ; i++)
 			{
-				if (! (bitbyte & (1<<k)) )
-					continue;
-				// OR this pvs row into the phs
-				index = ((j<<3)+k);
-				if (index >= portalclusters)
-					Error ("Bad bit in PVS");	// pad bits should be 0
-				src = (long *)(uncompressedvis + index*leafbytes);
-				dest = (long *)uncompressed;
-				for (l=0 ; l<leaflongs ; l++)
-					((long *)uncompressed)[l] |= src[l];
+				if (CheckBit (uncompressedvis + (tile+i)*leafbytes, index))
+					VisBits_Or (pas + i*leafbytes, src, leafbytes);
 			}
 		}
-		for (j=0 ; j<portalclusters ; j++)
+
+		for (i=0 ; i<n ; i++)
 		{
-			if ( CheckBit( uncompressed, j ) )
-			{
-				count++;
-			}
-		}
+			row = pas + i*leafbytes;
+			count += VisBits_Count (row, portalclusters);
 
-	//
-	// compress the bit string
-	//
-		j = CompressVis (uncompressed, compressed);
+		//
+		// compress the bit string
+		//
+			j = CompressVis (row, compressed);
 
-		dest = (long *)vismap_p;
-		vismap_p += j;
-		
-		if (vismap_p > vismap_end)
-			Error ("Vismap expansion overflow");
+			dest = vismap_p;
+			vismap_p += j;
+			
+			if (vismap_p > vismap_end)
+				Error ("Vismap expansion overflow");
 
-		dvis->bitofs[i][DVIS_PAS] = (byte *)dest-vismap;
+			dvis->bitofs[tile+i][DVIS_PAS] = dest-vismap;
 
-		memcpy (dest, compressed, j);	
+			memcpy (dest, compressed, j);	
+		}
 	}
 
+	free (sources);
+	free (pas);
+
 	Msg ("Average clusters audible: %i\n", count/portalclusters);
 }
 
@@ -942,6 +1031,11 @@ int ParseCommandLine( int argc, char **argv )
 			i++;
 			Msg( "Tracing vis from cluster %d to %d\n", g_TraceClusterStart, g_TraceClusterStop );
 		}
+		else if( !Q_stricmp( argv[i], "-flowbench" ) )
+		{
+			g_nFlowBenchPasses = max( atoi( argv[i+1] ), 1 );
+			i++;
+		}
 		else if (!Q_stricmp (argv[i],"-nosort"))
 		{
 			Msg ("nosort = true\n");
@@ -953,6 +1047,14 @@ int ParseCommandLine( int argc, char **argv )
 		{
 			g_bLowPriority = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-telemetry" ) )
+		{
+			g_bTelemetry = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-noviscache" ) )
+		{
+			g_bVisCache = false;
+		}
 		else if ( !Q_stricmp( argv[i], "-FullMinidumps" ) )
 		{
 			EnableFullMinidumps( true );
@@ -1033,7 +1135,14 @@ void PrintUsage( int argc, char **argv )
 		"  -tmpin          : Make portals come from \\tmp\\<mapname>.\n"
 		"  -tmpout         : Make portals come from \\tmp\\<mapname>.\n"
 		"  -trace <start cluster> <end cluster> : Writes a linefile that traces the vis from one cluster to another for debugging map vis.\n"
+		"  -flowbench <passes> : Time PortalFlow on the map's .prt on one thread, the\n"
+		"                    given number of times, and exit without writing the bsp.\n"
 		"  -FullMinidumps  : Write large minidumps on crash.\n"
+		"  -telemetry      : Write the time, cpu time, throughput and memory use of each\n"
+		"                    phase of the compile to <mapname>.vvis.json.\n"
+		"  -noviscache     : Don't reuse or update <mapname>.viscache, which lets vvis\n"
+		"                    skip portals whose surroundings didn't change since the\n"
+		"                    last compile.\n"
 		"  -x360		   : Generate Xbox360 version of vsp\n"
 		"  -nox360		   : Disable generation Xbox360 version of vsp (default)\n"
 		"\n"
@@ -1099,6 +1208,7 @@ int RunVVis( int argc, char **argv )
 	// Source is just the mapfile without an extension at this point...
 	V_strncpy( source, mapFile, sizeof( mapFile ) );
 	V_StripExtension( source, source, sizeof( source ) );
+	V_snprintf( g_szVisCacheFile, sizeof( g_szVisCacheFile ), "%s.viscache", source );
 
 	if (i != argc - 1)
 	{
@@ -1108,6 +1218,7 @@ int RunVVis( int argc, char **argv )
 	}
 
 	start = Plat_FloatTime();
+	Telemetry_BeginPhase( "vvis" );
 
 
 	if (!g_bUseMPI)
@@ -1127,7 +1238,9 @@ int RunVVis( int argc, char **argv )
 	ThreadSetDefault ();
 
 	Msg ("reading %s\n", mapFile);
+	Telemetry_BeginPhase( "LoadBSPFile" );
 	LoadBSPFile (mapFile);
+	Telemetry_EndPhase();
 	if (numnodes == 0 || numfaces == 0)
 		Error ("Empty map");
 	ParseEntities ();
@@ -1160,13 +1273,28 @@ int RunVVis( int argc, char **argv )
 	strcat (portalfile, ".prt");
 
 	Msg ("reading %s\n", portalfile);
+	Telemetry_BeginPhase( "LoadPortals" );
 	LoadPortals (portalfile);
+	Telemetry_EndPhase( g_numportals );
 
-	// don't write out results when simply doing a trace
-	if ( g_TraceClusterStart < 0 )
+	// don't write out results when simply doing a trace or a benchmark
+	if ( g_nFlowBenchPasses )
+	{
+		if ( g_bUseMPI )
+		{
+			Warning("Can't run -flowbench in MPI mode\n");
+		}
+		CalcFlowBench ();
+	}
+	else if ( g_TraceClusterStart < 0 )
 	{
+		Telemetry_BeginPhase( "CalcVis" );
 		CalcVis ();
+		Telemetry_EndPhase( portalclusters );
+
+		Telemetry_BeginPhase( "CalcPAS" );
 		CalcPAS ();
+		Telemetry_EndPhase( portalclusters );
 
 		// We need a mapping from cluster to leaves, since the PVS
 		// deals with clusters for both CalcVisibleFogVolumes and
@@ -1179,7 +1307,9 @@ int RunVVis( int argc, char **argv )
 		Msg ("visdatasize:%i  compressed from %i\n", visdatasize, originalvismapsize*2);
 
 		Msg ("writing %s\n", mapFile);
+		Telemetry_BeginPhase( "WriteBSPFile" );
 		WriteBSPFile (mapFile);
+		Telemetry_EndPhase();
 	}
 	else
 	{
@@ -1201,6 +1331,14 @@ int RunVVis( int argc, char **argv )
 	GetHourMinuteSecondsString( (int)( end - start ), str, sizeof( str ) );
 	Msg( "%s elapsed\n", str );
 
+	Telemetry_EndPhase();
+	if ( g_bTelemetry )
+	{
+		char telemetryFile[1024];
+		V_snprintf( telemetryFile, sizeof( telemetryFile ), "%s.vvis.json", source );
+		Telemetry_WriteReport( telemetryFile, "vvis" );
+	}
+
 	ReleasePakFileLumps();
 	DeleteCmdLine( argc, argv );
 	CmdLib_Cleanup();